@@ -0,0 +1,394 @@
+/*
+ * asp_bench: open many ASP sessions against afpd and measure the AFP
+ * request rate and the memory the server spends per session.
+ *
+ * Usage: asp_bench [-u] [-g] [-s sessions] [-n requests] [-P afpd pid]
+ *                  [-v volume] net.node:port
+ *
+ * net.node:port is the ASP listening socket of afpd (see nbplkup).
+ * Requests are FPGetSrvrParms, sent round robin over all sessions. With
+ * -v each session opens the volume and the requests are FPGetFileDirParms
+ * of its root instead, that is a request that switches to the session's
+ * user, volume and directory in a worker afpd (-aspworkers).
+ * -g logs in with "No User Authent" first, -P sums RSS and PSS of
+ * the children of the given afpd master from /proc, -u uses the DDP
+ * over UDP transport (afpd has to run with NETDDP_TRANSPORT=udp too).
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <netatalk/at.h>
+#include <netatalk/endian.h>
+#include <atalk/afp.h>
+#include <atalk/atp.h>
+#include <atalk/asp.h>
+
+#define TICKLE_INTERVAL 20
+
+/* bits of the parameter bitmaps, see include/atalk/volume.h and
+ * etc/afpd/directory.h */
+#define VOLPBIT_VID   5
+#define DIRPBIT_ATTR  0
+#define DIRPBIT_MDATE 3
+#define DIRPBIT_DID   8
+
+struct bench_sess {
+	ATP atp;		/* our workstation session socket */
+	struct sockaddr_at sss;	/* server session socket */
+	u_int8_t sid;
+	u_int16_t seq;
+	u_int16_t vid;		/* -v */
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* one ATP transaction, returns the 4 response user bytes in ub */
+static int transact(ATP atp, struct sockaddr_at *to, char *req,
+		    int reqlen, char *ub, char *reply, size_t *replylen)
+{
+	static char data[ASP_MAXPACKETS][ASP_CMDMAXSIZ];
+	struct atp_block atpb;
+	struct iovec iov[ASP_MAXPACKETS];
+	size_t len = 0;
+	int i;
+
+	atpb.atp_saddr = to;
+	atpb.atp_sreqdata = req;
+	atpb.atp_sreqdlen = reqlen;
+	atpb.atp_sreqto = 2;
+	atpb.atp_sreqtries = 5;
+	if (atp_sreq(atp, &atpb, ASP_MAXPACKETS, ATP_XO) < 0)
+		return -1;
+
+	for (i = 0; i < ASP_MAXPACKETS; i++) {
+		iov[i].iov_base = data[i];
+		iov[i].iov_len = ASP_CMDMAXSIZ;
+	}
+	atpb.atp_rresiov = iov;
+	atpb.atp_rresiovcnt = ASP_MAXPACKETS;
+	if (atp_rresp(atp, &atpb) < 0)
+		return -1;
+
+	memcpy(ub, data[0], ASP_HDRSIZ);
+	for (i = 0; i < atpb.atp_rresiovcnt; i++) {
+		if (reply && len + iov[i].iov_len - ASP_HDRSIZ <= *replylen)
+			memcpy(reply + len, data[i] + ASP_HDRSIZ,
+			       iov[i].iov_len - ASP_HDRSIZ);
+		len += iov[i].iov_len - ASP_HDRSIZ;
+	}
+	if (replylen)
+		*replylen = len;
+	return 0;
+}
+
+static int open_session(struct bench_sess *s, struct sockaddr_at *sls)
+{
+	struct sockaddr_at to = *sls;
+	char req[ASP_HDRSIZ], ub[ASP_HDRSIZ];
+	u_int16_t err;
+
+	if ((s->atp = atp_open(ATADDR_ANYPORT, NULL)) == NULL)
+		return -1;
+
+	req[0] = ASPFUNC_OPEN;
+	req[1] = atp_sockaddr(s->atp)->sat_port;
+	req[2] = 1;		/* ASP version 1.0 */
+	req[3] = 0;
+	if (transact(s->atp, &to, req, sizeof(req), ub, NULL, NULL) < 0)
+		return -1;
+
+	memcpy(&err, ub + 2, sizeof(err));
+	if (err != ASPERR_OK) {
+		fprintf(stderr, "open session: error %d\n",
+			(int16_t) ntohs(err));
+		return -1;
+	}
+	s->sss = *sls;
+	s->sss.sat_port = ub[0];
+	s->sid = ub[1];
+	s->seq = 0;
+	return 0;
+}
+
+/* ASP command, returns the AFP result code. reply may be NULL */
+static int command(struct bench_sess *s, char *cmd, int cmdlen,
+		   char *reply, size_t *replylen)
+{
+	char req[ASP_CMDMAXSIZ], ub[ASP_HDRSIZ];
+	u_int16_t seq;
+	u_int32_t result;
+
+	req[0] = ASPFUNC_CMD;
+	req[1] = s->sid;
+	seq = htons(s->seq++);
+	memcpy(req + 2, &seq, sizeof(seq));
+	memcpy(req + ASP_HDRSIZ, cmd, cmdlen);
+	if (transact(s->atp, &s->sss, req, ASP_HDRSIZ + cmdlen, ub,
+		     reply, replylen) < 0)
+		return 1;
+
+	memcpy(&result, ub, sizeof(result));
+	return ntohl(result);
+}
+
+/* FPOpenVol, returns the AFP result code */
+static int open_volume(struct bench_sess *s, const char *volume)
+{
+	char cmd[64], reply[64];
+	size_t replylen = sizeof(reply);
+	u_int16_t bitmap = htons(1 << VOLPBIT_VID);
+	int n = 0, ret;
+
+	cmd[n++] = AFP_OPENVOL;
+	cmd[n++] = 0;
+	memcpy(cmd + n, &bitmap, sizeof(bitmap));
+	n += sizeof(bitmap);
+	cmd[n++] = strlen(volume);
+	memcpy(cmd + n, volume, strlen(volume));
+	n += strlen(volume);
+
+	if ((ret = command(s, cmd, n, reply, &replylen)) != AFP_OK)
+		return ret;
+	if (replylen < 4)
+		return 1;
+	memcpy(&s->vid, reply + 2, sizeof(s->vid));	/* network order */
+	return AFP_OK;
+}
+
+/* the request we measure, FPGetFileDirParms of the volume root with -v */
+static int request(struct bench_sess *s, const char *volume)
+{
+	char cmd[16];
+	u_int32_t did = htonl(2);	/* DIRDID_ROOT */
+	u_int16_t fbitmap = 0;
+	u_int16_t dbitmap = htons((1 << DIRPBIT_ATTR) | (1 << DIRPBIT_MDATE) |
+				  (1 << DIRPBIT_DID));
+	int n = 0;
+
+	if (!volume) {
+		cmd[n++] = AFP_GETSRVPARAM;
+		cmd[n++] = 0;
+		return command(s, cmd, n, NULL, NULL);
+	}
+
+	cmd[n++] = AFP_GETFLDRPARAM;
+	cmd[n++] = 0;
+	memcpy(cmd + n, &s->vid, sizeof(s->vid));
+	n += sizeof(s->vid);
+	memcpy(cmd + n, &did, sizeof(did));
+	n += sizeof(did);
+	memcpy(cmd + n, &fbitmap, sizeof(fbitmap));
+	n += sizeof(fbitmap);
+	memcpy(cmd + n, &dbitmap, sizeof(dbitmap));
+	n += sizeof(dbitmap);
+	cmd[n++] = 2;		/* long names */
+	cmd[n++] = 0;		/* empty path: the directory itself */
+	return command(s, cmd, n, NULL, NULL);
+}
+
+static void tickle(struct bench_sess *s, struct sockaddr_at *sls)
+{
+	struct atp_block atpb;
+	char req[ASP_HDRSIZ];
+
+	req[0] = ASPFUNC_TICKLE;
+	req[1] = s->sid;
+	req[2] = req[3] = 0;
+	atpb.atp_saddr = sls;
+	atpb.atp_sreqdata = req;
+	atpb.atp_sreqdlen = sizeof(req);
+	atpb.atp_sreqto = 0;
+	atpb.atp_sreqtries = 1;
+	atp_sreq(s->atp, &atpb, 0, 0);
+}
+
+static void close_session(struct bench_sess *s)
+{
+	char req[ASP_HDRSIZ], ub[ASP_HDRSIZ];
+
+	req[0] = ASPFUNC_CLOSE;
+	req[1] = s->sid;
+	req[2] = req[3] = 0;
+	transact(s->atp, &s->sss, req, sizeof(req), ub, NULL, NULL);
+	atp_close(s->atp);
+}
+
+/* sum a "Key: n kB" field of /proc/<pid>/<file> */
+static long proc_kb(pid_t pid, const char *file, const char *key)
+{
+	char path[64], line[256];
+	FILE *fp;
+	long kb = 0;
+	size_t klen = strlen(key);
+
+	snprintf(path, sizeof(path), "/proc/%d/%s", (int) pid, file);
+	if ((fp = fopen(path, "r")) == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp))
+		if (strncmp(line, key, klen) == 0)
+			kb += atol(line + klen);
+	fclose(fp);
+	return kb;
+}
+
+static void memory_report(pid_t master, int sessions)
+{
+	DIR *dp;
+	struct dirent *de;
+	char path[64];
+	FILE *fp;
+	int pid, ppid, children = 0;
+	long rss = 0, pss = 0;
+
+	if ((dp = opendir("/proc")) == NULL)
+		return;
+	while ((de = readdir(dp))) {
+		if ((pid = atoi(de->d_name)) <= 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		if ((fp = fopen(path, "r")) == NULL)
+			continue;
+		if (fscanf(fp, "%*d %*s %*c %d", &ppid) == 1
+		    && ppid == master) {
+			rss += proc_kb(pid, "status", "VmRSS:");
+			pss += proc_kb(pid, "smaps_rollup", "Pss:");
+			children++;
+		}
+		fclose(fp);
+	}
+	closedir(dp);
+
+	rss += proc_kb(master, "status", "VmRSS:");
+	pss += proc_kb(master, "smaps_rollup", "Pss:");
+
+	printf("afpd: %d processes, RSS %ld kB, PSS %ld kB\n",
+	       children + 1, rss, pss);
+	printf("per session: RSS %.1f kB, PSS %.1f kB\n",
+	       (double) rss / sessions, (double) pss / sessions);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_sess *sess;
+	struct sockaddr_at sls;
+	unsigned int net, node, port;
+	char cmd[64], *volume = NULL;
+	double start, secs, last_tickle;
+	int nsess = 10, count = 10000, guest = 0, c, i, n, errors = 0;
+	pid_t master = 0;
+
+	while ((c = getopt(argc, argv, "ugs:n:P:v:")) != -1) {
+		switch (c) {
+		case 'u':
+			setenv("NETDDP_TRANSPORT", "udp", 1);
+			break;
+		case 'g':
+			guest = 1;
+			break;
+		case 's':
+			nsess = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'P':
+			master = atoi(optarg);
+			break;
+		case 'v':
+			volume = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1
+	    || sscanf(argv[optind], "%u.%u:%u", &net, &node, &port) != 3
+	    || nsess < 1)
+		goto usage;
+
+	memset(&sls, 0, sizeof(sls));
+	sls.sat_family = AF_APPLETALK;
+	sls.sat_addr.s_net = htons(net);
+	sls.sat_addr.s_node = node;
+	sls.sat_port = port;
+
+	if ((sess = calloc(nsess, sizeof(*sess))) == NULL)
+		return 1;
+
+	start = now();
+	for (i = 0; i < nsess; i++) {
+		if (open_session(&sess[i], &sls) < 0) {
+			fprintf(stderr, "session %d: open failed: %s\n", i,
+				strerror(errno));
+			nsess = i;
+			break;
+		}
+		if (guest) {
+			n = 0;
+			cmd[n++] = AFP_LOGIN;
+			cmd[n++] = strlen("AFPVersion 2.1");
+			memcpy(cmd + n, "AFPVersion 2.1", cmd[n - 1]);
+			n += cmd[n - 1];
+			cmd[n++] = strlen("No User Authent");
+			memcpy(cmd + n, "No User Authent", cmd[n - 1]);
+			n += cmd[n - 1];
+			if (command(&sess[i], cmd, n, NULL, NULL) != AFP_OK)
+				fprintf(stderr, "session %d: login failed\n",
+					i);
+		}
+		if (volume && open_volume(&sess[i], volume) != AFP_OK)
+			fprintf(stderr, "session %d: can't open %s\n", i,
+				volume);
+	}
+	if (nsess == 0)
+		return 1;
+	secs = now() - start;
+	printf("%d sessions opened in %.3f s\n", nsess, secs);
+
+	if (master)
+		memory_report(master, nsess);
+
+	last_tickle = start = now();
+	for (i = 0; i < count; i++) {
+		if (request(&sess[i % nsess], volume) != AFP_OK)
+			errors++;
+		if (now() - last_tickle > TICKLE_INTERVAL) {
+			for (n = 0; n < nsess; n++)
+				tickle(&sess[n], &sls);
+			last_tickle = now();
+		}
+	}
+	secs = now() - start;
+	printf("%d requests in %.3f s, %.0f requests/s, %d errors\n",
+	       count, secs, count / secs, errors);
+
+	if (master)
+		memory_report(master, nsess);
+
+	for (i = 0; i < nsess; i++)
+		close_session(&sess[i]);
+	free(sess);
+	return 0;
+
+      usage:
+	fprintf(stderr,
+		"Usage: asp_bench [-u] [-g] [-s sessions] [-n requests] "
+		"[-P afpd pid] [-v volume] net.node:port\n");
+	return 1;
+}
@@ -0,0 +1,266 @@
+/*
+ * asp_reply_bench: FPRead style ASP replies per second between two local
+ * processes. A forked server answers every request like afpd answers
+ * FPRead: it reads -s bytes of the file into the ASP reply buffer and sends
+ * them with asp_cmdreply(). The client sends -n XO requests.
+ *
+ * Usage: asp_reply_bench [-u] [-m shift|direct] [-n replies] [-s size] file
+ *
+ * -m shift builds the reply packets the way asp_cmdreply() did before, by
+ * moving the rest of the data forward to make room for the header of every
+ * packet, -m direct (default) uses asp_cmdreply(). -u runs over the DDP
+ * over UDP transport on loopback (see libatalk/netddp/netddp_udp.c).
+ *
+ * Reports replies per second as the client sees them and the time the
+ * server spends per reply, from the read to the last packet sent.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <netatalk/at.h>
+#include <netatalk/endian.h>
+#include <atalk/atp.h>
+#include <atalk/asp.h>
+
+#define BENCH_PORT 101
+#define BENCH_STOP 0xff
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* asp_cmdreply() as it was, data shifted to make room for the headers */
+static int shift_cmdreply(ASP asp, int result)
+{
+	struct iovec iov[ASP_MAXPACKETS];
+	struct atp_block atpb;
+	int iovcnt, buflen;
+	char *buf;
+
+	buf = (char *) asp->data;
+	buflen = asp->datalen;
+	result = htonl(result);
+
+	iovcnt = 0;
+	do {
+		iov[iovcnt].iov_base = buf;
+		memmove(buf + ASP_HDRSIZ, buf, buflen);
+
+		if (iovcnt == 0) {
+			memcpy(iov[iovcnt].iov_base, &result, ASP_HDRSIZ);
+		} else {
+			memset(iov[iovcnt].iov_base, 0, ASP_HDRSIZ);
+		}
+
+		if (buflen > ASP_CMDSIZ) {
+			buf += ASP_CMDMAXSIZ;
+			buflen -= ASP_CMDSIZ;
+			iov[iovcnt].iov_len = ASP_CMDMAXSIZ;
+		} else {
+			iov[iovcnt].iov_len = buflen + ASP_HDRSIZ;
+			buflen = 0;
+		}
+		iovcnt++;
+	} while (buflen > 0);
+
+	atpb.atp_saddr = &asp->asp_sat;
+	atpb.atp_sresiov = iov;
+	atpb.atp_sresiovcnt = iovcnt;
+	return atp_sresp(asp->asp_atp, &atpb);
+}
+
+static void server(int fd, off_t fsize, size_t size, int shift, int out)
+{
+	struct sockaddr_at sat;
+	struct atp_block atpb;
+	char req[ATP_MAXDATA];
+	double t, busy = 0;
+	unsigned long replies = 0;
+	off_t off = 0;
+	ssize_t len;
+	ATP atp;
+	ASP asp;
+
+	if ((atp = atp_open(BENCH_PORT, NULL)) == NULL
+	    || (asp = asp_init(atp)) == NULL) {
+		perror("server: atp_open");
+		exit(1);
+	}
+
+	for (;;) {
+		memset(&sat, 0, sizeof(sat));
+		atpb.atp_saddr = &sat;
+		atpb.atp_rreqdata = req;
+		atpb.atp_rreqdlen = sizeof(req);
+		if (atp_rreq(atp, &atpb) < 0)
+			continue;
+		if ((unsigned char) req[0] == BENCH_STOP)
+			break;
+
+		t = now();
+		asp->asp_sat = sat;
+		if ((len = pread(fd, asp->data, size, off)) < 0) {
+			perror("server: pread");
+			exit(1);
+		}
+		asp->datalen = len;
+		if ((off += size) >= fsize)
+			off = 0;
+		if (shift)
+			shift_cmdreply(asp, 0);
+		else
+			asp_cmdreply(asp, 0);
+		busy += now() - t;
+		replies++;
+	}
+
+	if (replies)
+		busy /= replies;
+	if (write(out, &busy, sizeof(busy)) != sizeof(busy))
+		perror("server: write");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	static char data[ASP_MAXPACKETS][ASP_CMDMAXSIZ];
+	struct sockaddr_at sat;
+	struct atp_block atpb;
+	struct iovec iov[ASP_MAXPACKETS];
+	struct stat st;
+	char req[ASP_HDRSIZ] = { 0 };
+	double start, secs, busy = 0;
+	size_t size = ASP_DATASIZ;
+	int count = 10000, shift = 0, packets, i, c, fd, status, pfd[2];
+	pid_t pid;
+	ATP atp;
+
+	while ((c = getopt(argc, argv, "um:n:s:")) != -1) {
+		switch (c) {
+		case 'u':
+			setenv("NETDDP_TRANSPORT", "udp", 1);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "shift"))
+				shift = 1;
+			else if (strcmp(optarg, "direct"))
+				goto usage;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || count < 1 || size < 1
+	    || size > ASP_DATASIZ)
+		goto usage;
+
+	if ((fd = open(argv[optind], O_RDONLY)) < 0
+	    || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (st.st_size < (off_t) size) {
+		fprintf(stderr, "asp_reply_bench: %s is smaller than %lu\n",
+			argv[optind], (unsigned long) size);
+		return 1;
+	}
+	packets = (size + ASP_CMDSIZ - 1) / ASP_CMDSIZ;
+
+	if (pipe(pfd) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	if ((pid = fork()) == 0) {
+		close(pfd[0]);
+		server(fd, st.st_size, size, shift, pfd[1]);
+	}
+	close(pfd[1]);
+
+	if ((atp = atp_open(ATADDR_ANYPORT, NULL)) == NULL) {
+		perror("atp_open");
+		kill(pid, SIGTERM);
+		return 1;
+	}
+	/* server lives at our node, on BENCH_PORT */
+	sat = *atp_sockaddr(atp);
+	sat.sat_port = BENCH_PORT;
+
+	/* give the server time to bind */
+	usleep(100000);
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		/* atp_rresp() leaves the lengths received */
+		for (c = 0; c < packets; c++) {
+			iov[c].iov_base = data[c];
+			iov[c].iov_len = sizeof(data[c]);
+		}
+		atpb.atp_saddr = &sat;
+		atpb.atp_sreqdata = req;
+		atpb.atp_sreqdlen = sizeof(req);
+		atpb.atp_sreqto = 2;
+		atpb.atp_sreqtries = 5;
+		if (atp_sreq(atp, &atpb, packets, ATP_XO) < 0) {
+			perror("atp_sreq");
+			break;
+		}
+		atpb.atp_rresiov = iov;
+		atpb.atp_rresiovcnt = packets;
+		if (atp_rresp(atp, &atpb) < 0) {
+			perror("atp_rresp");
+			break;
+		}
+	}
+	secs = now() - start;
+
+	/* no response to this one, the server reports and exits */
+	req[0] = BENCH_STOP;
+	atpb.atp_saddr = &sat;
+	atpb.atp_sreqdata = req;
+	atpb.atp_sreqdlen = sizeof(req);
+	atpb.atp_sreqto = 0;
+	atpb.atp_sreqtries = 1;
+	atp_sreq(atp, &atpb, 1, 0);
+	if (read(pfd[0], &busy, sizeof(busy)) != sizeof(busy))
+		kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	atp_close(atp);
+
+	if (i == 0)
+		return 1;
+	printf("mode %s, %d replies of %lu bytes in %d packets, %.3f s\n",
+	       shift ? "shift" : "direct", i, (unsigned long) size,
+	       packets, secs);
+	printf("%.0f replies/s, %.1f KB/s\n", i / secs,
+	       (double) i * size / secs / 1024);
+	printf("server: %.2f us per reply\n", busy * 1000000);
+	return 0;
+
+      usage:
+	fprintf(stderr,
+		"Usage: asp_reply_bench [-u] [-m shift|direct] [-n replies] [-s size] file\n");
+	return 1;
+}
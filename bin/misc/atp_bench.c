@@ -0,0 +1,162 @@
+/*
+ * atp_bench: ATP transaction rate and latency between two local
+ * processes. A forked responder answers every request with -p response
+ * packets of ATP_MAXDATA bytes, the requester sends -n XO transactions.
+ *
+ * Usage: atp_bench [-u] [-n transactions] [-p packets]
+ *
+ * -u runs over the DDP over UDP transport on loopback, so no kernel
+ * appletalk stack is needed (see libatalk/netddp/netddp_udp.c).
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <netatalk/at.h>
+#include <atalk/atp.h>
+
+#define BENCH_PORT 100
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void responder(int packets)
+{
+	static char data[8][ATP_MAXDATA];
+	struct sockaddr_at sat;
+	struct atp_block atpb;
+	struct iovec iov[8];
+	char req[ATP_MAXDATA];
+	ATP atp;
+	int i;
+
+	if ((atp = atp_open(BENCH_PORT, NULL)) == NULL) {
+		perror("responder: atp_open");
+		exit(1);
+	}
+
+	for (i = 0; i < packets; i++) {
+		iov[i].iov_base = data[i];
+		iov[i].iov_len = sizeof(data[i]);
+	}
+
+	for (;;) {
+		memset(&sat, 0, sizeof(sat));
+		atpb.atp_saddr = &sat;
+		atpb.atp_rreqdata = req;
+		atpb.atp_rreqdlen = sizeof(req);
+		if (atp_rreq(atp, &atpb) < 0)
+			continue;
+
+		atpb.atp_sresiov = iov;
+		atpb.atp_sresiovcnt = packets;
+		atp_sresp(atp, &atpb);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static char data[8][ATP_MAXDATA];
+	struct sockaddr_at sat;
+	struct atp_block atpb;
+	struct iovec iov[8];
+	char req[4] = { 0 };
+	double start, t, secs, lat, maxlat = 0;
+	int count = 10000, packets = 8, i, c, status;
+	pid_t pid;
+	ATP atp;
+
+	while ((c = getopt(argc, argv, "un:p:")) != -1) {
+		switch (c) {
+		case 'u':
+			setenv("NETDDP_TRANSPORT", "udp", 1);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'p':
+			packets = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: atp_bench [-u] [-n transactions] [-p packets]\n");
+			return 1;
+		}
+	}
+	if (packets < 1 || packets > 8) {
+		fprintf(stderr, "atp_bench: packets must be 1-8\n");
+		return 1;
+	}
+
+	if ((pid = fork()) == 0)
+		responder(packets);
+
+	if ((atp = atp_open(ATADDR_ANYPORT, NULL)) == NULL) {
+		perror("atp_open");
+		kill(pid, SIGTERM);
+		return 1;
+	}
+	/* responder lives at our node, on BENCH_PORT */
+	sat = *atp_sockaddr(atp);
+	sat.sat_port = BENCH_PORT;
+
+	/* give the responder time to bind */
+	usleep(100000);
+
+	for (i = 0; i < packets; i++) {
+		iov[i].iov_base = data[i];
+		iov[i].iov_len = sizeof(data[i]);
+	}
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		t = now();
+		atpb.atp_saddr = &sat;
+		atpb.atp_sreqdata = req;
+		atpb.atp_sreqdlen = sizeof(req);
+		atpb.atp_sreqto = 2;
+		atpb.atp_sreqtries = 5;
+		if (atp_sreq(atp, &atpb, packets, ATP_XO) < 0) {
+			perror("atp_sreq");
+			break;
+		}
+		atpb.atp_rresiov = iov;
+		atpb.atp_rresiovcnt = packets;
+		if (atp_rresp(atp, &atpb) < 0) {
+			perror("atp_rresp");
+			break;
+		}
+		lat = now() - t;
+		if (lat > maxlat)
+			maxlat = lat;
+	}
+	secs = now() - start;
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	atp_close(atp);
+
+	if (i == 0)
+		return 1;
+	printf("%d transactions of %d packets in %.3f s\n", i, packets, secs);
+	printf("%.0f transactions/s, %.1f KB/s\n", i / secs,
+	       (double) i * packets * ATP_MAXDATA / secs / 1024);
+	printf("latency: avg %.1f us, max %.1f us\n", secs / i * 1000000,
+	       maxlat * 1000000);
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * cnid_bench: adds, lookups, resolves and gets through the CNID backends
+ * the way afpd calls them, for comparing the backends on big volumes.
+ *
+ * Usage: cnid_bench [-B] [-b backend] [-n records] [-d dir] [-s server] [-p port]
+ *
+ * The database is the one of volume dir, which should be empty. The records
+ * are made up: a directory with 1000 files in it after the other, with
+ * inodes counting up and nothing on disk. After the adds every record is
+ * looked up, resolved and got by DID and name once, in an order jumping
+ * around the database. With -B the records are bulk loaded instead of added,
+ * the time includes writing the database.
+ *
+ * Like afpd it has to run as root, the backends switch to the owner of the
+ * volume.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+
+#include <atalk/cnid.h>
+#include <atalk/cnid_private.h>
+#include <atalk/directory.h>
+#include <atalk/logger.h>
+
+#define DEFAULT_RECORDS 1000000
+#define DIRSIZE         1000
+#define STRIDE          1000003	/* prime, for the order of the lookups */
+
+static cnid_t *ids;
+static const char *backend = "lsm", *server = "localhost", *port = "4700";
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* record i: its stat, name and parent */
+static cnid_t record(unsigned int i, struct stat *st, char *name,
+		     size_t *len)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = 1;
+	st->st_ino = 1000 + i;
+	if (i % DIRSIZE == 0) {
+		st->st_mode = S_IFDIR | 0755;
+		*len = sprintf(name, "directory %u", i / DIRSIZE);
+		return DIRDID_ROOT;
+	}
+	st->st_mode = S_IFREG | 0644;
+	*len = sprintf(name, "file %u.txt", i);
+	return ids[i - i % DIRSIZE];
+}
+
+static void report(const char *what, unsigned int n, double t)
+{
+	printf("%-8s %u in %.3f s, %.0f/s, %.2f us each\n", what, n, t,
+	       n / t, t * 1000000.0 / (n ? n : 1));
+}
+
+static struct _cnid_db *open_db(const char *dir, int flags)
+{
+	struct _cnid_db *cdb;
+
+	if ((cdb =
+	     cnid_open(dir, 022, (char *) backend, flags, server,
+		       port)) == NULL)
+		fprintf(stderr, "can't open the %s database of %s\n",
+			backend, dir);
+	return cdb;
+}
+
+/* what the database takes on disk */
+static void db_size(const char *dir)
+{
+	char path[MAXPATHLEN + 1];
+	struct dirent *de;
+	struct stat st;
+	off_t size = 0;
+	DIR *dp;
+
+	snprintf(path, sizeof(path), "%s/.AppleDB", dir);
+	if ((dp = opendir(path)) == NULL)
+		return;
+	while ((de = readdir(dp)) != NULL) {
+		snprintf(path, sizeof(path), "%s/.AppleDB/%s", dir,
+			 de->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			size += st.st_blocks * 512;
+	}
+	closedir(dp);
+	printf("database %.1f MB\n", size / 1048576.0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-B] [-b backend] [-n records] [-d dir] [-s server] [-p port]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char name[MAXPATHLEN + 1], buf[MAXPATHLEN + CNID_HEADER_LEN + 1];
+	const char *dir = NULL;
+	struct _cnid_db *cdb;
+	struct stat st;
+	unsigned int n = DEFAULT_RECORDS, i, j, err = 0;
+	int c, bulk = 0;
+	size_t len;
+	cnid_t did, id;
+	char *p;
+	double t;
+
+	while ((c = getopt(argc, argv, "Bb:n:d:s:p:")) != -1) {
+		switch (c) {
+		case 'B':
+			bulk = 1;
+			break;
+		case 'b':
+			backend = optarg;
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			server = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (dir == NULL || n == 0)
+		usage(argv[0]);
+	if (n % STRIDE == 0)
+		n++;
+	if ((ids = calloc(n, sizeof(cnid_t))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	set_processname("cnid_bench");
+	cnid_init();
+
+	if ((cdb = open_db(dir, bulk ? CNID_FLAG_BULK : 0)) == NULL)
+		return 1;
+	t = now();
+	for (i = 0; i < n; i++) {
+		did = record(i, &st, name, &len);
+		if ((ids[i] =
+		     cnid_add(cdb, &st, did, name, len, 0)) == CNID_INVALID) {
+			fprintf(stderr, "add of %u failed\n", i);
+			return 1;
+		}
+	}
+	if (bulk) {
+		cnid_close(cdb);
+		if ((cdb = open_db(dir, 0)) == NULL)
+			return 1;
+	}
+	report(bulk ? "bulk" : "add", n, now() - t);
+
+	t = now();
+	for (i = 0, j = 0; i < n; i++, j = (j + STRIDE) % n) {
+		did = record(j, &st, name, &len);
+		if (cnid_lookup(cdb, &st, did, name, len) != ids[j])
+			err++;
+	}
+	report("lookup", n, now() - t);
+
+	t = now();
+	for (i = 0, j = 0; i < n; i++, j = (j + STRIDE) % n) {
+		did = record(j, &st, name, &len);
+		id = ids[j];
+		if ((p = cnid_resolve(cdb, &id, buf, sizeof(buf))) == NULL
+		    || id != did || strcmp(p, name))
+			err++;
+	}
+	report("resolve", n, now() - t);
+
+	t = now();
+	for (i = 0, j = 0; i < n; i++, j = (j + STRIDE) % n) {
+		did = record(j, &st, name, &len);
+		if (cnid_get(cdb, did, name, len) != ids[j])
+			err++;
+	}
+	report("get", n, now() - t);
+
+	cnid_close(cdb);
+	db_size(dir);
+
+	if (err)
+		printf("%u wrong results\n", err);
+	return err ? 1 : 0;
+}
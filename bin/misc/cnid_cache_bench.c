@@ -0,0 +1,514 @@
+/*
+ * cnid_cache_bench: how many cnid_dbd round trips the CNID cache of the dbd
+ * backend saves when Finder browses a volume.
+ *
+ * Usage: cnid_cache_bench [-d dirs] [-f files] [-p passes] [-r every]
+ *
+ * A forked child plays cnid_dbd on a loopback TCP socket, with the records
+ * in memory, and counts the requests it gets. The volume is made up: 20
+ * folders with dirs subfolders with files files each, 50000 files with the
+ * defaults. Finder's browse is imitated the way afpd calls the backend:
+ * opening a folder resolves it and its parents back to the volume root,
+ * enumerates it twice (list and icon view ask again) with a cnid_add() per
+ * entry, then gets the parameters of the first 50 files with cnid_lookup()
+ * and cnid_get(). The tree is browsed passes times. With -r a second
+ * connection renames a file after every "every" requests, which makes
+ * cnid_dbd count up its generation and the cache start over.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <atalk/util.h>
+#include <atalk/logger.h>
+#include <atalk/cnid.h>
+#include <atalk/cnid_dbd_private.h>
+#include <atalk/directory.h>
+
+#define TOPDIRS   20
+#define VISIBLE   50		/* files Finder shows without scrolling */
+#define MAXCLIENT 8
+#define HASHSIZE  (1 << 18)
+
+/* ------------------ the fake cnid_dbd */
+struct rec {
+	cnid_t did;
+	u_int64_t dev, ino;
+	u_int32_t type;
+	char *name;
+};
+
+static struct rec *recs;
+static unsigned int nrecs, maxrecs;
+static u_int32_t didname_tab[HASHSIZE], devino_tab[HASHSIZE];
+static u_int32_t gen;
+static unsigned long *rpcs;	/* per connection, shared with the parent */
+static unsigned int conn;	/* the connection being served */
+
+static u_int32_t h_didname(cnid_t did, const char *name, size_t len)
+{
+	u_int32_t h = 2166136261U ^ did;
+
+	while (len--)
+		h = (h ^ (unsigned char) *name++) * 16777619U;
+	return h & (HASHSIZE - 1);
+}
+
+static u_int32_t h_devino(u_int64_t dev, u_int64_t ino)
+{
+	return ((ino ^ dev) * 0x9e3779b97f4a7c15ULL) >> 46;
+}
+
+/* record index + 1 by did/name or dev/ino, 0 if there is none */
+static u_int32_t *find_didname(cnid_t did, const char *name, size_t len)
+{
+	u_int32_t *p, h = h_didname(did, name, len);
+	struct rec *r;
+
+	for (; *(p = &didname_tab[h]); h = (h + 1) & (HASHSIZE - 1)) {
+		r = &recs[*p - 1];
+		if (r->name && r->did == did && strlen(r->name) == len
+		    && !memcmp(r->name, name, len))
+			break;
+	}
+	return p;
+}
+
+static u_int32_t *find_devino(u_int64_t dev, u_int64_t ino)
+{
+	u_int32_t *p, h = h_devino(dev, ino);
+	struct rec *r;
+
+	for (; *(p = &devino_tab[h]); h = (h + 1) & (HASHSIZE - 1)) {
+		r = &recs[*p - 1];
+		if (r->name && r->dev == dev && r->ino == ino)
+			break;
+	}
+	return p;
+}
+
+static cnid_t rec_set(unsigned int i, struct cnid_dbd_rqst *rqst,
+		      const char *name)
+{
+	struct rec *r = &recs[i];
+
+	free(r->name);
+	r->did = rqst->did;
+	r->dev = rqst->dev;
+	r->ino = rqst->ino;
+	r->type = rqst->type;
+	r->name = strndup(name, rqst->namelen);
+	*find_didname(r->did, name, rqst->namelen) = i + 1;
+	*find_devino(r->dev, r->ino) = i + 1;
+	return htonl(i + CNID_START);
+}
+
+/* renames leave stale index entries behind, the finds skip them */
+static int rec_of(cnid_t cnid)
+{
+	unsigned int i = ntohl(cnid) - CNID_START;
+
+	return i < nrecs && recs[i].name ? (int) i : -1;
+}
+
+static int answer(int fd, struct cnid_dbd_rqst *rqst, char *name)
+{
+	struct cnid_dbd_rply rply;
+	char buf[MAXPATHLEN + CNID_HEADER_LEN + 1];
+	struct iovec iov[2];
+	u_int32_t *p, type;
+	struct rec *r;
+	int i, j, vecs = 1;
+	u_int64_t v;
+
+	memset(&rply, 0, sizeof(rply));
+	rply.result = CNID_DBD_RES_OK;
+	switch (rqst->op) {
+	case CNID_DBD_OP_GETSTAMP:
+		memset(buf, 0, ADEDLEN_PRIVSYN);
+		memcpy(buf, "bench", 5);
+		rply.namelen = ADEDLEN_PRIVSYN;
+		break;
+	case CNID_DBD_OP_SHM_ATTACH:
+		rply.result = CNID_DBD_RES_ERR_DB;
+		break;
+	case CNID_DBD_OP_ADD:
+	case CNID_DBD_OP_LOOKUP:
+		rpcs[conn]++;
+		p = find_devino(rqst->dev, rqst->ino);
+		if (*p) {
+			r = &recs[*p - 1];
+			rply.cnid = htonl(*p - 1 + CNID_START);
+			if (r->did != rqst->did || strlen(r->name) != rqst->namelen
+			    || memcmp(r->name, name, rqst->namelen)) {
+				/* moved or renamed behind our back */
+				gen++;
+				rec_set(*p - 1, rqst, name);
+			}
+		} else if (rqst->op == CNID_DBD_OP_LOOKUP) {
+			rply.result = CNID_DBD_RES_NOTFOUND;
+		} else {
+			if (nrecs == maxrecs) {
+				rply.result = CNID_DBD_RES_ERR_MAX;
+				break;
+			}
+			rply.cnid = rec_set(nrecs++, rqst, name);
+		}
+		break;
+	case CNID_DBD_OP_GET:
+		rpcs[conn]++;
+		if (*(p = find_didname(rqst->did, name, rqst->namelen)))
+			rply.cnid = htonl(*p - 1 + CNID_START);
+		else
+			rply.result = CNID_DBD_RES_NOTFOUND;
+		break;
+	case CNID_DBD_OP_RESOLVE:
+		rpcs[conn]++;
+		if ((i = rec_of(rqst->cnid)) < 0) {
+			rply.result = CNID_DBD_RES_NOTFOUND;
+			break;
+		}
+		r = &recs[i];
+		memcpy(buf + CNID_OFS, &rqst->cnid, CNID_LEN);
+		for (v = r->dev, j = CNID_DEV_LEN - 1; j >= 0; j--, v >>= 8)
+			buf[CNID_DEV_OFS + j] = v;
+		for (v = r->ino, j = CNID_INO_LEN - 1; j >= 0; j--, v >>= 8)
+			buf[CNID_INO_OFS + j] = v;
+		type = htonl(r->type);
+		memcpy(buf + CNID_TYPE_OFS, &type, CNID_TYPE_LEN);
+		memcpy(buf + CNID_DID_OFS, &r->did, CNID_DID_LEN);
+		strcpy(buf + CNID_NAME_OFS, r->name);
+		rply.did = r->did;
+		rply.namelen = CNID_NAME_OFS + strlen(r->name) + 1;
+		break;
+	case CNID_DBD_OP_UPDATE:
+		rpcs[conn]++;
+		gen++;
+		if ((i = rec_of(rqst->cnid)) >= 0)
+			rec_set(i, rqst, name);
+		else
+			rply.result = CNID_DBD_RES_NOTFOUND;
+		break;
+	default:
+		rply.result = CNID_DBD_RES_ERR_DB;
+		break;
+	}
+	rply.gen = gen;
+
+	iov[0].iov_base = &rply;
+	iov[0].iov_len = sizeof(rply);
+	if (rply.namelen) {
+		iov[1].iov_base = buf;
+		iov[1].iov_len = rply.namelen;
+		vecs++;
+	}
+	return writev(fd, iov, vecs) ==
+	    (ssize_t) (sizeof(rply) + rply.namelen) ? 0 : -1;
+}
+
+/* one request of client fd, -1 when it's gone */
+static int serve(int fd, int *opened)
+{
+	struct cnid_dbd_rqst rqst;
+	char name[MAXPATHLEN + 1];
+	int len;
+
+	if (!*opened) {
+		/* init_tsock(): the length of the volume path, then the path */
+		if (readt(fd, &len, sizeof(len), 0, 5) != sizeof(len)
+		    || len < 0 || len > MAXPATHLEN
+		    || readt(fd, name, len, 0, 5) != len)
+			return -1;
+		*opened = 1;
+		return 0;
+	}
+	if (readt(fd, &rqst, sizeof(rqst), 0, 5) != sizeof(rqst)
+	    || rqst.namelen > MAXPATHLEN
+	    || (rqst.namelen
+		&& readt(fd, name, rqst.namelen, 0,
+			 5) != (ssize_t) rqst.namelen))
+		return -1;
+	name[rqst.namelen] = '\0';
+	return answer(fd, &rqst, name);
+}
+
+static void server(int lfd)
+{
+	int fds[MAXCLIENT], opened[MAXCLIENT], seq[MAXCLIENT];
+	int n = 0, accepted = 0, i, fd, max;
+	fd_set set;
+
+	while (1) {
+		FD_ZERO(&set);
+		FD_SET(lfd, &set);
+		max = lfd;
+		for (i = 0; i < n; i++) {
+			FD_SET(fds[i], &set);
+			if (fds[i] > max)
+				max = fds[i];
+		}
+		if (select(max + 1, &set, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
+		if (FD_ISSET(lfd, &set) && n < MAXCLIENT
+		    && (fd = accept(lfd, NULL, NULL)) >= 0) {
+			opened[n] = 0;
+			seq[n] = accepted < MAXCLIENT ? accepted++ : MAXCLIENT - 1;
+			fds[n++] = fd;
+		}
+		for (i = 0; i < n; i++) {
+			if (!FD_ISSET(fds[i], &set))
+				continue;
+			conn = seq[i];
+			if (serve(fds[i], &opened[i]) == 0)
+				continue;
+			close(fds[i]);
+			fds[i] = fds[--n];
+			opened[i] = opened[n];
+			seq[i] = seq[n];
+			i--;
+		}
+	}
+}
+
+/* ------------------ the browsing client */
+static unsigned int ndirs = 10, nfiles = 250, passes = 2, every;
+static unsigned long calls;
+static cnid_t topids[TOPDIRS], *dirids;
+static struct _cnid_db *cdb, *other;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* every "every" calls the other client renames file 0 of folder d */
+static void tick(unsigned int d)
+{
+	static unsigned int renames;
+	struct stat st;
+	char name[64];
+	size_t len;
+
+	calls++;
+	if (!every || calls % every)
+		return;
+	memset(&st, 0, sizeof(st));
+	st.st_dev = 1;
+	st.st_ino = 100000 + d * nfiles;
+	st.st_mode = S_IFREG | 0644;
+	len = sprintf(name, "file 0 renamed %u", ++renames);
+	/* cnid_dbd sees the inode under a new name */
+	cnid_add(other, &st, dirids[d], name, len, 0);
+}
+
+/* folder i of the volume: the top folders, then their subfolders */
+static cnid_t folder(unsigned int i, struct stat *st, char *name,
+		     size_t *len)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = 1;
+	st->st_ino = 10 + i;
+	st->st_mode = S_IFDIR | 0755;
+	if (i < TOPDIRS) {
+		*len = sprintf(name, "folder %u", i);
+		return DIRDID_ROOT;
+	}
+	i -= TOPDIRS;
+	*len = sprintf(name, "folder %u", i % ndirs);
+	return topids[i / ndirs];
+}
+
+static cnid_t file(unsigned int d, unsigned int f, struct stat *st,
+		   char *name, size_t *len)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = 1;
+	st->st_ino = 100000 + d * nfiles + f;
+	st->st_mode = S_IFREG | 0644;
+	*len = sprintf(name, "file %u", f);
+	return dirids[d];
+}
+
+/* opening folder d, a subfolder of a top folder */
+static int browse(unsigned int d)
+{
+	char name[MAXPATHLEN + 1], buf[MAXPATHLEN + CNID_HEADER_LEN + 1];
+	struct stat st;
+	unsigned int f, e;
+	size_t len;
+	cnid_t did, id;
+
+	/* the path: the folder and its parents */
+	for (id = dirids[d]; id != DIRDID_ROOT;) {
+		tick(d);
+		if (cnid_resolve(cdb, &id, buf, sizeof(buf)) == NULL)
+			return -1;
+	}
+	/* enumerated twice */
+	for (e = 0; e < 2; e++)
+		for (f = 0; f < nfiles; f++) {
+			tick(d);
+			did = file(d, f, &st, name, &len);
+			if (cnid_add(cdb, &st, did, name, len, 0) ==
+			    CNID_INVALID)
+				return -1;
+		}
+	/* the visible files' parameters */
+	for (f = 0; f < nfiles && f < VISIBLE; f++) {
+		did = file(d, f, &st, name, &len);
+		tick(d);
+		cnid_lookup(cdb, &st, did, name, len);
+		tick(d);
+		cnid_get(cdb, did, name, len);
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dirs] [-f files] [-p passes] [-r every]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	char name[MAXPATHLEN + 1], port[16];
+	struct stat st;
+	unsigned int i, p, n;
+	cnid_t did, id;
+	int c, lfd;
+	pid_t pid;
+	size_t len;
+	double t;
+
+	while ((c = getopt(argc, argv, "d:f:p:r:")) != -1) {
+		switch (c) {
+		case 'd':
+			ndirs = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			nfiles = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			passes = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			every = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!ndirs || !passes)
+		usage(argv[0]);
+	n = TOPDIRS * ndirs;
+	maxrecs = TOPDIRS + n + n * nfiles + 1024;
+	if (maxrecs > HASHSIZE / 2) {
+		fprintf(stderr, "at most %u objects\n", HASHSIZE / 2);
+		return 1;
+	}
+	if ((recs = calloc(maxrecs, sizeof(*recs))) == NULL
+	    || (dirids = calloc(n, sizeof(cnid_t))) == NULL
+	    || (rpcs = mmap(NULL, MAXCLIENT * sizeof(*rpcs), PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		perror("alloc");
+		return 1;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+	    || bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0
+	    || listen(lfd, MAXCLIENT) < 0
+	    || getsockname(lfd, (struct sockaddr *) &sin, &slen) < 0) {
+		perror("socket");
+		return 1;
+	}
+	sprintf(port, "%u", ntohs(sin.sin_port));
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0)
+		server(lfd);
+	close(lfd);
+
+	set_processname("cnid_cache_bench");
+	cnid_init();
+	if ((cdb = cnid_open("/tmp", 022, "dbd", 0, "127.0.0.1", port)) ==
+	    NULL
+	    || (other =
+		cnid_open("/tmp", 022, "dbd", 0, "127.0.0.1",
+			  port)) == NULL) {
+		fprintf(stderr, "cnid_open failed\n");
+		return 1;
+	}
+
+	/* the folders, added like a first visit would */
+	for (i = 0; i < TOPDIRS + n; i++) {
+		did = folder(i, &st, name, &len);
+		if ((id = cnid_add(cdb, &st, did, name, len, 0)) == CNID_INVALID) {
+			fprintf(stderr, "add of folder %u failed\n", i);
+			return 1;
+		}
+		if (i < TOPDIRS)
+			topids[i] = id;
+		else
+			dirids[i - TOPDIRS] = id;
+	}
+
+	/* cdb connected first */
+	rpcs[0] = 0;
+	t = now();
+	for (p = 0; p < passes; p++)
+		for (i = 0; i < n; i++)
+			if (browse(i) < 0) {
+				fprintf(stderr, "browsing folder %u failed\n",
+					i);
+				return 1;
+			}
+	t = now() - t;
+
+	printf("%u folders, %u files, %u passes\n", TOPDIRS + n,
+	       n * nfiles, passes);
+	printf("%lu calls, %lu RPCs, %lu avoided (%.1f%%), %.3f s, %.2f us per call\n",
+	       calls, rpcs[0], calls - rpcs[0],
+	       calls ? 100.0 * (calls - rpcs[0]) / calls : 0.0, t,
+	       t * 1000000.0 / (calls ? calls : 1));
+	if (every)
+		printf("%lu renames by the other client\n", calls / every);
+
+	cnid_close(other);
+	cnid_close(cdb);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return 0;
+}
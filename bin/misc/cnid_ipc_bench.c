@@ -0,0 +1,255 @@
+/*
+ * cnid_ipc_bench: round trips of "empty" cnid_dbd requests over the
+ * transports between afpd and cnid_dbd, see the IPC figure in
+ * etc/cnid_dbd/README.
+ *
+ * Usage: cnid_ipc_bench [-n requests] [-m unix|tcp|shm]
+ *
+ * A forked child plays cnid_dbd and answers every request with an empty
+ * CNID_DBD_RES_OK reply, no database is involved. Both sides do what
+ * libatalk/cnid/dbd/cnid_dbd.c and etc/cnid_dbd/comm.c do: writev() and
+ * readt() on the socket, or the shared memory rings with the socket as the
+ * wakeup channel. Without -m all transports are measured.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <atalk/util.h>
+#include <atalk/cnid_dbd_private.h>
+#include <atalk/shm_ring.h>
+
+#define DEFAULT_REQUESTS 20000
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* a connected pair of sockets, either AF_UNIX or TCP over loopback */
+static int sock_pair(int tcp, int sv[2])
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int lfd, on = 1;
+
+	if (!tcp)
+		return socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+	    || bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0
+	    || listen(lfd, 1) < 0
+	    || getsockname(lfd, (struct sockaddr *) &sin, &len) < 0
+	    || (sv[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0
+	    || connect(sv[0], (struct sockaddr *) &sin, sizeof(sin)) < 0
+	    || (sv[1] = accept(lfd, NULL, NULL)) < 0)
+		return -1;
+	close(lfd);
+	/* like tsock_getfd() */
+	setsockopt(sv[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	setsockopt(sv[1], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return 0;
+}
+
+/* ------------------ socket transport */
+static void sock_server(int fd)
+{
+	struct cnid_dbd_rqst rqst;
+	struct cnid_dbd_rply rply;
+
+	memset(&rply, 0, sizeof(rply));
+	while (readt(fd, &rqst, sizeof(rqst), 0, 5) == sizeof(rqst)) {
+		rply.result = CNID_DBD_RES_OK;
+		if (write(fd, &rply, sizeof(rply)) != sizeof(rply))
+			break;
+	}
+	_exit(0);
+}
+
+static int sock_rpc(int fd)
+{
+	struct cnid_dbd_rqst rqst;
+	struct cnid_dbd_rply rply;
+	struct iovec iov[1];
+
+	memset(&rqst, 0, sizeof(rqst));
+	rqst.op = CNID_DBD_OP_OPEN;
+	iov[0].iov_base = &rqst;
+	iov[0].iov_len = sizeof(rqst);
+	if (writev(fd, iov, 1) != sizeof(rqst))
+		return -1;
+	if (readt(fd, &rply, sizeof(rply), 0, 5) != sizeof(rply))
+		return -1;
+	return rply.result == CNID_DBD_RES_OK ? 0 : -1;
+}
+
+/* ------------------ shared memory transport */
+static shm_ring_t rq, rp;
+
+static void shm_server(int fd)
+{
+	struct cnid_dbd_rqst rqst;
+	struct cnid_dbd_rply rply;
+	struct iovec iov[1];
+	fd_set fds;
+	char bell[64];
+	int i, spin;
+
+	memset(&rply, 0, sizeof(rply));
+	spin = shm_ring_spins(CNID_DBD_SHM_SPIN);
+	while (1) {
+		for (i = 0; i < spin && shm_ring_empty(&rq); i++);
+		if (shm_ring_empty(&rq) && !shm_ring_sleep(&rq)) {
+			FD_ZERO(&fds);
+			FD_SET(fd, &fds);
+			select(fd + 1, &fds, NULL, NULL, NULL);
+			shm_ring_awake(&rq);
+			if (recv(fd, bell, sizeof(bell), MSG_DONTWAIT) == 0)
+				_exit(0);
+			continue;
+		}
+		iov[0].iov_base = &rqst;
+		iov[0].iov_len = sizeof(rqst);
+		if (shm_ring_get(&rq, iov, 1) != sizeof(rqst))
+			_exit(1);
+		rply.result = CNID_DBD_RES_OK;
+		iov[0].iov_base = &rply;
+		iov[0].iov_len = sizeof(rply);
+		if (shm_ring_put(&rp, iov, 1) < 0)
+			_exit(1);
+		shm_ring_wake(&rp);
+	}
+}
+
+static int shm_rpc(int fd)
+{
+	struct cnid_dbd_rqst rqst;
+	struct cnid_dbd_rply rply;
+	struct iovec iov[1];
+
+	memset(&rqst, 0, sizeof(rqst));
+	rqst.op = CNID_DBD_OP_OPEN;
+	iov[0].iov_base = &rqst;
+	iov[0].iov_len = sizeof(rqst);
+	if (shm_ring_put(&rq, iov, 1) < 0)
+		return -1;
+	if (shm_ring_waiting(&rq) && write(fd, "", 1) != 1)
+		return -1;
+	while (!shm_ring_wait(&rp, CNID_DBD_SHM_SPIN, 100));
+	iov[0].iov_base = &rply;
+	iov[0].iov_len = sizeof(rply);
+	if (shm_ring_get(&rp, iov, 1) != sizeof(rply))
+		return -1;
+	return rply.result == CNID_DBD_RES_OK ? 0 : -1;
+}
+
+/* ------------------ */
+static int bench(const char *mode, int n)
+{
+	int sv[2], i, status;
+	int shm = !strcmp(mode, "shm");
+	void *seg = NULL;
+	pid_t pid;
+	double t;
+
+	if (sock_pair(!strcmp(mode, "tcp"), sv) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (shm) {
+		seg = mmap(NULL, CNID_DBD_SHM_LEN, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (seg == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		shm_ring_init(CNID_DBD_SHM_RQST(seg), CNID_DBD_SHM_RINGSIZE);
+		shm_ring_init(CNID_DBD_SHM_RPLY(seg), CNID_DBD_SHM_RINGSIZE);
+		shm_ring_attach(&rq, CNID_DBD_SHM_RQST(seg),
+				CNID_DBD_SHM_RINGSIZE);
+		shm_ring_attach(&rp, CNID_DBD_SHM_RPLY(seg),
+				CNID_DBD_SHM_RINGSIZE);
+	}
+
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		if (shm)
+			shm_server(sv[1]);
+		sock_server(sv[1]);
+	}
+	close(sv[1]);
+
+	t = now();
+	for (i = 0; i < n; i++) {
+		if ((shm ? shm_rpc(sv[0]) : sock_rpc(sv[0])) < 0) {
+			fprintf(stderr, "%s: request %d failed\n", mode, i);
+			break;
+		}
+	}
+	t = now() - t;
+
+	close(sv[0]);
+	waitpid(pid, &status, 0);
+	if (seg)
+		munmap(seg, CNID_DBD_SHM_LEN);
+
+	printf("%-5s %d requests in %.3f s, %.0f requests/s, %.2f us/request\n",
+	       mode, i, t, i / t, t * 1000000.0 / (i ? i : 1));
+	return i == n ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *modes[] = { "unix", "tcp", "shm" };
+	char *mode = NULL;
+	int n = DEFAULT_REQUESTS;
+	int c, i, err = 0;
+
+	while ((c = getopt(argc, argv, "n:m:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-n requests] [-m unix|tcp|shm]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < 3; i++)
+		if (!mode || !strcmp(mode, modes[i]))
+			err |= bench(modes[i], n);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * crlf_bench: throughput of the CR/LF translation and newline scanning
+ * kernels of libatalk/util/crlf.c
+ *
+ * Usage: crlf_bench [-k kernel] [-s size] [-m MB]
+ *
+ * Every kernel the CPU can run (or just -k scalar|sse2|avx2|neon) swaps
+ * \012 and \015 in -m MB (default 512) of text, -s bytes at a time like
+ * FPRead does (default 4624, one ASP reply), then scans the same text for a
+ * \015 with newline mask 0x7f, which isn't there, so every byte is looked
+ * at. The results are checked against the scalar kernels first.
+ *
+ * Reports MB/s of both per kernel.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <atalk/crlf.h>
+
+static const char *names[] = { "scalar", "sse2", "avx2", "neon" };
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* lines of printable characters ending in \012, now and then a \015 */
+static void fill(char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (random() % 40 == 0)
+			buf[i] = '\012';
+		else if (random() % 500 == 0)
+			buf[i] = '\015';
+		else
+			buf[i] = ' ' + random() % 95;
+	}
+}
+
+/* same results as the scalar kernels, on every length and alignment */
+static int check(const char *name, const char *text)
+{
+	char ref[300], buf[300];
+	size_t off, len, i;
+
+	for (off = 0; off < 32; off++) {
+		for (len = 0; len < sizeof(ref) - off; len++) {
+			memcpy(ref, text + off, len);
+			memcpy(buf, text + off, len);
+			crlf_use("scalar");
+			crlf_swap(ref, len);
+			crlf_use(name);
+			crlf_swap(buf, len);
+			if (memcmp(ref, buf, len))
+				return -1;
+
+			for (i = 0; i < 4; i++) {
+				static const u_int8_t mask[] = { 0x7f, 0x0f, 0xdf, 0x7f };
+				static const u_int8_t ch[] = { '\012', 0x0a, 'A', 0 };
+				size_t r;
+
+				crlf_use("scalar");
+				r = nl_scan(text + off, len, mask[i], ch[i]);
+				crlf_use(name);
+				if (nl_scan(text + off, len, mask[i], ch[i]) != r)
+					return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *text, *buf;
+	const char *only = NULL;
+	size_t size = 4624, total = 512, off, len, done, found;
+	double start, swap_secs, scan_secs;
+	unsigned int k;
+	int c;
+
+	while ((c = getopt(argc, argv, "k:s:m:")) != -1) {
+		switch (c) {
+		case 'k':
+			only = optarg;
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'm':
+			total = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || size == 0 || total == 0)
+		goto usage;
+	total *= 1024 * 1024;
+
+	/* a megabyte of text, a read starts anywhere in it */
+	len = 1024 * 1024;
+	if ((text = malloc(len + size)) == NULL
+	    || (buf = malloc(len + size)) == NULL) {
+		perror("crlf_bench");
+		return 1;
+	}
+	srandom(1);
+	fill(text, len + size);
+	for (off = 0; off < len + size; off++)
+		if (text[off] == '\015')
+			text[off] = '\012';
+	memcpy(buf, text, len + size);
+
+	printf("%lu bytes per call, %lu MB, default kernels %s\n",
+	       (unsigned long) size, (unsigned long) (total >> 20),
+	       crlf_kernel());
+
+	for (k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+		if (only && strcmp(only, names[k]))
+			continue;
+		if (crlf_use(names[k]) < 0) {
+			if (only) {
+				fprintf(stderr, "crlf_bench: no %s here\n",
+					only);
+				return 1;
+			}
+			continue;
+		}
+		fill(buf, 300);
+		if (check(names[k], buf) < 0) {
+			printf("%-7s WRONG RESULTS\n", names[k]);
+			continue;
+		}
+
+		start = now();
+		for (done = 0, off = 0; done < total; done += size) {
+			crlf_swap(buf + off, size);
+			if ((off += 4093) >= len)
+				off -= len;
+		}
+		swap_secs = now() - start;
+
+		found = 0;
+		start = now();
+		for (done = 0, off = 0; done < total; done += size) {
+			found += nl_scan(text + off, size, 0x7f, '\015');
+			if ((off += 4093) >= len)
+				off -= len;
+		}
+		scan_secs = now() - start;
+		if (found != total / size * size + (total % size ? size : 0))
+			printf("%-7s scan found a \\015\n", names[k]);
+
+		printf("%-7s swap %8.1f MB/s   scan %8.1f MB/s\n", names[k],
+		       total / swap_secs / (1024 * 1024),
+		       total / scan_secs / (1024 * 1024));
+	}
+	return 0;
+
+      usage:
+	fprintf(stderr,
+		"usage: crlf_bench [-k scalar|sse2|avx2|neon] [-s size] [-m MB]\n");
+	return 1;
+}
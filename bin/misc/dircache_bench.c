@@ -0,0 +1,256 @@
+/*
+ * dircache_bench: browse a directory tree the way afpd fills its dircache
+ * and compare the cost of the cache entries with malloc() and with the slab
+ * allocator.
+ *
+ * Usage: dircache_bench [-m malloc|slab] [-n entries] [-r rounds] dir
+ *
+ * Every object below dir gets an entry like afpd's struct dir with its mac
+ * name, unix name and full path. The newest -n entries (default 8192) are
+ * kept, older ones are dropped like dircache evictions, the tree is walked
+ * -r times (default 3). In malloc mode an entry costs what dir_new() and the
+ * kazlib hashtables used to allocate: the struct, a bstring for the name,
+ * its UCS2 copy, the full path and three index nodes. In slab mode struct
+ * and strings come from libatalk's slabs like they do now.
+ *
+ * Reports allocator calls per entry, time per entry, and the RSS after the
+ * browse, after dropping every second entry and after dropping all.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <atalk/bstrlib.h>
+#include <atalk/bstradd.h>
+#include <atalk/slab.h>
+
+/* struct dir as it was before the slabs */
+struct bench_dir {
+	bstring fullpath;
+	bstring m_name;
+	bstring u_name;
+	void *m_name_ucs2;
+	void *qidx_node;
+	void *hnode[2];
+	time_t ctime;
+	int flags;
+	u_int32_t pdid;
+	u_int32_t did;
+	u_int32_t offcnt;
+	u_int16_t vid;
+	u_int32_t rights;
+	time_t dcache_ctime;
+	ino_t dcache_ino;
+};
+
+static int use_slab;
+static slab_t *dir_slab;
+static struct bench_dir **ring;
+static unsigned int ringsize, ringpos;
+static unsigned long long entries, dirs, allocs;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static long rss_kb(void)
+{
+	FILE *fp;
+	long size, rss = 0;
+
+	if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+		return -1;
+	if (fscanf(fp, "%ld %ld", &size, &rss) != 2)
+		rss = -1;
+	fclose(fp);
+	return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void drop(struct bench_dir *d)
+{
+	if (use_slab) {
+		bslabdestroy(d->m_name);
+		bslabdestroy(d->fullpath);
+		slab_free(dir_slab, d);
+		return;
+	}
+	free(d->hnode[0]);
+	free(d->hnode[1]);
+	free(d->qidx_node);
+	free(d->m_name_ucs2);
+	bdestroy(d->m_name);
+	bdestroy(d->fullpath);
+	free(d);
+}
+
+/* the caller's path is consumed */
+static struct bench_dir *add(const char *name, bstring path,
+			     const struct stat *st)
+{
+	struct bench_dir *d;
+	size_t len = strlen(name);
+
+	if (use_slab) {
+		d = slab_alloc(dir_slab);
+		memset(d, 0, sizeof(*d));
+		d->m_name = bslabcstr(name, len);
+		d->fullpath = bslabcstr(cfrombstr(path), blength(path));
+		bdestroy(path);
+		allocs += 3;
+	} else {
+		d = calloc(1, sizeof(*d));
+		d->m_name = bfromcstr(name);
+		/* convert_string_allocate() grows a buffer and shrinks it */
+		d->m_name_ucs2 = malloc(1024);
+		d->m_name_ucs2 = realloc(d->m_name_ucs2, 2 * (len + 1));
+		d->fullpath = path;
+		d->hnode[0] = malloc(5 * sizeof(void *));
+		d->hnode[1] = malloc(5 * sizeof(void *));
+		d->qidx_node = malloc(3 * sizeof(void *));
+		allocs += 8;
+	}
+	d->u_name = d->m_name;
+	d->dcache_ctime = st->st_ctime;
+	d->dcache_ino = st->st_ino;
+	d->did = ++entries;
+
+	if (ring[ringpos])
+		drop(ring[ringpos]);
+	ring[ringpos] = d;
+	ringpos = (ringpos + 1) % ringsize;
+	return d;
+}
+
+static void browse(const_bstring dirpath)
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	bstring path;
+	int mlen;
+
+	if ((dp = opendir(cfrombstr(dirpath))) == NULL)
+		return;
+	dirs++;
+
+	while ((de = readdir(dp)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		/* afpd builds the full path of every entry like this */
+		if ((path = bstrcpy(dirpath)) == NULL)
+			continue;
+		allocs += 2;
+		mlen = path->mlen;
+		bconchar(path, '/');
+		bcatcstr(path, de->d_name);
+		if (path->mlen != mlen)
+			allocs++;
+
+		if (lstat(cfrombstr(path), &st) != 0) {
+			bdestroy(path);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			bstring sub = bstrcpy(path);
+
+			add(de->d_name, path, &st);
+			browse(sub);
+			bdestroy(sub);
+		} else {
+			add(de->d_name, path, &st);
+		}
+	}
+	closedir(dp);
+}
+
+int main(int argc, char **argv)
+{
+	bstring top;
+	double start, secs;
+	unsigned int i;
+	int c, rounds = 3;
+
+	ringsize = 8192;
+	while ((c = getopt(argc, argv, "m:n:r:")) != -1) {
+		switch (c) {
+		case 'm':
+			if (!strcmp(optarg, "slab"))
+				use_slab = 1;
+			else if (strcmp(optarg, "malloc"))
+				goto usage;
+			break;
+		case 'n':
+			ringsize = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || ringsize == 0 || rounds < 1)
+		goto usage;
+
+	if ((ring = calloc(ringsize, sizeof(*ring))) == NULL
+	    || (dir_slab = slab_create(sizeof(struct bench_dir))) == NULL) {
+		perror("dircache_bench");
+		return 1;
+	}
+	top = bfromcstr(argv[optind]);
+
+	printf("mode %s, %u entries kept, RSS at start %ld kB\n",
+	       use_slab ? "slab" : "malloc", ringsize, rss_kb());
+
+	start = now();
+	for (c = 0; c < rounds; c++)
+		browse(top);
+	secs = now() - start;
+
+	if (entries == 0) {
+		fprintf(stderr, "dircache_bench: nothing found in %s\n",
+			argv[optind]);
+		return 1;
+	}
+	printf("%llu entries in %llu directories, %.3f s, %.2f us per entry\n",
+	       entries, dirs, secs, secs * 1e6 / entries);
+	printf("allocator calls per entry: %.2f\n",
+	       (double) allocs / entries);
+	printf("RSS after browse: %ld kB\n", rss_kb());
+
+	for (i = 0; i < ringsize; i += 2)
+		if (ring[i]) {
+			drop(ring[i]);
+			ring[i] = NULL;
+		}
+	printf("RSS after dropping every second entry: %ld kB\n", rss_kb());
+
+	for (i = 0; i < ringsize; i++)
+		if (ring[i]) {
+			drop(ring[i]);
+			ring[i] = NULL;
+		}
+	printf("RSS after dropping all entries: %ld kB\n", rss_kb());
+
+	bdestroy(top);
+	return 0;
+
+      usage:
+	fprintf(stderr,
+		"usage: dircache_bench [-m malloc|slab] [-n entries] [-r rounds] dir\n");
+	return 1;
+}
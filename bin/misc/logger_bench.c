@@ -0,0 +1,81 @@
+/*
+ * logger_bench: LOG() calls per second with the message level disabled,
+ * enabled to a logfile and enabled to syslog.
+ *
+ * Usage: logger_bench [-n calls] [-f logfile]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <atalk/logger.h>
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void run(const char *name, const char *logstr, int calls)
+{
+	char buf[MAXPATHLEN + 64];
+	double start, secs;
+	int i;
+
+	snprintf(buf, sizeof(buf), "%s", logstr);
+	setuplog(buf);
+
+	start = now();
+	for (i = 0; i < calls; i++)
+		LOG(log_debug, logtype_default,
+		    "enumerate: entry %d of \"%s\", did: %u", i,
+		    "Some Folder", 4711);
+	log_flush();
+	secs = now() - start;
+
+	printf("%-10s %10d calls %8.3f s %12.0f calls/s\n",
+	       name, calls, secs, secs > 0 ? calls / secs : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	char logstr[MAXPATHLEN + 64];
+	const char *file = "logger_bench.log";
+	int calls = 1000000, c;
+
+	while ((c = getopt(argc, argv, "n:f:")) != -1) {
+		switch (c) {
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: logger_bench [-n calls] [-f logfile]\n");
+			return 1;
+		}
+	}
+
+	set_processname("logger_bench");
+
+	snprintf(logstr, sizeof(logstr), "default log_info %s", file);
+	run("disabled", logstr, calls);
+
+	snprintf(logstr, sizeof(logstr), "default log_debug %s", file);
+	run("file", logstr, calls);
+
+	/* syslog is slow, don't flood it */
+	run("syslog", "default log_debug", calls / 10 ? calls / 10 : 1);
+
+	unlink(file);
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * nbp_udpd: minimal NBP names information socket for the DDP over UDP
+ * transport. With no kernel appletalk there is no atalkd, so something
+ * has to answer the register, unregister and lookup requests afpd and
+ * papd send to the NIS at startup. Only the local zone "*" exists.
+ *
+ * Usage: NETDDP_TRANSPORT=udp nbp_udpd
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netatalk/at.h>
+#include <netatalk/endian.h>
+#include <atalk/ddp.h>
+#include <atalk/nbp.h>
+#include <atalk/netddp.h>
+
+#define NBP_NIS_PORT 2
+#define MAXNAMES 256
+
+/* libatalk/nbp/nbp_util.c */
+extern int nbp_parse(char *, struct nbpnve *, int);
+extern int nbp_match(struct nbpnve *, struct nbpnve *, int);
+
+static struct nbpnve names[MAXNAMES];
+static int nnames;
+
+static char *put_name(char *data, struct nbpnve *nn)
+{
+	struct nbptuple nt;
+
+	nt.nt_net = nn->nn_sat.sat_addr.s_net;
+	nt.nt_node = nn->nn_sat.sat_addr.s_node;
+	nt.nt_port = nn->nn_sat.sat_port;
+	nt.nt_enum = 0;
+	memcpy(data, &nt, SZ_NBPTUPLE);
+	data += SZ_NBPTUPLE;
+
+	*data++ = nn->nn_objlen;
+	memcpy(data, nn->nn_obj, nn->nn_objlen);
+	data += nn->nn_objlen;
+	*data++ = nn->nn_typelen;
+	memcpy(data, nn->nn_type, nn->nn_typelen);
+	data += nn->nn_typelen;
+	*data++ = 1;
+	*data++ = '*';
+	return data;
+}
+
+int main(int argc _U_, char *argv[] _U_)
+{
+	struct sockaddr_at sat, from;
+	struct nbphdr nh;
+	struct nbpnve nn;
+	char buf[DDP_MAXSZ], reply[DDP_MAXSZ], *data;
+	socklen_t fromlen;
+	int s, cc, i, cnt;
+
+	memset(&sat, 0, sizeof(sat));
+	sat.sat_port = NBP_NIS_PORT;
+	if ((s = netddp_open(&sat, NULL)) < 0) {
+		perror("nbp_udpd: netddp_open");
+		return 1;
+	}
+
+	for (;;) {
+		fromlen = sizeof(from);
+		if ((cc = netddp_recvfrom(s, buf, sizeof(buf), 0,
+					  (struct sockaddr *) &from,
+					  &fromlen)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("nbp_udpd: netddp_recvfrom");
+			return 1;
+		}
+		if (cc < 1 + SZ_NBPHDR || buf[0] != DDPTYPE_NBP)
+			continue;
+		memcpy(&nh, buf + 1, SZ_NBPHDR);
+		if (nbp_parse(buf + 1 + SZ_NBPHDR, &nn, cc - 1 - SZ_NBPHDR) < 0)
+			continue;
+
+		data = reply;
+		*data++ = DDPTYPE_NBP;
+		data += SZ_NBPHDR;
+
+		switch (nh.nh_op) {
+		case NBPOP_BRRQ:	/* single segment, no forwarding */
+		case NBPOP_LKUP:
+			for (i = 0, cnt = 0; i < nnames && cnt < 15; i++) {
+				if (!nbp_match(&nn, &names[i], NBPMATCH_NOZONE))
+					continue;
+				if (data - reply + SZ_NBPTUPLE + 3 * (NBPSTRLEN + 1)
+				    > (int) sizeof(reply))
+					break;
+				data = put_name(data, &names[i]);
+				cnt++;
+			}
+			if (cnt == 0)
+				continue;
+			nh.nh_op = NBPOP_LKUPREPLY;
+			nh.nh_cnt = cnt;
+			break;
+
+		case NBPOP_RGSTR:
+			for (i = 0; i < nnames; i++)
+				if (nbp_match(&nn, &names[i],
+					      NBPMATCH_NOZONE | NBPMATCH_NOGLOB))
+					break;
+			if (i == nnames && nnames < MAXNAMES)
+				nnames++;
+			if (i < MAXNAMES) {
+				names[i] = nn;
+				nh.nh_op = NBPOP_OK;
+			} else {
+				nh.nh_op = NBPOP_ERROR;
+			}
+			nh.nh_cnt = 0;
+			break;
+
+		case NBPOP_UNRGSTR:
+			for (i = 0; i < nnames; i++)
+				if (nbp_match(&nn, &names[i],
+					      NBPMATCH_NOZONE | NBPMATCH_NOGLOB))
+					break;
+			if (i < nnames)
+				names[i] = names[--nnames];
+			nh.nh_op = NBPOP_OK;
+			nh.nh_cnt = 0;
+			break;
+
+		default:
+			continue;
+		}
+
+		memcpy(reply + 1, &nh, SZ_NBPHDR);
+		netddp_sendto(s, reply, data - reply, 0,
+			      (struct sockaddr *) &from, sizeof(from));
+	}
+}
@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <atalk/logger.h>
 #include <errno.h>
 #ifdef HAVE_SYS_TIME_H
@@ -23,6 +24,11 @@
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif				/* HAVE_SYS_STAT_H */
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <sys/poll.h>
+#endif				/* HAVE_SYS_EPOLL_H */
 
 #include <netatalk/endian.h>
 #include <atalk/atp.h>
@@ -30,11 +36,13 @@
 #include <atalk/compat.h>
 #include <atalk/util.h>
 #include <atalk/globals.h>
+#include <atalk/adouble.h>
 
 #include "switch.h"
 #include "auth.h"
 #include "fork.h"
 #include "dircache.h"
+#include "session.h"
 
 extern int debug;
 static AFPObj *child;
@@ -68,6 +76,7 @@ static void afp_asp_close(AFPObj * obj)
 
 	LOG(log_info, logtype_afpd, "%.2fKB read, %.2fKB written",
 	    asp->read_count / 1024.0, asp->write_count / 1024.0);
+	log_dircache_stat();
 	asp_close(asp);
 }
 
@@ -230,6 +239,17 @@ static void afp_asp_reload(int sig _U_)
 	reload_request = 1;
 }
 
+/* ---------------------------------
+ * SIGINT log and dump the dircache
+*/
+
+static volatile int dircache_request;
+
+static void afp_asp_dircache(int sig _U_)
+{
+	dircache_request = 1;
+}
+
 /* ---------------------- */
 #ifdef SERVERTEXT
 static void afp_asp_getmesg(int sig _U_)
@@ -239,13 +259,526 @@ static void afp_asp_getmesg(int sig _U_)
 }
 #endif				/* SERVERTEXT */
 
+/* set by obj->exit of a worker session, the session ends after the
+ * request instead of the process */
+static int request_closing;
+
+/* ----------------------
+ * an ASPFUNC_CMD or ASPFUNC_WRITE request
+ */
+static void afp_asp_request(AFPObj * obj, const int type)
+{
+	ASP asp = obj->handle;
+	const char *what = (type == ASPFUNC_WRITE) ? "(write) " : "";
+	static int ccnt = 0;
+	int func, reply;
+
+	func = (u_int8_t) asp->commands[0];
+	if (debug)
+		if (obj->options.flags & OPTION_DEBUG) {
+			printf("%scommand: %d (%s)\n", what, func,
+			       AfpNum2name(func));
+			bprint(asp->commands, asp->cmdlen);
+		}
+
+	if (afp_switch[func] != NULL) {
+		/*
+		 * The function called from afp_switch is expected to
+		 * read its parameters out of buf, put its
+		 * results in replybuf (updating rbuflen), and
+		 * return an error code.
+		 */
+		asp->datalen = ASP_DATASIZ;
+		reply = (*afp_switch[func]) (obj, asp->commands, asp->cmdlen,
+					     asp->data, &asp->datalen);
+	} else {
+		LOG(log_error, logtype_afpd, "%sbad function %X", what, func);
+		asp->datalen = 0;
+		reply = AFPERR_NOOP;
+	}
+
+	if (debug)
+		if (obj->options.flags & OPTION_DEBUG) {
+			printf("%sreply: %d, %d\n", what, reply, ccnt++);
+			bprint(asp->data, asp->datalen);
+		}
+
+	/* the session has replied and ended already */
+	if (request_closing)
+		return;
+
+	if (type == ASPFUNC_WRITE) {
+		if (asp_wrtreply(asp, reply) < 0) {
+			LOG(log_error, logtype_afpd, "asp_wrtreply: %s",
+			    strerror(errno));
+			obj->exit(EXITERR_CLNT);
+		}
+	} else if (asp_cmdreply(asp, reply) < 0) {
+		LOG(log_error, logtype_afpd, "asp_cmdreply: %s",
+		    strerror(errno));
+		obj->exit(EXITERR_CLNT);
+	}
+}
+
+/* ----------------------
+ * worker afpd, see asp_worker.c and session.c
+ */
+
+#define WORKER_EVENTS 64	/* sessions served per wait */
+#define WORKER_BATCH   8	/* requests of a session served in a row */
+
+struct asp_sess {
+	AFPObj as_obj;		/* as_obj.handle is the session's ASP */
+	struct session *as_session;
+	struct asp_sess *as_next;
+};
+
+static AFPObj *worker;		/* handle is the control ASP */
+static struct asp_sess *sessions;
+static int nsessions;
+static int master_gone;
+static int retired;		/* gets no new sessions */
+static sigset_t worker_sigs;
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+#endif
+
+static volatile int die_request, timedown_request;
+#ifdef SERVERTEXT
+static volatile int mesg_request;
+#endif
+
+static void afp_asp_worker_signal(int sig)
+{
+	switch (sig) {
+	case SIGTERM:
+	case SIGALRM:
+		die_request = 1;
+		break;
+	case SIGUSR1:
+		timedown_request = 1;
+		break;
+	case SIGHUP:
+		reload_request = 1;
+		break;
+	case SIGINT:
+		dircache_request = 1;
+		break;
+#ifdef SERVERTEXT
+	case SIGUSR2:
+		mesg_request = 1;
+		break;
+#endif
+	}
+}
+
+static void afp_asp_worker_exit(int sig _U_)
+{
+	request_closing = 1;
+}
+
+static void worker_switch(struct asp_sess *s)
+{
+	session_switch(s->as_session);
+	AFPobj = child = &s->as_obj;
+}
+
+static int worker_watch(const int fd, struct asp_sess *s)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+#else
+	return 0;
+#endif
+}
+
+static void worker_unwatch(const int fd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+#endif
+}
+
+/*
+ * Wait until a session has requests or the master a message.
+ * @returns the number of sessions put into ready, -1 on error. *ctl is set
+ * for a message from the master
+ */
+static int worker_wait(struct asp_sess **ready, int *ctl)
+{
+	int i, n, ret = 0, saveerrno;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev[WORKER_EVENTS + 1];
+
+	pthread_sigmask(SIG_UNBLOCK, &worker_sigs, NULL);
+	n = epoll_wait(epoll_fd, ev, WORKER_EVENTS + 1, -1);
+	saveerrno = errno;
+	pthread_sigmask(SIG_BLOCK, &worker_sigs, NULL);
+
+	*ctl = 0;
+	for (i = 0; i < n; i++) {
+		if (ev[i].data.ptr == NULL)
+			*ctl = 1;
+		else if (ret < WORKER_EVENTS)
+			ready[ret++] = ev[i].data.ptr;
+	}
+#else
+	struct pollfd *fds;
+	struct asp_sess *s;
+
+	if ((fds = malloc((nsessions + 1) * sizeof(*fds))) == NULL)
+		return -1;
+	fds[0].fd = master_gone ? -1 : ((ASP) worker->handle)->asp_ctlfd;
+	fds[0].events = POLLIN;
+	for (s = sessions, i = 1; s; s = s->as_next, i++) {
+		fds[i].fd = atp_fileno(((ASP) s->as_obj.handle)->asp_atp);
+		fds[i].events = POLLIN;
+	}
+
+	pthread_sigmask(SIG_UNBLOCK, &worker_sigs, NULL);
+	n = poll(fds, nsessions + 1, -1);
+	saveerrno = errno;
+	pthread_sigmask(SIG_BLOCK, &worker_sigs, NULL);
+
+	*ctl = (n > 0 && fds[0].revents);
+	for (s = sessions, i = 1; n > 0 && s && ret < WORKER_EVENTS;
+	     s = s->as_next, i++)
+		if (fds[i].revents)
+			ready[ret++] = s;
+	free(fds);
+#endif
+	if (n < 0) {
+		errno = saveerrno;
+		return -1;
+	}
+	return ret;
+}
+
+/* shutdown: the client is told, as by afp_asp_die() */
+static void worker_end(struct asp_sess *s, const int shutdown)
+{
+	struct asp_sess **p;
+	ASP asp = s->as_obj.handle;
+
+	worker_switch(s);
+	if (shutdown) {
+		asp_attention(asp, AFPATTN_SHUTDOWN);
+		if (asp_shutdown(asp) < 0)
+			LOG(log_error, logtype_afpd,
+			    "afp_die: asp_shutdown: %s", strerror(errno));
+	}
+
+	of_close_all_forks();
+	if (!master_gone)
+		asp_worker_closed(worker->handle, asp);
+	worker_unwatch(atp_fileno(asp->asp_atp));
+	afp_asp_close(&s->as_obj);
+	LOG(log_info, logtype_afpd, "done");
+
+	for (p = &sessions; *p != s; p = &(*p)->as_next);
+	*p = s->as_next;
+	nsessions--;
+
+	session_free(s->as_session);
+	AFPobj = child = worker;
+	free(s->as_obj.sinfo.sessionkey);
+	free(s);
+}
+
+static void worker_open(ASP asp)
+{
+	struct asp_sess *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL
+	    || (s->as_session = session_new()) == NULL) {
+		LOG(log_error, logtype_afpd, "afp_over_asp: %s",
+		    strerror(errno));
+		free(s);
+		if (!master_gone)
+			asp_worker_closed(worker->handle, asp);
+		asp_close(asp);
+		return;
+	}
+	s->as_obj = *worker;
+	s->as_obj.handle = asp;
+	s->as_obj.exit = afp_asp_worker_exit;
+	s->as_next = sessions;
+	sessions = s;
+	nsessions++;
+	worker_switch(s);
+
+	if (worker_watch(atp_fileno(asp->asp_atp), s) < 0
+	    || dircache_init(s->as_obj.options.dircachesize) != 0) {
+		LOG(log_error, logtype_afpd, "afp_over_asp: session setup: %s",
+		    strerror(errno));
+		worker_end(s, 1);
+		return;
+	}
+
+	LOG(log_info, logtype_afpd, "session from %u.%u:%u on %u.%u:%u",
+	    ntohs(asp->asp_sat.sat_addr.s_net),
+	    asp->asp_sat.sat_addr.s_node, asp->asp_sat.sat_port,
+	    ntohs(atp_sockaddr(asp->asp_atp)->sat_addr.s_net),
+	    atp_sockaddr(asp->asp_atp)->sat_addr.s_node,
+	    atp_sockaddr(asp->asp_atp)->sat_port);
+}
+
+/* messages from the master */
+static void worker_control(void)
+{
+	struct asp_sess *s;
+	u_int32_t serial;
+	ASP asp;
+	int type;
+
+	while ((type = asp_worker_recv(worker->handle, &asp, &serial)) > 0) {
+		switch (type) {
+		case ASPWRK_OPEN:
+			worker_open(asp);
+			break;
+		case ASPWRK_CLOSE:	/* timed out */
+			for (s = sessions; s; s = s->as_next)
+				if (((ASP) s->as_obj.handle)->asp_serial ==
+				    serial) {
+					worker_end(s, 1);
+					break;
+				}
+			break;
+		case ASPWRK_RETIRE:
+			retired = 1;
+			break;
+		}
+	}
+
+	if (type == 0 || (type < 0 && errno != EAGAIN)) {
+		if (type < 0 && errno != ECONNRESET)
+			LOG(log_error, logtype_afpd,
+			    "afp_over_asp: master: %s", strerror(errno));
+		/* serve the sessions we have, like a forked afpd does */
+		worker_unwatch(((ASP) worker->handle)->asp_ctlfd);
+		master_gone = 1;
+	}
+}
+
+/* serve the requests that have come in for s */
+static void worker_serve(struct asp_sess *s)
+{
+	ASP asp = s->as_obj.handle;
+	int reply, n;
+
+	for (n = 0; n < WORKER_BATCH; n++) {
+		if ((reply = asp_getrequest(asp)) == -1)
+			break;	/* EAGAIN: no more */
+
+		switch (reply) {
+		case ASPFUNC_CLOSE:
+			worker_end(s, 0);
+			return;
+
+		case ASPFUNC_CMD:
+		case ASPFUNC_WRITE:
+			worker_switch(s);
+			afp_asp_request(&s->as_obj, reply);
+			dir_free_invalid_q();
+			if (request_closing) {
+				request_closing = 0;
+				worker_end(s, 1);
+				return;
+			}
+			break;
+
+		default:
+			LOG(log_info, logtype_afpd,
+			    "main: asp_getrequest: %d", reply);
+			break;
+		}
+	}
+}
+
+/* the signals, they only set flags */
+static void worker_signals(void)
+{
+	struct asp_sess *s, *next;
+	struct sigaction sv;
+	struct itimerval it;
+
+	if (die_request) {
+		for (s = sessions; s; s = next) {
+			next = s->as_next;
+			worker_end(s, 1);
+		}
+		exit(0);
+	}
+
+	if (timedown_request) {
+		timedown_request = 0;
+		/* shutdown and don't reconnect. server going down in 5
+		 * minutes */
+		for (s = sessions; s; s = s->as_next)
+			asp_attention(s->as_obj.handle,
+				      AFPATTN_SHUTDOWN | AFPATTN_NORECONNECT |
+				      AFPATTN_TIME(5));
+
+		it.it_interval.tv_sec = 0;
+		it.it_interval.tv_usec = 0;
+		it.it_value.tv_sec = 300;
+		it.it_value.tv_usec = 0;
+		if (setitimer(ITIMER_REAL, &it, NULL) < 0) {
+			LOG(log_error, logtype_afpd,
+			    "afp_timedown: setitimer: %s", strerror(errno));
+			die_request = 1;
+			worker_signals();
+		}
+
+		/* ignore myself */
+		memset(&sv, 0, sizeof(sv));
+		sv.sa_handler = SIG_IGN;
+		sigemptyset(&sv.sa_mask);
+		sigaction(SIGUSR1, &sv, NULL);
+	}
+
+	if (reload_request) {
+		reload_request = 0;
+		for (s = sessions; s; s = s->as_next) {
+			worker_switch(s);
+			load_volumes(&s->as_obj);
+		}
+	}
+
+	if (dircache_request) {
+		dircache_request = 0;
+		for (s = sessions; s; s = s->as_next) {
+			worker_switch(s);
+			log_dircache_stat();
+			dircache_dump();
+		}
+	}
+
+#ifdef SERVERTEXT
+	if (mesg_request) {
+		mesg_request = 0;
+		/* message.<pid> is the worker's, it goes to all sessions */
+		readmessage(worker);
+		for (s = sessions; s; s = s->as_next)
+			asp_attention(s->as_obj.handle,
+				      AFPATTN_MESG | AFPATTN_TIME(5));
+	}
+#endif				/* SERVERTEXT */
+}
+
+/*
+ * The main loop of a worker: it gets new sessions from the master and
+ * serves their requests, switching to the session of a request before it
+ * runs it.
+ */
+static void afp_asp_worker(AFPObj * obj)
+{
+	struct asp_sess *ready[WORKER_EVENTS];
+	struct sigaction action;
+	int i, n, ctl;
+
+	worker = AFPobj = child = obj;
+	obj->exit = afp_asp_worker_exit;
+	obj->reply = (int (*)()) asp_cmdreply;
+	obj->attention = (int (*)(void *, AFPUserBytes)) asp_attention;
+
+	sigemptyset(&worker_sigs);
+	sigaddset(&worker_sigs, SIGTERM);
+	sigaddset(&worker_sigs, SIGALRM);
+	sigaddset(&worker_sigs, SIGUSR1);
+	sigaddset(&worker_sigs, SIGHUP);
+	sigaddset(&worker_sigs, SIGINT);
+#ifdef SERVERTEXT
+	sigaddset(&worker_sigs, SIGUSR2);
+#endif
+	pthread_sigmask(SIG_BLOCK, &worker_sigs, NULL);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = afp_asp_worker_signal;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	if (sigaction(SIGTERM, &action, NULL) < 0
+	    || sigaction(SIGALRM, &action, NULL) < 0
+	    || sigaction(SIGUSR1, &action, NULL) < 0
+	    || sigaction(SIGHUP, &action, NULL) < 0
+	    || sigaction(SIGINT, &action, NULL) < 0
+#ifdef SERVERTEXT
+	    || sigaction(SIGUSR2, &action, NULL) < 0
+#endif
+	    ) {
+		LOG(log_error, logtype_afpd, "afp_over_asp: sigaction: %s",
+		    strerror(errno));
+		exit(EXITERR_SYS);
+	}
+
+	/* the master has checked that there are */
+	ad_lock_ofd(1);
+
+	if (session_init() < 0) {
+		LOG(log_error, logtype_afpd, "afp_over_asp: session_init: %s",
+		    strerror(errno));
+		exit(EXITERR_SYS);
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	if ((epoll_fd = epoll_create(64)) < 0) {
+		LOG(log_error, logtype_afpd, "afp_over_asp: epoll_create: %s",
+		    strerror(errno));
+		exit(EXITERR_SYS);
+	}
+	fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+#endif
+	if (worker_watch(((ASP) obj->handle)->asp_ctlfd, NULL) < 0) {
+		LOG(log_error, logtype_afpd, "afp_over_asp: %s",
+		    strerror(errno));
+		exit(EXITERR_SYS);
+	}
+
+	LOG(log_info, logtype_afpd, "ASP worker started");
+
+	for (;;) {
+		worker_signals();
+		if ((retired || master_gone) && !sessions) {
+			LOG(log_info, logtype_afpd, "ASP worker done");
+			exit(0);
+		}
+
+		/* idle until the next request, don't keep the log waiting */
+		log_flush();
+		if ((n = worker_wait(ready, &ctl)) < 0) {
+			if (errno == EINTR)
+				continue;
+			LOG(log_error, logtype_afpd, "afp_over_asp: wait: %s",
+			    strerror(errno));
+			die_request = 1;
+			continue;
+		}
+
+		/* sessions first, a message may end one of them */
+		for (i = 0; i < n; i++)
+			worker_serve(ready[i]);
+		if (ctl)
+			worker_control();
+	}
+}
+
 /* ---------------------- */
 void afp_over_asp(AFPObj * obj)
 {
 	ASP asp;
 	struct sigaction action;
-	int func, reply = 0;
-	int ccnt = 0;
+	int reply = 0;
+
+	if (((ASP) obj->handle)->asp_flags & ASPFL_WORKER) {
+		afp_asp_worker(obj);
+		return;
+	}
 
 	AFPobj = obj;
 	obj->exit = afp_asp_die;
@@ -274,6 +807,16 @@ void afp_over_asp(AFPObj * obj)
 		afp_asp_die(EXITERR_SYS);
 	}
 
+	/* install SIGINT */
+	action.sa_handler = afp_asp_dircache;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	if (sigaction(SIGINT, &action, NULL) < 0) {
+		LOG(log_error, logtype_afpd, "afp_over_asp: sigaction: %s",
+		    strerror(errno));
+		afp_asp_die(EXITERR_SYS);
+	}
+
 	/*  install SIGTERM */
 	action.sa_handler = afp_asp_die;
 	sigemptyset(&action.sa_mask);
@@ -337,6 +880,11 @@ void afp_over_asp(AFPObj * obj)
 			reload_request = 0;
 			load_volumes(child);
 		}
+		if (dircache_request) {
+			dircache_request = 0;
+			log_dircache_stat();
+			dircache_dump();
+		}
 		switch (reply) {
 		case ASPFUNC_CLOSE:
 			afp_asp_close(obj);
@@ -351,88 +899,10 @@ void afp_over_asp(AFPObj * obj)
 			break;
 
 		case ASPFUNC_CMD:
-			func = (u_int8_t) asp->commands[0];
-			if (debug)
-				if (obj->options.flags & OPTION_DEBUG) {
-					printf("command: %d (%s)\n", func,
-					       AfpNum2name(func));
-					bprint(asp->commands, asp->cmdlen);
-				}
-
-			if (afp_switch[func] != NULL) {
-				/*
-				 * The function called from afp_switch is expected to
-				 * read its parameters out of buf, put its
-				 * results in replybuf (updating rbuflen), and
-				 * return an error code.
-				 */
-				asp->datalen = ASP_DATASIZ;
-				reply = (*afp_switch[func]) (obj,
-							     asp->commands,
-							     asp->cmdlen,
-							     asp->data,
-							     &asp->
-							     datalen);
-			} else {
-				LOG(log_error, logtype_afpd,
-				    "bad function %X", func);
-				asp->datalen = 0;
-				reply = AFPERR_NOOP;
-			}
-
-			if (debug)
-				if (obj->options.flags & OPTION_DEBUG) {
-					printf("reply: %d, %d\n", reply,
-					       ccnt++);
-					bprint(asp->data, asp->datalen);
-				}
-
-			if (asp_cmdreply(asp, reply) < 0) {
-				LOG(log_error, logtype_afpd,
-				    "asp_cmdreply: %s", strerror(errno));
-				afp_asp_die(EXITERR_CLNT);
-			}
-			break;
-
 		case ASPFUNC_WRITE:
-			func = (u_int8_t) asp->commands[0];
-
-			if (debug)
-				if (obj->options.flags & OPTION_DEBUG) {
-					printf("(write) command: %d\n",
-					       func);
-					bprint(asp->commands, asp->cmdlen);
-				}
-
-			if (afp_switch[func] != NULL) {
-				asp->datalen = ASP_DATASIZ;
-				reply = (*afp_switch[func]) (obj,
-							     asp->commands,
-							     asp->cmdlen,
-							     asp->data,
-							     &asp->
-							     datalen);
-			} else {
-				LOG(log_error, logtype_afpd,
-				    "(write) bad function %X", func);
-				asp->datalen = 0;
-				reply = AFPERR_NOOP;
-			}
-
-			if (debug)
-				if (obj->options.flags & OPTION_DEBUG) {
-					printf
-					    ("(write) reply code: %d, %d\n",
-					     reply, ccnt++);
-					bprint(asp->data, asp->datalen);
-				}
-
-			if (asp_wrtreply(asp, reply) < 0) {
-				LOG(log_error, logtype_afpd,
-				    "asp_wrtreply: %s", strerror(errno));
-				afp_asp_die(EXITERR_CLNT);
-			}
+			afp_asp_request(obj, reply);
 			break;
+
 		default:
 			/*
 			 * Bad asp packet.  Probably should have asp filter them,
@@ -443,6 +913,11 @@ void afp_over_asp(AFPObj * obj)
 			break;
 		}
 
+		/* the command is done, nothing references removed dirs now */
+		dir_free_invalid_q();
+		/* idle until the next request, don't keep the log waiting */
+		log_flush();
+
 		if (obj->options.flags & OPTION_DEBUG) {
 			of_pforkdesc(stdout);
 			fflush(stdout);
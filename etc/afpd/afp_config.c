@@ -25,6 +25,7 @@
 #include <atalk/afp.h>
 #include <atalk/compat.h>
 #include <atalk/server_child.h>
+#include <atalk/adouble.h>
 
 #ifdef HAVE_LDAP
 #include <atalk/ldapconfig.h>
@@ -191,6 +192,18 @@ static AFPConfig *ASPConfigInit(const struct afp_options *options,
 	config->optcount = refcount;
 	(*refcount)++;
 
+	/* the sessions of a worker need locks per open file, see
+	 * ad_lock_ofd(). the worker switches them on */
+	if (options->aspworkers > 0 && ad_lock_ofd(1) != 0) {
+		LOG(log_error, logtype_afpd,
+		    "-aspworkers: no open file description locks, "
+		    "one process per session");
+		asp_setworkers(0);
+	} else {
+		asp_setworkers(options->aspworkers);
+	}
+	ad_lock_ofd(0);
+
 	config->server_start = (void *) asp_start;
 	config->server_cleanup = (void *) asp_cleanup;
 
@@ -430,6 +430,15 @@ int afp_options_parseline(char *buf, struct afp_options *options)
 	if ((c = getoption(buf, "-dircachesize")))
 		options->dircachesize = atoi(c);
 
+	if ((c = getoption(buf, "-shareddircache")))
+		options->shareddircache = atoi(c);
+
+	if ((c = getoption(buf, "-prefetchthreads")))
+		options->prefetchthreads = atoi(c);
+
+	if ((c = getoption(buf, "-aspworkers")))
+		options->aspworkers = atoi(c);
+
 	if ((c = getoption(buf, "-tcpsndbuf")))
 		options->tcp_sndbuf = atoi(c);
 
@@ -13,6 +13,11 @@
 #include <ctype.h>
 
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <atalk/logger.h>
 #include <errno.h>
 
@@ -26,90 +31,238 @@
 #include "directory.h"
 #include "file.h"
 #include "desktop.h"
+#include "session.h"
 
-static struct savedt sa = { { 0, 0, 0, 0 }, -1, 0, 0 };
+/*
+ * APPL mappings
+ * =============
+ *
+ * The applications of a creator live in .AppleDesktop/<c>/<creator>.appl, a
+ * sequence of entries (tag, path length, path). The file is mapped and
+ * indexed: an array of entry offsets for afp_getappl() and a hash on the path
+ * for afp_addappl() and afp_rmvappl(). The last APPLDB_CACHE files are kept
+ * mapped, the mapping is shared with the other afpd processes through the
+ * page cache.
+ *
+ * Adding an application that is already there, which the Finder does all the
+ * time, doesn't write anything, a new tag is written in place and a new
+ * application is appended. Only removing one rewrites the file, into a
+ * temporary file which is renamed over the old one, so that other processes
+ * never see a shrinking mapping. Every access stats the file and remaps it
+ * if it has been replaced or has grown.
+ */
+#define APPL_HDRLEN   (4 + sizeof(u_int16_t))
+#define APPLDB_CACHE  4
+
+struct appldb {
+	u_int16_t ad_vid;
+	u_int8_t ad_creator[4];
+	int ad_fd;		/* -1: unused */
+	int ad_rdwr;
+	unsigned int ad_used;	/* for LRU */
+	dev_t ad_dev;
+	ino_t ad_ino;
+	unsigned char *ad_map;
+	size_t ad_len;		/* mapped and indexed size */
+	u_int32_t ad_count;
+	u_int32_t *ad_off;	/* entry offset by index */
+	u_int32_t *ad_hash;	/* bucket -> index + 1 */
+	u_int32_t *ad_next;	/* chain, index + 1 */
+	u_int32_t ad_mask;
+};
+
+static struct appldb appldbs[APPLDB_CACHE] = {
+	{.ad_fd = -1}, {.ad_fd = -1}, {.ad_fd = -1}, {.ad_fd = -1}
+};
+static unsigned int appldb_clock;
+
+static u_int32_t appl_hash(const unsigned char *p, int len)
+{
+	u_int32_t h = 2166136261U;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619U;
+	return h;
+}
+
+static void appldb_unmap(struct appldb *db)
+{
+	if (db->ad_map)
+		munmap(db->ad_map, db->ad_len);
+	db->ad_map = NULL;
+	db->ad_len = 0;
+	db->ad_count = 0;
+}
 
-static int pathcmp(char *p, int plen, char *q, int qlen)
+static void appldb_close(struct appldb *db)
 {
-	return ((plen == qlen && memcmp(p, q, plen) == 0) ? 0 : 1);
+	appldb_unmap(db);
+	if (db->ad_fd != -1)
+		close(db->ad_fd);
+	db->ad_fd = -1;
 }
 
-static int applopen(struct vol *vol, u_int8_t creator[4], int flags,
-		    int mode)
+/* map the file and build the index, a truncated last entry is ignored */
+static int appldb_index(struct appldb *db, size_t len)
 {
+	u_int32_t off, n, i, h, size;
+	u_int16_t plen;
+	void *tmp;
+
+	appldb_unmap(db);
+	if (len == 0)
+		return 0;
+
+	if ((db->ad_map = mmap(NULL, len, PROT_READ, MAP_SHARED, db->ad_fd,
+			       0)) == MAP_FAILED) {
+		db->ad_map = NULL;
+		LOG(log_error, logtype_afpd, "appldb_index: mmap: %s",
+		    strerror(errno));
+		return -1;
+	}
+	db->ad_len = len;
+
+	for (off = 0, n = 0; off + APPL_HDRLEN <= len; n++) {
+		memcpy(&plen, db->ad_map + off + 4, sizeof(plen));
+		off += APPL_HDRLEN + ntohs(plen);
+	}
+
+	for (size = 16; size < 2 * n; size *= 2);
+	if (!(tmp = realloc(db->ad_off, (n + 1) * sizeof(u_int32_t))))
+		goto nomem;
+	db->ad_off = tmp;
+	if (!(tmp = realloc(db->ad_next, (n + 1) * sizeof(u_int32_t))))
+		goto nomem;
+	db->ad_next = tmp;
+	if (!(tmp = realloc(db->ad_hash, size * sizeof(u_int32_t))))
+		goto nomem;
+	db->ad_hash = tmp;
+	memset(db->ad_hash, 0, size * sizeof(u_int32_t));
+	db->ad_mask = size - 1;
+
+	for (off = 0, i = 0; i < n; i++) {
+		db->ad_off[i] = off;
+		memcpy(&plen, db->ad_map + off + 4, sizeof(plen));
+		off += APPL_HDRLEN + ntohs(plen);
+	}
+	if (n && off > len)
+		n--;		/* path of the last one is cut off */
+
+	/* backwards, so a chain starts with the first entry of a path */
+	for (i = n; i > 0; i--) {
+		off = db->ad_off[i - 1];
+		memcpy(&plen, db->ad_map + off + 4, sizeof(plen));
+		h = appl_hash(db->ad_map + off + APPL_HDRLEN,
+			      ntohs(plen)) & db->ad_mask;
+		db->ad_next[i - 1] = db->ad_hash[h];
+		db->ad_hash[h] = i;
+	}
+	db->ad_count = n;
+	return 0;
+
+      nomem:
+	LOG(log_error, logtype_afpd, "appldb_index: out of memory");
+	appldb_unmap(db);
+	return -1;
+}
+
+/*
+ * Get the APPL file of a creator, opened with flags and indexed.
+ */
+static struct appldb *appldb_get(struct vol *vol, u_int8_t creator[4],
+				 int flags, int mode)
+{
+	struct appldb *db, *lru = &appldbs[0];
+	struct stat st;
 	char *dtf, *adt, *adts;
+	int i, fd;
 
-	if (sa.sdt_fd != -1) {
-		if (!(flags & (O_RDWR | O_WRONLY)) &&
-		    memcmp(sa.sdt_creator, creator,
-			   sizeof(CreatorType)) == 0
-		    && sa.sdt_vid == vol->v_vid) {
-			return (AFP_OK);
-		}
-		close(sa.sdt_fd);
-		sa.sdt_fd = -1;
+	for (i = 0; i < APPLDB_CACHE; i++) {
+		db = &appldbs[i];
+		if (db->ad_fd != -1 && db->ad_vid == vol->v_vid
+		    && memcmp(db->ad_creator, creator,
+			      sizeof(CreatorType)) == 0)
+			break;
+		if (db->ad_fd == -1 || (lru->ad_fd != -1
+					&& db->ad_used < lru->ad_used))
+			lru = db;
 	}
 
 	dtf = dtfile(vol, creator, ".appl");
+	if (i < APPLDB_CACHE) {
+		/* still the same file, and can we write it? */
+		if (stat(dtf, &st) < 0 || st.st_dev != db->ad_dev
+		    || st.st_ino != db->ad_ino
+		    || (!db->ad_rdwr && (flags & O_ACCMODE) != O_RDONLY)) {
+			appldb_close(db);
+			i = APPLDB_CACHE;
+			lru = db;
+		}
+	}
+
+	if (i == APPLDB_CACHE) {
+		db = lru;
+		appldb_close(db);
 
-	if ((sa.sdt_fd = open(dtf, flags, ad_mode(dtf, mode))) < 0) {
-		if (errno == ENOENT && (flags & O_CREAT)) {
-			if ((adts = strrchr(dtf, '/')) == NULL) {
-				return (AFPERR_PARAM);
-			}
+		if ((fd = open(dtf, flags, ad_mode(dtf, mode))) < 0) {
+			if (errno != ENOENT || !(flags & O_CREAT))
+				return NULL;
+			if ((adts = strrchr(dtf, '/')) == NULL)
+				return NULL;
 			*adts = '\0';
-			if ((adt = strrchr(dtf, '/')) == NULL) {
-				return (AFPERR_PARAM);
-			}
+			if ((adt = strrchr(dtf, '/')) == NULL)
+				return NULL;
 			*adt = '\0';
 			(void) ad_mkdir(dtf, DIRBITS | 0777);
 			*adt = '/';
 			(void) ad_mkdir(dtf, DIRBITS | 0777);
 			*adts = '/';
 
-			if ((sa.sdt_fd =
-			     open(dtf, flags, ad_mode(dtf, mode))) < 0) {
-				return (AFPERR_PARAM);
-			}
-		} else {
-			return (AFPERR_PARAM);
+			if ((fd = open(dtf, flags, ad_mode(dtf, mode))) < 0)
+				return NULL;
 		}
-	}
-	memcpy(sa.sdt_creator, creator, sizeof(CreatorType));
-	sa.sdt_vid = vol->v_vid;
-	sa.sdt_index = 0;
-	return (AFP_OK);
+		if (fstat(fd, &st) < 0) {
+			close(fd);
+			return NULL;
+		}
+		db->ad_fd = fd;
+		db->ad_rdwr = (flags & O_ACCMODE) != O_RDONLY;
+		db->ad_vid = vol->v_vid;
+		memcpy(db->ad_creator, creator, sizeof(CreatorType));
+		db->ad_dev = st.st_dev;
+		db->ad_ino = st.st_ino;
+		db->ad_len = (size_t) -1;
+	}
+	db->ad_used = ++appldb_clock;
+
+	if ((size_t) st.st_size != db->ad_len
+	    && appldb_index(db, st.st_size) < 0) {
+		appldb_close(db);
+		return NULL;
+	}
+	return db;
 }
 
-/*
- * copy appls to new file, deleting any matching (old) appl entries
- */
-static int copyapplfile(int sfd, int dfd, char *mpath, u_int16_t mplen)
+/* entry of a path */
+static unsigned char *appldb_find(struct appldb *db, char *path,
+				  u_int16_t len)
 {
-	int cc;
-	char *p;
-	u_int16_t len;
-	u_int8_t appltag[4];
-	char buf[MAXPATHLEN];
-
-	while ((cc =
-		read(sfd, buf, sizeof(appltag) + sizeof(u_int16_t))) > 0) {
-		p = buf + sizeof(appltag);
-		memcpy(&len, p, sizeof(len));
-		len = ntohs(len);
-		p += sizeof(len);
-		if ((cc = read(sa.sdt_fd, p, len)) < len) {
-			break;
-		}
-		if (pathcmp(mpath, mplen, p, len) != 0) {
-			p += len;
-			if (write(dfd, buf, p - buf) != p - buf) {
-				cc = -1;
-				break;
-			}
-		}
-	}
-	return (cc);
+	unsigned char *p;
+	u_int16_t plen;
+	u_int32_t i;
+
+	if (db->ad_count == 0)
+		return NULL;
+	i = db->ad_hash[appl_hash((unsigned char *) path, len)
+			& db->ad_mask];
+	for (; i; i = db->ad_next[i - 1]) {
+		p = db->ad_map + db->ad_off[i - 1];
+		memcpy(&plen, p + 4, sizeof(plen));
+		if (ntohs(plen) == len
+		    && memcmp(p + APPL_HDRLEN, path, len) == 0)
+			return p;
+	}
+	return NULL;
 }
 
 /*
@@ -154,14 +307,16 @@ int afp_addappl(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
 {
 	struct vol *vol;
 	struct dir *dir;
-	int tfd, cc;
+	struct appldb *db;
+	int cc;
 	u_int32_t did;
 	u_int16_t vid, mplen;
 	struct path *path;
-	char *dtf, *p, *mp;
+	char *p, *mp;
+	unsigned char *ent;
 	u_int8_t creator[4];
 	u_int8_t appltag[4];
-	char *mpath, *tempfile;
+	char *mpath;
 
 	*rbuflen = 0;
 	ibuf += 2;
@@ -191,27 +346,29 @@ int afp_addappl(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
 		return (AFPERR_BADTYPE);
 	}
 
-	if (applopen(vol, creator, O_RDWR | O_CREAT, 0666) != AFP_OK) {
-		return (AFPERR_PARAM);
-	}
-	if (lseek(sa.sdt_fd, 0L, SEEK_SET) < 0) {
-		return (AFPERR_PARAM);
-	}
-	dtf = dtfile(vol, creator, ".appl.temp");
-	tempfile = obj->oldtmp;
-	strcpy(tempfile, dtf);
-	if ((tfd = open(tempfile, O_RDWR | O_CREAT, 0666)) < 0) {
+	if ((db = appldb_get(vol, creator, O_RDWR | O_CREAT, 0666)) == NULL) {
 		return (AFPERR_PARAM);
 	}
 	mpath = obj->newtmp;
 	mp = makemacpath(vol, mpath, AFPOBJ_TMPSIZ, curdir, path->m_name);
 	if (!mp) {
-		close(tfd);
 		return AFPERR_PARAM;
 	}
 	mplen = mpath + AFPOBJ_TMPSIZ - mp;
 
-	/* write the new appl entry at start of temporary file */
+	if ((ent = appldb_find(db, mp, mplen))) {
+		/* known application, at most the tag changes */
+		if (memcmp(ent, appltag, sizeof(appltag)) == 0) {
+			return (AFP_OK);
+		}
+		if (pwrite(db->ad_fd, appltag, sizeof(appltag),
+			   ent - db->ad_map) != sizeof(appltag)) {
+			return (AFPERR_PARAM);
+		}
+		return (AFP_OK);
+	}
+
+	/* append the new appl entry */
 	p = mp - sizeof(u_int16_t);
 	mplen = htons(mplen);
 	memcpy(p, &mplen, sizeof(mplen));
@@ -219,21 +376,10 @@ int afp_addappl(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
 	p -= sizeof(appltag);
 	memcpy(p, appltag, sizeof(appltag));
 	cc = mpath + AFPOBJ_TMPSIZ - p;
-	if (write(tfd, p, cc) != cc) {
-		close(tfd);
-		unlink(tempfile);
-		return (AFPERR_PARAM);
-	}
-	cc = copyapplfile(sa.sdt_fd, tfd, mp, mplen);
-	close(tfd);
-	close(sa.sdt_fd);
-	sa.sdt_fd = -1;
-
-	if (cc < 0) {
-		unlink(tempfile);
-		return (AFPERR_PARAM);
-	}
-	if (rename(tempfile, dtfile(vol, creator, ".appl")) < 0) {
+	if (lseek(db->ad_fd, 0L, SEEK_END) < 0
+	    || write(db->ad_fd, p, cc) != cc) {
+		LOG(log_error, logtype_afpd, "afp_addappl(%s): write: %s",
+		    dtfile(vol, creator, ".appl"), strerror(errno));
 		return (AFPERR_PARAM);
 	}
 	return (AFP_OK);
@@ -244,11 +390,15 @@ int afp_rmvappl(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
 {
 	struct vol *vol;
 	struct dir *dir;
-	int tfd, cc;
+	struct appldb *db;
+	struct iovec iov[2];
+	int tfd;
+	ssize_t cc;
 	u_int32_t did;
 	u_int16_t vid, mplen;
 	struct path *path;
 	char *dtf, *mp;
+	unsigned char *ent;
 	u_int8_t creator[4];
 	char *tempfile, *mpath;
 
@@ -277,32 +427,36 @@ int afp_rmvappl(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
 		return (AFPERR_BADTYPE);
 	}
 
-	if (applopen(vol, creator, O_RDWR, 0666) != AFP_OK) {
+	if ((db = appldb_get(vol, creator, O_RDWR, 0666)) == NULL) {
 		return (AFPERR_NOOBJ);
 	}
-	if (lseek(sa.sdt_fd, 0L, SEEK_SET) < 0) {
-		return (AFPERR_PARAM);
-	}
-	dtf = dtfile(vol, creator, ".appl.temp");
-	tempfile = obj->oldtmp;
-	strcpy(tempfile, dtf);
-	if ((tfd = open(tempfile, O_RDWR | O_CREAT, 0666)) < 0) {
-		return (AFPERR_PARAM);
-	}
 	mpath = obj->newtmp;
 	mp = makemacpath(vol, mpath, AFPOBJ_TMPSIZ, curdir, path->m_name);
 	if (!mp) {
-		close(tfd);
 		return AFPERR_PARAM;
 	}
-
 	mplen = mpath + AFPOBJ_TMPSIZ - mp;
-	cc = copyapplfile(sa.sdt_fd, tfd, mp, mplen);
+
+	if ((ent = appldb_find(db, mp, mplen)) == NULL) {
+		return (AFP_OK);
+	}
+
+	/* copy the other entries to a new file */
+	dtf = dtfile(vol, creator, ".appl.temp");
+	tempfile = obj->oldtmp;
+	strcpy(tempfile, dtf);
+	if ((tfd = open(tempfile, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+		return (AFPERR_PARAM);
+	}
+	iov[0].iov_base = db->ad_map;
+	iov[0].iov_len = ent - db->ad_map;
+	iov[1].iov_base = ent + APPL_HDRLEN + mplen;
+	iov[1].iov_len = db->ad_len - (ent - db->ad_map) - APPL_HDRLEN - mplen;
+	cc = writev(tfd, iov, 2);
 	close(tfd);
-	close(sa.sdt_fd);
-	sa.sdt_fd = -1;
+	appldb_close(db);
 
-	if (cc < 0) {
+	if (cc != (ssize_t) (iov[0].iov_len + iov[1].iov_len)) {
 		unlink(tempfile);
 		return (AFPERR_PARAM);
 	}
@@ -316,13 +470,13 @@ int afp_getappl(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 		size_t *rbuflen)
 {
 	struct vol *vol;
+	struct appldb *db;
 	char *p, *q;
-	int cc;
 	size_t buflen;
 	u_int16_t vid, aindex, bitmap, len;
 	u_int8_t creator[4];
 	u_int8_t appltag[4];
-	char *buf, *cbuf;
+	char *cbuf;
 	struct path *path;
 #if defined(APPLCNAME)
 	char utomname[MAXPATHLEN + 1];
@@ -354,39 +508,19 @@ int afp_getappl(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 	bitmap = ntohs(bitmap);
 	ibuf += sizeof(bitmap);
 
-	if (applopen(vol, creator, O_RDONLY, 0666) != AFP_OK) {
+	if ((db = appldb_get(vol, creator, O_RDONLY, 0666)) == NULL) {
 		*rbuflen = 0;
 		return (AFPERR_NOITEM);
 	}
-	if (aindex < sa.sdt_index) {
-		if (lseek(sa.sdt_fd, 0L, SEEK_SET) < 0) {
-			*rbuflen = 0;
-			return (AFPERR_PARAM);
-		}
-		sa.sdt_index = 0;
-	}
-
-	/* position to correct spot within appl file */
-	buf = obj->oldtmp;
-	while ((cc = read(sa.sdt_fd, buf, sizeof(appltag)
-			  + sizeof(u_int16_t))) > 0) {
-		p = buf + sizeof(appltag);
-		memcpy(&len, p, sizeof(len));
-		len = ntohs(len);
-		p += sizeof(u_int16_t);
-		if ((cc = read(sa.sdt_fd, p, len)) < len) {
-			break;
-		}
-		if (sa.sdt_index == aindex) {
-			break;
-		}
-		sa.sdt_index++;
-	}
-	if (cc <= 0 || sa.sdt_index != aindex) {
+	if (aindex >= db->ad_count) {
 		*rbuflen = 0;
 		return (AFPERR_NOITEM);
 	}
-	sa.sdt_index++;
+
+	p = (char *) db->ad_map + db->ad_off[aindex] + sizeof(appltag);
+	memcpy(&len, p, sizeof(len));
+	len = ntohs(len);
+	p += sizeof(u_int16_t);
 
 #ifdef APPLCNAME
 	/*
@@ -454,3 +588,24 @@ int afp_getappl(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 	rbuf += sizeof(appltag);
 	return (AFP_OK);
 }
+
+/* a worker afpd closes the databases when a session ends, see session.c */
+static void appl_session_end(void)
+{
+	struct appldb *db;
+
+	for (db = appldbs; db < appldbs + APPLDB_CACHE; db++) {
+		appldb_close(db);
+		free(db->ad_off);
+		free(db->ad_hash);
+		free(db->ad_next);
+		db->ad_off = db->ad_hash = db->ad_next = NULL;
+	}
+}
+
+void appl_session_vars(void)
+{
+	session_var(appldbs, sizeof(appldbs));
+	session_var(&appldb_clock, sizeof(appldb_clock));
+	session_cleanup(appl_session_end);
+}
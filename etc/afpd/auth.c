@@ -33,6 +33,7 @@
 #include "switch.h"
 #include "status.h"
 #include "fork.h"
+#include "session.h"
 
 int afp_version = 11;
 static int afp_version_index;
@@ -842,3 +843,22 @@ void auth_unload(void)
 		uam_unload(mod);
 	}
 }
+
+/* a worker afpd frees what a session's login allocated, see session.c */
+static void auth_session_end(void)
+{
+	free(groups);
+	groups = NULL;
+	ngroups = 0;
+}
+
+void auth_session_vars(void)
+{
+	session_var(&afp_version, sizeof(afp_version));
+	session_var(&afp_version_index, sizeof(afp_version_index));
+	session_var(&uuid, sizeof(uuid));
+	session_var(&groups, sizeof(groups));
+	session_var(&ngroups, sizeof(ngroups));
+	session_var(&afp_uam, sizeof(afp_uam));
+	session_cleanup(auth_session_end);
+}
@@ -23,6 +23,11 @@
  * CNID database in conjunction with an enhanced cnid_dbd. This requires
  * the use of cnidscheme:dbd for the searched volume, the new functionality
  * is not built into cnidscheme:cdb.
+ *
+ * If dbd has built a catalog index for the volume (see
+ * libatalk/util/catindex.c), searchdb volumes answer all criteria from that
+ * instead: only the candidates it finds are looked at on disk. afpd keeps the
+ * index up to date with the catsearch_index_*() calls from its write paths.
  */
 
 #include "config.h"
@@ -45,6 +50,7 @@
 #include <atalk/logger.h>
 #include <atalk/cnid.h>
 #include <atalk/cnid_dbd_private.h>
+#include <atalk/catindex.h>
 #include <atalk/util.h>
 #include <atalk/bstradd.h>
 #include <atalk/unicode.h>
@@ -57,6 +63,7 @@
 #include "volume.h"
 #include "filedir.h"
 #include "fork.h"
+#include "session.h"
 
 
 struct finderinfo {
@@ -119,6 +126,8 @@ static int save_cidx = -1;	/* Saved index of currently scanned directory. */
 static struct dsitem *dstack = NULL;	/* Directory stack data... */
 static int dssize = 0;		/* Directory stack (allocated) size... */
 static int dsidx = 0;		/* First free item index... */
+static u_int32_t cur_pos;	/* Saved position index (ID) - used to remember "position" across FPCatSearch calls */
+static DIR *dirpos;		/* UNIX structure describing currently opened directory. */
 static struct scrit c1, c2;	/* search criteria */
 
 /* Clears directory stack. */
@@ -522,8 +531,6 @@ static int catsearch(struct vol *vol,
 		     uint32_t * pos,
 		     char *rbuf, uint32_t * nrecs, int *rsize, int ext)
 {
-	static u_int32_t cur_pos;	/* Saved position index (ID) - used to remember "position" across FPCatSearch calls */
-	static DIR *dirpos;	/* UNIX structure describing currently opened directory. */
 	struct dir *currentdir;	/* struct dir of current directory */
 	int cidx, r;
 	struct dirent *entry;
@@ -727,6 +734,17 @@ static int catsearch(struct vol *vol,
 	return result;
 }				/* catsearch() */
 
+/* catsearch_db() state across FPCatSearch calls */
+struct dbsearch {
+	char resbuf[DBD_MAX_SRCH_LEN];
+	char lname[MAXPATHLEN + 2];	/* lowercased search string */
+	uint32_t dbpos[2];	/* cnid_find() position */
+	uint32_t cur_pos;	/* steps so far, our AFP position */
+	int num_matches, cur_match;
+	size_t cur_off;
+};
+static struct dbsearch *dbs;
+
 /*!
  * This function performs a CNID db search
  *
@@ -749,32 +767,34 @@ static int catsearch_db(struct vol *vol,
 			uint32_t * pos,
 			char *rbuf, uint32_t * nrecs, int *rsize, int ext)
 {
-	static char resbuf[DBD_MAX_SRCH_RSLTS * sizeof(cnid_t)];
-	static uint32_t cur_pos;
-	static int num_matches;
 	int ccr, r;
 	int result = AFP_OK;
 	struct path path;
 	char *rrbuf = rbuf;
-	char buffer[MAXPATHLEN + 2];
 	uint16_t flags = CONV_TOLOWER;
+	time_t start_time = time(NULL);
+
+	if (dbs == NULL && (dbs = calloc(1, sizeof(*dbs))) == NULL) {
+		*rsize = 0;
+		return AFPERR_MISC;
+	}
 
 	LOG(log_debug, logtype_afpd,
 	    "catsearch_db(req pos: %u): {pos: %u, name: %s}", *pos,
-	    cur_pos, uname);
+	    dbs->cur_pos, uname);
 
-	if (*pos != 0 && *pos != cur_pos) {
+	if (*pos != 0 && *pos != dbs->cur_pos) {
 		result = AFPERR_CATCHNG;
 		goto catsearch_end;
 	}
 
-	if (cur_pos == 0 || *pos == 0) {
+	if (*pos == 0) {
 		if (convert_charset(vol->v_volcharset,
 				    vol->v_volcharset,
 				    vol->v_maccharset,
 				    uname,
 				    strlen(uname),
-				    buffer,
+				    dbs->lname,
 				    MAXPATHLEN, &flags) == (size_t) -1) {
 			LOG(log_error, logtype_afpd,
 			    "catsearch_db: conversion error");
@@ -782,40 +802,55 @@ static int catsearch_db(struct vol *vol,
 			goto catsearch_end;
 		}
 
-		LOG(log_debug, logtype_afpd, "catsearch_db: %s", buffer);
-
-		if ((num_matches = cnid_find(vol->v_cdb,
-					     buffer,
-					     strlen(uname),
-					     resbuf,
-					     sizeof(resbuf))) == -1) {
-			result = AFPERR_MISC;
-			goto catsearch_end;
-		}
+		LOG(log_debug, logtype_afpd, "catsearch_db: %s",
+		    dbs->lname);
+		dbs->dbpos[0] = dbs->dbpos[1] = 0;
+		dbs->cur_pos = 0;
+		dbs->num_matches = dbs->cur_match = 0;
 	}
 
-	while (cur_pos < num_matches) {
+	while (1) {
 		char *name;
 		cnid_t cnid, did;
-		char resolvebuf[12 + MAXPATHLEN + 1];
 		struct dir *dir;
 
-		/* Next CNID to process from buffer */
-		memcpy(&cnid, resbuf + cur_pos * sizeof(cnid_t),
+		if (dbs->cur_match == dbs->num_matches) {
+			/* next batch, if there's one */
+			if (dbs->cur_pos != 0 && dbs->dbpos[0] == 0)
+				break;
+			/* MacOS 9 doesn't like servers executing commands longer than few seconds */
+			if (dbs->cur_pos != 0 && start_time != time(NULL))
+				goto catsearch_pause;
+			if ((dbs->num_matches =
+			     cnid_find(vol->v_cdb, dbs->lname,
+				       strlen(dbs->lname), dbs->dbpos,
+				       dbs->resbuf,
+				       sizeof(dbs->resbuf))) == -1) {
+				result = AFPERR_MISC;
+				goto catsearch_end;
+			}
+			dbs->cur_match = 0;
+			dbs->cur_off = 0;
+			dbs->cur_pos++;
+			continue;
+		}
+
+		/* Next match to process from buffer, CNID and DID come with it */
+		memcpy(&cnid, dbs->resbuf + dbs->cur_off, sizeof(cnid_t));
+		memcpy(&did, dbs->resbuf + dbs->cur_off + sizeof(cnid_t),
 		       sizeof(cnid_t));
-		did = cnid;
+		name = dbs->resbuf + dbs->cur_off + 2 * sizeof(cnid_t);
+		dbs->cur_off += CNID_FIND_RECLEN(strlen(name));
+		dbs->cur_match++;
+		dbs->cur_pos++;
 
-		if ((name =
-		     cnid_resolve(vol->v_cdb, &did, resolvebuf,
-				  12 + MAXPATHLEN + 1)) == NULL)
-			goto next;
 		LOG(log_debug, logtype_afpd,
-		    "catsearch_db: {pos: %u, name:%s, cnid: %u}", cur_pos,
-		    name, ntohl(cnid));
+		    "catsearch_db: {pos: %u, name:%s, cnid: %u}",
+		    dbs->cur_pos, name, ntohl(cnid));
 		if ((dir = dirlookup(vol, did)) == NULL)
-			goto next;
+			continue;
 		if (movecwd(vol, dir) < 0)
-			goto next;
+			continue;
 
 		memset(&path, 0, sizeof(path));
 		path.u_name = name;
@@ -825,9 +860,9 @@ static int catsearch_db(struct vol *vol,
 			switch (errno) {
 			case EACCES:
 			case ELOOP:
-				goto next;
 			case ENOENT:
-
+				/* gone or renamed since cnid_dbd saw it */
+				continue;
 			default:
 				result = AFPERR_MISC;
 				goto catsearch_end;
@@ -836,7 +871,7 @@ static int catsearch_db(struct vol *vol,
 		/* For files path.d_dir is the parent dir, for dirs its the dir itself */
 		if (S_ISDIR(path.st.st_mode))
 			if ((dir = dirlookup(vol, cnid)) == NULL)
-				goto next;
+				continue;
 		path.d_dir = dir;
 
 		LOG(log_maxdebug, logtype_afpd,
@@ -863,25 +898,367 @@ static int catsearch_db(struct vol *vol,
 			if (rrbuf - rbuf >= 448)
 				goto catsearch_pause;
 		}
-	      next:
-		cur_pos++;
 	}			/* while */
 
 	/* finished */
 	result = AFPERR_EOF;
-	cur_pos = 0;
+	dbs->cur_pos = 0;
 	goto catsearch_end;
 
       catsearch_pause:
-	*pos = cur_pos;
+	*pos = dbs->cur_pos;
 
       catsearch_end:		/* Exiting catsearch: error condition */
 	*rsize = rrbuf - rbuf;
 	LOG(log_debug, logtype_afpd,
-	    "catsearch_db(req pos: %u): {pos: %u}", *pos, cur_pos);
+	    "catsearch_db(req pos: %u): {pos: %u}", *pos, dbs->cur_pos);
 	return result;
 }
 
+/*
+ * Catalog index
+ * =============
+ *
+ * The index has the name (lowercase UCS-2), dates, attributes and FinderInfo
+ * of every object, so most of crit_check() can be done from it alone. An
+ * object that passes is resolved, stat'ed and run through crit_check(), so
+ * records that don't reflect changes made behind our back can't produce wrong
+ * results. The index slot is the search position, catpos[1] holds the index
+ * generation: positions are stable across calls, also with several searches
+ * at the same time, and a compacted or rebuilt index is detected.
+ */
+static ucs2_t idx_lname[sizeof(c1.lname) / sizeof(ucs2_t)];
+static ucs2_t idx_uname[sizeof(c1.utf8name) / sizeof(ucs2_t)];
+static size_t idx_lnamelen, idx_unamelen;
+
+/* lowercase copy of a search name */
+static size_t idx_fold(const char *src, size_t size, ucs2_t *dst)
+{
+	size_t i;
+	ucs2_t c;
+
+	for (i = 0; i < size / sizeof(ucs2_t) - 1; i++) {
+		memcpy(&c, src + i * sizeof(ucs2_t), sizeof(c));
+		if (c == 0)
+			break;
+		dst[i] = tolower_w(c);
+	}
+	dst[i] = 0;
+	return i;
+}
+
+/* -------------------- */
+static int idx_name(const struct catindex_rec *rec, const ucs2_t *name,
+		    size_t len, int partial)
+{
+	const ucs2_t *n = CATINDEX_NAMEP(rec);
+	size_t i;
+
+	if (!partial)
+		return rec->cr_namelen == len
+		    && memcmp(n, name, len * sizeof(ucs2_t)) == 0;
+
+	if (len > rec->cr_namelen)
+		return 0;
+	if (len == 0)
+		return 1;
+	for (i = 0; i <= rec->cr_namelen - len; i++)
+		if (n[i] == name[0]
+		    && memcmp(n + i, name, len * sizeof(ucs2_t)) == 0)
+			return 1;
+	return 0;
+}
+
+/* crit_check() on an index record */
+static int idx_check(const struct catindex_rec *rec)
+{
+	struct finderinfo finfo;
+	int partial = (c1.rbitmap & (1U << CATPBIT_PARTIAL)) != 0;
+	int unknown;
+
+	if (rec->cr_isdir ? !c1.dbitmap : !c1.fbitmap)
+		return 0;
+
+	if ((c1.rbitmap & (1U << DIRPBIT_LNAME))
+	    && !idx_name(rec, idx_lname, idx_lnamelen, partial))
+		return 0;
+	if ((c1.rbitmap & (1U << FILPBIT_PDINFO))
+	    && !idx_name(rec, idx_uname, idx_unamelen, partial))
+		return 0;
+
+	if ((c1.rbitmap & (1U << DIRPBIT_MDATE))
+	    && ((time_t) rec->cr_mdate < c1.mdate
+		|| (time_t) rec->cr_mdate > c2.mdate))
+		return 0;
+	if ((c1.rbitmap & (1U << DIRPBIT_CDATE))
+	    && ((time_t) rec->cr_cdate < c1.cdate
+		|| (time_t) rec->cr_cdate > c2.cdate))
+		return 0;
+	if ((c1.rbitmap & (1U << DIRPBIT_BDATE))
+	    && ((time_t) rec->cr_bdate < c1.bdate
+		|| (time_t) rec->cr_bdate > c2.bdate))
+		return 0;
+
+	if ((c1.rbitmap & (1U << DIRPBIT_ATTR)) && c2.attr != 0
+	    && (rec->cr_attr & c2.attr) != c1.attr)
+		return 0;
+
+	if ((c1.rbitmap & (1U << DIRPBIT_FINFO))) {
+		finfo.f_type = rec->cr_type;
+		finfo.creator = rec->cr_creator;
+		finfo.attrs = rec->cr_fdflags & 0xff00;
+		finfo.label = rec->cr_fdflags & 0xff;
+		/* no FinderInfo, type and creator may come from the extension map */
+		unknown = finfo.f_type == 0 && finfo.creator == 0;
+		if (c2.finfo.f_type != 0 && !unknown
+		    && finfo.f_type != c1.finfo.f_type)
+			return 0;
+		if (c2.finfo.creator != 0 && !unknown
+		    && finfo.creator != c1.finfo.creator)
+			return 0;
+		if (c2.finfo.attrs != 0
+		    && (finfo.attrs & c2.finfo.attrs) != c1.finfo.attrs)
+			return 0;
+		if (c2.finfo.label != 0
+		    && (finfo.label & c2.finfo.label) != c1.finfo.label)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check a candidate on disk and add it to the reply.
+ * Returns 1 if added, 0 if it doesn't match (anymore), -1 on error.
+ */
+static int idx_result(struct vol *vol, const struct catindex_rec *rec,
+		      char **rrbuf, int ext)
+{
+	char resolvebuf[12 + MAXPATHLEN + 1];
+	struct path path;
+	struct dir *dir;
+	cnid_t did = rec->cr_cnid;
+	char *name;
+
+	if ((name = cnid_resolve(vol->v_cdb, &did, resolvebuf,
+				 sizeof(resolvebuf))) == NULL)
+		return 0;
+	if ((dir = dirlookup(vol, did)) == NULL || movecwd(vol, dir) < 0)
+		return 0;
+
+	memset(&path, 0, sizeof(path));
+	path.u_name = name;
+	if (of_stat(vol, &path) != 0)
+		return 0;
+	switch (S_IFMT & path.st.st_mode) {
+	case S_IFDIR:
+		/* For files path.d_dir is the parent dir, for dirs its the dir itself */
+		if ((dir = dirlookup(vol, rec->cr_cnid)) == NULL)
+			return 0;
+		path.m_name = cfrombstr(dir->d_m_name);
+		break;
+	case S_IFREG:
+		path.id = rec->cr_cnid;
+		break;
+	default:
+		return 0;
+	}
+	path.d_dir = dir;
+
+	if (!(crit_check(vol, &path) & 1))
+		return 0;
+	return rslt_add(vol, &path, rrbuf, ext) ? 1 : -1;
+}
+
+/*!
+ * This function performs a catalog index search
+ *
+ * Uses globals c1, c2, the search criteria
+ *
+ * @param vol       (r)  volume we are searching on ...
+ * @param rmatches  (r)  maximum number of matches we can return
+ * @param catpos    (rw) position we've stopped recently
+ * @param rbuf      (w)  output buffer
+ * @param nrecs     (w)  number of matches
+ * @param rsize     (w)  length of data written to output buffer
+ * @param ext       (r)  extended search flag
+ */
+static int catsearch_idx(struct vol *vol,
+			 int rmatches,
+			 uint32_t * catpos,
+			 char *rbuf, uint32_t * nrecs, int *rsize, int ext)
+{
+	catindex_t *ci = vol->v_catindex;
+	const struct catindex_rec *rec;
+	u_int32_t slot = catpos[0];
+	char *rrbuf = rbuf;
+	time_t start_time;
+	int num_rounds = NUM_ROUNDS;
+	int cwd = -1;
+	int r, result = AFP_OK;
+
+	if (slot != 0 && catpos[1] != catindex_gen(ci)) {
+		result = AFPERR_CATCHNG;
+		goto catsearch_end;
+	}
+
+	idx_lnamelen = idx_fold(c1.lname, sizeof(c1.lname), idx_lname);
+	idx_unamelen = idx_fold(c1.utf8name, sizeof(c1.utf8name) - 2,
+				idx_uname);
+	/* FIXME, as in crit_check() */
+	if ((unsigned) c2.mdate > 0x7fffffff)
+		c2.mdate = 0x7fffffff;
+	if ((unsigned) c2.cdate > 0x7fffffff)
+		c2.cdate = 0x7fffffff;
+	if ((unsigned) c2.bdate > 0x7fffffff)
+		c2.bdate = 0x7fffffff;
+
+	if ((cwd = open(".", O_RDONLY)) < 0) {
+		result = AFPERR_MISC;
+		goto catsearch_end;
+	}
+
+	start_time = time(NULL);
+	for (; slot < catindex_slots(ci); slot++) {
+		/* MacOS 9 doesn't like servers executing commands longer than few seconds */
+		if (--num_rounds <= 0) {
+			if (start_time != time(NULL))
+				goto catsearch_pause;
+			num_rounds = NUM_ROUNDS;
+		}
+
+		if ((rec = catindex_get(ci, slot)) == NULL
+		    || !idx_check(rec))
+			continue;
+		/* the candidates cost, account for them more */
+		num_rounds -= 16;
+
+		if ((r = idx_result(vol, rec, &rrbuf, ext)) < 0) {
+			result = AFPERR_MISC;
+			goto catsearch_end;
+		}
+		if (r == 0)
+			continue;
+		*nrecs += r;
+		/* Number of matches limit */
+		if (--rmatches == 0 || rrbuf - rbuf >= 448) {
+			slot++;
+			goto catsearch_pause;
+		}
+	}
+
+	result = AFPERR_EOF;
+	slot = 0;
+
+      catsearch_pause:
+	catpos[0] = slot;
+	catpos[1] = catindex_gen(ci);
+
+      catsearch_end:
+	*rsize = rrbuf - rbuf;
+	if (cwd != -1) {
+		if ((fchdir(cwd)) != 0) {
+			LOG(log_debug, logtype_afpd,
+			    "error chdiring back: %s", strerror(errno));
+		}
+		close(cwd);
+	}
+	return result;
+}
+
+/* put an object into the catalog index, path may be relative to the cwd */
+static void index_object(const struct vol *vol, const char *path,
+			 cnid_t did, cnid_t id)
+{
+	struct catindex_rec rec;
+	struct adouble ad, *adp = NULL;
+	struct stat st;
+	packed_finder buf;
+	u_int32_t date;
+	const char *uname;
+	char *mname, *fi;
+
+	if ((uname = strrchr(path, '/')) != NULL)
+		uname++;
+	else
+		uname = path;
+
+	if (ostat(path, &st, vol_syml_opt(vol)) != 0
+	    || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+		return;
+	if (id == CNID_INVALID
+	    && (id = cnid_add(vol->v_cdb, &st, did, (char *) uname,
+			      strlen(uname), 0)) == CNID_INVALID)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.cr_isdir = S_ISDIR(st.st_mode);
+	rec.cr_cnid = id;
+	rec.cr_did = did;
+	rec.cr_cdate = rec.cr_mdate = rec.cr_bdate = st.st_mtime;
+
+	ad_init(&ad, vol->v_adouble, vol->v_ad_options);
+	if (ad_metadata(path, rec.cr_isdir ? ADFLAGS_DIR : 0, &ad) == 0) {
+		adp = &ad;
+		if (ad_getdate(adp, AD_DATE_CREATE, &date) >= 0)
+			rec.cr_cdate = AD_DATE_TO_UNIX(date);
+		if (ad_getdate(adp, AD_DATE_BACKUP, &date) >= 0)
+			rec.cr_bdate = AD_DATE_TO_UNIX(date);
+		ad_getattr(adp, &rec.cr_attr);
+	}
+	fi = get_finderinfo(vol, uname, adp, &buf, 0);
+	memcpy(&rec.cr_type, fi + FINDERINFO_FRTYPEOFF, sizeof(rec.cr_type));
+	memcpy(&rec.cr_creator, fi + FINDERINFO_FRCREATOFF,
+	       sizeof(rec.cr_creator));
+	memcpy(&rec.cr_fdflags, fi + FINDERINFO_FRFLAGOFF,
+	       sizeof(rec.cr_fdflags));
+	if (adp)
+		ad_close_metadata(adp);
+
+	if ((mname = utompath(vol, (char *) uname, id, 1)) == NULL)
+		return;
+	if (catindex_put(vol->v_catindex, &rec, mname) != 0)
+		LOG(log_debug, logtype_afpd,
+		    "catsearch_index(\"%s\"): %s", path, strerror(errno));
+}
+
+/*!
+ * Update the catalog index after a file has been created or changed
+ *
+ * @param vol    (r) volume
+ * @param did    (r) parent directory
+ * @param path   (r) unix path, relative to the cwd or absolute
+ * @param id     (r) CNID or CNID_INVALID, then we look it up
+ */
+void catsearch_index_file(const struct vol *vol, cnid_t did,
+			  const char *path, cnid_t id)
+{
+	if (vol->v_catindex == NULL)
+		return;
+	index_object(vol, path, did, id);
+}
+
+/*!
+ * Update the catalog index after a directory has been created or changed
+ */
+void catsearch_index_dir(const struct vol *vol, const struct dir *dir)
+{
+	if (vol->v_catindex == NULL || dir == NULL
+	    || dir->d_did == DIRDID_ROOT)
+		return;
+	index_object(vol, cfrombstr(dir->d_fullpath), dir->d_pdid,
+		     dir->d_did);
+}
+
+/*!
+ * Remove an object from the catalog index
+ */
+void catsearch_index_del(const struct vol *vol, cnid_t id)
+{
+	if (vol->v_catindex == NULL || id == CNID_INVALID)
+		return;
+	catindex_del(vol->v_catindex, id);
+}
+
 /* -------------------------- */
 static int catsearch_afp(AFPObj * obj _U_, char *ibuf, size_t ibuflen,
 			 char *rbuf, size_t *rbuflen, int ext)
@@ -1086,8 +1463,13 @@ static int catsearch_afp(AFPObj * obj _U_, char *ibuf, size_t ibuflen,
 
 	/* Call search */
 	*rbuflen = 24;
-	if ((c1.rbitmap & (1U << FILPBIT_PDINFO))
-	    && !(c1.rbitmap & (1U << CATPBIT_PARTIAL))
+	if (vol->v_catindex && (vol->v_flags & AFPVOL_SEARCHDB)
+	    && catindex_refresh(vol->v_catindex) == 0)
+		/* all criteria from the catalog index */
+		ret =
+		    catsearch_idx(vol, rmatches, catpos, rbuf + 24, &nrecs,
+				  &rsize, ext);
+	else if ((c1.rbitmap & (1U << FILPBIT_PDINFO))
 	    && (strcmp(vol->v_cnidscheme, "dbd") == 0)
 	    && (vol->v_flags & AFPVOL_SEARCHDB))
 		/* we've got a name and it's a dbd volume, so search CNID database */
@@ -1131,3 +1513,29 @@ int afp_catsearch(AFPObj * obj, char *ibuf, size_t ibuflen,
 /* FIXME: we need a clean separation between afp stubs and 'real' implementation */
 /* (so, all buffer packing/unpacking should be done in stub, everything else 
    should be done in other functions) */
+
+/* a worker afpd frees a session's search state, see session.c */
+static void catsearch_session_end(void)
+{
+	clearstack();
+	free(dstack);
+	dstack = NULL;
+	dssize = 0;
+	if (dirpos != NULL)
+		closedir(dirpos);
+	dirpos = NULL;
+	free(dbs);
+	dbs = NULL;
+}
+
+void catsearch_session_vars(void)
+{
+	session_var(&save_cidx, sizeof(save_cidx));
+	session_var(&dstack, sizeof(dstack));
+	session_var(&dssize, sizeof(dssize));
+	session_var(&dsidx, sizeof(dsidx));
+	session_var(&cur_pos, sizeof(cur_pos));
+	session_var(&dirpos, sizeof(dirpos));
+	session_var(&dbs, sizeof(dbs));
+	session_cleanup(catsearch_session_end);
+}
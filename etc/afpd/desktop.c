@@ -20,6 +20,9 @@
 #include <atalk/adouble.h>
 #include <sys/uio.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netatalk/at.h>
 #include <netatalk/endian.h>
@@ -34,6 +37,7 @@
 #include "fork.h"
 #include "desktop.h"
 #include "mangle.h"
+#include "session.h"
 
 extern int debug;
 
@@ -64,70 +68,246 @@ int afp_closedt(AFPObj * obj _U_, char *ibuf _U_, size_t ibuflen _U_,
 	return (AFP_OK);
 }
 
-static struct savedt si = { { 0, 0, 0, 0 }, -1, 0, 0 };
+/*
+ * Icon files
+ * ==========
+ *
+ * The icons of a creator live in .AppleDesktop/<c>/<creator>.icon, a
+ * sequence of 12 byte headers (tag, type, icon type, pad, size) each
+ * followed by the bitmap. Instead of reading and seeking through the file on
+ * every request, the file is mapped and indexed: an array of header offsets
+ * for afp_geticoninfo() and a hash on (type, icon type) for afp_geticon() and
+ * afp_addicon(). Bitmaps are copied straight out of the mapping, which is
+ * shared with all other afpd processes through the page cache. The file
+ * format doesn't change, so nothing has to be converted and older afpd
+ * versions can still use the files.
+ *
+ * The last ICONDB_CACHE files are kept mapped. Icons are only ever appended
+ * or overwritten in place, so a file that has grown is simply reindexed.
+ */
+#define ICON_HDRLEN   12
+#define ICONDB_CACHE  4
+
+struct icondb {
+	u_int16_t id_vid;
+	u_int8_t id_creator[4];
+	int id_fd;		/* -1: unused */
+	unsigned int id_used;	/* for LRU */
+	unsigned char *id_map;
+	size_t id_len;		/* mapped and indexed size */
+	u_int32_t id_count;
+	u_int32_t *id_off;	/* header offset by index */
+	u_int32_t *id_hash;	/* bucket -> index + 1 */
+	u_int32_t *id_next;	/* chain, index + 1 */
+	u_int32_t id_mask;
+};
+
+static struct icondb icondbs[ICONDB_CACHE] = {
+	{.id_fd = -1}, {.id_fd = -1}, {.id_fd = -1}, {.id_fd = -1}
+};
+static unsigned int icondb_clock;
 
 static char *icon_dtfile(struct vol *vol, u_int8_t creator[4])
 {
 	return dtfile(vol, creator, ".icon");
 }
 
-static int iconopen(struct vol *vol, u_int8_t creator[4], int flags,
-		    int mode)
+static u_int32_t icon_hash(const unsigned char *ftype, unsigned char itype)
+{
+	u_int32_t h;
+
+	memcpy(&h, ftype, sizeof(h));
+	h ^= itype;
+	h *= 0x9e3779b1;
+	return h ^ (h >> 15);
+}
+
+static void icondb_unmap(struct icondb *db)
+{
+	if (db->id_map)
+		munmap(db->id_map, db->id_len);
+	db->id_map = NULL;
+	db->id_len = 0;
+	db->id_count = 0;
+}
+
+static void icondb_close(struct icondb *db)
+{
+	icondb_unmap(db);
+	if (db->id_fd != -1)
+		close(db->id_fd);
+	db->id_fd = -1;
+}
+
+/* map the file and build the index, a truncated last icon is ignored */
+static int icondb_index(struct icondb *db, size_t len)
+{
+	u_int32_t off, n, i, h, size;
+	u_int16_t bsize;
+	void *tmp;
+
+	icondb_unmap(db);
+	if (len == 0)
+		return 0;
+
+	if ((db->id_map = mmap(NULL, len, PROT_READ, MAP_SHARED, db->id_fd,
+			       0)) == MAP_FAILED) {
+		db->id_map = NULL;
+		LOG(log_error, logtype_afpd, "icondb_index: mmap: %s",
+		    strerror(errno));
+		return -1;
+	}
+	db->id_len = len;
+
+	for (off = 0, n = 0; off + ICON_HDRLEN <= len; n++) {
+		memcpy(&bsize, db->id_map + off + 10, sizeof(bsize));
+		off += ICON_HDRLEN + ntohs(bsize);
+	}
+
+	for (size = 16; size < 2 * n; size *= 2);
+	if (!(tmp = realloc(db->id_off, (n + 1) * sizeof(u_int32_t))))
+		goto nomem;
+	db->id_off = tmp;
+	if (!(tmp = realloc(db->id_next, (n + 1) * sizeof(u_int32_t))))
+		goto nomem;
+	db->id_next = tmp;
+	if (!(tmp = realloc(db->id_hash, size * sizeof(u_int32_t))))
+		goto nomem;
+	db->id_hash = tmp;
+	memset(db->id_hash, 0, size * sizeof(u_int32_t));
+	db->id_mask = size - 1;
+
+	for (off = 0, i = 0; i < n; i++) {
+		db->id_off[i] = off;
+		memcpy(&bsize, db->id_map + off + 10, sizeof(bsize));
+		off += ICON_HDRLEN + ntohs(bsize);
+	}
+	if (n && off > len)
+		n--;		/* bitmap of the last one is cut off */
+
+	/* backwards, so a chain starts with the first icon of its kind */
+	for (i = n; i > 0; i--) {
+		h = icon_hash(db->id_map + db->id_off[i - 1] + 4,
+			      db->id_map[db->id_off[i - 1] + 8]) & db->id_mask;
+		db->id_next[i - 1] = db->id_hash[h];
+		db->id_hash[h] = i;
+	}
+	db->id_count = n;
+	return 0;
+
+      nomem:
+	LOG(log_error, logtype_afpd, "icondb_index: out of memory");
+	icondb_unmap(db);
+	return -1;
+}
+
+/*
+ * Get the icon file of a creator, opened with flags and indexed.
+ */
+static struct icondb *icondb_get(struct vol *vol, u_int8_t creator[4],
+				 int flags, int mode)
 {
+	struct icondb *db, *lru = &icondbs[0];
+	struct stat st;
 	char *dtf, *adt, *adts;
+	int i, fd;
 
-	if (si.sdt_fd != -1) {
-		if (memcmp(si.sdt_creator, creator, sizeof(CreatorType)) ==
-		    0 && si.sdt_vid == vol->v_vid) {
-			return 0;
-		}
-		close(si.sdt_fd);
-		si.sdt_fd = -1;
+	for (i = 0; i < ICONDB_CACHE; i++) {
+		db = &icondbs[i];
+		if (db->id_fd != -1 && db->id_vid == vol->v_vid
+		    && memcmp(db->id_creator, creator,
+			      sizeof(CreatorType)) == 0)
+			break;
+		if (db->id_fd == -1 || (lru->id_fd != -1
+					&& db->id_used < lru->id_used))
+			lru = db;
 	}
 
-	dtf = icon_dtfile(vol, creator);
+	if (i < ICONDB_CACHE && (flags & O_ACCMODE) != O_RDONLY) {
+		/* opened read only */
+		icondb_close(db);
+		i = ICONDB_CACHE;
+		lru = db;
+	}
 
-	if ((si.sdt_fd = open(dtf, flags, ad_mode(dtf, mode))) < 0) {
-		if (errno == ENOENT && (flags & O_CREAT)) {
-			if ((adts = strrchr(dtf, '/')) == NULL) {
-				return -1;
-			}
+	if (i == ICONDB_CACHE) {
+		db = lru;
+		icondb_close(db);
+
+		dtf = icon_dtfile(vol, creator);
+		if ((fd = open(dtf, flags, ad_mode(dtf, mode))) < 0) {
+			if (errno != ENOENT || !(flags & O_CREAT))
+				return NULL;
+			if ((adts = strrchr(dtf, '/')) == NULL)
+				return NULL;
 			*adts = '\0';
-			if ((adt = strrchr(dtf, '/')) == NULL) {
-				return -1;
-			}
+			if ((adt = strrchr(dtf, '/')) == NULL)
+				return NULL;
 			*adt = '\0';
 			(void) ad_mkdir(dtf, DIRBITS | 0777);
 			*adt = '/';
 			(void) ad_mkdir(dtf, DIRBITS | 0777);
 			*adts = '/';
 
-			if ((si.sdt_fd =
-			     open(dtf, flags, ad_mode(dtf, mode))) < 0) {
+			if ((fd = open(dtf, flags, ad_mode(dtf, mode))) < 0) {
 				LOG(log_error, logtype_afpd,
 				    "iconopen(%s): open: %s", dtf,
 				    strerror(errno));
-				return -1;
+				return NULL;
 			}
-		} else {
-			return -1;
 		}
+		db->id_fd = fd;
+		db->id_vid = vol->v_vid;
+		memcpy(db->id_creator, creator, sizeof(CreatorType));
+		db->id_len = (size_t) -1;
 	}
+	db->id_used = ++icondb_clock;
 
-	memcpy(si.sdt_creator, creator, sizeof(CreatorType));
-	si.sdt_vid = vol->v_vid;
-	si.sdt_index = 1;
-	return 0;
+	/* another process may have added icons */
+	if (fstat(db->id_fd, &st) < 0) {
+		icondb_close(db);
+		return NULL;
+	}
+	if ((size_t) st.st_size != db->id_len
+	    && icondb_index(db, st.st_size) < 0) {
+		icondb_close(db);
+		return NULL;
+	}
+	return db;
+}
+
+/*
+ * First icon with the type and icon type of the header hdr, with the same
+ * tag too if tag is set.
+ */
+static unsigned char *icondb_find(struct icondb *db, const u_int8_t *hdr,
+				  int tag)
+{
+	unsigned char *ih;
+	u_int32_t i;
+
+	if (db->id_count == 0)
+		return NULL;
+	i = db->id_hash[icon_hash(hdr + 4, hdr[8]) & db->id_mask];
+	for (; i; i = db->id_next[i - 1]) {
+		ih = db->id_map + db->id_off[i - 1];
+		if (memcmp(ih + 4, hdr + 4, 5) == 0
+		    && (!tag || memcmp(ih, hdr, 10) == 0))
+			return ih;
+	}
+	return NULL;
 }
 
 int afp_addicon(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 		size_t *rbuflen)
 {
 	struct vol *vol;
+	struct icondb *db;
 	struct iovec iov[2];
-	u_int8_t fcreator[4], imh[12], irh[12], *p;
+	u_int8_t fcreator[4], imh[12], *irh, *p;
 	int itype, cc = AFP_OK, iovcnt = 0;
 	size_t buflen;
+	off_t off;
 	u_int32_t ftype, itag;
 	u_int16_t bsize, rsize, vid;
 
@@ -157,28 +337,13 @@ int afp_addicon(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 	memcpy(&bsize, ibuf, sizeof(bsize));
 	bsize = ntohs(bsize);
 
-	if (si.sdt_fd != -1) {
-		(void) close(si.sdt_fd);
-		si.sdt_fd = -1;
-	}
-
-	if (iconopen(vol, fcreator, O_RDWR | O_CREAT, 0666) < 0) {
+	if ((db = icondb_get(vol, fcreator, O_RDWR | O_CREAT, 0666)) == NULL) {
 		cc = AFPERR_NOITEM;
 		goto addicon_err;
 	}
 
-	if (lseek(si.sdt_fd, (off_t) 0L, SEEK_SET) < 0) {
-		close(si.sdt_fd);
-		si.sdt_fd = -1;
-		LOG(log_error, logtype_afpd, "afp_addicon(%s): lseek: %s",
-		    icon_dtfile(vol, fcreator), strerror(errno));
-		cc = AFPERR_PARAM;
-		goto addicon_err;
-	}
-
 	/*
-	 * Read icon elements until we find a match to replace, or
-	 * we get to the end to insert.
+	 * Look for an icon to replace, or we insert at the end.
 	 */
 	p = imh;
 	memcpy(p, &itag, sizeof(itag));
@@ -190,28 +355,19 @@ int afp_addicon(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 	bsize = htons(bsize);
 	memcpy(p, &bsize, sizeof(bsize));
 	bsize = ntohs(bsize);
-	while ((cc = read(si.sdt_fd, irh, sizeof(irh))) > 0) {
+
+	off = db->id_len;
+	if ((irh = icondb_find(db, imh, 1))) {
 		memcpy(&rsize, irh + 10, sizeof(rsize));
 		rsize = ntohs(rsize);
 		/*
-		 * Is this our set of headers?
+		 * Is the size correct?
 		 */
-		if (memcmp(irh, imh, sizeof(irh) - sizeof(u_int16_t)) == 0) {
-			/*
-			 * Is the size correct?
-			 */
-			if (bsize != rsize)
-				cc = AFPERR_ITYPE;
-			break;
-		}
-
-		if (lseek(si.sdt_fd, (off_t) rsize, SEEK_CUR) < 0) {
-			LOG(log_error, logtype_afpd,
-			    "afp_addicon(%s): lseek: %s", icon_dtfile(vol,
-								      fcreator),
-			    strerror(errno));
-			cc = AFPERR_PARAM;
-		}
+		if (bsize != rsize)
+			cc = AFPERR_ITYPE;
+		else
+			cc = 1;
+		off = irh - db->id_map + ICON_HDRLEN;
 	}
 
 	/*
@@ -252,7 +408,8 @@ int afp_addicon(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 			iovcnt = 1;
 		}
 
-		if (writev(si.sdt_fd, iov, iovcnt) < 0) {
+		if (lseek(db->id_fd, off, SEEK_SET) < 0
+		    || writev(db->id_fd, iov, iovcnt) < 0) {
 			LOG(log_error, logtype_afpd,
 			    "afp_addicon(%s): writev: %s", icon_dtfile(vol,
 								       fcreator),
@@ -260,8 +417,6 @@ int afp_addicon(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 			return (AFPERR_PARAM);
 		}
 
-	close(si.sdt_fd);
-	si.sdt_fd = -1;
 	return (AFP_OK);
 }
 
@@ -275,8 +430,9 @@ int afp_geticoninfo(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 		    char *rbuf, size_t *rbuflen)
 {
 	struct vol *vol;
+	struct icondb *db;
 	u_int8_t fcreator[4], ih[12];
-	u_int16_t vid, iindex, bsize;
+	u_int16_t vid, iindex;
 
 	*rbuflen = 0;
 	ibuf += 2;
@@ -307,51 +463,27 @@ int afp_geticoninfo(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 		return (AFP_OK);
 	}
 
-	if (iconopen(vol, fcreator, O_RDONLY, 0) < 0) {
+	if ((db = icondb_get(vol, fcreator, O_RDONLY, 0)) == NULL) {
 		return (AFPERR_NOITEM);
 	}
 
-	if (iindex < si.sdt_index) {
-		if (lseek(si.sdt_fd, (off_t) 0L, SEEK_SET) < 0) {
-			return (AFPERR_PARAM);
-		}
-		si.sdt_index = 1;
+	if (iindex == 0 || iindex > db->id_count) {
+		return (AFPERR_NOITEM);
 	}
 
-	/*
-	 * Position to the correct spot.
-	 */
-	for (;;) {
-		if (read(si.sdt_fd, ih, sizeof(ih)) != sizeof(ih)) {
-			close(si.sdt_fd);
-			si.sdt_fd = -1;
-			return (AFPERR_NOITEM);
-		}
-		memcpy(&bsize, ih + 10, sizeof(bsize));
-		bsize = ntohs(bsize);
-		if (lseek(si.sdt_fd, (off_t) bsize, SEEK_CUR) < 0) {
-			LOG(log_error, logtype_afpd,
-			    "afp_iconinfo(%s): lseek: %s", icon_dtfile(vol,
-								       fcreator),
-			    strerror(errno));
-			return (AFPERR_PARAM);
-		}
-		if (si.sdt_index == iindex) {
-			memcpy(rbuf, ih, sizeof(ih));
-			*rbuflen = sizeof(ih);
-			return (AFP_OK);
-		}
-		si.sdt_index++;
-	}
+	memcpy(rbuf, db->id_map + db->id_off[iindex - 1], ICON_HDRLEN);
+	*rbuflen = ICON_HDRLEN;
+	return (AFP_OK);
 }
 
 
-int afp_geticon(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
+int afp_geticon(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_, char *rbuf,
 		size_t *rbuflen)
 {
 	struct vol *vol;
+	struct icondb *db;
 	ssize_t rc;
-	u_int8_t fcreator[4], ftype[4], itype, ih[12];
+	u_int8_t fcreator[4], ih[12], *p;
 	u_int16_t vid, bsize, rsize;
 
 	*rbuflen = 0;
@@ -365,61 +497,28 @@ int afp_geticon(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 
 	memcpy(fcreator, ibuf, sizeof(fcreator));
 	ibuf += sizeof(fcreator);
-	memcpy(ftype, ibuf, sizeof(ftype));
-	ibuf += sizeof(ftype);
-	itype = (unsigned char) *ibuf++;
+	/* type and icon type, at their place in an icon header */
+	memcpy(ih + 4, ibuf, 4);
+	ibuf += 4;
+	ih[8] = (unsigned char) *ibuf++;
 	ibuf++;
 	memcpy(&bsize, ibuf, sizeof(bsize));
 	bsize = ntohs(bsize);
 
-	if (iconopen(vol, fcreator, O_RDONLY, 0) < 0) {
+	if ((db = icondb_get(vol, fcreator, O_RDONLY, 0)) == NULL) {
 		return (AFPERR_NOITEM);
 	}
 
-	if (lseek(si.sdt_fd, (off_t) 0L, SEEK_SET) < 0) {
-		close(si.sdt_fd);
-		si.sdt_fd = -1;
-		LOG(log_error, logtype_afpd, "afp_geticon(%s): lseek: %s",
-		    icon_dtfile(vol, fcreator), strerror(errno));
-		return (AFPERR_PARAM);
-	}
-
-	si.sdt_index = 1;
-	while ((rc = read(si.sdt_fd, ih, sizeof(ih))) > 0) {
-		si.sdt_index++;
-		if (memcmp(ih + sizeof(int), ftype, sizeof(ftype)) == 0 &&
-		    *(ih + sizeof(int) + sizeof(ftype)) == itype) {
-			break;
-		}
-		memcpy(&rsize, ih + 10, sizeof(rsize));
-		rsize = ntohs(rsize);
-		if (lseek(si.sdt_fd, (off_t) rsize, SEEK_CUR) < 0) {
-			LOG(log_error, logtype_afpd,
-			    "afp_geticon(%s): lseek: %s", icon_dtfile(vol,
-								      fcreator),
-			    strerror(errno));
-			return (AFPERR_PARAM);
-		}
-	}
-
-	if (rc < 0) {
-		LOG(log_error, logtype_afpd, "afp_geticon(%s): read: %s",
-		    icon_dtfile(vol, fcreator), strerror(errno));
-		return (AFPERR_PARAM);
-	}
-
-	if (rc == 0) {
+	if ((p = icondb_find(db, ih, 0)) == NULL) {
 		return (AFPERR_NOITEM);
 	}
 
-	memcpy(&rsize, ih + 10, sizeof(rsize));
+	memcpy(&rsize, p + 10, sizeof(rsize));
 	rsize = ntohs(rsize);
 #define min(a,b)	((a)<(b)?(a):(b))
 	rc = min(bsize, rsize);
 
-	if (read(si.sdt_fd, rbuf, rc) < rc) {
-		return (AFPERR_PARAM);
-	}
+	memcpy(rbuf, p + ICON_HDRLEN, rc);
 	*rbuflen = rc;
 
 	return AFP_OK;
@@ -789,3 +888,24 @@ int afp_rmvcomment(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 
 	return ad_rmvcomment(vol, s_path);
 }
+
+/* a worker afpd closes the databases when a session ends, see session.c */
+static void desktop_session_end(void)
+{
+	struct icondb *db;
+
+	for (db = icondbs; db < icondbs + ICONDB_CACHE; db++) {
+		icondb_close(db);
+		free(db->id_off);
+		free(db->id_hash);
+		free(db->id_next);
+		db->id_off = db->id_hash = db->id_next = NULL;
+	}
+}
+
+void desktop_session_vars(void)
+{
+	session_var(icondbs, sizeof(icondbs));
+	session_var(&icondb_clock, sizeof(icondb_clock));
+	session_cleanup(desktop_session_end);
+}
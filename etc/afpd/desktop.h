@@ -30,13 +30,6 @@
 #include <atalk/globals.h>
 #include "volume.h"
 
-struct savedt {
-    u_int8_t	sdt_creator[ 4 ];
-    int		sdt_fd;
-    int		sdt_index;
-    int16_t	sdt_vid;
-};
-
 typedef unsigned char CreatorType[4];
 
 extern char	*dtfile (const struct vol *, u_int8_t [], char *);
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <atalk/util.h>
 #include <atalk/cnid.h>
@@ -30,17 +31,18 @@
 #include <atalk/bstrlib.h>
 #include <atalk/bstradd.h>
 #include <atalk/globals.h>
+#include <atalk/slab.h>
 
 #include "dircache.h"
 #include "directory.h"
-#include "hash.h"
+#include "session.h"
 
 
 /*
  * Directory Cache
  * ===============
  *
- * Cache files and directories in a LRU cache.
+ * Cache files and directories in a 2Q/CLOCK cache.
  *
  * The directory cache caches directories and files(!). The main reason for having the cache
  * is avoiding recursive walks up the path, querying the CNID database each time, when
@@ -67,9 +69,6 @@
  *   (8) finally added to the cache with dircache_add()
  * (2) of course does contain the steps 6,7 and 8.
  *
- * The dircache is a LRU cache, whenever it fills up we call dircache_evict internally which removes
- * DIRCACHE_FREE_QUANTUM elements from the cache.
- *
  * There is only one cache for all volumes, so of course we use the volume id in hashing calculations.
  *
  * In order to avoid cache poisoning, we store the cached entries st_ctime from stat in
@@ -84,33 +83,97 @@
  * Using ctime leads to cache eviction in case 2) where it wouldn't be necessary, because
  * the dir itself (name, CNID, ...) hasn't changed, but there's no other way.
  *
+ * Replacement
+ * ===========
+ *
+ * Enumerating a big directory adds thousands of files that are never looked at again,
+ * with a plain LRU they push the directories out that every path resolution needs.
+ * So entries live in one of two queues:
+ * - new entries are put on probation
+ * - an entry on probation that is found in the cache is promoted to the protected queue,
+ *   a protected entry that is found gets its reference bit set
+ * When the cache is full, the oldest entry on probation is evicted as long as probation
+ * holds more than 1/DIRCACHE_PROBATION_SHARE of the entries. Otherwise a clock hand
+ * moves over the protected queue: referenced entries lose their bit and get another
+ * round, unreferenced ones are demoted to probation. Nothing moves on a hit but the
+ * promotion, so looking up a protected entry only sets a bit.
+ * The hashes of entries evicted from probation are remembered in a direct mapped
+ * table of "ghosts". An entry that is added again while its ghost is still there
+ * was evicted too early and goes straight to the protected queue.
+ *
+ * Size
+ * ====
+ *
+ * The configured size is max(DEFAULT_MAX_DIRCACHE_SIZE, min(size, MAX_POSSIBLE_DIRCACHE_SIZE))
+ * entries. Every DIRCACHE_ADAPT_INTERVAL additions dircache_adapt() adjusts the limit:
+ * it's halved (not below DIRCACHE_MIN_SIZE) while the system is short of memory,
+ * and doubled (up to DIRCACHE_MAX_GROWTH times the configured size) when the clock hand
+ * had to demote many protected entries or many evicted entries come back, ie the
+ * entries in use don't fit.
+ *
  * Indexes
  * =======
  *
- * The maximum dircache size is:
- * max(DEFAULT_MAX_DIRCACHE_SIZE, min(size, MAX_POSSIBLE_DIRCACHE_SIZE)).
- * It is a hashtable which we use to store "struct dir"s in. If the cache get full, oldest
- * entries are evicted in chunks of DIRCACHE_FREE.
- *
- * We have/need two indexes:
- * - a DID/name index on the main dircache, another hashtable
- * - a queue index on the dircache, for evicting the oldest entries
+ * We have/need two indexes, both are open addressing hashtables with linear probing
+ * that grow with the number of entries:
+ * - the main dircache, indexed by volume and CNID
+ * - a DID/name index on the main dircache
+ * A slot stores the hash value next to the pointer, so a probe only dereferences
+ * a struct dir if the hash matches.
+ * The replacement queues are linked through struct dir, there's no extra allocation.
  *
  * Debugging
  * =========
  *
- * Sending SIGINT to a afpd child causes it to dump the dircache to a file "/tmp/dircache.PID".
+ * Sending SIGINT to a afpd child causes it to log the dircache statistics and dump the
+ * dircache to a file "/tmp/dircache.PID".
  */
 
 /********************************************************
  * Local funcs and variables
  ********************************************************/
 
+/* struct dir.dcache_queue */
+#define DCACHE_NOQUEUE   0
+#define DCACHE_PROBATION 1
+#define DCACHE_PROTECTED 2
+
+/* initial and minimum slots of the hashtables */
+#define DCACHE_TABLE_MIN 1024
+
+struct dc_slot {
+	u_int32_t hash;
+	struct dir *dir;	/* NULL if the slot is free */
+};
+
+struct dc_table {
+	struct dc_slot *slots;
+	u_int32_t mask;		/* number of slots - 1, a power of 2 */
+	u_int32_t count;
+};
+
+struct dc_queue {
+	struct dir *head;	/* oldest, next for the clock hand */
+	struct dir *tail;
+	u_int32_t count;
+};
+
 /*****************************
  *       the dircache        */
 
-static hash_t *dircache;	/* The actual cache */
-static unsigned int dircache_maxsize;	/* cache maximum size */
+static struct dc_table dircache;	/* The actual cache */
+static unsigned int dircache_maxsize;	/* current size limit */
+static unsigned int dircache_basesize;	/* size limit from afpd.conf */
+
+static struct dc_queue queue_probation;
+static struct dc_queue queue_protected;
+
+static u_int32_t *ghosts;	/* hashes of entries evicted from probation */
+static u_int32_t ghost_mask;
+
+static unsigned int adapt_added;	/* since the last dircache_adapt() */
+static unsigned int adapt_demoted;
+static unsigned int adapt_readded;
 
 static struct dircache_stat {
 	u_int64_t lookups;
@@ -120,13 +183,17 @@ static struct dircache_stat {
 	u_int64_t removed;
 	u_int64_t expunged;
 	u_int64_t evicted;
+	u_int64_t promoted;
+	u_int64_t demoted;
+	u_int64_t readded;
+	u_int64_t grown;
+	u_int64_t shrunk;
 } dircache_stat;
 
 /* FNV 1a */
-static hash_val_t hash_vid_did(const void *key)
+static u_int32_t hash_vid_did(const struct dir *k)
 {
-	const struct dir *k = (const struct dir *) key;
-	hash_val_t hash = 2166136261;
+	u_int32_t hash = 2166136261U;
 
 	hash ^= k->d_vid >> 8;
 	hash *= 16777619;
@@ -145,18 +212,15 @@ static hash_val_t hash_vid_did(const void *key)
 	return hash;
 }
 
-static int hash_comp_vid_did(const void *key1, const void *key2)
+static int hash_comp_vid_did(const struct dir *k1, const struct dir *k2)
 {
-	const struct dir *k1 = key1;
-	const struct dir *k2 = key2;
-
 	return !(k1->d_did == k2->d_did && k1->d_vid == k2->d_vid);
 }
 
 /**************************************************
  * DID/name index on dircache (another hashtable) */
 
-static hash_t *index_didname;
+static struct dc_table index_didname;
 
 #undef get16bits
 #if defined(__i386__)
@@ -166,13 +230,12 @@ static hash_t *index_didname;
                       +(uint32_t)(((const uint8_t *)(d))[0]) )
 #endif
 
-static hash_val_t hash_didname(const void *p)
+static u_int32_t hash_didname(const struct dir *key)
 {
-	const struct dir *key = (const struct dir *) p;
 	const unsigned char *data = key->d_u_name->data;
 	int len = key->d_u_name->slen;
-	hash_val_t hash = key->d_pdid + key->d_vid;
-	hash_val_t tmp;
+	u_int32_t hash = key->d_pdid + key->d_vid;
+	u_int32_t tmp;
 
 	int rem = len & 3;
 	len >>= 2;
@@ -216,67 +279,331 @@ static hash_val_t hash_didname(const void *p)
 	return hash;
 }
 
-static int hash_comp_didname(const void *k1, const void *k2)
+static int hash_comp_didname(const struct dir *key1, const struct dir *key2)
 {
-	const struct dir *key1 = (const struct dir *) k1;
-	const struct dir *key2 = (const struct dir *) k2;
-
 	return !(key1->d_vid == key2->d_vid
 		 && key1->d_pdid == key2->d_pdid
 		 && (bstrcmp(key1->d_u_name, key2->d_u_name) == 0));
 }
 
+/**************************************************
+ * open addressing hashtables                     */
+
+static int table_init(struct dc_table *t, u_int32_t size)
+{
+	if ((t->slots = calloc(size, sizeof(struct dc_slot))) == NULL)
+		return -1;
+	t->mask = size - 1;
+	t->count = 0;
+	return 0;
+}
+
+static struct dir *table_lookup(const struct dc_table *t, u_int32_t hash,
+				const struct dir *key,
+				int (*comp) (const struct dir *,
+					     const struct dir *))
+{
+	const struct dc_slot *slot;
+	u_int32_t i = hash & t->mask;
+
+	while ((slot = &t->slots[i])->dir) {
+		if (slot->hash == hash && comp(slot->dir, key) == 0)
+			return slot->dir;
+		i = (i + 1) & t->mask;
+	}
+	return NULL;
+}
+
+static void table_put(struct dc_table *t, u_int32_t hash, struct dir *dir)
+{
+	u_int32_t i = hash & t->mask;
+
+	while (t->slots[i].dir)
+		i = (i + 1) & t->mask;
+	t->slots[i].hash = hash;
+	t->slots[i].dir = dir;
+	t->count++;
+}
+
+static int table_resize(struct dc_table *t, u_int32_t size)
+{
+	struct dc_table new;
+	u_int32_t i;
+
+	if (table_init(&new, size) != 0)
+		return -1;
+	for (i = 0; i <= t->mask; i++)
+		if (t->slots[i].dir)
+			table_put(&new, t->slots[i].hash, t->slots[i].dir);
+	free(t->slots);
+	*t = new;
+	return 0;
+}
+
+/* the table is doubled before it gets more than half full */
+static int table_insert(struct dc_table *t, u_int32_t hash, struct dir *dir)
+{
+	if (2 * (t->count + 1) > t->mask + 1
+	    && table_resize(t, 2 * (t->mask + 1)) != 0)
+		return -1;
+	table_put(t, hash, dir);
+	return 0;
+}
+
+/*!
+ * Remove dir from the table. Instead of leaving a tombstone, the following
+ * entries of the probe sequence are moved back into the hole if their home
+ * slot allows it.
+ */
+static int table_delete(struct dc_table *t, u_int32_t hash,
+			const struct dir *dir)
+{
+	u_int32_t i = hash & t->mask;
+	u_int32_t j, home;
+
+	while (t->slots[i].dir != dir) {
+		if (t->slots[i].dir == NULL)
+			return -1;
+		i = (i + 1) & t->mask;
+	}
+
+	for (j = i;;) {
+		j = (j + 1) & t->mask;
+		if (t->slots[j].dir == NULL)
+			break;
+		home = t->slots[j].hash & t->mask;
+		if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+			t->slots[i] = t->slots[j];
+			i = j;
+		}
+	}
+	t->slots[i].dir = NULL;
+	t->count--;
+	return 0;
+}
+
+/* give back memory after the cache was shrunk */
+static void table_trim(struct dc_table *t)
+{
+	u_int32_t size = t->mask + 1;
+
+	while (size > DCACHE_TABLE_MIN && 8 * t->count < size)
+		size /= 2;
+	if (size != t->mask + 1)
+		(void) table_resize(t, size);
+}
+
 /***************************
- * queue index on dircache */
+ * replacement queues      */
 
-static q_t *index_queue;	/* the index itself */
-static u_int64_t queue_count;
+static struct dc_queue *dcq_of(const struct dir *dir)
+{
+	return dir->dcache_queue ==
+	    DCACHE_PROTECTED ? &queue_protected : &queue_probation;
+}
+
+static void dcq_append(struct dir *dir, int which)
+{
+	struct dc_queue *q;
+
+	dir->dcache_queue = which;
+	q = dcq_of(dir);
+	dir->dcache_next = NULL;
+	dir->dcache_prev = q->tail;
+	if (q->tail)
+		q->tail->dcache_next = dir;
+	else
+		q->head = dir;
+	q->tail = dir;
+	q->count++;
+}
+
+static void dcq_unlink(struct dir *dir)
+{
+	struct dc_queue *q = dcq_of(dir);
+
+	if (dir->dcache_prev)
+		dir->dcache_prev->dcache_next = dir->dcache_next;
+	else
+		q->head = dir->dcache_next;
+	if (dir->dcache_next)
+		dir->dcache_next->dcache_prev = dir->dcache_prev;
+	else
+		q->tail = dir->dcache_prev;
+	q->count--;
+	dir->dcache_prev = dir->dcache_next = NULL;
+	dir->dcache_queue = DCACHE_NOQUEUE;
+}
+
+/* twice as many ghosts as entries, a power of 2 */
+static int ghosts_init(unsigned int entries)
+{
+	u_int32_t *new;
+
+	if ((new = calloc(2 * entries, sizeof(u_int32_t))) == NULL)
+		return -1;
+	free(ghosts);
+	ghosts = new;
+	ghost_mask = 2 * entries - 1;
+	return 0;
+}
 
 /*!
- * @brief Remove a fixed number of (oldest) entries from the cache and indexes
- *
- * The default is to remove the 256 oldest entries from the cache.
- * 1. Get the oldest entry
- * 2. If it's in use ie open forks reference it or it's curdir requeue it,
- *    dont remove it
- * 3. Remove the dir from the main cache and the didname index
- * 4. Free the struct dir structure and all its members
+ * @brief Account a cache hit
+ *
+ * Entries on probation are promoted, protected ones get their reference bit set.
  */
-static void dircache_evict(void)
+static void dircache_touch(struct dir *dir)
+{
+	if (dir->dcache_queue == DCACHE_PROBATION) {
+		dcq_unlink(dir);
+		dir->dcache_ref = 0;
+		dcq_append(dir, DCACHE_PROTECTED);
+		dircache_stat.promoted++;
+	} else {
+		dir->dcache_ref = 1;
+	}
+}
+
+/*!
+ * @brief Remove entries from the cache and indexes until at most maxcount are left
+ *
+ * 1. If probation holds more than its share or nothing is protected, take the
+ *    oldest entry on probation
+ * 2. If it's curdir requeue it, dont remove it
+ * 3. Remember its ghost, remove the dir from the main cache, the didname
+ *    index and its queue and free the struct dir structure and all its members
+ * 4. Otherwise advance the clock hand over the protected queue: a referenced
+ *    entry gets another round, an unreferenced one is demoted to probation
+ */
+static void dircache_evict(unsigned int maxcount)
 {
-	int i = DIRCACHE_FREE_QUANTUM;
 	struct dir *dir;
+	u_int32_t hash;
 
 	LOG(log_debug, logtype_afpd,
 	    "dircache: {starting cache eviction}");
 
-	while (i--) {
-		if ((dir = (struct dir *) dequeue(index_queue)) == NULL) {	/* 1 */
-			dircache_dump();
-			AFP_PANIC("dircache_evict");
-		}
-		queue_count--;
-
-		if (curdir == dir) {	/* 2 */
-			if ((dir->qidx_node =
-			     enqueue(index_queue, dir)) == NULL) {
+	while (dircache.count > maxcount) {
+		if (queue_probation.count >
+		    dircache_maxsize / DIRCACHE_PROBATION_SHARE
+		    || queue_protected.count == 0) {
+			if ((dir = queue_probation.head) == NULL) {	/* 1 */
 				dircache_dump();
 				AFP_PANIC("dircache_evict");
 			}
-			queue_count++;
-			continue;
+			if (curdir == dir) {	/* 2 */
+				dcq_unlink(dir);
+				dcq_append(dir, DCACHE_PROBATION);
+				if (queue_protected.count == 0
+				    && queue_probation.count == 1)
+					break;
+				continue;
+			}
+			hash = hash_vid_did(dir);	/* 3 */
+			ghosts[hash & ghost_mask] = hash;
+			dircache_remove(NULL, dir, DIRCACHE_ALL);
+			dir_free(dir);
+			dircache_stat.evicted++;
+		} else {
+			dir = queue_protected.head;	/* 4 */
+			dcq_unlink(dir);
+			if (dir->dcache_ref) {
+				dir->dcache_ref = 0;
+				dcq_append(dir, DCACHE_PROTECTED);
+			} else {
+				dcq_append(dir, DCACHE_PROBATION);
+				dircache_stat.demoted++;
+				adapt_demoted++;
+			}
 		}
-
-		dircache_remove(NULL, dir, DIRCACHE | DIDNAME_INDEX);	/* 3 */
-		dir_free(dir);	/* 4 */
 	}
 
-	AFP_ASSERT(queue_count == dircache->hash_nodecount);
-	dircache_stat.evicted += DIRCACHE_FREE_QUANTUM;
 	LOG(log_debug, logtype_afpd,
 	    "dircache: {finished cache eviction}");
 }
 
+/*!
+ * @brief Is the system short of memory?
+ *
+ * On Linux MemAvailable from /proc/meminfo includes the page cache that can be
+ * dropped, elsewhere we only know the free pages.
+ */
+static int mem_pressure(void)
+{
+#if defined(__linux__)
+	FILE *fp;
+	char line[128];
+	unsigned long long val, total = 0, avail = 0;
+
+	if ((fp = fopen("/proc/meminfo", "r")) == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "MemTotal: %llu", &val) == 1) {
+			total = val;
+		} else if (sscanf(line, "MemAvailable: %llu", &val) == 1) {
+			avail = val;
+			break;
+		}
+	}
+	fclose(fp);
+	return total && avail && avail < total / DIRCACHE_MEM_LOW;
+#elif defined(_SC_PHYS_PAGES) && defined(_SC_AVPHYS_PAGES)
+	long total = sysconf(_SC_PHYS_PAGES);
+	long avail = sysconf(_SC_AVPHYS_PAGES);
+
+	return total > 0 && avail >= 0 && avail < total / DIRCACHE_MEM_LOW;
+#else
+	return 0;
+#endif
+}
+
+/*!
+ * @brief Adjust the size limit of the cache
+ *
+ * 1. Under memory pressure halve the limit, not below DIRCACHE_MIN_SIZE
+ * 2. Without pressure go back to the configured size
+ * 3. If the clock hand demoted or ghosts brought back more than a quarter of
+ *    the entries added since the last call, the entries in use don't fit:
+ *    double the limit
+ * 4. After shrinking, evict what's above the limit and give back table memory
+ */
+static void dircache_adapt(void)
+{
+	unsigned int limit = dircache_maxsize;
+
+	if (mem_pressure()) {	/* 1 */
+		if (limit > DIRCACHE_MIN_SIZE)
+			limit /= 2;
+	} else if (limit < dircache_basesize) {	/* 2 */
+		limit *= 2;
+	} else if (adapt_demoted + adapt_readded > adapt_added / 4	/* 3 */
+		   && limit < dircache_basesize * DIRCACHE_MAX_GROWTH
+		   && limit < MAX_POSSIBLE_DIRCACHE_SIZE) {
+		limit *= 2;
+	}
+	adapt_added = adapt_demoted = adapt_readded = 0;
+
+	if (limit == dircache_maxsize || ghosts_init(limit) != 0)
+		return;
+
+	LOG(log_info, logtype_afpd,
+	    "dircache: size limit %u -> %u entries, %u cached",
+	    dircache_maxsize, limit, dircache.count);
+
+	if (limit > dircache_maxsize) {
+		dircache_maxsize = limit;
+		dircache_stat.grown++;
+		return;
+	}
+
+	dircache_maxsize = limit;	/* 4 */
+	dircache_stat.shrunk++;
+	dircache_evict(limit);
+	table_trim(&dircache);
+	table_trim(&index_didname);
+}
+
 
 /********************************************************
  * Interface
@@ -305,7 +632,6 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
 	struct dir *cdir = NULL;
 	struct dir key;
 	struct stat st;
-	hnode_t *hn;
 
 	AFP_ASSERT(vol);
 	AFP_ASSERT(ntohl(cnid) >= CNID_START);
@@ -313,8 +639,8 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
 	dircache_stat.lookups++;
 	key.d_vid = vol->v_vid;
 	key.d_did = cnid;
-	if ((hn = hash_lookup(dircache, &key)))
-		cdir = hnode_get(hn);
+	cdir = table_lookup(&dircache, hash_vid_did(&key), &key,
+			    hash_comp_vid_did);
 
 	if (cdir) {
 		if (cdir->d_flags & DIRF_ISFILE) {	/* (1) */
@@ -348,6 +674,7 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
 		LOG(log_debug, logtype_afpd,
 		    "dircache(cnid:%u): {cached: path:\"%s\"}",
 		    ntohl(cnid), cfrombstr(cdir->d_fullpath));
+		dircache_touch(cdir);
 		dircache_stat.hits++;
 	} else {
 		LOG(log_debug, logtype_afpd,
@@ -378,8 +705,6 @@ struct dir *dircache_search_by_name(const struct vol *vol,
 	struct dir *cdir = NULL;
 	struct dir key;
 	struct stat st;
-
-	hnode_t *hn;
 	static_bstring uname = { -1, len, (unsigned char *) name };
 
 	AFP_ASSERT(vol);
@@ -398,8 +723,8 @@ struct dir *dircache_search_by_name(const struct vol *vol,
 		key.d_pdid = dir->d_did;
 		key.d_u_name = &uname;
 
-		if ((hn = hash_lookup(index_didname, &key)))
-			cdir = hnode_get(hn);
+		cdir = table_lookup(&index_didname, hash_didname(&key),
+				    &key, hash_comp_didname);
 	}
 
 	if (cdir) {
@@ -428,6 +753,7 @@ struct dir *dircache_search_by_name(const struct vol *vol,
 		LOG(log_debug, logtype_afpd,
 		    "dircache(did:%u,\"%s\"): {found in cache}",
 		    ntohl(dir->d_did), name);
+		dircache_touch(cdir);
 		dircache_stat.hits++;
 	} else {
 		LOG(log_debug, logtype_afpd,
@@ -439,6 +765,31 @@ struct dir *dircache_search_by_name(const struct vol *vol,
 	return cdir;
 }
 
+/*!
+ * @brief Check whether the did/name index has an entry for name
+ *
+ * Unlike dircache_search_by_name() the entry isn't validated, this is only
+ * a hint for callers that want to skip work for objects already cached.
+ *
+ * @returns 1 if found, 0 if not
+ */
+int dircache_has_name(const struct vol *vol, const struct dir *dir,
+		      char *name, int len)
+{
+	struct dir key;
+	static_bstring uname = { -1, len, (unsigned char *) name };
+
+	if (dir->d_did == DIRDID_ROOT_PARENT)
+		return 0;
+
+	key.d_vid = vol->v_vid;
+	key.d_pdid = dir->d_did;
+	key.d_u_name = &uname;
+
+	return table_lookup(&index_didname, hash_didname(&key), &key,
+			    hash_comp_didname) != NULL;
+}
+
 /*!
  * @brief create struct dir from struct path
  *
@@ -451,18 +802,23 @@ struct dir *dircache_search_by_name(const struct vol *vol,
 int dircache_add(const struct vol *vol, struct dir *dir)
 {
 	struct dir key;
-	hnode_t *hn;
+	struct dir *cdir;
+	u_int32_t hash;
 
 	AFP_ASSERT(dir);
 	AFP_ASSERT(ntohl(dir->d_pdid) >= 2);
 	AFP_ASSERT(ntohl(dir->d_did) >= CNID_START);
 	AFP_ASSERT(dir->d_u_name);
 	AFP_ASSERT(dir->d_vid);
-	AFP_ASSERT(dircache->hash_nodecount <= dircache_maxsize);
+	AFP_ASSERT(dircache.count <= dircache_maxsize);
+
+	/* Check whether the size limit should change */
+	if (++adapt_added >= DIRCACHE_ADAPT_INTERVAL)
+		dircache_adapt();
 
 	/* Check if cache is full */
-	if (dircache->hash_nodecount == dircache_maxsize)
-		dircache_evict();
+	if (dircache.count >= dircache_maxsize)
+		dircache_evict(dircache_maxsize - 1);
 
 	/* 
 	 * Make sure we don't add duplicates
@@ -471,46 +827,55 @@ int dircache_add(const struct vol *vol, struct dir *dir)
 	/* Search primary cache by CNID */
 	key.d_vid = dir->d_vid;
 	key.d_did = dir->d_did;
-	if ((hn = hash_lookup(dircache, &key))) {
+	if ((cdir = table_lookup(&dircache, hash_vid_did(&key), &key,
+				 hash_comp_vid_did))) {
 		/* Found an entry with the same CNID, delete it */
-		dir_remove(vol, hnode_get(hn));
+		dir_remove(vol, cdir);
 		dircache_stat.expunged++;
 	}
 	key.d_vid = vol->v_vid;
 	key.d_pdid = dir->d_pdid;
 	key.d_u_name = dir->d_u_name;
-	if ((hn = hash_lookup(index_didname, &key))) {
+	if ((cdir = table_lookup(&index_didname, hash_didname(&key), &key,
+				 hash_comp_didname))) {
 		/* Found an entry with the same DID/name, delete it */
-		dir_remove(vol, hnode_get(hn));
+		dir_remove(vol, cdir);
 		dircache_stat.expunged++;
 	}
 
 	/* Add it to the main dircache */
-	if (hash_alloc_insert(dircache, dir, dir) == 0) {
+	if (table_insert(&dircache, hash_vid_did(dir), dir) != 0) {
 		dircache_dump();
 		exit(EXITERR_SYS);
 	}
 
 	/* Add it to the did/name index */
-	if (hash_alloc_insert(index_didname, dir, dir) == 0) {
+	if (table_insert(&index_didname, hash_didname(dir), dir) != 0) {
 		dircache_dump();
 		exit(EXITERR_SYS);
 	}
 
-	/* Add it to the fifo queue index */
-	if ((dir->qidx_node = enqueue(index_queue, dir)) == NULL) {
-		dircache_dump();
-		exit(EXITERR_SYS);
+	/* New entries start on probation, unless they've been evicted too early */
+	dir->dcache_ref = 0;
+	hash = hash_vid_did(dir);
+	if (ghosts[hash & ghost_mask] == hash) {
+		ghosts[hash & ghost_mask] = 0;
+		dcq_append(dir, DCACHE_PROTECTED);
+		dircache_stat.readded++;
+		adapt_readded++;
 	} else {
-		queue_count++;
+		dcq_append(dir, DCACHE_PROBATION);
 	}
 
 	dircache_stat.added++;
 	LOG(log_debug, logtype_afpd, "dircache(did:%u,'%s'): {added}",
 	    ntohl(dir->d_did), cfrombstr(dir->d_u_name));
 
-	AFP_ASSERT(queue_count == index_didname->hash_nodecount
-		   && queue_count == dircache->hash_nodecount);
+	/* Let the other afpd children know */
+	dircache_shm_add(vol, dir);
+
+	AFP_ASSERT(queue_probation.count + queue_protected.count ==
+		   dircache.count && dircache.count == index_didname.count);
 
 	return 0;
 }
@@ -523,57 +888,52 @@ int dircache_add(const struct vol *vol, struct dir *dir)
   */
 void dircache_remove(const struct vol *vol _U_, struct dir *dir, int flags)
 {
-	hnode_t *hn;
-
 	AFP_ASSERT(dir);
 	AFP_ASSERT((flags & ~(QUEUE_INDEX | DIDNAME_INDEX | DIRCACHE)) ==
 		   0);
 
 	if (flags & QUEUE_INDEX) {
-		/* remove it from the queue index */
-		dequeue(dir->qidx_node->prev);	/* this effectively deletes the dequeued node */
-		queue_count--;
+		/* remove it from its replacement queue */
+		AFP_ASSERT(dir->dcache_queue != DCACHE_NOQUEUE);
+		dcq_unlink(dir);
 	}
 
 	if (flags & DIDNAME_INDEX) {
-		if ((hn = hash_lookup(index_didname, dir)) == NULL) {
+		if (table_delete(&index_didname, hash_didname(dir), dir) != 0) {
 			LOG(log_error, logtype_afpd,
 			    "dircache_remove(%u,\"%s\"): not in didname index",
 			    ntohl(dir->d_did), cfrombstr(dir->d_u_name));
 			dircache_dump();
 			AFP_PANIC("dircache_remove");
 		}
-		hash_delete_free(index_didname, hn);
 	}
 
 	if (flags & DIRCACHE) {
-		if ((hn = hash_lookup(dircache, dir)) == NULL) {
+		if (table_delete(&dircache, hash_vid_did(dir), dir) != 0) {
 			LOG(log_error, logtype_afpd,
 			    "dircache_remove(%u,\"%s\"): not in dircache",
 			    ntohl(dir->d_did), cfrombstr(dir->d_u_name));
 			dircache_dump();
 			AFP_PANIC("dircache_remove");
 		}
-		hash_delete_free(dircache, hn);
 	}
 
 	LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {removed}",
 	    ntohl(dir->d_did), cfrombstr(dir->d_u_name));
 
 	dircache_stat.removed++;
-	AFP_ASSERT(queue_count == index_didname->hash_nodecount
-		   && queue_count == dircache->hash_nodecount);
+	AFP_ASSERT(queue_probation.count + queue_protected.count ==
+		   dircache.count && dircache.count == index_didname.count);
 }
 
 /*!
  * @brief Initialize the dircache and indexes
  *
- * This is called in child afpd initialisation. The maximum cache size will be
- * max(DEFAULT_MAX_DIRCACHE_SIZE, min(size, MAX_POSSIBLE_DIRCACHE_SIZE)).
+ * This is called in child afpd initialisation. The configured cache size will be
+ * max(DEFAULT_MAX_DIRCACHE_SIZE, min(size, MAX_POSSIBLE_DIRCACHE_SIZE)), the
+ * limit is adjusted from there at runtime by dircache_adapt().
  * It initializes a hashtable which we use to store a directory cache in.
- * It also initializes two indexes:
- * - a DID/name index on the main dircache
- * - a queue index on the dircache
+ * It also initializes a DID/name index on the main dircache.
  *
  * @param size   (r) requested maximum size from afpd.conf
  *
@@ -590,9 +950,9 @@ int dircache_init(int reqsize)
 		       && (dircache_maxsize < reqsize))
 			dircache_maxsize *= 2;
 	}
-	if ((dircache =
-	     hash_create(dircache_maxsize, hash_comp_vid_did,
-			 hash_vid_did)) == NULL)
+	dircache_basesize = dircache_maxsize;
+	if (table_init(&dircache, DCACHE_TABLE_MIN) != 0
+	    || ghosts_init(dircache_maxsize) != 0)
 		return -1;
 
 	LOG(log_debug, logtype_afpd,
@@ -600,16 +960,12 @@ int dircache_init(int reqsize)
 	    dircache_maxsize);
 
 	/* Initialize did/name index hashtable */
-	if ((index_didname =
-	     hash_create(dircache_maxsize, hash_comp_didname,
-			 hash_didname)) == NULL)
+	if (table_init(&index_didname, DCACHE_TABLE_MIN) != 0)
 		return -1;
 
-	/* Initialize index queue */
-	if ((index_queue = queue_init()) == NULL)
-		return -1;
-	else
-		queue_count = 0;
+	/* the rest is per process, a worker afpd comes here for every session */
+	if (invalid_dircache_entries != NULL)
+		return 0;
 
 	/* Initialize index queue */
 	if ((invalid_dircache_entries = queue_init()) == NULL)
@@ -625,6 +981,118 @@ int dircache_init(int reqsize)
 	return 0;
 }
 
+/*!
+ * @brief Free the cache and the directories in it
+ *
+ * A worker afpd does this when a session ends, see session.c
+ */
+static void dircache_free(void)
+{
+	u_int32_t i;
+
+	for (i = 0; dircache.slots && i <= dircache.mask; i++)
+		if (dircache.slots[i].dir)
+			dir_free(dircache.slots[i].dir);
+	free(dircache.slots);
+	free(index_didname.slots);
+	free(ghosts);
+	memset(&dircache, 0, sizeof(dircache));
+	memset(&index_didname, 0, sizeof(index_didname));
+	memset(&queue_probation, 0, sizeof(queue_probation));
+	memset(&queue_protected, 0, sizeof(queue_protected));
+	ghosts = NULL;
+}
+
+void dircache_session_vars(void)
+{
+	session_var(&dircache, sizeof(dircache));
+	session_var(&dircache_maxsize, sizeof(dircache_maxsize));
+	session_var(&dircache_basesize, sizeof(dircache_basesize));
+	session_var(&queue_probation, sizeof(queue_probation));
+	session_var(&queue_protected, sizeof(queue_protected));
+	session_var(&ghosts, sizeof(ghosts));
+	session_var(&ghost_mask, sizeof(ghost_mask));
+	session_var(&adapt_added, sizeof(adapt_added));
+	session_var(&adapt_demoted, sizeof(adapt_demoted));
+	session_var(&adapt_readded, sizeof(adapt_readded));
+	session_var(&dircache_stat, sizeof(dircache_stat));
+	session_var(&index_didname, sizeof(index_didname));
+	session_cleanup(dircache_free);
+}
+
+/*!
+ * @brief Log dircache statistics
+ */
+void log_dircache_stat(void)
+{
+	struct slab_stat dirs, names;
+
+	LOG(log_info, logtype_afpd,
+	    "dircache statistics: "
+	    "entries: %u (probation: %u, protected: %u), limit: %u, "
+	    "lookups: %llu, hits: %llu, misses: %llu, "
+	    "added: %llu, removed: %llu, expunged: %llu, evicted: %llu, "
+	    "promoted: %llu, demoted: %llu, readded: %llu, "
+	    "grown: %llu, shrunk: %llu",
+	    dircache.count, queue_probation.count, queue_protected.count,
+	    dircache_maxsize,
+	    (unsigned long long) dircache_stat.lookups,
+	    (unsigned long long) dircache_stat.hits,
+	    (unsigned long long) dircache_stat.misses,
+	    (unsigned long long) dircache_stat.added,
+	    (unsigned long long) dircache_stat.removed,
+	    (unsigned long long) dircache_stat.expunged,
+	    (unsigned long long) dircache_stat.evicted,
+	    (unsigned long long) dircache_stat.promoted,
+	    (unsigned long long) dircache_stat.demoted,
+	    (unsigned long long) dircache_stat.readded,
+	    (unsigned long long) dircache_stat.grown,
+	    (unsigned long long) dircache_stat.shrunk);
+
+	dir_alloc_stat(&dirs, &names);
+	LOG(log_info, logtype_afpd,
+	    "dircache memory: dirs: %u in %u chunks, names: %u in %u chunks",
+	    dirs.inuse, dirs.chunks, names.inuse, names.chunks);
+	log_dircache_shm_stat();
+}
+
+static void dump_dir(FILE *dump, int i, const struct dir *dir)
+{
+	fprintf(dump, "%05u: %3u  %6u  %6u %s%s   %s\n",
+		i,
+		ntohs(dir->d_vid),
+		ntohl(dir->d_pdid),
+		ntohl(dir->d_did),
+		dir->d_flags & DIRF_ISFILE ? "f" : "d",
+		dir->dcache_ref ? "r" : " ",
+		cfrombstr(dir->d_fullpath));
+}
+
+static void dump_table(FILE *dump, const struct dc_table *t)
+{
+	u_int32_t n;
+	int i = 1;
+
+	fprintf(dump, "       VID     DID    CNID STAT PATH\n");
+	fprintf(dump,
+		"====================================================================\n");
+	for (n = 0; n <= t->mask; n++)
+		if (t->slots[n].dir)
+			dump_dir(dump, i++, t->slots[n].dir);
+}
+
+static void dump_queue(FILE *dump, const struct dc_queue *q)
+{
+	const struct dir *dir;
+	int i = 1;
+
+	fprintf(dump, "       VID     DID    CNID STAT PATH\n");
+	fprintf(dump,
+		"====================================================================\n");
+	for (dir = q->head; dir && i <= q->count; dir = dir->dcache_next)
+		dump_dir(dump, i++, dir);
+}
+
 /*!
  * @brief Dump dircache to /tmp/dircache.PID
  */
@@ -632,11 +1100,6 @@ void dircache_dump(void)
 {
 	char tmpnam[64];
 	FILE *dump;
-	qnode_t *n = index_queue->next;
-	hnode_t *hn;
-	hscan_t hs;
-	const struct dir *dir;
-	int i;
 
 	LOG(log_warning, logtype_afpd, "Dumping directory cache...");
 
@@ -648,63 +1111,33 @@ void dircache_dump(void)
 	}
 	setbuf(dump, NULL);
 
-	fprintf(dump, "Number of cache entries in LRU queue: %lu\n",
-		queue_count);
-	fprintf(dump, "Configured maximum cache size: %u\n\n",
-		dircache_maxsize);
+	fprintf(dump, "Number of cache entries: %u (probation: %u, protected: %u)\n",
+		dircache.count, queue_probation.count, queue_protected.count);
+	fprintf(dump, "Configured maximum cache size: %u, current limit: %u\n",
+		dircache_basesize, dircache_maxsize);
+	fprintf(dump, "Hashtable slots: %u, %u\n",
+		dircache.mask + 1, index_didname.mask + 1);
+	fprintf(dump, "Lookups: %llu, hits: %llu, misses: %llu, evicted: %llu, "
+		"promoted: %llu, demoted: %llu, readded: %llu\n\n",
+		(unsigned long long) dircache_stat.lookups,
+		(unsigned long long) dircache_stat.hits,
+		(unsigned long long) dircache_stat.misses,
+		(unsigned long long) dircache_stat.evicted,
+		(unsigned long long) dircache_stat.promoted,
+		(unsigned long long) dircache_stat.demoted,
+		(unsigned long long) dircache_stat.readded);
 
 	fprintf(dump, "Primary CNID index:\n");
-	fprintf(dump, "       VID     DID    CNID STAT PATH\n");
-	fprintf(dump,
-		"====================================================================\n");
-	hash_scan_begin(&hs, dircache);
-	i = 1;
-	while ((hn = hash_scan_next(&hs))) {
-		dir = hnode_get(hn);
-		fprintf(dump, "%05u: %3u  %6u  %6u %s    %s\n",
-			i++,
-			ntohs(dir->d_vid),
-			ntohl(dir->d_pdid),
-			ntohl(dir->d_did),
-			dir->d_flags & DIRF_ISFILE ? "f" : "d",
-			cfrombstr(dir->d_fullpath));
-	}
+	dump_table(dump, &dircache);
 
 	fprintf(dump, "\nSecondary DID/name index:\n");
-	fprintf(dump, "       VID     DID    CNID STAT PATH\n");
-	fprintf(dump,
-		"====================================================================\n");
-	hash_scan_begin(&hs, index_didname);
-	i = 1;
-	while ((hn = hash_scan_next(&hs))) {
-		dir = hnode_get(hn);
-		fprintf(dump, "%05u: %3u  %6u  %6u %s    %s\n",
-			i++,
-			ntohs(dir->d_vid),
-			ntohl(dir->d_pdid),
-			ntohl(dir->d_did),
-			dir->d_flags & DIRF_ISFILE ? "f" : "d",
-			cfrombstr(dir->d_fullpath));
-	}
+	dump_table(dump, &index_didname);
 
-	fprintf(dump, "\nLRU Queue:\n");
-	fprintf(dump, "       VID     DID    CNID STAT PATH\n");
-	fprintf(dump,
-		"====================================================================\n");
+	fprintf(dump, "\nProtected queue (r: referenced):\n");
+	dump_queue(dump, &queue_protected);
 
-	for (i = 1; i <= queue_count; i++) {
-		if (n == index_queue)
-			break;
-		dir = (struct dir *) n->data;
-		fprintf(dump, "%05u: %3u  %6u  %6u %s    %s\n",
-			i,
-			ntohs(dir->d_vid),
-			ntohl(dir->d_pdid),
-			ntohl(dir->d_did),
-			dir->d_flags & DIRF_ISFILE ? "f" : "d",
-			cfrombstr(dir->d_fullpath));
-		n = n->next;
-	}
+	fprintf(dump, "\nProbation queue:\n");
+	dump_queue(dump, &queue_probation);
 
 	fprintf(dump, "\n");
 	fflush(dump);
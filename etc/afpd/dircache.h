@@ -16,6 +16,7 @@
 #define DIRCACHE_H
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <atalk/volume.h>
 #include <atalk/directory.h>
@@ -23,7 +24,15 @@
 /* Maximum size of the dircache hashtable */
 #define DEFAULT_MAX_DIRCACHE_SIZE 8192
 #define MAX_POSSIBLE_DIRCACHE_SIZE 131072
-#define DIRCACHE_FREE_QUANTUM 256
+
+/* Runtime adjustment of the size limit, see dircache_adapt() */
+#define DIRCACHE_MIN_SIZE 1024
+#define DIRCACHE_MAX_GROWTH 4           /* times the configured size */
+#define DIRCACHE_ADAPT_INTERVAL 1024    /* additions */
+#define DIRCACHE_MEM_LOW 16             /* pressure below 1/16 of RAM available */
+
+/* probation may use 1/n of the entries before eviction prefers it */
+#define DIRCACHE_PROBATION_SHARE 4
 
 /* flags for dircache_remove */
 #define DIRCACHE      (1 << 0)
@@ -36,6 +45,15 @@ extern int        dircache_add(const struct vol *, struct dir *);
 extern void       dircache_remove(const struct vol *, struct dir *, int flag);
 extern struct dir *dircache_search_by_did(const struct vol *vol, cnid_t did);
 extern struct dir *dircache_search_by_name(const struct vol *, const struct dir *dir, char *name, int len);
+extern int        dircache_has_name(const struct vol *, const struct dir *dir, char *name, int len);
 extern void       dircache_dump(void);
 extern void       log_dircache_stat(void);
+
+/* shared dircache, dircache_shm.c */
+extern int        dircache_shm_init(int entries);
+extern cnid_t     dircache_shm_search_by_name(const struct vol *, cnid_t pdid, const char *name, int len, const struct stat *st);
+extern char       *dircache_shm_search_by_did(const struct vol *, cnid_t did, cnid_t *pdid, char *buf, size_t buflen, ino_t *ino, time_t *ctime);
+extern void       dircache_shm_stale(void);
+extern void       dircache_shm_add(const struct vol *, const struct dir *);
+extern void       log_dircache_shm_stat(void);
 #endif /* DIRCACHE_H */
@@ -0,0 +1,466 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * The directory cache shared by all afpd children, see below.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <atalk/util.h>
+#include <atalk/cnid.h>
+#include <atalk/logger.h>
+#include <atalk/volume.h>
+#include <atalk/directory.h>
+#include <atalk/bstrlib.h>
+#include <atalk/bstradd.h>
+
+#include "dircache.h"
+
+/*
+ * Shared Directory Cache
+ * ======================
+ *
+ * The dircache in dircache.c is private to every afpd child, so many sessions
+ * browsing the same volume each query cnid_dbd for the same CNIDs. The shared
+ * dircache is a second level cache behind it, visible to all children:
+ *
+ * - the afpd master maps it MAP_SHARED before the first child is forked, every
+ *   child inherits the mapping
+ * - it consists of two fixed size, 4-way set associative tables:
+ *   (volume, parent DID, name) -> CNID is consulted by get_id() before cnid_add()
+ *   (volume, DID) -> parent DID, name is consulted by dirlookup() before cnid_resolve()
+ * - every entry is protected by its own sequence counter (a seqlock), readers never
+ *   block and discard entries that change while they copy them, writers that find
+ *   an entry being written by someone else take another way of the set or don't
+ *   cache. An entry left half written by a child that died is taken over by the
+ *   next writer
+ * - entries are filled from dircache_add(), so everything that enters a private
+ *   cache is published to all other children
+ *
+ * Volumes are identified by a hash of their path, because volume ids are handed out
+ * per process. Only volumes with a persistent CNID backend (dbd) are cached, as
+ * CNIDs of the other backends are not the same in every process.
+ *
+ * Like in the private cache every hit is validated against a fresh stat of the
+ * object: inode and st_ctime must match the values stored when the entry was
+ * added, otherwise the entry is ignored and the CNID database is asked.
+ */
+
+#define DCSHM_MAGIC      0x44435348	/* "DCSH" */
+#define DCSHM_WAYS       4
+#define DCSHM_MAXNAME    86	/* makes an entry 128 bytes */
+#define DCSHM_MIN_SIZE   4096
+#define DCSHM_MAX_SIZE   (1 << 20)
+
+#define DCSHM_ISFILE     (1 << 0)
+
+struct dcshm_entry {
+	volatile u_int64_t seq;	/* SEQ(), 0 if never used */
+	cnid_t did;
+	cnid_t pdid;
+	u_int64_t vkey;
+	u_int64_t ino;
+	int64_t ctime;
+	u_int8_t flags;
+	u_int8_t namelen;
+	char name[DCSHM_MAXNAME];	/* not terminated */
+};
+
+/* what entry_write() copies */
+#define DCSHM_DATA  offsetof(struct dcshm_entry, did)
+
+/* the count is odd while the entry is being written, the pid is the writer's */
+#define SEQ(pid, count)  (((u_int64_t) (pid) << 32) | (u_int32_t) (count))
+#define SEQ_PID(seq)     ((pid_t) ((seq) >> 32))
+
+struct dcshm_header {
+	u_int32_t magic;
+	u_int32_t nsets;	/* sets per table, power of 2 */
+};
+
+static struct dcshm_header *dcshm;
+static struct dcshm_entry *table_name;	/* (vkey, pdid, name) */
+static struct dcshm_entry *table_did;	/* (vkey, did) */
+static u_int32_t dcshm_mask;
+static unsigned int dcshm_victim;
+
+static struct dcshm_stat {
+	u_int64_t lookups;
+	u_int64_t hits;
+	u_int64_t misses;
+	u_int64_t stale;
+	u_int64_t added;
+	u_int64_t busy;
+} dcshm_stat;
+
+/* FNV 1a, 64 bit */
+#define FNV64_INIT  0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+static u_int64_t fnv64(u_int64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= FNV64_PRIME;
+	}
+	return hash;
+}
+
+static int vol_shareable(const struct vol *vol)
+{
+	return vol->v_cdb && (vol->v_cdb->flags & CNID_FLAG_PERSISTENT);
+}
+
+static u_int64_t vol_key(const struct vol *vol)
+{
+	return fnv64(FNV64_INIT, vol->v_path, strlen(vol->v_path));
+}
+
+static struct dcshm_entry *set_by_name(u_int64_t vkey, cnid_t pdid,
+				       const char *name, int len)
+{
+	u_int64_t hash;
+
+	hash = fnv64(vkey, &pdid, sizeof(pdid));
+	hash = fnv64(hash, name, len);
+	return &table_name[(((hash >> 32) ^ hash) & dcshm_mask) * DCSHM_WAYS];
+}
+
+static struct dcshm_entry *set_by_did(u_int64_t vkey, cnid_t did)
+{
+	u_int64_t hash;
+
+	hash = fnv64(vkey, &did, sizeof(did));
+	return &table_did[(((hash >> 32) ^ hash) & dcshm_mask) * DCSHM_WAYS];
+}
+
+/*!
+ * @brief Copy an entry, seqlock read side
+ *
+ * @returns 0 if a consistent copy of a used entry was made, -1 otherwise
+ */
+static int entry_read(const struct dcshm_entry *e, struct dcshm_entry *copy)
+{
+	u_int64_t seq = e->seq;
+
+	if (seq == 0 || (seq & 1))
+		return -1;
+	__sync_synchronize();
+	memcpy(copy, (const void *) e, sizeof(*copy));
+	__sync_synchronize();
+	if (e->seq != seq)
+		return -1;
+	return 0;
+}
+
+/*!
+ * @brief Whether the writer of an odd entry died while writing it
+ */
+static int entry_stuck(u_int64_t seq)
+{
+	pid_t pid = SEQ_PID(seq);
+
+	/* ours: an earlier process with our pid, we don't write two entries
+	 * at once */
+	if (pid <= 0 || pid == getpid())
+		return 1;
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/*!
+ * @brief Overwrite an entry, seqlock write side
+ *
+ * Never waits: if another process is just writing the entry, we fail.
+ * An entry a dead writer left odd is taken over, the count moves on by 2
+ * and stays odd until we're done.
+ *
+ * @returns 0 if the entry was written, -1 if it's busy
+ */
+static int entry_write(struct dcshm_entry *e, const struct dcshm_entry *new)
+{
+	u_int64_t seq = e->seq, next;
+	u_int32_t count = seq;
+	pid_t pid = getpid();
+
+	if ((seq & 1) && !entry_stuck(seq))
+		return -1;
+	count += (seq & 1) ? 2 : 1;
+	next = SEQ(pid, count);
+	if (!__sync_bool_compare_and_swap(&e->seq, seq, next))
+		return -1;
+	memcpy((char *) e + DCSHM_DATA, (const char *) new + DCSHM_DATA,
+	       sizeof(*e) - DCSHM_DATA);
+	__sync_synchronize();
+	e->seq = SEQ(pid, count + 1);
+	dcshm_stat.added++;
+	return 0;
+}
+
+/*!
+ * @brief Put a new entry into a way of a set
+ *
+ * An entry with the same key is overwritten. Else an unused or stuck way
+ * is taken, else one is evicted round robin. Ways that are being written
+ * are passed over.
+ */
+static void set_put(struct dcshm_entry *set, const struct dcshm_entry *new,
+		    int by_name)
+{
+	struct dcshm_entry copy;
+	u_int64_t seq;
+	int i, n, spare = -1;
+
+	for (i = 0; i < DCSHM_WAYS; i++) {
+		seq = set[i].seq;
+		if (seq == 0 || ((seq & 1) && entry_stuck(seq))) {
+			if (spare == -1)
+				spare = i;
+			continue;
+		}
+		if (entry_read(&set[i], &copy) != 0 || copy.vkey != new->vkey)
+			continue;
+		if (by_name) {
+			if (copy.pdid != new->pdid || copy.namelen != new->namelen
+			    || memcmp(copy.name, new->name, new->namelen) != 0)
+				continue;
+		} else if (copy.did != new->did) {
+			continue;
+		}
+		/* don't dirty the cacheline if nothing changed */
+		if (memcmp((char *) &copy + DCSHM_DATA,
+			   (const char *) new + DCSHM_DATA,
+			   sizeof(copy) - DCSHM_DATA) == 0)
+			return;
+		/* no second entry with the same key */
+		if (entry_write(&set[i], new) != 0)
+			dcshm_stat.busy++;
+		return;
+	}
+	if (spare != -1 && entry_write(&set[spare], new) == 0)
+		return;
+	for (n = 0; n < DCSHM_WAYS; n++) {
+		i = dcshm_victim++ % DCSHM_WAYS;
+		if (i != spare && entry_write(&set[i], new) == 0)
+			return;
+	}
+	dcshm_stat.busy++;
+}
+
+/********************************************************
+ * Interface
+ ********************************************************/
+
+/*!
+ * @brief Create the shared dircache
+ *
+ * Must be called by the afpd master before children are forked, calling it
+ * again once the cache exists does nothing.
+ *
+ * @param entries   (r) requested entries per table, 0 disables the cache
+ *
+ * @returns 0 on success or if disabled, -1 on error
+ */
+int dircache_shm_init(int entries)
+{
+	u_int32_t nentries = DCSHM_MIN_SIZE;
+	size_t tablesize, len;
+	void *p;
+
+	if (entries <= 0 || dcshm)
+		return 0;
+
+	while (nentries < DCSHM_MAX_SIZE && nentries < (u_int32_t) entries)
+		nentries *= 2;
+	tablesize = nentries * sizeof(struct dcshm_entry);
+	len = sizeof(struct dcshm_entry) + 2 * tablesize;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		 -1, 0);
+	if (p == MAP_FAILED) {
+		LOG(log_error, logtype_afpd, "dircache_shm_init: mmap: %s",
+		    strerror(errno));
+		return -1;
+	}
+
+	/* header gets a full entry, so that the tables stay aligned */
+	dcshm = p;
+	dcshm->magic = DCSHM_MAGIC;
+	dcshm->nsets = nentries / DCSHM_WAYS;
+	table_name = (struct dcshm_entry *) p + 1;
+	table_did = table_name + nentries;
+	dcshm_mask = dcshm->nsets - 1;
+
+	LOG(log_info, logtype_afpd,
+	    "dircache_shm_init: shared dircache with 2 x %u entries (%lu KB)",
+	    nentries, (unsigned long) (len / 1024));
+	return 0;
+}
+
+/*!
+ * @brief Search the shared cache for the CNID of an object
+ *
+ * @param vol   (r) volume
+ * @param pdid  (r) CNID of the parent directory
+ * @param name  (r) name (server side encoding)
+ * @param len   (r) strlen of name
+ * @param st    (r) fresh stat of the object
+ *
+ * @returns CNID if found and still valid, else CNID_INVALID
+ */
+cnid_t dircache_shm_search_by_name(const struct vol *vol, cnid_t pdid,
+				   const char *name, int len,
+				   const struct stat *st)
+{
+	struct dcshm_entry *set, copy;
+	u_int64_t vkey;
+	int i;
+
+	if (!dcshm || len > DCSHM_MAXNAME || !vol_shareable(vol))
+		return CNID_INVALID;
+
+	dcshm_stat.lookups++;
+	vkey = vol_key(vol);
+	set = set_by_name(vkey, pdid, name, len);
+
+	for (i = 0; i < DCSHM_WAYS; i++) {
+		if (entry_read(&set[i], &copy) != 0)
+			continue;
+		if (copy.vkey != vkey || copy.pdid != pdid
+		    || copy.namelen != len || memcmp(copy.name, name, len) != 0)
+			continue;
+		if (copy.ino != (u_int64_t) st->st_ino
+		    || copy.ctime != (int64_t) st->st_ctime) {
+			LOG(log_debug, logtype_afpd,
+			    "dircache_shm(did:%u,\"%s\"): {modified}",
+			    ntohl(pdid), name);
+			dcshm_stat.stale++;
+			return CNID_INVALID;
+		}
+		dcshm_stat.hits++;
+		return copy.did;
+	}
+
+	dcshm_stat.misses++;
+	return CNID_INVALID;
+}
+
+/*!
+ * @brief Search the shared cache for a directory by CNID
+ *
+ * The caller must build the path from the parent and name, stat it and compare
+ * the result with ino and ctime before trusting it.
+ *
+ * @param vol    (r) volume
+ * @param did    (r) CNID of the directory
+ * @param pdid   (w) CNID of the parent directory
+ * @param buf    (w) buffer for the name
+ * @param buflen (r) size of buf
+ * @param ino    (w) inode when the entry was added
+ * @param ctime  (w) st_ctime when the entry was added
+ *
+ * @returns name (in buf) if found, else NULL
+ */
+char *dircache_shm_search_by_did(const struct vol *vol, cnid_t did,
+				 cnid_t *pdid, char *buf, size_t buflen,
+				 ino_t *ino, time_t *ctime)
+{
+	struct dcshm_entry *set, copy;
+	u_int64_t vkey;
+	int i;
+
+	if (!dcshm || !vol_shareable(vol))
+		return NULL;
+
+	dcshm_stat.lookups++;
+	vkey = vol_key(vol);
+	set = set_by_did(vkey, did);
+
+	for (i = 0; i < DCSHM_WAYS; i++) {
+		if (entry_read(&set[i], &copy) != 0)
+			continue;
+		if (copy.vkey != vkey || copy.did != did)
+			continue;
+		if (copy.namelen >= buflen)
+			break;
+		memcpy(buf, copy.name, copy.namelen);
+		buf[copy.namelen] = 0;
+		*pdid = copy.pdid;
+		*ino = copy.ino;
+		*ctime = copy.ctime;
+		dcshm_stat.hits++;
+		return buf;
+	}
+
+	dcshm_stat.misses++;
+	return NULL;
+}
+
+/*!
+ * @brief A dircache_search_by_did() hit turned out to be stale
+ */
+void dircache_shm_stale(void)
+{
+	dcshm_stat.hits--;
+	dcshm_stat.stale++;
+}
+
+/*!
+ * @brief Publish a struct dir that has just been added to the private dircache
+ *
+ * Files only go into the name table, directories into both.
+ */
+void dircache_shm_add(const struct vol *vol, const struct dir *dir)
+{
+	struct dcshm_entry new;
+
+	if (!dcshm || blength(dir->d_u_name) > DCSHM_MAXNAME
+	    || !vol_shareable(vol))
+		return;
+
+	memset(&new, 0, sizeof(new));
+	new.did = dir->d_did;
+	new.pdid = dir->d_pdid;
+	new.flags = (dir->d_flags & DIRF_ISFILE) ? DCSHM_ISFILE : 0;
+	new.vkey = vol_key(vol);
+	new.ino = dir->dcache_ino;
+	new.ctime = dir->dcache_ctime;
+	new.namelen = blength(dir->d_u_name);
+	memcpy(new.name, cfrombstr(dir->d_u_name), new.namelen);
+
+	set_put(set_by_name(new.vkey, new.pdid, new.name, new.namelen),
+		&new, 1);
+
+	if (new.flags & DCSHM_ISFILE)
+		return;
+
+	set_put(set_by_did(new.vkey, new.did), &new, 0);
+}
+
+void log_dircache_shm_stat(void)
+{
+	if (!dcshm)
+		return;
+	LOG(log_info, logtype_afpd,
+	    "shared dircache statistics: "
+	    "lookups: %llu, hits: %llu, misses: %llu, stale: %llu, "
+	    "added: %llu, busy: %llu",
+	    (unsigned long long) dcshm_stat.lookups,
+	    (unsigned long long) dcshm_stat.hits,
+	    (unsigned long long) dcshm_stat.misses,
+	    (unsigned long long) dcshm_stat.stale,
+	    (unsigned long long) dcshm_stat.added,
+	    (unsigned long long) dcshm_stat.busy);
+}
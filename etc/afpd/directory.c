@@ -28,6 +28,7 @@
 #include <atalk/bstradd.h>
 #include <atalk/errchk.h>
 #include <atalk/globals.h>
+#include <atalk/slab.h>
 
 #include "directory.h"
 #include "dircache.h"
@@ -39,6 +40,7 @@
 #include "unix.h"
 #include "mangle.h"
 #include "hash.h"
+#include "session.h"
 
 /*
  * FIXMEs, loose ends after the dircache rewrite:
@@ -54,8 +56,8 @@
 int afp_errno;
 /* As long as directory.c hasn't got its own init call, this get initialized in dircache_init */
 struct dir rootParent = {
-	NULL, NULL, NULL, NULL,	/* path, d_m_name, d_u_name, d_m_name_ucs2 */
-	NULL, 0, 0,		/* qidx_node, ctime, d_flags */
+	NULL, NULL, NULL,	/* path, d_m_name, d_u_name */
+	0, 0,			/* ctime, d_flags */
 	0, 0, 0, 0		/* pdid, did, offcnt, d_vid */
 };
 
@@ -81,6 +83,12 @@ struct path Cur_Path = {
  */
 q_t *invalid_dircache_entries;
 
+/*
+ * struct dirs and their names come from slabs, a browsing client creates and
+ * drops them by the million
+ */
+static slab_t *dir_slab;
+
 
 /*******************************************************************************************
  * Locals
@@ -394,7 +402,7 @@ int get_afp_errno(const int param)
  * 1. Check for special CNIDs 0 (invalid), 1 and 2.
  * 2a. Check if the DID is in the cache.
  * 2b. Check if it's really a dir  because we cache files too.
- * 3. If it's not in the cache resolve it via the database.
+ * 3. If it's not in the cache resolve it via the shared dircache or the database.
  * 4. Build complete server-side path to the dir.
  * 5. Check if it exists and is a directory.
  * 6. Create the struct dir and populate it.
@@ -416,6 +424,9 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
 	int buflen = 12 + MAXPATHLEN + 1;
 	int utf8;
 	int err = 0;
+	int shared = 1;
+	ino_t shm_ino;
+	time_t shm_ctime;
 
 	LOG(log_debug, logtype_afpd, "dirlookup(did: %u): START",
 	    ntohl(did));
@@ -471,15 +482,28 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
 
 	utf8 = utf8_encoding();
 
-	/* Get it from the database */
+      resolve:
+	/* Get it from the shared dircache or the database */
 	cnid = did;
-	LOG(log_debug, logtype_afpd,
-	    "dirlookup(did: %u): querying CNID database", ntohl(did));
-	if ((upath =
-	     cnid_resolve(vol->v_cdb, &cnid, buffer, buflen)) == NULL) {
-		afp_errno = AFPERR_NOOBJ;
-		err = 1;
-		goto exit;
+	if (shared
+	    && (upath = dircache_shm_search_by_did(vol, did, &cnid, buffer,
+						    buflen, &shm_ino,
+						    &shm_ctime)) != NULL) {
+		LOG(log_debug, logtype_afpd,
+		    "dirlookup(did: %u): found in shared dircache",
+		    ntohl(did));
+	} else {
+		shared = 0;
+		LOG(log_debug, logtype_afpd,
+		    "dirlookup(did: %u): querying CNID database",
+		    ntohl(did));
+		if ((upath =
+		     cnid_resolve(vol->v_cdb, &cnid, buffer,
+				  buflen)) == NULL) {
+			afp_errno = AFPERR_NOOBJ;
+			err = 1;
+			goto exit;
+		}
 	}
 	if ((upath = strdup(upath)) == NULL) {	/* 3 */
 		afp_errno = AFPERR_NOOBJ;
@@ -514,6 +538,8 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
 	    ntohl(did), cfrombstr(fullpath));
 
 	if (ostat(cfrombstr(fullpath), &st, vol_syml_opt(vol)) != 0) {	/* 5a */
+		if (shared)
+			goto stale;
 		switch (errno) {
 		case ENOENT:
 			afp_errno = AFPERR_NOOBJ;
@@ -530,10 +556,15 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
 		}
 	} else {
 		if (!S_ISDIR(st.st_mode)) {	/* 5b */
+			if (shared)
+				goto stale;
 			afp_errno = AFPERR_BADTYPE;
 			err = 1;
 			goto exit;
 		}
+		if (shared
+		    && (st.st_ino != shm_ino || st.st_ctime != shm_ctime))
+			goto stale;
 	}
 
 	/* Get macname from unix name */
@@ -551,12 +582,27 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
 		err = 1;
 		goto exit;
 	}
+	fullpath = NULL;	/* dir_new() has freed it */
 
 	/* Add it to the cache only if it's a dir */
 	if (dircache_add(vol, ret) != 0) {	/* 7 */
 		err = 1;
 		goto exit;
 	}
+	goto exit;
+
+      stale:
+	/* the shared dircache entry is outdated, ask the database */
+	LOG(log_debug, logtype_afpd,
+	    "dirlookup(did: %u): stale shared dircache entry \"%s\"",
+	    ntohl(did), cfrombstr(fullpath));
+	dircache_shm_stale();
+	free(upath);
+	upath = NULL;
+	bdestroy(fullpath);
+	fullpath = NULL;
+	shared = 0;
+	goto resolve;
 
       exit:
 	if (upath)
@@ -677,11 +723,14 @@ int caseenumerate(const struct vol *vol, struct path *path,
  * @param vol      (r) pointer to struct vol
  * @param pdid     (r) Parent CNID
  * @param did      (r) CNID
- * @param path     (r) Full unix path to object
+ * @param path     (rw) Full unix path to object, consumed on success only
  * @param st       (r) struct stat of object
  *
  * @returns pointer to new struct dir or NULL on error
  *
+ * @note On success dir_new() has freed path, the caller must not touch it
+ *       any more. On error path still belongs to the caller.
+ *
  * @note Most of the time mac name and unix name are the same.
  */
 struct dir *dir_new(const char *m_name,
@@ -690,37 +739,46 @@ struct dir *dir_new(const char *m_name,
 		    cnid_t pdid, cnid_t did, bstring path, struct stat *st)
 {
 	struct dir *dir;
+	bstring fullpath = NULL;
 
-	dir = (struct dir *) calloc(1, sizeof(struct dir));
-	if (!dir)
+	if (dir_slab == NULL
+	    && (dir_slab = slab_create(sizeof(struct dir))) == NULL)
 		return NULL;
 
-	if ((dir->d_m_name = bfromcstr(m_name)) == NULL) {
-		free(dir);
+	if ((dir = slab_alloc(dir_slab)) == NULL)
 		return NULL;
-	}
+	memset(dir, 0, sizeof(struct dir));
 
-	if (convert_string_allocate
-	    ((utf8_encoding())? CH_UTF8_MAC : vol->v_maccharset, CH_UCS2,
-	     m_name, -1, (char **) &dir->d_m_name_ucs2) == (size_t) -1) {
-		LOG(log_error, logtype_afpd,
-		    "dir_new(did: %u) {%s, %s}: couldn't set UCS2 name",
-		    ntohl(did), m_name, u_name);
-		dir->d_m_name_ucs2 = NULL;
+	if ((dir->d_m_name = bslabcstr(m_name, strlen(m_name))) == NULL) {
+		slab_free(dir_slab, dir);
+		return NULL;
 	}
 
 	if (m_name == u_name || !strcmp(m_name, u_name)) {
 		dir->d_u_name = dir->d_m_name;
-	} else if ((dir->d_u_name = bfromcstr(u_name)) == NULL) {
-		bdestroy(dir->d_m_name);
-		free(dir);
+	} else if ((dir->d_u_name =
+		    bslabcstr(u_name, strlen(u_name))) == NULL) {
+		bslabdestroy(dir->d_m_name);
+		slab_free(dir_slab, dir);
 		return NULL;
 	}
 
+	/* the caller's path is only freed on success */
+	if (path
+	    && (fullpath =
+		bslabcstr(cfrombstr(path), blength(path))) == NULL) {
+		if (dir->d_u_name != dir->d_m_name)
+			bslabdestroy(dir->d_u_name);
+		bslabdestroy(dir->d_m_name);
+		slab_free(dir_slab, dir);
+		return NULL;
+	}
+	bdestroy(path);
+
 	dir->d_did = did;
 	dir->d_pdid = pdid;
 	dir->d_vid = vol->v_vid;
-	dir->d_fullpath = path;
+	dir->d_fullpath = fullpath;
 	dir->dcache_ctime = st->st_ctime;
 	dir->dcache_ino = st->st_ino;
 	if (!S_ISDIR(st->st_mode))
@@ -737,13 +795,36 @@ struct dir *dir_new(const char *m_name,
 void dir_free(struct dir *dir)
 {
 	if (dir->d_u_name != dir->d_m_name) {
-		bdestroy(dir->d_u_name);
+		bslabdestroy(dir->d_u_name);
 	}
-	if (dir->d_m_name_ucs2)
-		free(dir->d_m_name_ucs2);
-	bdestroy(dir->d_m_name);
-	bdestroy(dir->d_fullpath);
-	free(dir);
+	bslabdestroy(dir->d_m_name);
+	bslabdestroy(dir->d_fullpath);
+	slab_free(dir_slab, dir);
+}
+
+/*!
+ * @brief Free the struct dirs dir_remove() has queued
+ *
+ * Called between AFP commands, when no one references them anymore.
+ */
+void dir_free_invalid_q(void)
+{
+	struct dir *dir;
+
+	while ((dir = (struct dir *) dequeue(invalid_dircache_entries)))
+		dir_free(dir);
+}
+
+/*!
+ * @brief Get the allocator statistics for struct dirs and their names
+ */
+void dir_alloc_stat(struct slab_stat *dirs, struct slab_stat *names)
+{
+	if (dir_slab)
+		slab_stat(dir_slab, dirs);
+	else
+		memset(dirs, 0, sizeof(*dirs));
+	slab_stat_size(names);
 }
 
 /*!
@@ -837,11 +918,12 @@ struct dir *dir_add(struct vol *vol, const struct dir *dir,
 		err = 4;
 		goto exit;
 	}
+	fullpath = NULL;	/* dir_new() has freed it */
 
 	if ((dircache_add(vol, cdir)) != 0) {	/* 4 */
 		LOG(log_error, logtype_afpd,
 		    "dir_add: fatal dircache error: %s",
-		    cfrombstr(fullpath));
+		    cfrombstr(cdir->d_fullpath));
 		exit(EXITERR_SYS);
 	}
 
@@ -852,7 +934,7 @@ struct dir *dir_add(struct vol *vol, const struct dir *dir,
 
 		if (adp)
 			ad_close_metadata(adp);
-		if (!cdir && fullpath)
+		if (fullpath)
 			bdestroy(fullpath);
 		if (cdir)
 			dir_free(cdir);
@@ -1877,6 +1959,9 @@ int setdirparams(struct vol *vol, struct path *path, u_int16_t d_bitmap,
 		ad_close_metadata(&ad);
 	}
 
+	if (err == AFP_OK)
+		catsearch_index_dir(vol, dir);
+
 	if (change_parent_mdate && dir->d_did != DIRDID_ROOT
 	    && gettimeofday(&tv, NULL) == 0) {
 		if (movecwd(vol, dirlookup(vol, dir->d_pdid)) == 0) {
@@ -2064,6 +2149,7 @@ int afp_createdir(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 	ad_close_metadata(&ad);
 
       createdir_done:
+	catsearch_index_dir(vol, dir);
 	memcpy(rbuf, &dir->d_did, sizeof(u_int32_t));
 	*rbuflen = sizeof(u_int32_t);
 	setvoltime(obj, vol);
@@ -2196,6 +2282,7 @@ int deletecurdir(struct vol *vol)
 	err = netatalk_rmdir_all_errors(-1, cfrombstr(fdir->d_u_name));
 	if (err == AFP_OK || err == AFPERR_NOOBJ) {
 		cnid_delete(vol->v_cdb, fdir->d_did);
+		catsearch_index_del(vol, fdir->d_did);
 		dir_remove(vol, fdir);
 	} else {
 		LOG(log_error, logtype_afpd,
@@ -2499,3 +2586,11 @@ int afp_opendir(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 	*rbuflen = sizeof(curdir->d_did);
 	return AFP_OK;
 }
+
+/* a worker afpd switches the current directory with the session, see
+ * session.c. the caseenumerate() cache is checked with of_stat() in the
+ * current directory, it's safe to share */
+void directory_session_vars(void)
+{
+	session_var(&curdir, sizeof(curdir));
+}
@@ -38,6 +38,7 @@
 
 #include <atalk/directory.h>
 #include <atalk/globals.h>
+#include <atalk/slab.h>
 
 #include "volume.h"
 
@@ -86,6 +87,7 @@ extern void        dir_free_invalid_q(void);
 extern struct dir  *dir_new(const char *mname, const char *uname, const struct vol *,
                             cnid_t pdid, cnid_t did, bstring fullpath, struct stat *);
 extern void        dir_free (struct dir *);
+extern void        dir_alloc_stat(struct slab_stat *dirs, struct slab_stat *names);
 extern struct dir  *dir_add(struct vol *, const struct dir *, struct path *, int);
 extern int         dir_modify(const struct vol *vol, struct dir *dir, cnid_t pdid, cnid_t did,
                               const char *new_mname, const char *new_uname, bstring pdir_fullpath);
@@ -116,6 +118,7 @@ extern int         caseenumerate (const struct vol *, struct path *, struct dir
 
 /* from enumerate.c */
 extern char        *check_dirent (const struct vol *, char *);
+extern cnid_t      enumerate_prefetched(const struct vol *, cnid_t did, const char *name, const struct stat *st);
 
 /* FP functions */
 int afp_createdir (AFPObj *obj, char *ibuf, size_t ibuflen, char *rbuf,  size_t *rbuflen);
@@ -134,5 +137,8 @@ int afp_enumerate_ext2 (AFPObj *obj, char *ibuf, size_t ibuflen, char *rbuf,  si
 /* from catsearch.c */
 int afp_catsearch (AFPObj *obj, char *ibuf, size_t ibuflen, char *rbuf,  size_t *rbuflen);
 int afp_catsearch_ext (AFPObj *obj, char *ibuf, size_t ibuflen, char *rbuf,  size_t *rbuflen);
+void catsearch_index_file(const struct vol *, cnid_t did, const char *path, cnid_t id);
+void catsearch_index_dir(const struct vol *, const struct dir *);
+void catsearch_index_del(const struct vol *, cnid_t id);
 
 #endif
@@ -29,51 +29,164 @@
 #include "file.h"
 #include "fork.h"
 #include "filedir.h"
+#include "prefetch.h"
+#include "session.h"
 
 #define min(a,b)	((a)<(b)?(a):(b))
 
 /*
- * Struct to save directory reading context in. Used to prevent
- * O(n^2) searches on a directory.
+ * Directory snapshots, to prevent O(n^2) searches on a directory. A snapshot
+ * is an array of entries, so any sindex is found in O(1). The stat of an
+ * entry is kept for SD_STAT_TTL seconds and reused by the following
+ * enumerate() calls, e.g. when a reply was full or the Finder asks for the
+ * files and the directories separately. The last SD_CACHE directories are
+ * kept.
  */
+struct sd_entry {
+	u_int32_t se_name;	/* offset in sd_names */
+	u_int16_t se_len;
+	u_int16_t se_flags;
+	int se_job;		/* in the stat prefetch or -1 */
+	cnid_t se_cnid;		/* from the batch prefetch or CNID_INVALID */
+	time_t se_time;		/* when se_st was taken */
+	struct stat se_st;
+};
+#define SE_GONE		1	/* stat() failed, skip it */
+#define SE_STAT		2	/* se_st is valid */
+
 struct savedir {
 	u_int16_t sd_vid;
-	u_int32_t sd_did;
-	int sd_buflen;
-	char *sd_buf;
-	char *sd_last;
-	unsigned int sd_sindex;
+	u_int32_t sd_did;	/* 0: unused */
+	unsigned int sd_used;	/* for LRU */
+	struct sd_entry *sd_ent;
+	unsigned int sd_count;
+	unsigned int sd_size;
+	char *sd_names;
+	size_t sd_nameslen;
+	size_t sd_namessize;
+	unsigned int sd_sindex;	/* sindex of the entry at sd_pos */
+	unsigned int sd_pos;	/* where the last enumerate() stopped */
 };
+#define SD_CACHE	4
+#define SD_STAT_TTL	2
 #define SDBUFBRK	2048
 
+static struct savedir savedirs[SD_CACHE];
+static unsigned int sd_clock;
+
+/* snapshot and entry of the running enumerate(), for enumerate_prefetched() */
+static const struct vol *cur_vol;
+static struct savedir *cur_sd;
+static struct sd_entry *cur_ent;
+
+static struct savedir *savedir_get(u_int16_t vid, u_int32_t did, int new)
+{
+	struct savedir *sd, *lru = &savedirs[0];
+	int i;
+
+	for (i = 0; i < SD_CACHE; i++) {
+		sd = &savedirs[i];
+		if (sd->sd_did == did && sd->sd_vid == vid)
+			break;
+		if (sd->sd_used < lru->sd_used)
+			lru = sd;
+	}
+	if (i == SD_CACHE) {
+		if (!new)
+			return NULL;
+		sd = lru;
+	}
+
+	if (new) {
+		sd->sd_vid = vid;
+		sd->sd_did = did;
+		sd->sd_count = 0;
+		sd->sd_nameslen = 0;
+		sd->sd_sindex = 1;
+		sd->sd_pos = 0;
+	}
+	sd->sd_used = ++sd_clock;
+	return sd;
+}
+
 static int enumerate_loop(struct dirent *de, char *mname _U_, void *data)
 {
 	struct savedir *sd = data;
-	char *start, *end;
-	int len, lenm;
+	struct sd_entry *e;
+	size_t len, size;
+	void *tmp;
 
-	end = sd->sd_buf + sd->sd_buflen;
 	len = strlen(de->d_name);
-	*(sd->sd_last)++ = len;
-	lenm = 0;		/* strlen(mname); */
-	if (sd->sd_last + len + lenm + 4 > end) {
-		char *buf;
-
-		start = sd->sd_buf;
-		if (!(buf = realloc(sd->sd_buf, sd->sd_buflen + SDBUFBRK))) {
+	if (sd->sd_count == sd->sd_size) {
+		size = sd->sd_size ? 2 * sd->sd_size : 64;
+		if (!(tmp = realloc(sd->sd_ent, size * sizeof(*e)))) {
+			LOG(log_error, logtype_afpd,
+			    "afp_enumerate: realloc: %s", strerror(errno));
+			errno = ENOMEM;
+			return -1;
+		}
+		sd->sd_ent = tmp;
+		sd->sd_size = size;
+	}
+	if (sd->sd_nameslen + len + 1 > sd->sd_namessize) {
+		size = sd->sd_namessize + SDBUFBRK;
+		while (sd->sd_nameslen + len + 1 > size)
+			size *= 2;
+		if (!(tmp = realloc(sd->sd_names, size))) {
 			LOG(log_error, logtype_afpd,
 			    "afp_enumerate: realloc: %s", strerror(errno));
 			errno = ENOMEM;
 			return -1;
 		}
-		sd->sd_buf = buf;
-		sd->sd_buflen += SDBUFBRK;
-		sd->sd_last = (sd->sd_last - start) + sd->sd_buf;
-		end = sd->sd_buf + sd->sd_buflen;
+		sd->sd_names = tmp;
+		sd->sd_namessize = size;
 	}
 
-	memcpy(sd->sd_last, de->d_name, len + 1);
-	sd->sd_last += len + 1;
+	e = &sd->sd_ent[sd->sd_count++];
+	e->se_name = sd->sd_nameslen;
+	e->se_len = len;
+	e->se_flags = 0;
+	e->se_job = -1;
+	e->se_cnid = CNID_INVALID;
+	memcpy(sd->sd_names + sd->sd_nameslen, de->d_name, len + 1);
+	sd->sd_nameslen += len + 1;
+	return 0;
+}
+
+/* entries waiting in the stat prefetch */
+static struct sd_entry *pf_ent[PREFETCH_MAX];
+static int pf_count;
+
+/* stat an entry, or reuse a recent stat */
+static int sd_stat(const struct vol *vol, struct sd_entry *e,
+		   struct path *path, time_t now)
+{
+	int ret = -1;
+
+	if ((e->se_flags & SE_STAT) && now - e->se_time < SD_STAT_TTL) {
+		path->st = e->se_st;
+		path->st_valid = 1;
+		path->st_errno = 0;
+		return 0;
+	}
+	if (e->se_job >= 0) {
+		ret = prefetch_wait(e->se_job, &path->st);
+		e->se_job = -1;
+		path->st_valid = 1;
+		path->st_errno = 0;
+	}
+	/* of_stat() again if the prefetch failed, it logs the error */
+	if (ret != 0 && of_stat(vol, path) < 0) {
+		e->se_flags &= ~SE_STAT;
+		return -1;
+	}
+	if ((e->se_flags & SE_STAT)
+	    && (e->se_st.st_ino != path->st.st_ino
+		|| e->se_st.st_dev != path->st.st_dev))
+		e->se_cnid = CNID_INVALID;
+	e->se_st = path->st;
+	e->se_time = now;
+	e->se_flags |= SE_STAT;
 	return 0;
 }
 
@@ -143,6 +256,116 @@ for_each_dirent(const struct vol *vol, char *name, dir_loop fn, void *data)
 	return ret;
 }
 
+/*
+ * Queue the stats of the objects the current enumerate() is about to return
+ * for the prefetch threads, see prefetch.c.
+ */
+static void enumerate_stat_prefetch(const AFPObj * obj,
+				    const struct vol *vol,
+				    struct savedir *sd, unsigned int pos,
+				    u_int16_t reqcnt, time_t now)
+{
+	struct sd_entry *e;
+	int todo = min(reqcnt, PREFETCH_MAX);
+
+	if (prefetch_begin(vol, obj->options.prefetchthreads) != 0)
+		return;
+
+	for (; todo && pos < sd->sd_count; pos++) {
+		e = &sd->sd_ent[pos];
+		if (e->se_flags & SE_GONE)
+			continue;
+		todo--;
+		if ((e->se_flags & SE_STAT) && now - e->se_time < SD_STAT_TTL)
+			continue;
+		if ((e->se_job = prefetch_add(sd->sd_names + e->se_name)) < 0)
+			break;
+		pf_ent[pf_count++] = e;
+	}
+}
+
+/*
+ * CNIDs of the objects the current enumerate() is about to return, asked
+ * for with one cnid_add_batch() instead of one cnid_add() per object and
+ * kept in the snapshot. get_id() picks them up through
+ * enumerate_prefetched(), so it still updates the CNID cached in the
+ * AppleDouble file.
+ */
+#define ENUM_PREFETCH 128
+
+static void enumerate_prefetch(const struct vol *vol, struct savedir *sd,
+			       unsigned int pos, u_int16_t reqcnt,
+			       u_int16_t fbitmap, u_int16_t dbitmap,
+			       time_t now)
+{
+	static struct cnid_batch batch[ENUM_PREFETCH];
+	static struct sd_entry *ent[ENUM_PREFETCH];
+	struct cnid_batch *b;
+	struct sd_entry *e;
+	struct path path;
+	char *name;
+	int i, count = 0, todo = min(reqcnt, ENUM_PREFETCH);
+
+	if (vol->v_cdb == NULL || vol->v_cdb->cnid_add_batch == NULL)
+		return;
+
+	for (; todo && pos < sd->sd_count; pos++) {
+		e = &sd->sd_ent[pos];
+		if (e->se_flags & SE_GONE)
+			continue;
+		todo--;
+		if (e->se_cnid != CNID_INVALID)
+			continue;
+
+		name = sd->sd_names + e->se_name;
+		if (dircache_has_name(vol, curdir, name, e->se_len))
+			continue;
+
+		memset(&path, 0, sizeof(path));
+		path.u_name = name;
+		if (sd_stat(vol, e, &path, now) != 0)
+			continue;
+		if (S_ISDIR(e->se_st.st_mode) ? dbitmap == 0 : fbitmap == 0)
+			continue;
+		if (dircache_shm_search_by_name(vol, curdir->d_did, name,
+						e->se_len, &e->se_st)
+		    != CNID_INVALID)
+			continue;
+
+		ent[count] = e;
+		b = &batch[count++];
+		b->st = &e->se_st;
+		b->did = curdir->d_did;
+		b->name = name;
+		b->len = e->se_len;
+	}
+
+	if (count < 2 || cnid_add_batch(vol->v_cdb, batch, count) < 0)
+		return;
+	for (i = 0; i < count; i++)
+		ent[i]->se_cnid = batch[i].cnid;
+}
+
+/*!
+ * @brief CNID for the object the running enumerate() is working on
+ *
+ * @returns CNID or CNID_INVALID if the caller has to ask the CNID backend
+ */
+cnid_t enumerate_prefetched(const struct vol *vol, cnid_t did,
+			    const char *name, const struct stat *st)
+{
+	struct sd_entry *e = cur_ent;
+
+	if (e == NULL || e->se_cnid == CNID_INVALID || vol != cur_vol
+	    || did != cur_sd->sd_did)
+		return CNID_INVALID;
+
+	if (e->se_st.st_ino == st->st_ino && e->se_st.st_dev == st->st_dev
+	    && !strcmp(cur_sd->sd_names + e->se_name, name))
+		return e->se_cnid;
+	return CNID_INVALID;
+}
+
 /* This is the maximal length of a single entry for a file/dir in the reply
    block if all bits in the file/dir bitmap are set: header(4) + params(104) +
    macnamelength(1) + macname(31) + utf8(4) + utf8namelen(2) + utf8name(255) +
@@ -151,15 +374,18 @@ for_each_dirent(const struct vol *vol, char *name, dir_loop fn, void *data)
 #define REPLY_PARAM_MAXLEN (4 + 104 + 1 + MACFILELEN + 4 + 2 + UTF8FILELEN_EARLY + 1)
 
 /* ----------------------------- */
-static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
-		     char *rbuf, size_t *rbuflen, int ext)
+static int do_enumerate(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
+			char *rbuf, size_t *rbuflen, int ext)
 {
-	static struct savedir sd = { 0, 0, 0, NULL, NULL, 0 };
+	struct savedir *sd;
+	struct sd_entry *e;
 	struct vol *vol;
 	struct dir *dir;
-	int did, ret, len, first = 1;
+	int did, ret, first = 1;
+	unsigned int pos, start;
+	time_t now;
 	size_t esz;
-	char *data, *start;
+	char *data;
 	u_int16_t vid, fbitmap, dbitmap, reqcnt, actcnt = 0;
 	u_int16_t temp16;
 	u_int32_t sindex, maxsz, sz = 0;
@@ -167,16 +393,6 @@ static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 	struct path s_path;
 	int header;
 
-	if (sd.sd_buflen == 0) {
-		if ((sd.sd_buf = (char *) malloc(SDBUFBRK)) == NULL) {
-			LOG(log_error, logtype_afpd,
-			    "afp_enumerate: malloc: %s", strerror(errno));
-			*rbuflen = 0;
-			return AFPERR_MISC;
-		}
-		sd.sd_buflen = SDBUFBRK;
-	}
-
 	ibuf += 2;
 
 	memcpy(&vid, ibuf, sizeof(vid));
@@ -269,21 +485,21 @@ static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 	sz = 3 * sizeof(u_int16_t);	/* fbitmap, dbitmap, reqcount */
 
 	/*
-	 * Read the directory into a pre-malloced buffer, stored
-	 *          len <name> \0
-	 * The end is indicated by a len of 0.
+	 * Read the directory into a snapshot, or use the one we have.
 	 */
-	if (sindex == 1 || curdir->d_did != sd.sd_did || vid != sd.sd_vid) {
-		sd.sd_last = sd.sd_buf;
+	sd = savedir_get(vid, curdir->d_did, 0);
+	if (sindex == 1 || sd == NULL) {
+		sd = savedir_get(vid, curdir->d_did, 1);
 		/* if dir was in the cache we don't have the inode */
 		if ((!o_path->st_valid
 		     && ostat(".", &o_path->st, vol_syml_opt(vol)) < 0)
 		    || (ret =
 			for_each_dirent(vol, ".", enumerate_loop,
-					(void *) &sd)) < 0) {
+					(void *) sd)) < 0) {
 			LOG(log_error, logtype_afpd,
 			    "enumerate: loop error: %s (%d)",
 			    strerror(errno), errno);
+			sd->sd_did = 0;
 			switch (errno) {
 			case EACCES:
 				return AFPERR_ACCESS;
@@ -296,33 +512,28 @@ static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 			}
 		}
 		setdiroffcnt(curdir, &o_path->st, ret);
-		*sd.sd_last = 0;
-
-		sd.sd_last = sd.sd_buf;
-		sd.sd_sindex = 1;
-
-		sd.sd_vid = vid;
-		sd.sd_did = curdir->d_did;
 	}
 
 	/*
-	 * Position sd_last as dictated by sindex.
+	 * Position as dictated by sindex, relative to where the last call
+	 * stopped if possible.
 	 */
-	if (sindex < sd.sd_sindex) {
-		sd.sd_sindex = 1;
-		sd.sd_last = sd.sd_buf;
-	}
-	while (sd.sd_sindex < sindex) {
-		len = (unsigned char) *(sd.sd_last)++;
-		if (len == 0) {
-			sd.sd_did = 0;	/* invalidate sd struct to force re-read */
-			return (AFPERR_NOOBJ);
-		}
-		sd.sd_last += len + 1;
-		sd.sd_sindex++;
+	if (sindex >= sd->sd_sindex)
+		pos = sd->sd_pos + (sindex - sd->sd_sindex);
+	else
+		pos = sindex - 1;
+	if (pos >= sd->sd_count) {
+		sd->sd_did = 0;	/* invalidate sd struct to force re-read */
+		return (AFPERR_NOOBJ);
 	}
 
-	while ((len = (unsigned char) *(sd.sd_last)) != 0) {
+	now = time(NULL);
+	cur_vol = vol;
+	cur_sd = sd;
+	enumerate_stat_prefetch(obj, vol, sd, pos, reqcnt, now);
+	enumerate_prefetch(vol, sd, pos, reqcnt, fbitmap, dbitmap, now);
+
+	while (pos < sd->sd_count) {
 		/*
 		 * If we've got all we need, send it.
 		 */
@@ -334,17 +545,16 @@ static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 		 * Save the start position, in case we exceed the buffer
 		 * limitation, and have to back up one.
 		 */
-		start = sd.sd_last;
-		sd.sd_last++;
+		start = pos;
+		e = &sd->sd_ent[pos++];
 
-		if (*sd.sd_last == 0) {
+		if (e->se_flags & SE_GONE) {
 			/* stat() already failed on this one */
-			sd.sd_last += len + 1;
 			continue;
 		}
 		memset(&s_path, 0, sizeof(s_path));
-		s_path.u_name = sd.sd_last;
-		if (of_stat(vol, &s_path) < 0) {
+		s_path.u_name = sd->sd_names + e->se_name;
+		if (sd_stat(vol, e, &s_path, now) < 0) {
 			/*
 			 * Somebody else plays with the dir, well it can be us with 
 			 * "Empty Trash..."
@@ -352,15 +562,14 @@ static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 
 			/* so the next time it won't try to stat it again
 			 * another solution would be to invalidate the cache with 
-			 * sd.sd_did = 0 but if it's not ENOENT error it will start again
+			 * sd->sd_did = 0 but if it's not ENOENT error it will start again
 			 */
-			*sd.sd_last = 0;
-			sd.sd_last += len + 1;
+			e->se_flags |= SE_GONE;
 			curdir->d_offcnt--;	/* a little lie */
 			continue;
 		}
 
-		sd.sd_last += len + 1;
+		cur_ent = e;
 		s_path.m_name = NULL;
 		/*
 		 * If a fil/dir is not a dir, it's a file. This is slightly
@@ -371,14 +580,13 @@ static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 			if (dbitmap == 0) {
 				continue;
 			}
-			int len = strlen(s_path.u_name);
 			if ((dir =
 			     dircache_search_by_name(vol, curdir,
 						     s_path.u_name,
-						     len)) == NULL) {
+						     e->se_len)) == NULL) {
 				if ((dir =
 				     dir_add(vol, curdir, &s_path,
-					     len)) == NULL) {
+					     e->se_len)) == NULL) {
 					LOG(log_error, logtype_afpd,
 					    "enumerate(vid:%u, did:%u, name:'%s'): error adding dir: '%s'",
 					    ntohs(vid), ntohl(did),
@@ -420,7 +628,7 @@ static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 			if (first) {	/* maxsz can't hold a single reply */
 				return AFPERR_PARAM;
 			}
-			sd.sd_last = start;
+			pos = start;
 			break;
 		}
 
@@ -448,10 +656,11 @@ static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 	}
 
 	if (actcnt == 0) {
-		sd.sd_did = 0;	/* invalidate sd struct to force re-read */
+		sd->sd_did = 0;	/* invalidate sd struct to force re-read */
 		return (AFPERR_NOOBJ);
 	}
-	sd.sd_sindex = sindex + actcnt;
+	sd->sd_sindex = sindex + actcnt;
+	sd->sd_pos = pos;
 
 	/*
 	 * All done, fill in misc junk in rbuf
@@ -469,9 +678,48 @@ static int enumerate(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 	return (AFP_OK);
 }
 
+/* ----------------------------- */
+static int enumerate(AFPObj * obj, char *ibuf, size_t ibuflen,
+		     char *rbuf, size_t *rbuflen, int ext)
+{
+	int ret;
+
+	ret = do_enumerate(obj, ibuf, ibuflen, rbuf, rbuflen, ext);
+
+	/* the prefetch jobs point to the names in the snapshot */
+	prefetch_end();
+	while (pf_count)
+		pf_ent[--pf_count]->se_job = -1;
+
+	cur_ent = NULL;
+	cur_sd = NULL;
+	cur_vol = NULL;
+	return ret;
+}
+
 /* ----------------------------- */
 int afp_enumerate(AFPObj * obj, char *ibuf, size_t ibuflen,
 		  char *rbuf, size_t *rbuflen)
 {
 	return enumerate(obj, ibuf, ibuflen, rbuf, rbuflen, 0);
 }
+
+/* a worker afpd frees a session's snapshots, see session.c. the rest is
+ * only used during an enumerate() */
+static void enumerate_session_end(void)
+{
+	int i;
+
+	for (i = 0; i < SD_CACHE; i++) {
+		free(savedirs[i].sd_ent);
+		free(savedirs[i].sd_names);
+	}
+	memset(savedirs, 0, sizeof(savedirs));
+}
+
+void enumerate_session_vars(void)
+{
+	session_var(savedirs, sizeof(savedirs));
+	session_var(&sd_clock, sizeof(sd_clock));
+	session_cleanup(enumerate_session_end);
+}
@@ -193,7 +193,8 @@ char *set_name(const struct vol *vol, char *data, cnid_t pid, char *name,
  * @brief Get CNID for did/upath args both from database and adouble file
  *
  * 1. Get the objects CNID as stored in its adouble file
- * 2. Get the objects CNID from the database
+ * 2. Get the objects CNID from the shared dircache, an afp_enumerate() batch
+ *    or the database
  * 3. If there's a problem with a "dbd" database, fallback to "tdb" in memory
  * 4. In case 2 and 3 differ, store 3 in the adouble file
  *
@@ -219,7 +220,13 @@ uint32_t get_id(struct vol *vol,
 		   catching moved files */
 		adcnid = ad_getid(adp, st->st_dev, st->st_ino, 0, vol->v_stamp);	/* (1) */
 
-		dbcnid = cnid_add(vol->v_cdb, st, did, upath, len, adcnid);	/* (2) */
+		/* another afpd child may just have asked the database */
+		dbcnid = dircache_shm_search_by_name(vol, did, upath, len, st);
+		/* or afp_enumerate() already did, in a batch */
+		if (dbcnid == CNID_INVALID)
+			dbcnid = enumerate_prefetched(vol, did, upath, st);
+		if (dbcnid == CNID_INVALID)
+			dbcnid = cnid_add(vol->v_cdb, st, did, upath, len, adcnid);	/* (2) */
 		/* Throw errors if cnid_add fails. */
 		if (dbcnid == CNID_INVALID) {
 			switch (errno) {
@@ -364,6 +371,7 @@ int getmetadata(struct vol *vol,
 					LOG(log_error, logtype_afpd,
 					    "getmetadata: fullpath: %s",
 					    strerror(errno));
+					bdestroy(fullpath);
 					return AFPERR_MISC;
 				}
 
@@ -373,6 +381,7 @@ int getmetadata(struct vol *vol,
 					     st)) == NULL) {
 					LOG(log_error, logtype_afpd,
 					    "getmetadata: error from dir_new");
+					bdestroy(fullpath);
 					return AFPERR_MISC;
 				}
 
@@ -664,6 +673,7 @@ int afp_createfile(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
 	int creatf, did, openf, retvalue = AFP_OK;
 	u_int16_t vid;
 	struct path *s_path;
+	cnid_t id;
 
 	*rbuflen = 0;
 	ibuf++;
@@ -766,11 +776,12 @@ int afp_createfile(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
 		return AFPERR_MISC;
 	}
 
-	(void) get_id(vol, adp, &st, dir->d_did, upath, strlen(upath));
+	id = get_id(vol, adp, &st, dir->d_did, upath, strlen(upath));
 
 	ad_flush(adp);
 
 	ad_close(adp, ADFLAGS_DF | ADFLAGS_HF);
+	catsearch_index_file(vol, dir->d_did, upath, id);
 
       createfile_done:
 	curdir->d_offcnt++;
@@ -845,6 +856,7 @@ int setfilparams(struct vol *vol,
 		 struct path *path, u_int16_t f_bitmap, char *buf)
 {
 	struct adouble ad, *adp;
+	struct ofork *of;
 	struct extmap *em;
 	int bit, isad = 1, err = AFP_OK;
 	char *upath;
@@ -1065,6 +1077,12 @@ int setfilparams(struct vol *vol,
 		ad_close_metadata(adp);
 
 	}
+	if ((f_bitmap & ((1 << FILPBIT_FINFO) | (1 << FILPBIT_PDINFO)))
+	    && (of = of_findname(vol, path)))
+		of_typechanged(of);
+
+	if (err == AFP_OK)
+		catsearch_index_file(vol, curdir->d_did, upath, path->id);
 
 	if (change_parent_mdate && gettimeofday(&tv, NULL) == 0) {
 		newdate = AD_DATE_FROM_UNIX(tv.tv_sec);
@@ -1332,6 +1350,7 @@ int afp_copyfile(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
 		retvalue = err;
 		goto copy_exit;
 	}
+	catsearch_index_file(d_vol, curdir->d_did, upath, CNID_INVALID);
 	curdir->d_offcnt++;
 
 
@@ -1643,6 +1662,7 @@ int deletefile(const struct vol *vol, int dirfd, char *file,
 			cnid_get(vol->v_cdb, curdir->d_did, file,
 				 strlen(file)))) {
 			cnid_delete(vol->v_cdb, id);
+			catsearch_index_del(vol, id);
 		}
 	}
 
@@ -2258,6 +2278,10 @@ int afp_exchangefiles(AFPObj * obj, char *ibuf, size_t ibuflen _U_,
 			curdir->d_did, vol->v_stamp)) {
 		ad_flush(adsp);
 	}
+	if (did)
+		catsearch_index_file(vol, curdir->d_did, upath, did);
+	if (sid)
+		catsearch_index_file(vol, sdir->d_did, p, sid);
 
 	/* change perms, src gets dest perm and vice versa */
 
@@ -406,6 +406,7 @@ static int moveandrename(const struct vol *vol,
 		/* fix up the catalog entry */
 		cnid_update(vol->v_cdb, id, st, curdir->d_did, upath,
 			    strlen(upath));
+		catsearch_index_file(vol, curdir->d_did, upath, id);
 	}
 
       exit:
@@ -26,12 +26,15 @@
 #include <atalk/util.h>
 #include <atalk/cnid.h>
 #include <atalk/globals.h>
+#include <atalk/bstradd.h>
+#include <atalk/crlf.h>
 
 #include "fork.h"
 #include "file.h"
 #include "directory.h"
 #include "desktop.h"
 #include "volume.h"
+#include "readahead.h"
 
 
 extern int debug;
@@ -510,6 +513,8 @@ int afp_openfork(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 		}
 		if ((access & OPENACC_WR))
 			ofork->of_flags |= AFPFORK_ACCWR;
+		if ((access & OPENACC_DWR))
+			ofork->of_flags |= AFPFORK_DENYWR;
 	}
 	/* the file may be open read only without ressource fork */
 	if ((access & OPENACC_RD))
@@ -597,6 +602,7 @@ int afp_setforkparams(AFPObj * obj _U_, char *ibuf, size_t ibuflen,
 	if (size < 0)
 		return AFPERR_PARAM;	/* Some MacOS don't return an error they just don't change the size! */
 
+	of_drop_readahead(ofork);
 
 	if (bitmap == (1 << FILPBIT_DFLEN)
 	    || bitmap == (1 << FILPBIT_EXTDFLEN)) {
@@ -768,24 +774,32 @@ int afp_bytelock(AFPObj * obj, char *ibuf, size_t ibuflen, char *rbuf,
 
 #undef UNLOCKBIT
 
-/* --------------------------- */
+/* ---------------------------
+ * Is the fork's file of type TEXT? Remembered for the fork until
+ * of_typechanged() tells us its FinderInfo or name changed.
+ */
 static int crlf(struct ofork *of)
 {
 	struct extmap *em;
+	int text;
+
+	if (of->of_flags & AFPFORK_TEXTCHK)
+		return (of->of_flags & AFPFORK_TEXT) != 0;
 
 	if (ad_meta_fileno(of->of_ad) == -1 || !memcmp(ufinderi, ad_entry(of->of_ad, ADEID_FINDERI), 8)) {	/* META */
 		/* no resource fork or no finderinfo, use our files extension mapping */
-		if (!(em = getextmap(of_name(of)))
-		    || memcmp("TEXT", em->em_type, sizeof(em->em_type))) {
-			return 0;
-		}
-		/* file type is TEXT */
-		return 1;
-
-	} else if (!memcmp("TEXT", ad_entry(of->of_ad, ADEID_FINDERI), 4)) {
-		return 1;
+		text = (em = getextmap(of_name(of)))
+		    && !memcmp("TEXT", em->em_type, sizeof(em->em_type));
+	} else {
+		text = !memcmp("TEXT", ad_entry(of->of_ad, ADEID_FINDERI), 4);
 	}
-	return 0;
+
+	of->of_flags |= AFPFORK_TEXTCHK;
+	if (text)
+		of->of_flags |= AFPFORK_TEXT;
+	else
+		of->of_flags &= ~AFPFORK_TEXT;
+	return text;
 }
 
 
@@ -795,10 +809,10 @@ static ssize_t read_file(struct ofork *ofork, int eid,
 			 size_t *rbuflen, const int xlate)
 {
 	ssize_t cc;
+	size_t nl;
 	int eof = 0;
-	char *p, *q;
 
-	cc = ad_read(ofork->of_ad, eid, offset, rbuf, *rbuflen);
+	cc = ra_read(ofork, eid, offset, rbuf, *rbuflen);
 	if (cc < 0) {
 		LOG(log_error, logtype_afpd, "afp_read(%s): ad_read: %s",
 		    of_name(ofork), strerror(errno));
@@ -812,31 +826,18 @@ static ssize_t read_file(struct ofork *ofork, int eid,
 	/*
 	 * Do Newline check.
 	 */
-	if (nlmask != 0) {
-		for (p = rbuf, q = p + cc; p < q;) {
-			if ((*p++ & nlmask) == nlchar) {
-				break;
-			}
-		}
-		if (p != q) {
-			cc = p - rbuf;
-			eof = 0;
-		}
+	if (nlmask != 0
+	    && (nl = nl_scan(rbuf, cc, nlmask, nlchar)) < (size_t) cc) {
+		cc = nl + 1;
+		eof = 0;
 	}
+	ra_done(ofork, offset + cc);
 
 	/*
 	 * If this file is of type TEXT, then swap \012 to \015.
 	 */
-	if (xlate) {
-		for (p = rbuf, q = p + cc; p < q; p++) {
-			if (*p == '\012') {
-				*p = '\015';
-			} else if (*p == '\015') {
-				*p = '\012';
-			}
-
-		}
-	}
+	if (xlate)
+		crlf_swap(rbuf, cc);
 
 	*rbuflen = cc;
 	if (eof) {
@@ -1084,6 +1085,26 @@ int flushfork(struct ofork *ofork)
 	return (err);
 }
 
+/* update the catalog index with a file we've written to */
+static void index_fork(struct ofork *ofork)
+{
+	struct vol *vol = ofork->of_vol;
+	struct dir *dir;
+	char path[MAXPATHLEN + 1], *upath;
+
+	if (vol->v_catindex == NULL
+	    || (dir = dirlookup(vol, ofork->of_did)) == NULL
+	    || (upath = mtoupath(vol, of_name(ofork), dir->d_did,
+				 utf8_encoding())) == NULL)
+		return;
+	if ((size_t) snprintf(path, sizeof(path), "%s/%s",
+			      cfrombstr(dir->d_fullpath), upath)
+	    >= sizeof(path))
+		return;
+	catsearch_index_file(vol, dir->d_did, path, CNID_INVALID);
+}
+
+/* ---------------------------- */
 int afp_closefork(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 		  char *rbuf _U_, size_t *rbuflen)
 {
@@ -1100,6 +1121,8 @@ int afp_closefork(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 		    ofrefnum);
 		return (AFPERR_PARAM);
 	}
+	if ((ofork->of_flags & AFPFORK_MODIFIED))
+		index_fork(ofork);
 	if (of_closefork(ofork) < 0) {
 		LOG(log_error, logtype_afpd,
 		    "afp_closefork(%s): of_closefork: %s", of_name(ofork),
@@ -1115,22 +1138,15 @@ static ssize_t write_file(struct ofork *ofork, int eid,
 			  off_t offset, char *rbuf,
 			  size_t rbuflen, const int xlate)
 {
-	char *p, *q;
 	ssize_t cc;
 
 	/*
 	 * If this file is of type TEXT, swap \015 to \012.
 	 */
-	if (xlate) {
-		for (p = rbuf, q = p + rbuflen; p < q; p++) {
-			if (*p == '\015') {
-				*p = '\012';
-			} else if (*p == '\012') {
-				*p = '\015';
-			}
-		}
-	}
+	if (xlate)
+		crlf_swap(rbuf, rbuflen);
 
+	of_drop_readahead(ofork);
 	if ((cc = ad_write(ofork->of_ad, eid, offset, 0,
 			   rbuf, rbuflen)) < 0) {
 		switch (errno) {
@@ -26,6 +26,7 @@ struct ofork {
     cnid_t              of_did;
     uint16_t            of_refnum;
     int                 of_flags;
+    struct readahead    *of_ra;
     struct ofork        **prevp, *next;
 //    struct ofork        *of_d_prev, *of_d_next;
 };
@@ -47,6 +48,9 @@ struct ofork {
 #define AFPFORK_ACCWR   (1<<5)
 #define AFPFORK_ACCMASK (AFPFORK_ACCRD | AFPFORK_ACCWR)
 #define AFPFORK_MODIFIED (1<<6) /* used in FCE for modified files */
+#define AFPFORK_DENYWR  (1<<7)  /* opened deny-write */
+#define AFPFORK_TEXTCHK (1<<8)  /* AFPFORK_TEXT is known, see crlf() */
+#define AFPFORK_TEXT    (1<<9)  /* type TEXT */
 
 
 #define of_name(a) (a)->of_ad->ad_m_name
@@ -70,6 +74,8 @@ extern int          of_closefork (struct ofork *ofork);
 extern void         of_closevol  (const struct vol *vol);
 extern void         of_close_all_forks(void);
 extern struct adouble *of_ad     (const struct vol *, struct path *, struct adouble *);
+extern void         of_drop_readahead(const struct ofork *);
+extern void         of_typechanged(const struct ofork *);
 
 extern struct ofork *of_findnameat(int dirfd, struct path *path);
 extern int of_fstatat(int dirfd, struct path *path);
@@ -37,6 +37,7 @@
 #include "status.h"
 #include "fork.h"
 #include "uam_auth.h"
+#include "dircache.h"
 
 #define AFP_LISTENERS 32
 #define FDSET_SAFETY  5
@@ -385,6 +386,12 @@ int main(int ac, char **av)
 	/* Register CNID  */
 	cnid_init();
 
+	/* The shared dircache must exist before the first child is forked */
+	for (config = configs; config; config = config->next)
+		if (dircache_shm_init(config->obj.options.shareddircache) != 0)
+			LOG(log_error, logtype_afpd,
+			    "main: shared dircache disabled");
+
 	/* watch atp and ipc parent/child file descriptor. */
 
 	if (default_options.flags & OPTION_KEEPSESSIONS) {
@@ -412,6 +419,7 @@ int main(int ac, char **av)
 	while (1) {
 		LOG(log_maxdebug, logtype_afpd, "main: polling %i fds",
 		    fdset_used);
+		log_flush();
 		pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
 		ret = poll(fdset, fdset_used, -1);
 		pthread_sigmask(SIG_BLOCK, &sigs, NULL);
@@ -22,6 +22,8 @@
 #include "volume.h"
 #include "directory.h"
 #include "fork.h"
+#include "readahead.h"
+#include "session.h"
 
 /* we need to have a hashed list of oforks (by dev inode) */
 #define OFORK_HASHSIZE  64
@@ -116,6 +118,8 @@ int of_rename(const struct vol *vol,
 			}
 			if (newdir != olddir)
 				of->of_did = newdir->d_did;
+			/* the extension mapping may say otherwise now */
+			of->of_flags &= ~AFPFORK_TEXTCHK;
 		}
 	}
 
@@ -235,6 +239,7 @@ struct ofork *of_alloc(struct vol *vol,
 		of->of_flags = AFPFORK_DATA;
 	else
 		of->of_flags = AFPFORK_RSRC;
+	of->of_ra = NULL;
 
 	of_hash(of);
 	return (of);
@@ -387,6 +392,36 @@ struct ofork *of_findnameat(int dirfd, struct path *path)
 	return NULL;
 }
 
+/* --------------------------
+ * the file of fork has been written to, forget what readahead buffered for
+ * every fork of it
+ */
+void of_drop_readahead(const struct ofork *fork)
+{
+	struct ofork *of;
+
+	for (of = ofork_table[hashfn(&fork->key)]; of; of = of->next) {
+		if (fork->key.dev == of->key.dev
+		    && fork->key.inode == of->key.inode)
+			ra_drop(of);
+	}
+}
+
+/* --------------------------
+ * the FinderInfo of the file of fork changed, forget for every fork of it
+ * whether it's TEXT
+ */
+void of_typechanged(const struct ofork *fork)
+{
+	struct ofork *of;
+
+	for (of = ofork_table[hashfn(&fork->key)]; of; of = of->next) {
+		if (fork->key.dev == of->key.dev
+		    && fork->key.inode == of->key.inode)
+			of->of_flags &= ~AFPFORK_TEXTCHK;
+	}
+}
+
 void of_dealloc(struct ofork *of)
 {
 	if (!oforks)
@@ -394,6 +429,7 @@ void of_dealloc(struct ofork *of)
 
 	of_unhash(of);
 	oforks[of->of_refnum % nforks] = NULL;
+	ra_free(of);
 
 	/* decrease refcount */
 	of->of_ad->ad_refcount--;
@@ -511,3 +547,20 @@ void of_close_all_forks(void)
 	}
 	return;
 }
+
+/* a worker afpd has closed the forks of a session, see session.c */
+static void ofork_session_end(void)
+{
+	free(oforks);
+	oforks = NULL;
+	nforks = 0;
+}
+
+void ofork_session_vars(void)
+{
+	session_var(ofork_table, sizeof(ofork_table));
+	session_var(&oforks, sizeof(oforks));
+	session_var(&nforks, sizeof(nforks));
+	session_var(&lastrefnum, sizeof(lastrefnum));
+	session_cleanup(ofork_session_end);
+}
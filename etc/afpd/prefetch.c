@@ -0,0 +1,269 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Parallel stat and AppleDouble header prefetch for enumerate().
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <atalk/util.h>
+#include <atalk/logger.h>
+#include <atalk/adouble.h>
+#include <atalk/volume.h>
+
+#include "prefetch.h"
+
+/*
+ * Enumerate Prefetch
+ * ==================
+ *
+ * For every object enumerate() returns, afpd stats it and reads the header of
+ * its AppleDouble file, one synchronous syscall after the other. On a cold
+ * cache or a network file system every one of them waits for the disk or the
+ * server. enumerate() queues the entries of the next reply here first: a small
+ * pool of threads stats them and reads their AppleDouble headers in parallel,
+ * while the main thread builds the reply and picks up the stat results in
+ * order with prefetch_wait(). The header is only read to get it into the
+ * cache, ad_metadata() reads it again.
+ *
+ * The threads never touch afpd state: they work relative to a descriptor of
+ * the enumerated directory, so a chdir() of the main thread doesn't matter,
+ * the names and AppleDouble paths are prepared by prefetch_add(), and they
+ * block all signals. prefetch_end() drops the jobs that haven't started and
+ * waits for the running ones before the names go away.
+ *
+ * The threads are started in the afpd child on first use, -prefetchthreads
+ * sets their number, 0 (the default) disables the prefetch.
+ */
+
+#define PF_QUEUED  0
+#define PF_RUNNING 1
+#define PF_DONE    2
+
+#define PF_PATHLEN 320		/* ".AppleDouble/" and a name */
+
+struct pf_job {
+	const char *name;	/* in the caller's buffer */
+	char adpath[PF_PATHLEN];	/* "" if there's none */
+	struct stat st;
+	int err;
+	int state;
+};
+
+static struct pf_job jobs[PREFETCH_MAX];
+static int njobs;		/* jobs queued in this call */
+static int next;		/* next job for a thread */
+static int running;
+static int pf_dirfd = -1;
+static int statopt;
+
+static int nthreads;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+static const struct vol *cur_vol;
+
+static void do_job(struct pf_job *job, int fd, int opt)
+{
+	char buf[AD_DATASZ_MAX];
+	int adfd;
+
+	if (ostatat(fd, job->name, &job->st, opt) != 0) {
+		job->err = errno;
+		return;
+	}
+	job->err = 0;
+
+	if (!S_ISREG(job->st.st_mode) || job->adpath[0] == 0)
+		return;
+	if ((adfd = openat(fd, job->adpath, O_RDONLY | O_NOFOLLOW)) < 0)
+		return;
+	if (pread(adfd, buf, sizeof(buf), 0) < 0) {
+		/* only warming the cache */
+	}
+	close(adfd);
+}
+
+static void *worker(void *arg _U_)
+{
+	struct pf_job *job;
+	int fd, opt;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (next >= njobs)
+			pthread_cond_wait(&work, &lock);
+		job = &jobs[next++];
+		job->state = PF_RUNNING;
+		fd = pf_dirfd;
+		opt = statopt;
+		running++;
+		pthread_mutex_unlock(&lock);
+
+		do_job(job, fd, opt);
+
+		pthread_mutex_lock(&lock);
+		job->state = PF_DONE;
+		running--;
+		pthread_cond_broadcast(&done);
+	}
+	return NULL;
+}
+
+static int start_threads(int threads)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t sigs, oldsigs;
+	int i;
+
+	if (threads > PREFETCH_THREADS)
+		threads = PREFETCH_THREADS;
+
+	/* the threads inherit the mask, signals are for the main thread */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_SETMASK, &sigs, &oldsigs);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 64 * 1024 + AD_DATASZ_MAX);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tid, &attr, worker, NULL) != 0) {
+			LOG(log_error, logtype_afpd,
+			    "prefetch: can't start thread: %s",
+			    strerror(errno));
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	nthreads = i;
+	return nthreads ? 0 : -1;
+}
+
+/*!
+ * @brief Start queueing jobs for the current directory
+ *
+ * @returns 0 or -1 if the prefetch is disabled or not possible
+ */
+int prefetch_begin(const struct vol *vol, int threads)
+{
+	static int failed;
+
+	if (threads <= 0 || failed)
+		return -1;
+	if (nthreads == 0 && start_threads(threads) != 0) {
+		failed = 1;
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+	njobs = next = 0;
+	if ((pf_dirfd = open(".", O_RDONLY)) < 0) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	statopt = vol_syml_opt(vol);
+	cur_vol = vol;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/*!
+ * @brief Queue the stat of name, it must stay valid until prefetch_end()
+ *
+ * @returns job number for prefetch_wait() or -1
+ */
+int prefetch_add(const char *name)
+{
+	struct pf_job *job;
+	char *adpath = NULL;
+
+	if (pf_dirfd == -1 || njobs == PREFETCH_MAX)
+		return -1;
+
+	job = &jobs[njobs];
+	job->name = name;
+	job->state = PF_QUEUED;
+	if (cur_vol->ad_path)
+		adpath = cur_vol->ad_path(name, 0);
+	if (adpath == NULL || strlcpy(job->adpath, adpath, PF_PATHLEN) >= PF_PATHLEN)
+		job->adpath[0] = 0;
+
+	pthread_mutex_lock(&lock);
+	njobs++;
+	pthread_cond_signal(&work);
+	pthread_mutex_unlock(&lock);
+	return njobs - 1;
+}
+
+/*!
+ * @brief Wait for a job
+ *
+ * @returns 0 with the stat in st, -1 with errno set if the stat failed
+ */
+int prefetch_wait(int job, struct stat *st)
+{
+	struct pf_job *j;
+
+	if (job < 0 || job >= njobs) {
+		errno = EINVAL;
+		return -1;
+	}
+	j = &jobs[job];
+
+	pthread_mutex_lock(&lock);
+	if (j->state == PF_QUEUED && job == next) {
+		/* don't wait for a thread, do it ourselves */
+		j->state = PF_RUNNING;
+		next++;
+		running++;
+		pthread_mutex_unlock(&lock);
+		do_job(j, pf_dirfd, statopt);
+		pthread_mutex_lock(&lock);
+		j->state = PF_DONE;
+		running--;
+		pthread_cond_broadcast(&done);
+	}
+	while (j->state != PF_DONE)
+		pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+
+	if (j->err) {
+		errno = j->err;
+		return -1;
+	}
+	*st = j->st;
+	return 0;
+}
+
+/*!
+ * @brief Drop queued jobs and wait for the running ones
+ */
+void prefetch_end(void)
+{
+	if (pf_dirfd == -1)
+		return;
+
+	pthread_mutex_lock(&lock);
+	njobs = next;
+	while (running)
+		pthread_cond_wait(&done, &lock);
+	njobs = next = 0;
+	close(pf_dirfd);
+	pf_dirfd = -1;
+	cur_vol = NULL;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,23 @@
+/*
+ * Parallel stat and AppleDouble header prefetch for enumerate(),
+ * see prefetch.c
+ */
+
+#ifndef AFPD_PREFETCH_H
+#define AFPD_PREFETCH_H 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <atalk/volume.h>
+
+/* jobs per enumerate() call */
+#define PREFETCH_MAX     128
+#define PREFETCH_THREADS 32
+
+extern int  prefetch_begin(const struct vol *, int threads);
+extern int  prefetch_add(const char *name);
+extern int  prefetch_wait(int job, struct stat *st);
+extern void prefetch_end(void);
+
+#endif /* AFPD_PREFETCH_H */
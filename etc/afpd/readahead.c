@@ -0,0 +1,160 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Readahead for forks that are read sequentially with FPRead.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <atalk/adouble.h>
+#include <atalk/logger.h>
+
+#include "fork.h"
+#include "readahead.h"
+
+/*
+ * FPRead Readahead
+ * ================
+ *
+ * Over ASP a client reads a file in requests of at most 4624 bytes, every one
+ * of them a pread() of its own that waits for the disk on a cold cache. Once
+ * a fork has been read sequentially RA_TRIGGER times we read ahead:
+ *
+ * - the data fork gets posix_fadvise(POSIX_FADV_WILLNEED) for a window ahead
+ *   of the reader, so the disk works while the reply is on the wire. The
+ *   window doubles from RA_WINDOW_MIN to RA_WINDOW_MAX as long as the reads
+ *   stay sequential, the next one is started when the reader is half way.
+ *
+ * - a fork opened deny-write can't change under us, except by writes of this
+ *   process, which drop the buffered block of every fork of the file (see
+ *   of_drop_readahead()). Such a fork reads RA_BLOCK bytes at a time and
+ *   serves the following requests from memory.
+ *
+ * A read somewhere else starts over.
+ */
+
+struct readahead {
+	off_t  ra_next;     /* where a sequential read starts */
+	int    ra_seq;      /* sequential reads in a row */
+	off_t  ra_advised;  /* posix_fadvise()d up to here */
+	size_t ra_window;
+	char   *ra_buf;     /* RA_BLOCK bytes, deny-write forks only */
+	off_t  ra_off;      /* of the buffered block */
+	size_t ra_len;
+	int    ra_eof;      /* the block ends at the end of the fork */
+};
+
+/* -------------------------- */
+static void ra_advise(struct ofork *of, int eid, struct readahead *ra,
+		      off_t pos)
+{
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	off_t start;
+	int fd;
+
+	if (eid != ADEID_DFORK || (fd = ad_data_fileno(of->of_ad)) < 0)
+		return;
+	if (ra->ra_advised > pos + (off_t) ra->ra_window / 2)
+		return;
+
+	start = MAX(pos, ra->ra_advised);
+	posix_fadvise(fd, start, pos + ra->ra_window - start,
+		      POSIX_FADV_WILLNEED);
+	ra->ra_advised = pos + ra->ra_window;
+	if (ra->ra_window < RA_WINDOW_MAX)
+		ra->ra_window *= 2;
+#endif
+}
+
+/*!
+ * ad_read() for FPRead, with readahead
+ *
+ * The caller reports how far the client got with ra_done().
+ */
+ssize_t ra_read(struct ofork *of, int eid, off_t off, char *buf,
+		size_t len)
+{
+	struct readahead *ra;
+	ssize_t cc;
+
+	if ((ra = of->of_ra) == NULL) {
+		if ((ra = calloc(1, sizeof(struct readahead))) == NULL)
+			return ad_read(of->of_ad, eid, off, buf, len);
+		ra->ra_window = RA_WINDOW_MIN;
+		of->of_ra = ra;
+	}
+
+	if (ra->ra_len && off >= ra->ra_off
+	    && off < ra->ra_off + (off_t) ra->ra_len
+	    && (off + (off_t) len <= ra->ra_off + (off_t) ra->ra_len
+		|| ra->ra_eof)) {
+		cc = MIN(len, ra->ra_off + ra->ra_len - off);
+		memcpy(buf, ra->ra_buf + (off - ra->ra_off), cc);
+		return cc;
+	}
+
+	if (off == ra->ra_next) {
+		ra->ra_seq++;
+	} else {
+		ra->ra_seq = 0;
+		ra->ra_advised = 0;
+		ra->ra_window = RA_WINDOW_MIN;
+	}
+	if (ra->ra_seq < RA_TRIGGER)
+		return ad_read(of->of_ad, eid, off, buf, len);
+
+	if (!(of->of_flags & AFPFORK_DENYWR) || len >= RA_BLOCK) {
+		ra_advise(of, eid, ra, off + len);
+		return ad_read(of->of_ad, eid, off, buf, len);
+	}
+
+	if (ra->ra_buf == NULL && (ra->ra_buf = malloc(RA_BLOCK)) == NULL)
+		return ad_read(of->of_ad, eid, off, buf, len);
+
+	ra->ra_len = 0;
+	if ((cc = ad_read(of->of_ad, eid, off, ra->ra_buf, RA_BLOCK)) < 0)
+		return cc;
+	ra->ra_off = off;
+	ra->ra_len = cc;
+	ra->ra_eof = (cc < RA_BLOCK);
+	ra_advise(of, eid, ra, off + cc);
+
+	cc = MIN(len, ra->ra_len);
+	memcpy(buf, ra->ra_buf, cc);
+	return cc;
+}
+
+/*!
+ * The client has read up to end, the next sequential read starts there
+ */
+void ra_done(struct ofork *of, off_t end)
+{
+	if (of->of_ra)
+		of->of_ra->ra_next = end;
+}
+
+/*!
+ * Forget the buffered block, the fork has been written to
+ */
+void ra_drop(struct ofork *of)
+{
+	if (of->of_ra)
+		of->of_ra->ra_len = 0;
+}
+
+/* -------------------------- */
+void ra_free(struct ofork *of)
+{
+	if (of->of_ra) {
+		free(of->of_ra->ra_buf);
+		free(of->of_ra);
+		of->of_ra = NULL;
+	}
+}
@@ -0,0 +1,27 @@
+/*
+ * Sequential readahead for FPRead, see readahead.c
+ */
+
+#ifndef AFPD_READAHEAD_H
+#define AFPD_READAHEAD_H 1
+
+#include <sys/types.h>
+
+/* sequential reads of a fork before we read ahead */
+#define RA_TRIGGER       2
+
+/* block buffered for a fork nobody else may write */
+#define RA_BLOCK         (64 * 1024)
+
+/* posix_fadvise() window ahead of the reader, doubles while streaming */
+#define RA_WINDOW_MIN    (128 * 1024)
+#define RA_WINDOW_MAX    (2 * 1024 * 1024)
+
+struct ofork;
+
+extern ssize_t ra_read(struct ofork *of, int eid, off_t off, char *buf, size_t len);
+extern void    ra_done(struct ofork *of, off_t end);
+extern void    ra_drop(struct ofork *of);
+extern void    ra_free(struct ofork *of);
+
+#endif /* AFPD_READAHEAD_H */
@@ -0,0 +1,314 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Several AFP sessions in one afpd.
+ *
+ * afpd keeps the state of a session in globals, one process one session.
+ * A worker afpd (-aspworkers) serves many sessions: the modules register
+ * their per session globals with session_var(), and before a request of
+ * another session the worker calls session_switch(), which saves the
+ * globals of the session it leaves and loads those of the one it enters,
+ * together with the effective ids, groups, umask and working directory.
+ * A new session starts with the globals as session_init() found them, that
+ * is what a forked afpd starts with.
+ *
+ * Shared on purpose: the allocators, the shared dircache, the prefetch
+ * threads and the server message.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <atalk/logger.h>
+#include <atalk/adouble.h>
+#include <atalk/util.h>
+#include <atalk/bstrlib.h>
+#include <atalk/bstradd.h>
+#include <atalk/globals.h>
+
+#include "auth.h"
+#include "directory.h"
+#include "session.h"
+
+#define SESSION_CLEANUPS 16
+
+struct sessvar {
+	void *sv_addr;
+	size_t sv_len;
+	const void *sv_owner;	/* UAM module, NULL for afpd */
+	struct sessvar *sv_next;
+};
+
+struct session {
+	unsigned char *s_vars;	/* the globals while not current */
+	uid_t s_euid;
+	gid_t s_egid;
+	uid_t s_fuid;		/* ad_setfuid() */
+	mode_t s_umask;
+};
+
+static struct sessvar *vars, **vars_tail = &vars;
+static size_t vars_len;
+static void (*cleanups[SESSION_CLEANUPS]) (void);
+static int ncleanups;
+
+static struct session template;	/* the state a new session starts with */
+static struct session *current;
+static int inited;
+
+/* ---------------------- registry */
+
+void session_var_owned(void *addr, size_t len, const void *owner)
+{
+	struct sessvar *sv;
+
+	if (inited) {
+		LOG(log_error, logtype_afpd,
+		    "session_var: too late to register %p", addr);
+		return;
+	}
+	if ((sv = malloc(sizeof(*sv))) == NULL) {
+		LOG(log_error, logtype_afpd, "session_var: %s",
+		    strerror(errno));
+		return;
+	}
+	sv->sv_addr = addr;
+	sv->sv_len = len;
+	sv->sv_owner = owner;
+	sv->sv_next = NULL;
+	*vars_tail = sv;
+	vars_tail = &sv->sv_next;
+}
+
+/* a global that differs from session to session */
+void session_var(void *addr, size_t len)
+{
+	session_var_owned(addr, len, NULL);
+}
+
+/* the UAM owner is unloaded */
+void session_drop(const void *owner)
+{
+	struct sessvar **p, *sv;
+
+	for (p = &vars; (sv = *p);) {
+		if (sv->sv_owner == owner) {
+			*p = sv->sv_next;
+			free(sv);
+		} else {
+			p = &sv->sv_next;
+		}
+	}
+	for (vars_tail = &vars; *vars_tail;
+	     vars_tail = &(*vars_tail)->sv_next);
+}
+
+/* fn frees what a session has allocated, it's called with the session
+ * current */
+void session_cleanup(void (*fn) (void))
+{
+	if (ncleanups == SESSION_CLEANUPS) {
+		LOG(log_error, logtype_afpd, "session_cleanup: too many");
+		return;
+	}
+	cleanups[ncleanups++] = fn;
+}
+
+/* ---------------------- switching */
+
+static void vars_save(unsigned char *p)
+{
+	struct sessvar *sv;
+
+	for (sv = vars; sv; sv = sv->sv_next) {
+		memcpy(p, sv->sv_addr, sv->sv_len);
+		p += sv->sv_len;
+	}
+}
+
+static void vars_load(const unsigned char *p)
+{
+	struct sessvar *sv;
+
+	for (sv = vars; sv; sv = sv->sv_next) {
+		memcpy(sv->sv_addr, p, sv->sv_len);
+		p += sv->sv_len;
+	}
+}
+
+static void creds_save(struct session *s)
+{
+	s->s_euid = geteuid();
+	s->s_egid = getegid();
+	s->s_fuid = ad_getfuid();
+	s->s_umask = umask(0);
+	umask(s->s_umask);
+}
+
+/* groups and ngroups are the new session's already, ogroups the ones
+ * the process has now */
+static void creds_load(const struct session *s, gid_t * ogroups,
+		       int ongroups)
+{
+	ad_setfuid(s->s_fuid);
+	umask(s->s_umask);
+
+	/* can't switch without root */
+	if (template.s_euid != 0)
+		return;
+
+	if (geteuid() == s->s_euid && getegid() == s->s_egid
+	    && ongroups == ngroups
+	    && (!ngroups
+		|| memcmp(ogroups, groups, ngroups * sizeof(gid_t)) == 0))
+		return;
+
+	if (seteuid(0) < 0 || setgroups(ngroups, groups) < 0
+	    || setegid(s->s_egid) < 0 || seteuid(s->s_euid) < 0) {
+		LOG(log_error, logtype_afpd,
+		    "session_switch: can't become %u/%u: %s", s->s_euid,
+		    s->s_egid, strerror(errno));
+		exit(EXITERR_SYS);
+	}
+}
+
+/* the working directory is curdir's, but a session that isn't in a volume
+ * doesn't have one. a directory that's gone leaves it in / */
+static void cwd_load(void)
+{
+	if (curdir == NULL || curdir->d_did == DIRDID_ROOT_PARENT) {
+		if (chdir("/") < 0)
+			LOG(log_error, logtype_afpd, "session_switch: /: %s",
+			    strerror(errno));
+		return;
+	}
+	if (chdir(cfrombstr(curdir->d_fullpath)) < 0) {
+		LOG(log_info, logtype_afpd, "session_switch: \"%s\": %s",
+		    cfrombstr(curdir->d_fullpath), strerror(errno));
+		curdir = &rootParent;
+		if (chdir("/") < 0)
+			LOG(log_error, logtype_afpd,
+			    "session_switch: /: %s", strerror(errno));
+	}
+}
+
+/*!
+ * @brief Make s the current session
+ *
+ * The globals of the current session are saved, those of s loaded, then the
+ * process takes on the credentials and the working directory of s.
+ * Exits if the credentials can't be set, the process would go on with the
+ * rights of another user.
+ */
+void session_switch(struct session *s)
+{
+	gid_t *ogroups = groups;
+	int ongroups = ngroups;
+
+	if (s == current)
+		return;
+
+	if (current) {
+		vars_save(current->s_vars);
+		creds_save(current);
+	}
+	vars_load(s->s_vars);
+	current = s;
+
+	/* ogroups still points to the old session's array, we only compare */
+	creds_load(s, ogroups, ongroups);
+	cwd_load();
+}
+
+/* ---------------------- life cycle */
+
+/*!
+ * @brief Register the per session globals of all modules
+ *
+ * Called once in a worker before its first session, the globals as they
+ * are now become the start state of each session.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int session_init(void)
+{
+	struct sessvar *sv;
+
+	if (inited)
+		return 0;
+
+	appl_session_vars();
+	auth_session_vars();
+	catsearch_session_vars();
+	desktop_session_vars();
+	dircache_session_vars();
+	directory_session_vars();
+	enumerate_session_vars();
+	ofork_session_vars();
+	switch_session_vars();
+	volume_session_vars();
+
+	/* configfree() has unloaded the volumes of the master, curdir points
+	 * into them */
+	curdir = NULL;
+
+	for (sv = vars; sv; sv = sv->sv_next)
+		vars_len += sv->sv_len;
+	if ((template.s_vars = malloc(vars_len)) == NULL)
+		return -1;
+	vars_save(template.s_vars);
+	creds_save(&template);
+	inited = 1;
+
+	LOG(log_debug, logtype_afpd, "session_init: %lu bytes per session",
+	    (unsigned long) vars_len);
+	return 0;
+}
+
+/*!
+ * @brief A new session, it isn't current yet
+ */
+struct session *session_new(void)
+{
+	struct session *s;
+
+	if ((s = malloc(sizeof(*s))) == NULL)
+		return NULL;
+	if ((s->s_vars = malloc(vars_len)) == NULL) {
+		free(s);
+		return NULL;
+	}
+	memcpy(s->s_vars, template.s_vars, vars_len);
+	s->s_euid = template.s_euid;
+	s->s_egid = template.s_egid;
+	s->s_fuid = template.s_fuid;
+	s->s_umask = template.s_umask;
+	return s;
+}
+
+/*!
+ * @brief End a session
+ *
+ * Runs the cleanups with s current, then the process is back in the start
+ * state with no current session.
+ */
+void session_free(struct session *s)
+{
+	int i;
+
+	session_switch(s);
+	for (i = ncleanups - 1; i >= 0; i--)
+		cleanups[i] ();
+
+	session_switch(&template);
+	current = NULL;
+	free(s->s_vars);
+	free(s);
+}
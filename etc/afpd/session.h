@@ -0,0 +1,34 @@
+/*
+ * Several AFP sessions in one afpd, see session.c
+ */
+
+#ifndef AFPD_SESSION_H
+#define AFPD_SESSION_H 1
+
+#include <sys/types.h>
+
+struct session;
+
+extern void session_var(void *addr, size_t len);
+extern void session_var_owned(void *addr, size_t len, const void *owner);
+extern void session_drop(const void *owner);
+extern void session_cleanup(void (*fn)(void));
+
+extern int  session_init(void);
+extern struct session *session_new(void);
+extern void session_switch(struct session *);
+extern void session_free(struct session *);
+
+/* the modules with per session globals */
+extern void appl_session_vars(void);
+extern void auth_session_vars(void);
+extern void catsearch_session_vars(void);
+extern void desktop_session_vars(void);
+extern void dircache_session_vars(void);
+extern void directory_session_vars(void);
+extern void enumerate_session_vars(void);
+extern void ofork_session_vars(void);
+extern void switch_session_vars(void);
+extern void volume_session_vars(void);
+
+#endif /* AFPD_SESSION_H */
@@ -41,6 +41,7 @@
 #include "filedir.h"
 #include "status.h"
 #include "misc.h"
+#include "session.h"
 
 static int afp_null(AFPObj * obj _U_, char *ibuf, size_t ibuflen _U_,
 		    char *rbuf _U_, size_t *rbuflen)
@@ -221,3 +222,11 @@ int uam_afpserver_action(const int id, const int which,
 
 	return 0;
 }
+
+/* login and an expired password change the tables, see session.c */
+void switch_session_vars(void)
+{
+	session_var(&afp_switch, sizeof(afp_switch));
+	session_var(preauth_switch, sizeof(preauth_switch));
+	session_var(postauth_switch, sizeof(postauth_switch));
+}
@@ -38,6 +38,10 @@
 #include "afp_config.h"
 #include "auth.h"
 #include "uam_auth.h"
+#include "session.h"
+
+/* the module in uam_setup(), for uam_session_var() */
+static void *uam_loading;
 
 /* --- server uam functions -- */
 
@@ -81,17 +85,21 @@ struct uam_mod *uam_load(const char *path, const char *name)
 
 	/* version check would go here */
 
+	uam_loading = module;
 	if (!mod->uam_fcn->uam_setup ||
 	    ((*mod->uam_fcn->uam_setup) (name) < 0)) {
+		uam_loading = NULL;
 		LOG(log_error, logtype_afpd,
 		    "uam_load(%s): uam_setup failed", name);
 		goto uam_load_err;
 	}
+	uam_loading = NULL;
 
 	mod->uam_module = module;
 	return mod;
 
       uam_load_err:
+	session_drop(module);
 	free(mod);
       uam_load_fail:
 	mod_close(module);
@@ -106,10 +114,17 @@ void uam_unload(struct uam_mod *mod)
 	if (mod->uam_fcn->uam_cleanup)
 		(*mod->uam_fcn->uam_cleanup) ();
 
+	session_drop(mod->uam_module);
 	mod_close(mod->uam_module);
 	free(mod);
 }
 
+/* a UAM registers its login state from uam_setup() */
+void uam_session_var(void *addr, const size_t len)
+{
+	session_var_owned(addr, len, uam_loading);
+}
+
 /* -- client-side uam functions -- */
 /* set up stuff for this uam. */
 int uam_register(const int type, const char *path, const char *name, ...)
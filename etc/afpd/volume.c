@@ -39,6 +39,7 @@
 #ifdef CNID_DB
 #include <atalk/cnid.h>
 #endif				/* CNID_DB */
+#include <atalk/catindex.h>
 
 #include "directory.h"
 #include "file.h"
@@ -48,6 +49,7 @@
 #include "fork.h"
 #include "hash.h"
 #include "auth.h"
+#include "session.h"
 
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -1965,6 +1967,17 @@ static int volume_openDB(struct vol *volume)
 #endif
 	}
 
+	/* the catalog index is built by dbd, see catsearch.c */
+	if (volume->v_cdb && !(flags & CNID_FLAG_MEMORY)
+	    && strcmp(volume->v_cnidscheme, "dbd") == 0) {
+		char dbdir[MAXPATHLEN + 1];
+
+		if ((size_t) snprintf(dbdir, sizeof(dbdir), "%s/.AppleDB",
+				      volume->v_dbpath ? volume->v_dbpath :
+				      volume->v_path) < sizeof(dbdir))
+			volume->v_catindex = catindex_open(dbdir);
+	}
+
 	return (!volume->v_cdb) ? -1 : 0;
 }
 
@@ -2035,6 +2048,7 @@ int afp_openvol(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 
 	struct vol *volume;
 	struct dir *dir;
+	bstring fullpath;
 	int len, ret;
 	size_t namelen;
 	u_int16_t bitmap;
@@ -2159,12 +2173,14 @@ int afp_openvol(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 	else if (*(vol_uname + 1) != '\0')
 		vol_uname++;
 
-	if ((dir = dir_new(vol_mname,
-			   vol_uname,
-			   volume,
-			   DIRDID_ROOT_PARENT,
-			   DIRDID_ROOT, bfromcstr(volume->v_path), &st)
+	if ((fullpath = bfromcstr(volume->v_path)) == NULL
+	    || (dir = dir_new(vol_mname,
+			      vol_uname,
+			      volume,
+			      DIRDID_ROOT_PARENT,
+			      DIRDID_ROOT, fullpath, &st)
 	    ) == NULL) {
+		bdestroy(fullpath);
 		free(vol_mname);
 		LOG(log_error, logtype_afpd, "afp_openvol(%s): malloc: %s",
 		    volume->v_path, strerror(errno));
@@ -2232,6 +2248,10 @@ int afp_openvol(AFPObj * obj, char *ibuf, size_t ibuflen _U_, char *rbuf,
 		cnid_close(volume->v_cdb);
 		volume->v_cdb = NULL;
 	}
+	if (volume->v_catindex != NULL) {
+		catindex_close(volume->v_catindex);
+		volume->v_catindex = NULL;
+	}
 	*rbuflen = 0;
 	return ret;
 }
@@ -2248,6 +2268,10 @@ static void closevol(struct vol *vol)
 		cnid_close(vol->v_cdb);
 		vol->v_cdb = NULL;
 	}
+	if (vol->v_catindex != NULL) {
+		catindex_close(vol->v_catindex);
+		vol->v_catindex = NULL;
+	}
 }
 
 /* ------------------------- */
@@ -2716,3 +2740,15 @@ static char *get_vol_uuid(const AFPObj * obj, const char *volname)
 
 	return strdup(cp);
 }
+
+/* every session of a worker afpd has its volumes, see session.c */
+void volume_session_vars(void)
+{
+	session_var(&current_vol, sizeof(current_vol));
+	session_var(&Volumes, sizeof(Volumes));
+	session_var(&lastvid, sizeof(lastvid));
+	session_var(&Extmap, sizeof(Extmap));
+	session_var(&Defextmap, sizeof(Defextmap));
+	session_var(&Extmap_cnt, sizeof(Extmap_cnt));
+	session_cleanup(unload_volumes_and_extmap);
+}
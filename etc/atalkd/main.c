@@ -1105,6 +1105,7 @@ int main( int ac, char **av)
 
     for (;;) {
 	readfds = fds;
+	log_flush();
 	if ( select( nfds, &readfds, NULL, NULL, NULL) < 0 ) {
 	    if ( errno == EINTR ) {
 		errno = 0;
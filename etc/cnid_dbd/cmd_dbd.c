@@ -80,6 +80,8 @@
 #define DBOPTIONS (DB_CREATE | DB_INIT_LOCK | DB_INIT_LOG | DB_INIT_MPOOL | DB_INIT_TXN)
 
 int nocniddb = 0;		/* Dont open CNID database, only scan filesystem */
+int scanthreads = 4;		/* prefetch threads for -s and -r */
+int watchsecs = 0;		/* -w: rescan at least every watchsecs seconds */
 struct volinfo volinfo;		/* needed by pack.c:idxname() */
 volatile sig_atomic_t alarmed;	/* flags for signals */
 int db_locked;			/* have we got the fcntl lock on lockfile ? */
@@ -174,7 +176,7 @@ static void set_signal(void)
 static void usage(void)
 {
 	printf("dbd (%s %s)\n"
-	       "Usage: dbd [-e|-t|-v|-x] -d [-i] | -s [-c|-n]| -r [-c|-f] | -u <path to netatalk volume>\n"
+	       "Usage: dbd [-e|-m|-t|-v|-x] [-j threads] -d [-i] | -s [-c|-n]| -r [-c|-f|-w seconds] | -u <path to netatalk volume>\n"
 	       "dbd can dump, scan, reindex and rebuild Netatalk dbd CNID databases.\n"
 	       "dbd must be run with appropiate permissions i.e. as root.\n\n"
 	       "Main commands are:\n"
@@ -203,12 +205,17 @@ static void usage(void)
 	       "      Options: -c Don't create .AppleDouble stuff, only cleanup orphaned.\n"
 	       "               -f wipe database and rebuild from IDs stored in AppleDouble\n"
 	       "                  files, only available for volumes without 'nocnidcache'\n"
-	       "                  option. Implies -e.\n\n"
+	       "                  option. Implies -e.\n"
+	       "               -w keep running, rebuild again on every change and at least\n"
+	       "                  every seconds. Implies -m, not with -e or -f.\n\n"
 	       "   -u Upgrade:\n"
 	       "      Opens the database which triggers any necessary upgrades,\n"
 	       "      then closes and exits.\n\n"
 	       "General options:\n"
 	       "   -e only work on inactive volumes and lock them (exclusive)\n"
+	       "   -j threads reading the volume ahead of -s and -r (default 4, 0 for none)\n"
+	       "   -m only look into directories changed since the last -m run of -r,\n"
+	       "      -e only deletes the CNIDs of objects vanished since then\n"
 	       "   -x rebuild indexes (just for completeness, mostly useless!)\n"
 	       "   -t show statistics while running\n"
 	       "   -v verbose\n\n"
@@ -235,7 +242,7 @@ int main(int argc, char **argv)
 	/* Inhereting perms in ad_mkdir etc requires this */
 	ad_setfuid(0);
 
-	while ((c = getopt(argc, argv, ":cdefinrstuvx")) != -1) {
+	while ((c = getopt(argc, argv, ":cdefij:mnrstuvw:x")) != -1) {
 		switch (c) {
 		case 'c':
 			flags |= DBD_FLAGS_CLEANUP;
@@ -250,6 +257,12 @@ int main(int argc, char **argv)
 			scan = 1;
 			flags |= DBD_FLAGS_SCAN;
 			break;
+		case 'j':
+			scanthreads = atoi(optarg);
+			break;
+		case 'm':
+			flags |= DBD_FLAGS_MANIFEST;
+			break;
 		case 'n':
 			nocniddb = 1;	/* FIXME: this could/should be a flag too for consistency */
 			break;
@@ -269,6 +282,13 @@ int main(int argc, char **argv)
 			exclusive = 1;
 			flags |= DBD_FLAGS_EXCL;
 			break;
+		case 'w':
+			flags |= DBD_FLAGS_MANIFEST;
+			if ((watchsecs = atoi(optarg)) <= 0) {
+				usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'x':
 			rebuildindexes = 1;
 			break;
@@ -289,6 +309,12 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	/* -w keeps the volume usable by afpd and needs a database to rebuild */
+	if (watchsecs && (!rebuild || exclusive || nocniddb)) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
 	if ((optind + 1) != argc) {
 		usage();
 		exit(EXIT_FAILURE);
@@ -458,9 +484,16 @@ int main(int argc, char **argv)
 			dbd_log(LOGSTD, "Error dumping database");
 		}
 	} else if ((rebuild && !nocniddb) || scan) {
+		if (watchsecs)
+			(void) scan_watch_init();
 		if (cmd_dbd_scanvol(dbd, &volinfo, flags) < 0) {
 			dbd_log(LOGSTD, "Error repairing database.");
 		}
+		/* -w: again whenever the volume changes, until we're told to stop */
+		while (watchsecs && scan_watch_wait() == 0) {
+			if (cmd_dbd_scanvol(dbd, &volinfo, flags) < 0)
+				dbd_log(LOGSTD, "Error repairing database.");
+		}
 	}
 
       cleanup:
@@ -15,6 +15,7 @@ typedef unsigned int dbd_flags_t;
 #define DBD_FLAGS_EXCL     (1 << 2)
 #define DBD_FLAGS_CLEANUP  (1 << 3) /* Dont create AD stuff, but cleanup orphaned */
 #define DBD_FLAGS_STATS    (1 << 4)
+#define DBD_FLAGS_MANIFEST (1 << 5) /* only look into directories changed since the last run */
 
 #define ADv2_DIRNAME ".AppleDouble"
 
@@ -25,12 +26,75 @@ typedef unsigned int dbd_flags_t;
         (strcmp(a,c) b 0)
 
 extern int nocniddb; /* Dont open CNID database, only scan filesystem */
+extern int scanthreads; /* prefetch threads walking ahead of the scan */
+extern int watchsecs; /* -w: rescan at least every watchsecs seconds */
 extern int db_locked; /* have we got the fcntl lock on lockfd ? */
 extern volatile sig_atomic_t alarmed;
 
 void dbd_log(enum logtype lt, char *fmt, ...);
 int cmd_dbd_scanvol(DBD *dbd, struct volinfo *volinfo, dbd_flags_t flags);
 
+/* cmd_dbd_prefetch.c */
+struct scan_prefetch_stat {
+    unsigned long long dirs;
+    unsigned long long objects;
+    unsigned long long headers; /* AppleDouble and EA headers read */
+    unsigned long long steals;  /* directories taken from another thread */
+};
+
+int scan_prefetch_start(const struct volinfo *vi, int threads);
+void scan_prefetch_progress(unsigned long long scanned);
+void scan_prefetch_stop(struct scan_prefetch_stat *st);
+
+/* cmd_dbd_manifest.c */
+struct mf_dir {
+    u_int32_t md_len;       /* whole record */
+    cnid_t    md_cnid;
+    cnid_t    md_did;       /* parent */
+    u_int32_t md_nfiles;    /* CNIDs of the objects but directories */
+    u_int32_t md_nsubs;     /* subdirectories */
+    u_int32_t md_pad;
+    u_int64_t md_dev;
+    u_int64_t md_ino;
+    int64_t   md_mtime;     /* 0: look into it next time */
+    int64_t   md_ctime;
+    int64_t   md_admtime;   /* of .AppleDouble, 0 if there's none */
+    int64_t   md_adctime;
+};
+
+struct mf_build {
+    struct mf_dir mb_dir;
+    cnid_t        *mb_files;
+    u_int32_t     mb_filealloc;
+    unsigned char *mb_subs;
+    size_t        mb_sublen;
+    size_t        mb_suballoc;
+};
+
+int mf_load(const char *dbdir, const char *stamp);
+const struct mf_dir *mf_find(cnid_t cnid);
+int mf_subdirs(const struct mf_dir *dir, int (*fn)(const char *name, cnid_t cnid, void *arg), void *arg);
+int mf_begin(const char *dbdir, const char *stamp);
+int mf_put(struct mf_build *b);
+int mf_copy(const struct mf_dir *dir);
+int mf_carry(const struct mf_dir *dir);
+int mf_commit(void);
+void mf_abort(void);
+long mf_vanished(int (*fn)(cnid_t cnid, void *arg), void *arg);
+void mf_stats(unsigned long long *dirs, unsigned long long *carried);
+void mf_free(void);
+void mf_build_init(struct mf_build *b, cnid_t cnid, cnid_t did);
+int mf_build_file(struct mf_build *b, cnid_t cnid);
+int mf_build_sub(struct mf_build *b, const char *name, cnid_t cnid);
+void mf_build_free(struct mf_build *b);
+
+/* cmd_dbd_watch.c */
+int scan_watch_init(void);
+void scan_watch_dir(cnid_t did);
+int scan_watch_wait(void);
+void scan_watch_prune(int manifest);
+int scan_watch_wanted(cnid_t did);
+
 /*
   Functions for querying the database which couldn't be reused from the existing
   funcs pool of dbd_* for one reason or another
@@ -0,0 +1,535 @@
+/*
+  Volume manifest for dbd -m
+  ==========================
+
+  .AppleDB/manifest describes every directory of the volume as of the last
+  rebuild: its CNID, dev/ino, mtime and ctime, those of its .AppleDouble
+  directory, the CNIDs of its objects and the names and CNIDs of its
+  subdirectories. A directory's times change whenever an object in it is
+  created, deleted or renamed, so if they are the same as in the manifest
+  the scanner doesn't have to look at the objects again, it takes them from
+  the manifest and goes on with the subdirectories.
+
+  Records are looked up by the directory's CNID, so a directory that has
+  been moved, and keeps its CNID, is found too. Times of directories changed
+  while the scan was running aren't trusted, they are written as 0 and the
+  directory is looked into next time.
+
+  The CNIDs of the old manifest that aren't in the new one belong to objects
+  that have vanished, mf_vanished() hands them out. This needs the scan to
+  have been complete.
+*/
+
+#include "config.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+
+#include <atalk/cnid_dbd_private.h>
+
+#include "cmd_dbd.h"
+
+#define MF_NAME    "manifest"
+#define MF_MAGIC   0x444d4e46	/* "DMNF" */
+#define MF_VERSION 1
+
+#define MF_ALIGN(len) (((len) + 7) & ~7)
+
+struct mf_hdr {
+	u_int32_t mh_magic;
+	u_int32_t mh_version;
+	char mh_stamp[CNID_DEV_LEN];
+};
+
+/* a subdirectory, followed by its name and a 0, padded to 8 bytes */
+struct mf_sub {
+	cnid_t ms_cnid;
+	u_int16_t ms_len;	/* whole entry */
+	u_int16_t ms_namelen;
+};
+
+#define MF_SUBNAME(sub) ((const char *) ((const struct mf_sub *) (sub) + 1))
+#define MF_FILES(dir)   ((const cnid_t *) ((const struct mf_dir *) (dir) + 1))
+#define MF_SUBS(dir)    ((const unsigned char *) (MF_FILES(dir) + MF_ALIGN((dir)->md_nfiles * sizeof(cnid_t)) / sizeof(cnid_t)))
+
+/* the old manifest */
+static unsigned char *mf_buf;
+static size_t mf_len;
+static u_int32_t *mf_hash;	/* record offset + 1 by CNID */
+static u_int32_t mf_hsize;
+
+/* the new one */
+static FILE *mf_out;
+static char *mf_path, *mf_tmp;
+static unsigned char *mf_seen;	/* bitmap of the CNIDs in it */
+static size_t mf_seenlen;
+static unsigned long long mf_dirs, mf_carried;
+
+/* ------------------------ CNID bitmap */
+static int seen_set(cnid_t cnid)
+{
+	u_int32_t id = ntohl(cnid);
+	size_t len;
+	unsigned char *p;
+
+	if (id / 8 >= mf_seenlen) {
+		for (len = mf_seenlen ? mf_seenlen : 65536; id / 8 >= len;
+		     len *= 2);
+		if ((p = realloc(mf_seen, len)) == NULL)
+			return -1;
+		memset(p + mf_seenlen, 0, len - mf_seenlen);
+		mf_seen = p;
+		mf_seenlen = len;
+	}
+	mf_seen[id / 8] |= 1 << (id % 8);
+	return 0;
+}
+
+static int seen_isset(cnid_t cnid)
+{
+	u_int32_t id = ntohl(cnid);
+
+	return id / 8 < mf_seenlen && (mf_seen[id / 8] & (1 << (id % 8)));
+}
+
+/* ------------------------ the old manifest */
+static u_int32_t hashof(cnid_t cnid)
+{
+	return (ntohl(cnid) * 2654435761U) & (mf_hsize - 1);
+}
+
+static const struct mf_dir *dir_at(u_int32_t off)
+{
+	return (const struct mf_dir *) (mf_buf + off);
+}
+
+static int mf_index(void)
+{
+	const struct mf_dir *dir;
+	size_t off, n = 0;
+	u_int32_t h;
+
+	for (off = sizeof(struct mf_hdr); off < mf_len; off += dir->md_len) {
+		dir = dir_at(off);
+		if (off + sizeof(*dir) > mf_len || dir->md_len < sizeof(*dir)
+		    || dir->md_len % 8 || off + dir->md_len > mf_len)
+			return -1;
+		n++;
+	}
+	for (mf_hsize = 1024; mf_hsize < 2 * n; mf_hsize *= 2);
+	if ((mf_hash = calloc(mf_hsize, sizeof(*mf_hash))) == NULL)
+		return -1;
+
+	for (off = sizeof(struct mf_hdr); off < mf_len; off += dir->md_len) {
+		dir = dir_at(off);
+		for (h = hashof(dir->md_cnid); mf_hash[h];
+		     h = (h + 1) & (mf_hsize - 1));
+		mf_hash[h] = off + 1;
+	}
+	return 0;
+}
+
+static char *mf_mkpath(const char *dbdir)
+{
+	char *path;
+
+	if ((path = malloc(strlen(dbdir) + sizeof(MF_NAME) + 1)) == NULL)
+		return NULL;
+	sprintf(path, "%s/%s", dbdir, MF_NAME);
+	return path;
+}
+
+/*!
+ * Load the manifest of the CNID database directory dbdir written for the
+ * database with stamp
+ *
+ * @returns 0 or -1 if there's none or it's for another database
+ */
+int mf_load(const char *dbdir, const char *stamp)
+{
+	struct mf_hdr *hdr;
+	struct stat st;
+	ssize_t n;
+	size_t got;
+	char *path;
+	int fd;
+
+	mf_free();
+	if ((path = mf_mkpath(dbdir)) == NULL)
+		return -1;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr)
+	    || (mf_buf = malloc(st.st_size)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	for (got = 0; got < (size_t) st.st_size; got += n) {
+		if ((n = read(fd, mf_buf + got, st.st_size - got)) <= 0) {
+			close(fd);
+			mf_free();
+			return -1;
+		}
+	}
+	close(fd);
+	mf_len = got;
+
+	hdr = (struct mf_hdr *) mf_buf;
+	if (hdr->mh_magic != MF_MAGIC || hdr->mh_version != MF_VERSION
+	    || memcmp(hdr->mh_stamp, stamp, CNID_DEV_LEN)
+	    || mf_index() < 0) {
+		dbd_log(LOGSTD, "Ignoring manifest of another database");
+		mf_free();
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * The record of directory cnid in the old manifest, NULL if there's none
+ */
+const struct mf_dir *mf_find(cnid_t cnid)
+{
+	u_int32_t h;
+
+	if (mf_hash == NULL)
+		return NULL;
+	for (h = hashof(cnid); mf_hash[h]; h = (h + 1) & (mf_hsize - 1)) {
+		if (dir_at(mf_hash[h] - 1)->md_cnid == cnid)
+			return dir_at(mf_hash[h] - 1);
+	}
+	return NULL;
+}
+
+/*!
+ * Call fn for every subdirectory of dir, stop if it returns != 0
+ */
+int mf_subdirs(const struct mf_dir *dir,
+	       int (*fn) (const char *name, cnid_t cnid, void *arg),
+	       void *arg)
+{
+	const unsigned char *p = MF_SUBS(dir);
+	const struct mf_sub *sub;
+	u_int32_t i;
+	int ret;
+
+	for (i = 0; i < dir->md_nsubs; i++, p += sub->ms_len) {
+		sub = (const struct mf_sub *) p;
+		if ((ret = fn(MF_SUBNAME(sub), sub->ms_cnid, arg)) != 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* ------------------------ the new manifest */
+
+/*!
+ * Start writing a new manifest for dbdir, mf_commit() replaces the old one
+ * with it. Without it the CNIDs are only remembered for mf_vanished().
+ */
+int mf_begin(const char *dbdir, const char *stamp)
+{
+	struct mf_hdr hdr;
+	int fd;
+
+	if ((mf_path = mf_mkpath(dbdir)) == NULL
+	    || (mf_tmp = malloc(strlen(mf_path) + 8)) == NULL)
+		goto error;
+	strcpy(mf_tmp, mf_path);
+	strcat(mf_tmp, ".XXXXXX");
+	if ((fd = mkstemp(mf_tmp)) < 0) {
+		free(mf_tmp);
+		mf_tmp = NULL;
+		goto error;
+	}
+	if ((mf_out = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		goto error;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.mh_magic = MF_MAGIC;
+	hdr.mh_version = MF_VERSION;
+	memcpy(hdr.mh_stamp, stamp, CNID_DEV_LEN);
+	if (fwrite(&hdr, sizeof(hdr), 1, mf_out) != 1)
+		goto error;
+	return 0;
+
+      error:
+	dbd_log(LOGSTD, "Can't write manifest: %s", strerror(errno));
+	mf_abort();
+	return -1;
+}
+
+static int mf_write(const void *buf, size_t len)
+{
+	if (mf_out && len && fwrite(buf, len, 1, mf_out) != 1) {
+		dbd_log(LOGSTD, "Can't write manifest: %s",
+			strerror(errno));
+		mf_abort();
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Add a directory record, built with mf_build_*()
+ */
+int mf_put(struct mf_build *b)
+{
+	static const char zero[8];
+	u_int32_t i;
+
+	b->mb_dir.md_len = sizeof(b->mb_dir)
+	    + MF_ALIGN(b->mb_dir.md_nfiles * sizeof(cnid_t)) + b->mb_sublen;
+	mf_dirs++;
+
+	if (seen_set(b->mb_dir.md_cnid) < 0)
+		return -1;
+	for (i = 0; i < b->mb_dir.md_nfiles; i++)
+		if (seen_set(b->mb_files[i]) < 0)
+			return -1;
+	/* a subdirectory whose scan failed has no record of its own */
+	for (i = 0; i < b->mb_sublen;
+	     i += ((struct mf_sub *) (b->mb_subs + i))->ms_len)
+		if (seen_set(((struct mf_sub *) (b->mb_subs + i))->ms_cnid) < 0)
+			return -1;
+
+	if (mf_out == NULL)
+		return 0;
+	if (mf_write(&b->mb_dir, sizeof(b->mb_dir)) < 0
+	    || mf_write(b->mb_files, b->mb_dir.md_nfiles * sizeof(cnid_t)) < 0
+	    || mf_write(zero, MF_ALIGN(b->mb_dir.md_nfiles * sizeof(cnid_t))
+			- b->mb_dir.md_nfiles * sizeof(cnid_t)) < 0
+	    || mf_write(b->mb_subs, b->mb_sublen) < 0)
+		return -1;
+	return 0;
+}
+
+/*!
+ * Add the record of dir of the old manifest as it is
+ */
+int mf_copy(const struct mf_dir *dir)
+{
+	const unsigned char *p = MF_SUBS(dir);
+	const cnid_t *files = MF_FILES(dir);
+	u_int32_t i;
+
+	mf_dirs++;
+	if (seen_set(dir->md_cnid) < 0)
+		return -1;
+	for (i = 0; i < dir->md_nfiles; i++)
+		if (seen_set(files[i]) < 0)
+			return -1;
+	for (i = 0; i < dir->md_nsubs;
+	     i++, p += ((const struct mf_sub *) p)->ms_len)
+		if (seen_set(((const struct mf_sub *) p)->ms_cnid) < 0)
+			return -1;
+	return mf_write(dir, dir->md_len);
+}
+
+static int carry(const struct mf_dir *dir, int depth)
+{
+	const unsigned char *p = MF_SUBS(dir);
+	const struct mf_dir *sub;
+	u_int32_t i;
+
+	/* loops can only come from a broken manifest */
+	if (depth > MAXPATHLEN / 2 || mf_copy(dir) < 0)
+		return -1;
+	mf_carried++;
+	for (i = 0; i < dir->md_nsubs;
+	     i++, p += ((const struct mf_sub *) p)->ms_len) {
+		if ((sub = mf_find(((const struct mf_sub *) p)->ms_cnid))
+		    && carry(sub, depth + 1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Add the records of dir and everything below it from the old manifest
+ */
+int mf_carry(const struct mf_dir *dir)
+{
+	return carry(dir, 0);
+}
+
+/*!
+ * Replace the old manifest with the new one
+ */
+int mf_commit(void)
+{
+	if (mf_out == NULL)
+		return -1;
+	if (fflush(mf_out) != 0 || fsync(fileno(mf_out)) < 0
+	    || rename(mf_tmp, mf_path) < 0) {
+		dbd_log(LOGSTD, "Can't write manifest: %s",
+			strerror(errno));
+		mf_abort();
+		return -1;
+	}
+	fclose(mf_out);
+	mf_out = NULL;
+	free(mf_tmp);
+	mf_tmp = NULL;
+	free(mf_path);
+	mf_path = NULL;
+	return 0;
+}
+
+/*!
+ * Throw the new manifest away, the old one stays
+ */
+void mf_abort(void)
+{
+	if (mf_out) {
+		fclose(mf_out);
+		mf_out = NULL;
+	}
+	if (mf_tmp) {
+		unlink(mf_tmp);
+		free(mf_tmp);
+		mf_tmp = NULL;
+	}
+	free(mf_path);
+	mf_path = NULL;
+}
+
+/* ------------------------ */
+
+/*!
+ * Call fn for every CNID of the old manifest that isn't in the new one
+ *
+ * @returns number of CNIDs, -1 if fn failed
+ */
+long mf_vanished(int (*fn) (cnid_t cnid, void *arg), void *arg)
+{
+	const struct mf_dir *dir;
+	const unsigned char *p;
+	const cnid_t *files;
+	size_t off;
+	u_int32_t i;
+	long n = 0;
+
+#define MF_VANISHED(cnid)						\
+	if (!seen_isset(cnid)) {					\
+		if (seen_set(cnid) < 0 || fn((cnid), arg) != 0)		\
+			return -1;					\
+		n++;							\
+	}
+
+	if (mf_buf == NULL)
+		return 0;
+	for (off = sizeof(struct mf_hdr); off < mf_len; off += dir->md_len) {
+		dir = dir_at(off);
+		MF_VANISHED(dir->md_cnid);
+		files = MF_FILES(dir);
+		for (i = 0; i < dir->md_nfiles; i++) {
+			MF_VANISHED(files[i]);
+		}
+		p = MF_SUBS(dir);
+		for (i = 0; i < dir->md_nsubs;
+		     i++, p += ((const struct mf_sub *) p)->ms_len) {
+			MF_VANISHED(((const struct mf_sub *) p)->ms_cnid);
+		}
+	}
+	return n;
+#undef MF_VANISHED
+}
+
+/*!
+ * Directory records written and how many of them carried over with mf_carry()
+ */
+void mf_stats(unsigned long long *dirs, unsigned long long *carried)
+{
+	*dirs = mf_dirs;
+	*carried = mf_carried;
+}
+
+/*!
+ * Forget both manifests
+ */
+void mf_free(void)
+{
+	mf_abort();
+	free(mf_buf);
+	mf_buf = NULL;
+	mf_len = 0;
+	free(mf_hash);
+	mf_hash = NULL;
+	mf_hsize = 0;
+	free(mf_seen);
+	mf_seen = NULL;
+	mf_seenlen = 0;
+	mf_dirs = mf_carried = 0;
+}
+
+/* ------------------------ building a record */
+
+void mf_build_init(struct mf_build *b, cnid_t cnid, cnid_t did)
+{
+	memset(b, 0, sizeof(*b));
+	b->mb_dir.md_cnid = cnid;
+	b->mb_dir.md_did = did;
+}
+
+int mf_build_file(struct mf_build *b, cnid_t cnid)
+{
+	cnid_t *p;
+
+	if (b->mb_dir.md_nfiles == b->mb_filealloc) {
+		b->mb_filealloc = b->mb_filealloc ? 2 * b->mb_filealloc : 64;
+		if ((p = realloc(b->mb_files,
+				 b->mb_filealloc * sizeof(cnid_t))) == NULL)
+			return -1;
+		b->mb_files = p;
+	}
+	b->mb_files[b->mb_dir.md_nfiles++] = cnid;
+	return 0;
+}
+
+int mf_build_sub(struct mf_build *b, const char *name, cnid_t cnid)
+{
+	struct mf_sub *sub;
+	size_t namelen = strlen(name);
+	size_t len = MF_ALIGN(sizeof(*sub) + namelen + 1);
+	unsigned char *p;
+
+	if (namelen > MAXPATHLEN)
+		return -1;
+	if (b->mb_sublen + len > b->mb_suballoc) {
+		while (b->mb_sublen + len > b->mb_suballoc)
+			b->mb_suballoc =
+			    b->mb_suballoc ? 2 * b->mb_suballoc : 1024;
+		if ((p = realloc(b->mb_subs, b->mb_suballoc)) == NULL)
+			return -1;
+		b->mb_subs = p;
+	}
+	sub = (struct mf_sub *) (b->mb_subs + b->mb_sublen);
+	memset(sub, 0, len);
+	sub->ms_cnid = cnid;
+	sub->ms_len = len;
+	sub->ms_namelen = namelen;
+	memcpy(sub + 1, name, namelen);
+	b->mb_sublen += len;
+	b->mb_dir.md_nsubs++;
+	return 0;
+}
+
+void mf_build_free(struct mf_build *b)
+{
+	free(b->mb_files);
+	free(b->mb_subs);
+	memset(b, 0, sizeof(*b));
+}
@@ -0,0 +1,397 @@
+/*
+  Volume prefetch for dbd -s|-r
+  =============================
+
+  The scanner in cmd_dbd_scanvol.c walks the volume depth first: for every
+  object it runs lstat(), opens the AppleDouble file, maybe the EA header,
+  and asks the database, one synchronous call after the other. On a cold cache
+  nearly every one of them waits for the disk, so a big volume takes hours
+  mostly spent waiting.
+
+  The scanner stays as it is, it is the only one that changes anything on the
+  volume or in the database, so what it does and reports doesn't change. A
+  pool of threads walks the volume ahead of it and gets what it is going to
+  need into the cache: the directories, the inodes, the .AppleDouble
+  directories and the headers of the AppleDouble and EA files.
+
+  The threads share nothing with the scanner but the counters below. They
+  don't use the cwd, every directory is opened with openat() relative to the
+  volume root and read with fdopendir(), and they block all signals. A
+  directory is a task, every thread has its own queue of them: it takes the
+  newest task from its queue and puts the subdirectories it finds there, in
+  reverse order so it goes on with the first one like the scanner does. A
+  thread without tasks steals the oldest one from another thread's queue.
+
+  The threads stay at most PF_AHEAD objects ahead of the scanner, which
+  reports its progress with scan_prefetch_progress(), so what they read is
+  still in the cache when the scanner gets there.
+*/
+
+#include "config.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <atalk/adouble.h>
+#include <atalk/volinfo.h>
+#include <atalk/volume.h>
+#include <atalk/cnid_dbd_private.h>
+
+#include "cmd_dbd.h"
+
+#define PF_AHEAD   65536	/* objects the threads may be ahead */
+#define PF_HDRSIZ  1024		/* bytes read of AppleDouble and EA headers */
+
+struct pf_task {
+	struct pf_task *next, *prev;
+	char path[1];		/* relative to the volume root, "." for it */
+};
+
+struct pf_thread {
+	pthread_t tid;
+	pthread_mutex_t lock;	/* of the queue */
+	struct pf_task *newest, *oldest;
+};
+
+static struct pf_thread *threads;
+static int nqueues;
+static int nthreads;		/* running */
+static int rootfd = -1;
+static int ea_ad;		/* EAs in .AppleDouble/name::EA */
+
+/* all below under lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;	/* tasks queued or stop */
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;	/* scanner caught up */
+static int idle;		/* threads waiting for work */
+static int stop;		/* see STOPPED() */
+static unsigned long long scanned;	/* by the scanner */
+static struct scan_prefetch_stat pfstat;
+
+/* no threads run when start clears it, after that it is only touched
+ * atomically: prefetch_dir() peeks without the lock */
+#define STOPPED()  __sync_fetch_and_add(&stop, 0)
+#define STOP()     __sync_lock_test_and_set(&stop, 1)
+
+static int skip_dir(const char *path, const char *name)
+{
+	if (!strcmp(name, ADv2_DIRNAME) || !strcmp(name, ".AppleDB")
+	    || !strcmp(name, ".AppleDesktop"))
+		return 1;
+	/* the scanner ignores these in the volume root */
+	return !strcmp(path, ".") && !strcmp(name, ".zfs");
+}
+
+/* ------------------------ queues */
+static void push(struct pf_thread *t, struct pf_task *task)
+{
+	pthread_mutex_lock(&t->lock);
+	task->prev = NULL;
+	if ((task->next = t->newest) != NULL)
+		t->newest->prev = task;
+	else
+		t->oldest = task;
+	t->newest = task;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* the newest of our own tasks or the oldest of somebody else's */
+static struct pf_task *pop(struct pf_thread *t)
+{
+	struct pf_task *task;
+	int i;
+
+	pthread_mutex_lock(&t->lock);
+	if ((task = t->newest) != NULL) {
+		if ((t->newest = task->next) != NULL)
+			t->newest->prev = NULL;
+		else
+			t->oldest = NULL;
+	}
+	pthread_mutex_unlock(&t->lock);
+	if (task)
+		return task;
+
+	for (i = 1; i < nthreads && !task; i++) {
+		struct pf_thread *v = &threads[(t - threads + i) % nthreads];
+
+		pthread_mutex_lock(&v->lock);
+		if ((task = v->oldest) != NULL) {
+			if ((v->oldest = task->prev) != NULL)
+				v->oldest->next = NULL;
+			else
+				v->newest = NULL;
+		}
+		pthread_mutex_unlock(&v->lock);
+	}
+	if (task) {
+		pthread_mutex_lock(&lock);
+		pfstat.steals++;
+		pthread_mutex_unlock(&lock);
+	}
+	return task;
+}
+
+static struct pf_task *new_task(const char *path, const char *name)
+{
+	struct pf_task *task;
+	size_t len = strlen(path) + 1 + strlen(name);
+
+	if ((task = malloc(sizeof(*task) + len)) == NULL)
+		return NULL;
+	if (!strcmp(path, "."))
+		strcpy(task->path, name);
+	else
+		sprintf(task->path, "%s/%s", path, name);
+	return task;
+}
+
+/* ------------------------ the work */
+static int read_header(int dirfd, const char *path, char *buf)
+{
+	int fd, ret;
+
+	if ((fd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW)) < 0)
+		return 0;
+	ret = (read(fd, buf, PF_HDRSIZ) > 0);
+	close(fd);
+	return ret;
+}
+
+/* what read_addir() looks at */
+static void read_addir(int dirfd)
+{
+	DIR *dp;
+	int fd;
+
+	if ((fd = openat(dirfd, ADv2_DIRNAME,
+			 O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0)
+		return;
+	if ((dp = fdopendir(fd)) == NULL) {
+		close(fd);
+		return;
+	}
+	while (readdir(dp) != NULL);
+	closedir(dp);
+}
+
+static void prefetch_dir(struct pf_thread *t, struct pf_task *task)
+{
+	char hdr[PF_HDRSIZ], adpath[MAXPATHLEN + 1];
+	struct pf_task *subdirs = NULL, *sub;
+	struct dirent *ep;
+	struct stat st;
+	unsigned long long objects = 0, headers = 0;
+	DIR *dp;
+	int fd;
+
+	if ((fd = openat(rootfd, task->path,
+			 O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0)
+		return;
+	if ((dp = fdopendir(fd)) == NULL) {
+		close(fd);
+		return;
+	}
+
+	read_addir(fd);
+	headers += read_header(fd, ADv2_DIRNAME "/.Parent", hdr);
+	if (ea_ad)
+		headers += read_header(fd, ADv2_DIRNAME "/.Parent::EA", hdr);
+
+	while ((ep = readdir(dp)) != NULL && !STOPPED()) {
+		if (DIR_DOT_OR_DOTDOT(ep->d_name))
+			continue;
+		/* counted like the scanner counts */
+		objects++;
+		if (fstatat(fd, ep->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			if (skip_dir(task->path, ep->d_name))
+				continue;
+			/* the subdirectory's header comes with its task */
+			if ((sub = new_task(task->path, ep->d_name)) != NULL) {
+				sub->next = subdirs;
+				subdirs = sub;
+			}
+			continue;
+		}
+		if (!S_ISREG(st.st_mode))
+			continue;
+
+		if ((size_t) snprintf(adpath, sizeof(adpath), "%s/%s",
+				      ADv2_DIRNAME, ep->d_name)
+		    >= sizeof(adpath))
+			continue;
+		headers += read_header(fd, adpath, hdr);
+		if (ea_ad && strlen(adpath) + 4 < sizeof(adpath)) {
+			strcat(adpath, "::EA");
+			headers += read_header(fd, adpath, hdr);
+		}
+	}
+	closedir(dp);
+
+	/* subdirs has the last one first, so the first one ends up newest */
+	while ((sub = subdirs) != NULL) {
+		subdirs = sub->next;
+		push(t, sub);
+	}
+
+	pthread_mutex_lock(&lock);
+	pfstat.dirs++;
+	pfstat.objects += objects;
+	pfstat.headers += headers;
+	if (idle)
+		pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+}
+
+static void *worker(void *arg)
+{
+	struct pf_thread *t = arg;
+	struct pf_task *task;
+
+	pthread_mutex_lock(&lock);
+	while (!STOPPED()) {
+		if (pfstat.objects > scanned + PF_AHEAD) {
+			pthread_cond_wait(&room, &lock);
+			continue;
+		}
+		pthread_mutex_unlock(&lock);
+
+		if ((task = pop(t)) != NULL) {
+			prefetch_dir(t, task);
+			free(task);
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&lock);
+		/* idle threads don't queue tasks, so if all are idle we're done */
+		if (++idle == nthreads) {
+			STOP();
+			pthread_cond_broadcast(&work);
+		} else if (!STOPPED()) {
+			/* stop may have broadcast while we were popping */
+			pthread_cond_wait(&work, &lock);
+		}
+		idle--;
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* ------------------------ interface */
+
+/*!
+ * Start n threads walking the volume vi ahead of the scanner
+ *
+ * @returns 0 on success, -1 if there is no prefetch
+ */
+int scan_prefetch_start(const struct volinfo *vi, int n)
+{
+	sigset_t sigs, oldsigs;
+	struct pf_task *root;
+
+	if (n <= 0)
+		return -1;
+	if ((rootfd = open(vi->v_path, O_RDONLY | O_DIRECTORY)) < 0)
+		return -1;
+	if ((threads = calloc(n, sizeof(*threads))) == NULL
+	    || (root = new_task(".", ".")) == NULL) {
+		free(threads);
+		threads = NULL;
+		close(rootfd);
+		rootfd = -1;
+		return -1;
+	}
+	ea_ad = (vi->v_vfs_ea == AFPVOL_EA_AD);
+	stop = idle = 0;
+	scanned = 0;
+	memset(&pfstat, 0, sizeof(pfstat));
+
+	for (nqueues = 0; nqueues < n; nqueues++)
+		pthread_mutex_init(&threads[nqueues].lock, NULL);
+	root->next = root->prev = NULL;
+	threads[0].newest = threads[0].oldest = root;
+
+	/* the threads inherit the mask, signals are for the scanner */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_SETMASK, &sigs, &oldsigs);
+	/* they wait for the lock until nthreads is right */
+	pthread_mutex_lock(&lock);
+	for (nthreads = 0; nthreads < n; nthreads++) {
+		if (pthread_create(&threads[nthreads].tid, NULL, worker,
+				   &threads[nthreads]) != 0) {
+			dbd_log(LOGSTD, "Can't start prefetch thread: %s",
+				strerror(errno));
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	if (nthreads == 0) {
+		scan_prefetch_stop(NULL);
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * The scanner has looked at n objects
+ */
+void scan_prefetch_progress(unsigned long long n)
+{
+	if (!threads)
+		return;
+	pthread_mutex_lock(&lock);
+	scanned = n;
+	if (pfstat.objects <= scanned + PF_AHEAD / 2)
+		pthread_cond_broadcast(&room);
+	pthread_mutex_unlock(&lock);
+}
+
+/*!
+ * Stop the threads, drop what they haven't done and tell what they did
+ */
+void scan_prefetch_stop(struct scan_prefetch_stat *st)
+{
+	struct pf_task *task;
+	int i;
+
+	if (!threads)
+		return;
+
+	pthread_mutex_lock(&lock);
+	STOP();
+	pthread_cond_broadcast(&work);
+	pthread_cond_broadcast(&room);
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i].tid, NULL);
+	for (i = 0; i < nqueues; i++) {
+		while ((task = threads[i].newest) != NULL) {
+			threads[i].newest = task->next;
+			free(task);
+		}
+		pthread_mutex_destroy(&threads[i].lock);
+	}
+	if (st)
+		*st = pfstat;
+
+	free(threads);
+	threads = NULL;
+	nqueues = nthreads = 0;
+	close(rootfd);
+	rootfd = -1;
+}
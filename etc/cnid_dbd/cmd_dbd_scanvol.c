@@ -23,6 +23,7 @@
 #include <string.h>
 #include <errno.h>
 #include <setjmp.h>
+#include <time.h>
 
 #include <atalk/adouble.h>
 #include <atalk/unicode.h>
@@ -32,6 +33,7 @@
 #include <atalk/ea.h>
 #include <atalk/util.h>
 #include <atalk/acl.h>
+#include <atalk/catindex.h>
 
 #include "cmd_dbd.h"
 #include "dbif.h"
@@ -65,6 +67,25 @@ static struct cnid_dbd_rply rply;
 static jmp_buf jmp;
 static struct vol volume;	/* fake it for ea_open */
 static char pname[MAXPATHLEN] = "../";
+static catindex_t *catidx;	/* catalog index we're building */
+
+/* directory entries looked at, for the prefetch threads and -t */
+static unsigned long long seen;
+static time_t scanstart;
+
+/* -m: building a manifest, and skipping what the old one says is unchanged */
+static int manifest;
+static int incremental;
+static unsigned long long dirs_unchanged, dirs_scanned;
+
+/*
+  Commits don't wait for the log to reach the disk, every SCAN_GROUP commits
+  share one log flush. A crash loses the last ones, a scan run again redoes
+  them.
+*/
+#define SCAN_GROUP 1000
+static unsigned int unflushed;
+static unsigned long long commits, flushes;
 
 /*
   Taken from afpd/desktop.c
@@ -730,6 +751,83 @@ static int read_addir(void)
 	return 0;
 }
 
+/*
+  dbif_txn_close() with group commit, see SCAN_GROUP
+*/
+static int scan_log_flush(void)
+{
+	if (unflushed == 0)
+		return 0;
+	unflushed = 0;
+	flushes++;
+	if (dbif_log_flush(dbd) < 0
+	    || (dbd_rebuild && dbif_log_flush(dbd_rebuild) < 0)) {
+		dbd_log(LOGSTD, "Error flushing the database log");
+		return -1;
+	}
+	return 0;
+}
+
+static int scan_txn_close(DBD * db, int ret)
+{
+	if (ret != 1)
+		return dbif_txn_close(db, ret);
+
+	if (dbif_txn_commit_nosync(db) < 0) {
+		dbd_log(LOGSTD, "Fatal error committing transaction");
+		return -1;
+	}
+	commits++;
+	if (++unflushed >= SCAN_GROUP)
+		return scan_log_flush();
+	return 0;
+}
+
+/*
+  Add an object to the catalog index for afpd's FPCatSearch
+*/
+static void index_object(const char *name, cnid_t did, cnid_t cnid,
+			 const struct stat *st, int adflags)
+{
+	struct catindex_rec rec;
+	struct adouble ad;
+	u_int32_t date;
+	char *mname;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.cr_isdir = S_ISDIR(st->st_mode);
+	rec.cr_cnid = cnid;
+	rec.cr_did = did;
+	rec.cr_cdate = rec.cr_mdate = rec.cr_bdate = st->st_mtime;
+
+	ad_init(&ad, myvolinfo->v_adouble, myvolinfo->v_ad_options);
+	if (ad_metadata(name, adflags, &ad) == 0) {
+		if (ad_getdate(&ad, AD_DATE_CREATE, &date) >= 0)
+			rec.cr_cdate = AD_DATE_TO_UNIX(date);
+		if (ad_getdate(&ad, AD_DATE_BACKUP, &date) >= 0)
+			rec.cr_bdate = AD_DATE_TO_UNIX(date);
+		ad_getattr(&ad, &rec.cr_attr);
+		if (ad_entry(&ad, ADEID_FINDERI)) {
+			memcpy(&rec.cr_type,
+			       ad_entry(&ad, ADEID_FINDERI) + FINDERINFO_FRTYPEOFF,
+			       sizeof(rec.cr_type));
+			memcpy(&rec.cr_creator,
+			       ad_entry(&ad, ADEID_FINDERI) + FINDERINFO_FRCREATOFF,
+			       sizeof(rec.cr_creator));
+			memcpy(&rec.cr_fdflags,
+			       ad_entry(&ad, ADEID_FINDERI) + FINDERINFO_FRFLAGOFF,
+			       sizeof(rec.cr_fdflags));
+		}
+		ad_close_metadata(&ad);
+	}
+
+	if ((mname = utompath((char *) name)) == NULL)
+		return;
+	if (catindex_put(catidx, &rec, mname) != 0)
+		dbd_log(LOGSTD, "Error indexing '%s/%s': %s", cwdbuf, name,
+			strerror(errno));
+}
+
 /*
   Check CNID for a file/dir, both from db and from ad-file.
   For detailed specs see intro.
@@ -811,7 +909,7 @@ static cnid_t check_cnid(const char *name, cnid_t did, struct stat *st,
 	ret =
 	    dbd_lookup(dbd, &rqst, &rply,
 		       (dbd_flags & DBD_FLAGS_SCAN) ? 1 : 0);
-	if (dbif_txn_close(dbd, ret) != 0)
+	if (scan_txn_close(dbd, ret) != 0)
 		return CNID_INVALID;
 	if (rply.result == CNID_DBD_RES_OK) {
 		db_cnid = rply.cnid;
@@ -867,7 +965,7 @@ static cnid_t check_cnid(const char *name, cnid_t did, struct stat *st,
 			if (rply.result == CNID_DBD_RES_OK) {
 				/* Occupied! Choose another, update ad-file */
 				ret = dbd_add(dbd, &rqst, &rply, 1);
-				if (dbif_txn_close(dbd, ret) != 0)
+				if (scan_txn_close(dbd, ret) != 0)
 					return CNID_INVALID;
 				db_cnid = rply.cnid;
 				dbd_log(LOGSTD, "New CNID for '%s/%s': %u",
@@ -905,7 +1003,7 @@ static cnid_t check_cnid(const char *name, cnid_t did, struct stat *st,
 				cwdbuf, name, ntohl(ad_cnid));
 			rqst.cnid = ad_cnid;
 			ret = dbd_rebuild_add(dbd, &rqst, &rply);
-			if (dbif_txn_close(dbd, ret) != 0)
+			if (scan_txn_close(dbd, ret) != 0)
 				return CNID_INVALID;
 		}
 		return ad_cnid;
@@ -915,7 +1013,7 @@ static cnid_t check_cnid(const char *name, cnid_t did, struct stat *st,
 		if (!(dbd_flags & DBD_FLAGS_SCAN)) {
 			/* add to db */
 			ret = dbd_add(dbd, &rqst, &rply, 1);
-			if (dbif_txn_close(dbd, ret) != 0)
+			if (scan_txn_close(dbd, ret) != 0)
 				return CNID_INVALID;
 			db_cnid = rply.cnid;
 			dbd_log(LOGSTD, "New CNID for '%s/%s': %u", cwdbuf,
@@ -952,21 +1050,131 @@ static cnid_t check_cnid(const char *name, cnid_t did, struct stat *st,
 	return CNID_INVALID;
 }
 
+static int dbd_readdir(int volroot, cnid_t did, cnid_t pdid);
+
+/*
+  Enter the subdirectory name with CNID cnid of the directory did and scan it.
+*/
+static int scan_subdir(const char *name, cnid_t cnid, cnid_t did)
+{
+	const struct mf_dir *old;
+	int cwd, ret;
+
+	/* Nothing changed in there since the last -w pass, and it hasn't moved */
+	if (!scan_watch_wanted(cnid) && (old = mf_find(cnid)) != NULL
+	    && old->md_did == did)
+		return mf_carry(old);
+
+	strcat(cwdbuf, "/");
+	strcat(cwdbuf, name);
+	dbd_log(LOGDEBUG, "Entering directory: %s", cwdbuf);
+	ret = 0;
+	if (-1 == (cwd = open(".", O_RDONLY))) {
+		dbd_log(LOGSTD, "Cant open directory '%s': %s", cwdbuf,
+			strerror(errno));
+		goto exit;
+	}
+	if (0 != chdir(name)) {
+		dbd_log(LOGSTD, "Cant chdir to directory '%s': %s", cwdbuf,
+			strerror(errno));
+		close(cwd);
+		goto exit;
+	}
+
+	ret = dbd_readdir(0, cnid, did);
+
+	if (fchdir(cwd) < 0)
+		dbd_log(LOGSTD, "Cant chdir to directory '%i': %s", cwd,
+			strerror(errno));
+	close(cwd);
+
+      exit:
+	*(strrchr(cwdbuf, '/')) = 0;
+	return ret;
+}
+
+static int scan_mfsubdir(const char *name, cnid_t cnid, void *did)
+{
+	return scan_subdir(name, cnid, *(cnid_t *) did) < 0 ? -1 : 0;
+}
+
+/*
+  Fill in the manifest record of the directory we're in. Times from while
+  we're running can't be trusted, the directory may change again within
+  the same second.
+*/
+static void mf_stat(struct mf_dir *md)
+{
+	struct stat st;
+
+	if (lstat(".", &st) == 0) {
+		md->md_dev = st.st_dev;
+		md->md_ino = st.st_ino;
+		if (st.st_mtime < scanstart && st.st_ctime < scanstart) {
+			md->md_mtime = st.st_mtime;
+			md->md_ctime = st.st_ctime;
+		}
+	}
+	if (lstat(ADv2_DIRNAME, &st) == 0) {
+		if (st.st_mtime < scanstart && st.st_ctime < scanstart) {
+			md->md_admtime = st.st_mtime;
+			md->md_adctime = st.st_ctime;
+		} else {
+			md->md_mtime = md->md_ctime = 0;
+		}
+	}
+}
+
+static int mf_unchanged(const struct mf_dir *old, const struct mf_dir *md)
+{
+	return md->md_mtime != 0
+	    && ((myvolinfo->v_flags & AFPVOL_NODEV)
+		|| old->md_dev == md->md_dev)
+	    && old->md_ino == md->md_ino
+	    && old->md_mtime == md->md_mtime
+	    && old->md_ctime == md->md_ctime
+	    && old->md_admtime == md->md_admtime
+	    && old->md_adctime == md->md_adctime
+	    && old->md_did == md->md_did;
+}
+
 /*
   This is called recursively for all dirs.
   volroot=1 means we're in the volume root dir, 0 means we aren't.
   We use this when checking for netatalk private folders like .AppleDB.
-  did is our parents CNID.
+  did is our CNID, pdid our parents.
 */
-static int dbd_readdir(int volroot, cnid_t did)
+static int dbd_readdir(int volroot, cnid_t did, cnid_t pdid)
 {
-	int cwd, ret = 0, adflags, adfile_ok, addir_ok, encoding_ok;
+	int ret = 0, adflags, adfile_ok, addir_ok, encoding_ok;
 	cnid_t cnid = 0;
 	const char *name;
+	const struct mf_dir *old;
+	struct mf_build mb;
 	DIR *dp;
 	struct dirent *ep;
 	static struct stat st;	/* Save some stack space */
 
+	/* Changes from now on wake up dbd -w */
+	scan_watch_dir(did);
+
+	if (manifest) {
+		mf_build_init(&mb, did, pdid);
+		mf_stat(&mb.mb_dir);
+
+		/* Nothing created, deleted or renamed in here: take the objects from the manifest */
+		if ((old = mf_find(did)) != NULL
+		    && mf_unchanged(old, &mb.mb_dir)) {
+			if (alarmed)
+				longjmp(jmp, 1);	/* this jumps back to cmd_dbd_scanvol() */
+			dirs_unchanged++;
+			if (mf_copy(old) < 0)
+				return -1;
+			return mf_subdirs(old, scan_mfsubdir, &did);
+		}
+	}
+	dirs_scanned++;
+
 	/* Check again for .AppleDouble folder, check_adfile also checks/creates it */
 	if ((addir_ok = check_addir(volroot)) != 0)
 		if (!(dbd_flags & DBD_FLAGS_SCAN))
@@ -995,6 +1203,10 @@ static int dbd_readdir(int volroot, cnid_t did)
 		if (DIR_DOT_OR_DOTDOT(ep->d_name))
 			continue;
 
+		/* Tell the prefetch threads how far we are */
+		if ((++seen & 255) == 0)
+			scan_prefetch_progress(seen);
+
 		/* Check for netatalk special folders e.g. ".AppleDB" or ".AppleDesktop" */
 		if ((name = check_netatalk_dirs(ep->d_name)) != NULL) {
 			if (!volroot)
@@ -1063,19 +1275,17 @@ static int dbd_readdir(int volroot, cnid_t did)
            Statistics
          **************************************************************************/
 		static unsigned long long statcount = 0;
-		static time_t t = 0;
-
-		if (t == 0)
-			t = time(NULL);
 
 		statcount++;
 		if ((statcount % 10000) == 0) {
-			if (dbd_flags & DBD_FLAGS_STATS)
+			if (dbd_flags & DBD_FLAGS_STATS) {
+				time_t t = time(NULL) - scanstart;
+
 				dbd_log(LOGSTD,
-					"Scanned: %10llu, time: %10llu s",
-					statcount,
-					(unsigned long long) (time(NULL) -
-							      t));
+					"Scanned: %10llu, time: %10llu s, %8llu/s",
+					statcount, (unsigned long long) t,
+					statcount / (t ? t : 1));
+			}
 		}
 
 	/**************************************************************************
@@ -1107,13 +1317,16 @@ static int dbd_readdir(int volroot, cnid_t did)
 				ret =
 				    dbd_rebuild_add(dbd_rebuild, &rqst,
 						    &rply);
-				if (dbif_txn_close(dbd_rebuild, ret) != 0)
-					return -1;
+				if (scan_txn_close(dbd_rebuild, ret) != 0) {
+					ret = -1;
+					break;
+				}
 				if (rply.result != CNID_DBD_RES_OK) {
 					dbd_log(LOGSTD,
 						"Fatal error adding CNID: %u for '%s/%s' to in-memory rebuild-db",
 						cnid, cwdbuf, ep->d_name);
-					return -1;
+					ret = -1;
+					break;
 				}
 				count++;
 				if (count == 10000) {
@@ -1121,49 +1334,38 @@ static int dbd_readdir(int volroot, cnid_t did)
 					    (dbd_rebuild, 0, 0, 0) < 0) {
 						dbd_log(LOGSTD,
 							"Error checkpointing!");
-						return -1;
+						ret = -1;
+						break;
 					}
 					count = 0;
 				}
 			}
 		}
 
+		if (cnid && catidx)
+			index_object(ep->d_name, did, cnid, &st, adflags);
+
 		/* Check EA files */
 		if (myvolinfo->v_vfs_ea == AFPVOL_EA_AD)
 			check_eafiles(ep->d_name);
 
+		/* For the manifest */
+		if (manifest && cnid) {
+			if ((S_ISDIR(st.st_mode)
+			     ? mf_build_sub(&mb, ep->d_name, cnid)
+			     : mf_build_file(&mb, cnid)) < 0) {
+				dbd_log(LOGSTD, "Out of memory");
+				ret = -1;
+				break;
+			}
+		}
+
 	/**************************************************************************
           Recursion
         **************************************************************************/
 		if (S_ISDIR(st.st_mode) && (cnid || nocniddb)) {	/* If we have no cnid for it we cant recur */
-			strcat(cwdbuf, "/");
-			strcat(cwdbuf, ep->d_name);
-			dbd_log(LOGDEBUG, "Entering directory: %s",
-				cwdbuf);
-			if (-1 == (cwd = open(".", O_RDONLY))) {
-				dbd_log(LOGSTD,
-					"Cant open directory '%s': %s",
-					cwdbuf, strerror(errno));
-				continue;
-			}
-			if (0 != chdir(ep->d_name)) {
-				dbd_log(LOGSTD,
-					"Cant chdir to directory '%s': %s",
-					cwdbuf, strerror(errno));
-				close(cwd);
-				continue;
-			}
-
-			ret = dbd_readdir(0, cnid);
-
-			if (fchdir(cwd) < 0)
-				dbd_log(LOGSTD,
-                                        "Cant chdir to directory '%i': %s",
-                                        cwd, strerror(errno));;
-			close(cwd);
-			*(strrchr(cwdbuf, '/')) = 0;
-			if (ret < 0)
-				return -1;
+			if ((ret = scan_subdir(ep->d_name, cnid, did)) < 0)
+				break;
 		}
 	}
 
@@ -1172,6 +1374,11 @@ static int dbd_readdir(int volroot, cnid_t did)
 	 */
 
 	closedir(dp);
+	if (manifest) {
+		if (ret >= 0 && mf_put(&mb) < 0)
+			ret = -1;
+		mf_build_free(&mb);
+	}
 	return ret;
 }
 
@@ -1203,8 +1410,14 @@ static int scanvol(struct volinfo *vi, dbd_flags_t flags)
 	if (chdir(myvolinfo->v_path) < 0)
 		dbd_log(LOGSTD, "chdir failed: \"%s\"", myvolinfo->v_path);
 
+	/* Threads reading ahead of us, we go on without them if they don't start.
+	   Not when the manifest lets us skip most of the volume, they'd read all of it. */
+	if (!incremental
+	    && scan_prefetch_start(myvolinfo, scanthreads) == 0)
+		dbd_log(LOGDEBUG, "Started %d prefetch threads", scanthreads);
+
 	/* Start recursion */
-	if (dbd_readdir(1, htonl(2)) < 0)	/* 2 = volumeroot CNID */
+	if (dbd_readdir(1, htonl(2), htonl(1)) < 0)	/* 2 = volumeroot CNID, 1 its parent */
 		return -1;
 
 	return 0;
@@ -1277,7 +1490,7 @@ static void delete_orphaned_cnids(DBD * dbd, DBD * dbd_rebuild,
 							goto cleanup;
 						}
 
-						if (dbif_txn_close
+						if (scan_txn_close
 						    (dbd, ret) != 0)
 							return;
 						deleted++;
@@ -1308,7 +1521,7 @@ static void delete_orphaned_cnids(DBD * dbd, DBD * dbd_rebuild,
 					(void) dbif_txn_abort(dbd);
 					goto cleanup;
 				}
-				if (dbif_txn_close(dbd, ret) != 0)
+				if (scan_txn_close(dbd, ret) != 0)
 					return;
 				deleted++;
 			}
@@ -1336,6 +1549,42 @@ static void delete_orphaned_cnids(DBD * dbd, DBD * dbd_rebuild,
 	return;
 }
 
+/*
+  A CNID of the last manifest that isn't in the new one: its object is gone.
+  With -e it's deleted from the database, like the orphans of a full -re run.
+*/
+static int scan_vanished(cnid_t cnid, void *arg _U_)
+{
+	int ret;
+
+	if (catidx)
+		(void) catindex_del(catidx, cnid);
+	if (!(dbd_flags & DBD_FLAGS_EXCL))
+		return 0;
+
+	memset(&rqst, 0, sizeof(struct cnid_dbd_rqst));
+	memset(&rply, 0, sizeof(struct cnid_dbd_rply));
+	rqst.cnid = cnid;
+	if (dbd_flags & DBD_FLAGS_SCAN) {
+		if (dbd_resolve(dbd, &rqst, &rply) >= 0
+		    && rply.result == CNID_DBD_RES_OK)
+			dbd_log(LOGSTD, "Orphaned CNID in database: %u",
+				ntohl(cnid));
+		return 0;
+	}
+
+	if ((ret = dbd_delete(dbd, &rqst, &rply, DBIF_CNID)) == -1) {
+		dbd_log(LOGSTD, "Error deleting CNID %u", ntohl(cnid));
+		(void) dbif_txn_abort(dbd);
+		return -1;
+	}
+	if (scan_txn_close(dbd, ret) != 0)
+		return -1;
+	if (rply.result == CNID_DBD_RES_OK)
+		dbd_log(LOGSTD, "Orphaned CNID in database: %u", ntohl(cnid));
+	return 0;
+}
+
 static const char *get_tmpdb_path(void)
 {
 	pid_t pid = getpid();
@@ -1351,9 +1600,12 @@ static const char *get_tmpdb_path(void)
 */
 int cmd_dbd_scanvol(DBD * dbd_ref, struct volinfo *vi, dbd_flags_t flags)
 {
-	int ret = 0;
+	int ret = 0, complete = 0;
+	long vanished = 0;
 	struct db_param db_param = { 0 };
+	struct scan_prefetch_stat pfstat = { 0 };
 	const char *tmpdb_path = NULL;
+	char dbdir[MAXPATHLEN + 1];
 
 	/* Set cachesize for in-memory rebuild db */
 	db_param.cachesize = 64 * 1024;	/* 64 MB */
@@ -1379,9 +1631,47 @@ int cmd_dbd_scanvol(DBD * dbd_ref, struct volinfo *vi, dbd_flags_t flags)
 	}
 	memcpy(stamp, rply.name, CNID_DEV_LEN);
 
-	/* temporary rebuild db, used with -re rebuild to delete unused CNIDs, not used with -f */
+	seen = 0;
+	scanstart = 0;
+	commits = flushes = 0;
+	dirs_unchanged = dirs_scanned = 0;
+	if ((size_t) snprintf(dbdir, sizeof(dbdir), "%s/.AppleDB",
+			      vi->v_dbpath) >= sizeof(dbdir)) {
+		ret = -1;
+		goto exit;
+	}
+
+	/*
+	  -m: the manifest of the last run tells which directories haven't changed.
+	  An incremental run appends to the catalog index instead of rewriting it, so
+	  without one it has to look at everything.
+	*/
+	manifest = incremental = 0;
+	if ((flags & DBD_FLAGS_MANIFEST) && !nocniddb
+	    && !(vi->v_flags & AFPVOL_NOADOUBLE)) {
+		manifest = 1;
+		if (!(flags & DBD_FLAGS_FORCE) && mf_load(dbdir, stamp) == 0) {
+			incremental = 1;
+			if (!(flags & DBD_FLAGS_SCAN)
+			    && (catidx = catindex_open(dbdir)) == NULL) {
+				dbd_log(LOGSTD,
+					"No catalog index in \"%s\", scanning the whole volume",
+					dbdir);
+				mf_free();
+				incremental = 0;
+			}
+		}
+		scan_watch_prune(incremental);
+		if (!(flags & DBD_FLAGS_SCAN))
+			(void) mf_begin(dbdir, stamp);
+		dbd_log(LOGDEBUG, incremental ? "Scanning changed directories"
+			: "Scanning the whole volume");
+	}
+
+	/* temporary rebuild db, used with -re rebuild to delete unused CNIDs, not used with -f.
+	   An incremental run deletes the CNIDs that vanished from the manifest instead. */
 	if (!nocniddb && (flags & DBD_FLAGS_EXCL)
-	    && !(flags & DBD_FLAGS_FORCE)) {
+	    && !(flags & DBD_FLAGS_FORCE) && !incremental) {
 		tmpdb_path = get_tmpdb_path();
 		if (NULL ==
 		    (dbd_rebuild = dbif_init(tmpdb_path, "cnid2.db"))) {
@@ -1408,18 +1698,69 @@ int cmd_dbd_scanvol(DBD * dbd_ref, struct volinfo *vi, dbd_flags_t flags)
 		}
 	}
 
+	/* catalog index for afpd, rewritten on every rebuild but incremental ones */
+	if (!nocniddb && !(flags & DBD_FLAGS_SCAN) && !incremental
+	    && (catidx = catindex_create(dbdir)) == NULL)
+		dbd_log(LOGSTD, "Can't create catalog index in \"%s\": %s",
+			dbdir, strerror(errno));
+
 	if (setjmp(jmp) != 0) {
 		ret = 0;	/* Got signal, jump from dbd_readdir */
 		goto exit;
 	}
 
 	/* scanvol */
+	scanstart = time(NULL);
 	if ((scanvol(vi, flags)) != 0) {
 		ret = -1;
 		goto exit;
 	}
+	complete = 1;
+
+	if (incremental && (vanished = mf_vanished(scan_vanished, NULL)) < 0)
+		ret = -1;
+	/* without it the next run looks at everything, that's all */
+	if (manifest && ret == 0 && !(flags & DBD_FLAGS_SCAN))
+		(void) mf_commit();
 
       exit:
+	scan_prefetch_stop(&pfstat);
+	if ((flags & DBD_FLAGS_STATS) && scanstart) {
+		time_t t = time(NULL) - scanstart;
+
+		dbd_log(LOGSTD,
+			"Scanned %llu entries in %llu s, %llu/s",
+			seen, (unsigned long long) t, seen / (t ? t : 1));
+		dbd_log(LOGSTD,
+			"Prefetched %llu entries in %llu directories, %llu AppleDouble and EA headers, %llu directories stolen",
+			pfstat.objects, pfstat.dirs, pfstat.headers,
+			pfstat.steals);
+		if (!nocniddb)
+			dbd_log(LOGSTD,
+				"Committed %llu transactions with %llu log flushes",
+				commits, flushes + (unflushed ? 1 : 0));
+		if (manifest) {
+			unsigned long long dirs, carried;
+
+			mf_stats(&dirs, &carried);
+			dbd_log(LOGSTD,
+				"Looked into %llu directories, %llu unchanged, %llu carried over from the last pass, %ld CNIDs vanished",
+				dirs_scanned, dirs_unchanged, carried,
+				vanished);
+		}
+	}
+	mf_free();
+
+	if (catidx) {
+		/* an interrupted scan leaves the old index alone */
+		if (complete && ret == 0 && !incremental
+		    && catindex_commit(catidx) != 0)
+			dbd_log(LOGSTD, "Error writing catalog index: %s",
+				strerror(errno));
+		catindex_close(catidx);
+		catidx = NULL;
+	}
+
 	if (!nocniddb) {
 		if (dbif_txn_close(dbd, ret == 0 ? 1 : 0) != 0)
 			ret = -1;
@@ -1427,6 +1768,8 @@ int cmd_dbd_scanvol(DBD * dbd_ref, struct volinfo *vi, dbd_flags_t flags)
 			if (dbif_txn_close(dbd_rebuild, ret == 0 ? 1 : 0)
 			    != 0)
 				ret = -1;
+		if (scan_log_flush() != 0)
+			ret = -1;
 		if ((ret == 0) && dbd_rebuild && (flags & DBD_FLAGS_EXCL)
 		    && !(flags & DBD_FLAGS_FORCE))
 			/* We can only do this in exclusive mode, otherwise we might delete CNIDs added from
@@ -1437,6 +1780,7 @@ int cmd_dbd_scanvol(DBD * dbd_ref, struct volinfo *vi, dbd_flags_t flags)
 	if (dbd_rebuild) {
 		dbd_log(LOGDEBUG, "Closing tmp db");
 		dbif_close(dbd_rebuild);
+		dbd_rebuild = NULL;
 
 		if (tmpdb_path) {
 			char cmd[8 + MAXPATHLEN];
@@ -0,0 +1,302 @@
+/*
+  Watching the volume for dbd -w
+  ==============================
+
+  After its first pass dbd -w keeps running and scans the volume again
+  whenever something changed: at least every watchsecs seconds, and
+  WATCH_SETTLE seconds after the last change inotify reported, but no later
+  than WATCH_DELAY seconds after the first one.
+
+  Every directory the scanner looks into gets an inotify watch for objects
+  created, deleted or moved in it, one inotify reports a change in is dirty.
+  A pass after inotify reported changes only walks down to the dirty
+  directories: the
+  scanner asks scan_watch_wanted() before it enters a directory, the others
+  are carried over from the manifest as they are. A pass every watchsecs,
+  and every pass after inotify lost events or a directory couldn't be
+  watched (see /proc/sys/fs/inotify/max_user_watches), walks the whole
+  volume and looks into the directories the manifest says have changed.
+*/
+
+#include "config.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#include <arpa/inet.h>
+
+#include <atalk/cnid_dbd_private.h>
+
+#include "cmd_dbd.h"
+
+#define WATCH_SETTLE 2		/* seconds without changes before a pass */
+#define WATCH_DELAY  30		/* at the latest after the first change */
+
+#ifdef HAVE_SYS_INOTIFY_H
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                      | IN_ONLYDIR | IN_DONT_FOLLOW)
+#endif
+
+/* a set of CNIDs */
+struct cnidset {
+	cnid_t *cs_ids;		/* 0: free */
+	u_int32_t cs_size;
+	u_int32_t cs_used;
+};
+
+static int watching;
+static int ifd = -1;
+static cnid_t *wdcnid;		/* directory by watch descriptor */
+static int wdalloc;
+static int incomplete;		/* a directory isn't watched */
+static int overflow;		/* inotify lost events */
+static time_t lastfull;
+static struct cnidset dirty;	/* since the pass before */
+static struct cnidset wanted;	/* the dirty ones and their parents */
+static int pruned;		/* the coming pass only walks to the dirty ones */
+static int pruning;		/* this pass does */
+
+/* ------------------------ CNID sets */
+static u_int32_t cs_hash(const struct cnidset *cs, cnid_t cnid)
+{
+	return (ntohl(cnid) * 2654435761U) & (cs->cs_size - 1);
+}
+
+static int cs_has(const struct cnidset *cs, cnid_t cnid)
+{
+	u_int32_t h;
+
+	if (cs->cs_used == 0)
+		return 0;
+	for (h = cs_hash(cs, cnid); cs->cs_ids[h];
+	     h = (h + 1) & (cs->cs_size - 1))
+		if (cs->cs_ids[h] == cnid)
+			return 1;
+	return 0;
+}
+
+static int cs_add(struct cnidset *cs, cnid_t cnid)
+{
+	struct cnidset old = *cs;
+	u_int32_t h, i;
+
+	if (cnid == 0 || cs_has(cs, cnid))
+		return 0;
+	if (2 * (cs->cs_used + 1) > cs->cs_size) {
+		cs->cs_size = cs->cs_size ? 2 * cs->cs_size : 256;
+		if ((cs->cs_ids = calloc(cs->cs_size, sizeof(cnid_t))) == NULL) {
+			*cs = old;
+			return -1;
+		}
+		cs->cs_used = 0;
+		for (i = 0; i < old.cs_size; i++)
+			if (old.cs_ids[i])
+				cs_add(cs, old.cs_ids[i]);
+		free(old.cs_ids);
+	}
+	for (h = cs_hash(cs, cnid); cs->cs_ids[h];
+	     h = (h + 1) & (cs->cs_size - 1));
+	cs->cs_ids[h] = cnid;
+	cs->cs_used++;
+	return 0;
+}
+
+static void cs_clear(struct cnidset *cs)
+{
+	if (cs->cs_used)
+		memset(cs->cs_ids, 0, cs->cs_size * sizeof(cnid_t));
+	cs->cs_used = 0;
+}
+
+/* ------------------------ inotify */
+#ifdef HAVE_SYS_INOTIFY_H
+static void read_events(void)
+{
+	char buf[16384];
+	struct inotify_event *ev;
+	ssize_t len, off;
+
+	while ((len = read(ifd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < len;
+		     off += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) (buf + off);
+			if (ev->mask & IN_Q_OVERFLOW) {
+				overflow = 1;
+			} else if (ev->wd < 0 || ev->wd >= wdalloc) {
+				continue;
+			} else if (ev->mask & IN_IGNORED) {
+				/* the directory is gone */
+				wdcnid[ev->wd] = 0;
+			} else if (cs_add(&dirty, wdcnid[ev->wd]) < 0) {
+				overflow = 1;
+			}
+		}
+	}
+}
+#endif
+
+/* ------------------------ interface */
+
+/*!
+ * dbd -w: watch the directories the scanner looks into
+ *
+ * @returns 0, -1 if they can't be watched and only the passes every
+ *          watchsecs are done
+ */
+int scan_watch_init(void)
+{
+	watching = 1;
+	lastfull = time(NULL);
+#ifdef HAVE_SYS_INOTIFY_H
+	if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0)
+		return 0;
+	dbd_log(LOGSTD, "Can't watch the volume: %s", strerror(errno));
+#endif
+	incomplete = 1;
+	return -1;
+}
+
+/*!
+ * The scanner is in the directory with CNID did
+ */
+void scan_watch_dir(cnid_t did)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	cnid_t *p;
+	int wd, n;
+
+	if (ifd < 0)
+		return;
+	if ((wd = inotify_add_watch(ifd, ".", WATCH_EVENTS)) < 0) {
+		if (!incomplete)
+			dbd_log(LOGSTD,
+				"Can't watch all directories (%s), scanning the whole volume on every change",
+				strerror(errno));
+		incomplete = 1;
+		return;
+	}
+	if (wd >= wdalloc) {
+		for (n = wdalloc ? wdalloc : 1024; wd >= n; n *= 2);
+		if ((p = realloc(wdcnid, n * sizeof(cnid_t))) == NULL) {
+			incomplete = 1;
+			return;
+		}
+		memset(p + wdalloc, 0, (n - wdalloc) * sizeof(cnid_t));
+		wdcnid = p;
+		wdalloc = n;
+	}
+	wdcnid[wd] = did;
+#endif
+}
+
+/*!
+ * Wait until the next pass is due
+ *
+ * @returns 0, -1 on a termination signal
+ */
+int scan_watch_wait(void)
+{
+	time_t now, first = 0, last = 0;
+	u_int32_t changes = 0;
+	struct pollfd pfd;
+
+	pruning = 0;
+	for (;;) {
+		if (alarmed)
+			return -1;
+		now = time(NULL);
+
+		if (dirty.cs_used || overflow) {
+			if (!first || dirty.cs_used != changes) {
+				if (!first)
+					first = now;
+				last = now;
+				changes = dirty.cs_used;
+			}
+			if (now - last >= WATCH_SETTLE
+			    || now - first >= WATCH_DELAY) {
+				pruned = !overflow && !incomplete;
+				return 0;
+			}
+		}
+		if (now - lastfull >= watchsecs) {
+			pruned = 0;
+			return 0;
+		}
+
+		if (ifd < 0) {
+			sleep(1);
+			continue;
+		}
+		pfd.fd = ifd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 1000) > 0) {
+#ifdef HAVE_SYS_INOTIFY_H
+			read_events();
+#endif
+		}
+	}
+}
+
+/*!
+ * A pass starts, with the manifest of the last one loaded if manifest is set
+ */
+void scan_watch_prune(int manifest)
+{
+	const struct mf_dir *dir;
+	u_int32_t i;
+
+	if (!watching)
+		return;
+#ifdef HAVE_SYS_INOTIFY_H
+	/* what happened since scan_watch_wait() */
+	if (ifd >= 0)
+		read_events();
+#endif
+
+	pruning = 0;
+	cs_clear(&wanted);
+	if (pruned && manifest && !overflow && !incomplete) {
+		pruning = 1;
+		for (i = 0; i < dirty.cs_size && pruning; i++) {
+			if (!dirty.cs_ids[i])
+				continue;
+			/* a directory the manifest doesn't know, can't tell how to get there */
+			if ((dir = mf_find(dirty.cs_ids[i])) == NULL) {
+				pruning = 0;
+				break;
+			}
+			/* up to the volume root, which has no record of a parent */
+			for (; dir; dir = mf_find(dir->md_did)) {
+				if (cs_has(&wanted, dir->md_cnid))
+					break;
+				if (cs_add(&wanted, dir->md_cnid) < 0) {
+					pruning = 0;
+					break;
+				}
+			}
+		}
+		dbd_log(LOGDEBUG, "%u directories changed",
+			(unsigned int) dirty.cs_used);
+	}
+	if (!pruning)
+		lastfull = time(NULL);
+	pruned = overflow = 0;
+	cs_clear(&dirty);
+}
+
+/*!
+ * Does the scanner have to look into the directory with CNID did?
+ */
+int scan_watch_wanted(cnid_t did)
+{
+	return !pruning || cs_has(&wanted, did);
+}
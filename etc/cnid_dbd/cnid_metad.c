@@ -22,6 +22,12 @@
                        via TCP socket
    4.       afpd          ------->         cnid_dbd
 
+   Volumes given with -w get their cnid_dbd at startup, before any afpd
+   asks, and it is restarted whenever it exits. Such a warm cnid_dbd runs
+   recovery, checkpoints and reads its databases into the cache ahead of
+   the clients and doesn't exit when idle, so connecting to the volume is
+   only step 1 and 3.
+
    cnid_metad and cnid_dbd have been converted to non-blocking IO in 2010.
  */
 
@@ -105,9 +111,12 @@ struct server {
 	time_t tm;		/* When respawned last */
 	unsigned int count;	/* Times respawned in the last TESTTIME secondes */
 	int control_fd;		/* file descriptor to child cnid_dbd process */
+	int warm;		/* started ahead of the clients, see -w */
 };
 
 static struct server srv[MAXVOLS];
+static char *warmvols[MAXVOLS];
+static int nwarm;
 
 /* Default logging config: log to syslog with level log_note */
 static char logconfig[MAXPATHLEN + 21 + 1] = "default log_note";
@@ -145,16 +154,21 @@ static struct server *test_usockfn(struct volinfo *volinfo)
 	return NULL;
 }
 
-/* -------------------- */
-static int maybe_start_dbd(char *dbdpn, struct volinfo *volinfo)
+/* --------------------
+ * Pass clntfd to the cnid_dbd of the volume, starting it if there is none.
+ * With clntfd -1 the cnid_dbd is only started, warm for the volumes of -w.
+ */
+static int maybe_start_dbd(char *dbdpn, struct volinfo *volinfo, int clntfd,
+			   int warm)
 {
 	pid_t pid;
 	struct server *up;
 	int sv[2];
-	int i;
+	int i, n;
 	time_t t;
 	char buf1[8];
 	char buf2[8];
+	char *args[8];
 	char *volpath = volinfo->v_path;
 	int ret;
 
@@ -164,7 +178,7 @@ static int maybe_start_dbd(char *dbdpn, struct volinfo *volinfo)
 	up = test_usockfn(volinfo);
 	if (up && up->pid) {
 		/* we already have a process, send our fd */
-		if (send_fd(up->control_fd, rqstfd) < 0) {
+		if (clntfd >= 0 && send_fd(up->control_fd, clntfd) < 0) {
 			/* FIXME */
 			return -1;
 		}
@@ -184,6 +198,7 @@ static int maybe_start_dbd(char *dbdpn, struct volinfo *volinfo)
 				retainvolinfo(volinfo);
 				up->tm = t;
 				up->count = 0;
+				up->warm = warm;
 				if (i == maxvol)
 					maxvol++;
 				break;
@@ -259,21 +274,25 @@ static int maybe_start_dbd(char *dbdpn, struct volinfo *volinfo)
 		}
 
 		sprintf(buf1, "%i", sv[1]);
-		sprintf(buf2, "%i", rqstfd);
+		sprintf(buf2, "%i", clntfd);
 
+		n = 0;
+		args[n++] = dbdpn;
 		if (up->count == MAXSPAWN) {
 			/* there's a pb with the db inform child, it will delete the db */
 			LOG(log_warning, logtype_cnid,
 			    "Multiple attempts to start CNID db daemon for \"%s\" failed, wiping the slate clean...",
 			    up->volinfo->v_path);
-			ret =
-			    execlp(dbdpn, dbdpn, "-d", volpath, buf1, buf2,
-				   logconfig, NULL);
-		} else {
-			ret =
-			    execlp(dbdpn, dbdpn, volpath, buf1, buf2,
-				   logconfig, NULL);
+			args[n++] = "-d";
 		}
+		if (up->warm)
+			args[n++] = "-w";
+		args[n++] = volpath;
+		args[n++] = buf1;
+		args[n++] = buf2;
+		args[n++] = logconfig;
+		args[n] = NULL;
+		ret = execvp(dbdpn, args);
 		if (ret) {
 		/* Yikes! We're still here, so exec failed... */
 			LOG(log_error, logtype_cnid, "Fatal error in exec: %s",
@@ -317,6 +336,23 @@ static int set_dbdir(char *dbdir)
 	return 0;
 }
 
+/* ------------------
+ * Start the cnid_dbd of a volume given with -w
+ */
+static void start_warm(char *dbdpn, char *volpath)
+{
+	struct volinfo *volinfo;
+
+	if ((volinfo = allocvolinfo(volpath)) == NULL) {
+		LOG(log_error, logtype_cnid, "allocvolinfo(\"%s\"): %s",
+		    volpath, strerror(errno));
+		return;
+	}
+	if (set_dbdir(volinfo->v_dbpath) == 0)
+		maybe_start_dbd(dbdpn, volinfo, -1, 1);
+	(void) closevolinfo(volinfo);
+}
+
 /* ------------------ */
 static uid_t user_to_uid(char *username)
 {
@@ -482,7 +518,7 @@ int main(int argc, char *argv[])
 
 	set_processname("cnid_metad");
 
-	while ((cc = getopt(argc, argv, "vVds:p:h:u:g:l:f:")) != -1) {
+	while ((cc = getopt(argc, argv, "vVds:p:h:u:g:l:f:w:")) != -1) {
 		switch (cc) {
 		case 'v':
 		case 'V':
@@ -522,6 +558,10 @@ int main(int argc, char *argv[])
 		case 'f':
 			logfile = strdup(optarg);
 			break;
+		case 'w':
+			if (nwarm < MAXVOLS)
+				warmvols[nwarm++] = strdup(optarg);
+			break;
 		default:
 			err++;
 			break;
@@ -586,6 +626,9 @@ int main(int argc, char *argv[])
 	sigprocmask(SIG_SETMASK, NULL, &set);
 	sigdelset(&set, SIGCHLD);
 
+	for (i = 0; i < nwarm; i++)
+		start_warm(dbdpn, warmvols[i]);
+
 	while (1) {
 		rqstfd = usockfd_check(srvfd, &set);
 		/* Collect zombie processes and log what happened to them */
@@ -613,6 +656,10 @@ int main(int argc, char *argv[])
 			}
 			sigchild = 0;
 		}
+		/* warm ones are back right away, unless they respawn too fast */
+		for (i = 0; i < maxvol; i++)
+			if (srv[i].warm && !srv[i].pid)
+				maybe_start_dbd(dbdpn, srv[i].volinfo, -1, 1);
 		if (rqstfd <= 0)
 			continue;
 
@@ -665,7 +712,7 @@ int main(int argc, char *argv[])
 			goto loop_end;
 		}
 
-		maybe_start_dbd(dbdpn, volinfo);
+		maybe_start_dbd(dbdpn, volinfo, rqstfd, 0);
 
 		(void) closevolinfo(volinfo);
 
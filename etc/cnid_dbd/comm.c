@@ -20,6 +20,13 @@
 #include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <time.h>
 
@@ -39,71 +46,369 @@
 
 
 struct connection {
-	time_t tm;		/* When respawned last */
-	int fd;
+	time_t tm;		/* last request */
+	int fd;			/* -1 if the slot is free */
+	int heapidx;		/* position in idle_heap */
+	int shmidx;		/* position in shm_fds or -1 */
+	int ready;		/* queued in the current round */
+	int roundidx;		/* position in round_fds if ready */
+	struct cnid_dbd_shm *shm;	/* shared memory transport, see comm_shm_attach */
+	shm_ring_t rqst;
+	shm_ring_t rply;
+	char shmname[CNID_DBD_SHM_NAMELEN];	/* until the client has it mapped */
+	int held;		/* reply waits for comm_flush() */
+	int heldidx;		/* position in held_fds if held */
+	int held_shm;		/* ... and goes through the ring */
+	struct cnid_dbd_rply held_rply;
+	char *held_name;
+	size_t held_size;
 };
 
 static int control_fd;
 static int cur_fd;
-static struct connection *fd_table;
-static int fd_table_size;
+static struct connection *cur_conn;
+static int cur_shm;		/* current request came through the ring */
+static int fd_table_size;	/* max number of clients */
 static int fds_in_use = 0;
+static int shm_ipc;
+static int client_idle_timeout;
+static u_int32_t db_gen;	/* see comm_gen() */
+
+/* the clients, indexed by fd */
+static struct connection *conns;
+static int conns_size;
+
+/* clients ordered by the time of their last request, oldest first */
+static int *idle_heap;
+static int heap_len;
+
+/* clients on the shared memory transport */
+static int *shm_fds;
+static int shms_in_use = 0;
+
+/* clients with a held reply */
+static int *held_fds;
+static int held_len;
+
+/* clients with a request, each one is served once per round */
+static int *round_fds;
+static int round_len;
+static int round_pos;
+
+#ifdef HAVE_SYS_EPOLL_H
+#define MAX_EVENTS 256
+static int epoll_fd = -1;
+#else
+#define MAX_EVENTS 1
+#endif
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
+/* ------------ idle heap */
+static void heap_swap(int a, int b)
+{
+	int fd = idle_heap[a];
 
-static void invalidate_fd(int fd)
+	idle_heap[a] = idle_heap[b];
+	idle_heap[b] = fd;
+	conns[idle_heap[a]].heapidx = a;
+	conns[idle_heap[b]].heapidx = b;
+}
+
+static void heap_up(int i)
 {
-	int i;
+	while (i > 0
+	       && conns[idle_heap[(i - 1) / 2]].tm > conns[idle_heap[i]].tm) {
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
 
-	if (fd == control_fd)
-		return;
-	for (i = 0; i != fds_in_use; i++)
-		if (fd_table[i].fd == fd)
+static void heap_down(int i)
+{
+	int c;
+
+	while ((c = 2 * i + 1) < heap_len) {
+		if (c + 1 < heap_len
+		    && conns[idle_heap[c + 1]].tm < conns[idle_heap[c]].tm)
+			c++;
+		if (conns[idle_heap[i]].tm <= conns[idle_heap[c]].tm)
 			break;
+		heap_swap(i, c);
+		i = c;
+	}
+}
 
-	assert(i < fds_in_use);
+static void heap_remove(int i)
+{
+	heap_len--;
+	if (i == heap_len)
+		return;
+	heap_swap(i, heap_len);
+	heap_up(i);
+	heap_down(i);
+}
 
+/* ------------ */
+static void release_conn(struct connection *conn)
+{
+	if (conn->shm) {
+		munmap(conn->shm, CNID_DBD_SHM_LEN);
+		conn->shm = NULL;
+		shms_in_use--;
+		shm_fds[conn->shmidx] = shm_fds[shms_in_use];
+		conns[shm_fds[conn->shmidx]].shmidx = conn->shmidx;
+		conn->shmidx = -1;
+	}
+	if (conn->shmname[0]) {
+		shm_unlink(conn->shmname);
+		conn->shmname[0] = '\0';
+	}
+	if (conn->ready) {
+		/* still waiting for its turn */
+		round_fds[conn->roundidx] = round_fds[--round_len];
+		conns[round_fds[conn->roundidx]].roundidx = conn->roundidx;
+	}
+	if (conn->held) {
+		held_fds[conn->heldidx] = held_fds[--held_len];
+		conns[held_fds[conn->heldidx]].heldidx = conn->heldidx;
+	}
+	heap_remove(conn->heapidx);
+	close(conn->fd);
+	conn->fd = -1;
+	conn->ready = 0;
+	conn->held = 0;
 	fds_in_use--;
-	fd_table[i] = fd_table[fds_in_use];
-	fd_table[fds_in_use].fd = -1;
-	close(fd);
-	return;
 }
 
+static void invalidate_fd(int fd)
+{
+	if (fd == control_fd)
+		return;
+
+	assert(fd < conns_size && conns[fd].fd == fd);
+	release_conn(&conns[fd]);
+}
+
+/* a new client, fds_in_use < fd_table_size */
+static int add_conn(int fd, time_t t)
+{
+	struct connection *tmp;
+	int i, size;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+#endif
+
+	if (fd >= conns_size) {
+		size = conns_size ? conns_size : 64;
+		while (size <= fd)
+			size *= 2;
+		if ((tmp = realloc(conns, size * sizeof(*conns))) == NULL) {
+			LOG(log_error, logtype_cnid, "Out of memory");
+			close(fd);
+			return -1;
+		}
+		conns = tmp;
+		for (i = conns_size; i < size; i++) {
+			memset(&conns[i], 0, sizeof(*conns));
+			conns[i].fd = -1;
+			conns[i].shmidx = -1;
+		}
+		conns_size = size;
+	}
+#ifndef HAVE_SYS_EPOLL_H
+	if (fd >= FD_SETSIZE) {
+		LOG(log_error, logtype_cnid, "fd %d too large for select()",
+		    fd);
+		close(fd);
+		return -1;
+	}
+#else
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		LOG(log_error, logtype_cnid, "epoll_ctl: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+#endif
+
+	conns[fd].fd = fd;
+	conns[fd].tm = t;
+	conns[fd].ready = 0;
+	conns[fd].shmidx = -1;
+	conns[fd].heapidx = heap_len;
+	idle_heap[heap_len++] = fd;
+	heap_up(heap_len - 1);
+	fds_in_use++;
+	return 0;
+}
+
+/* ------------ */
+static void add_to_round(struct connection *conn)
+{
+	if (!conn->ready) {
+		conn->ready = 1;
+		conn->roundidx = round_len;
+		round_fds[round_len++] = conn->fd;
+	}
+}
+
+/*
+ * Connections on the shared memory transport: put the ones with a request
+ * in their ring into the round.
+ */
+static void shm_pending(void)
+{
+	int i;
+
+	for (i = 0; i != shms_in_use; i++)
+		if (!shm_ring_empty(&conns[shm_fds[i]].rqst))
+			add_to_round(&conns[shm_fds[i]]);
+}
 
 /*
- *  Check for client requests. We keep up to fd_table_size open descriptors in
- *  fd_table. If the table is full and we get a new descriptor via
- *  control_fd, we close a random decriptor in the table to make space. The
- *  affected client will automatically reconnect. For an EOF (descriptor is
- *  closed by the client, so a read here returns 0) comm_rcv will take care of
- *  things and clean up fd_table. The same happens for any read/write errors.
+ * Tell the clients on the shared memory transport to ring the bell on the
+ * socket, because we're going to sleep.
+ *
+ * returns 1 if a request arrived in the meantime
  */
+static int shm_sleep(void)
+{
+	int i;
+
+	for (i = 0; i != shms_in_use; i++)
+		if (shm_ring_sleep(&conns[shm_fds[i]].rqst)) {
+			while (i--)
+				shm_ring_awake(&conns[shm_fds[i]].rqst);
+			return 1;
+		}
+	return 0;
+}
 
-static int check_fd(time_t timeout, const sigset_t * sigmask, time_t * now)
+static void shm_awake(void)
 {
-	int fd;
+	int i;
+
+	for (i = 0; i != shms_in_use; i++)
+		shm_ring_awake(&conns[shm_fds[i]].rqst);
+}
+
+/* ------------
+ * Wait for events, returns the number of ready fds in fds or -1
+ */
+static int wait_fds(int *fds, int timeout, const sigset_t * sigmask)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[MAX_EVENTS];
+	int i, ret;
+#else
 	fd_set readfds;
 	struct timespec tv;
-	int ret;
-	int i;
-	int maxfd = control_fd;
-	time_t t;
+	int fd, ret, maxfd = control_fd;
+#endif
 
+	/* about to idle, write out buffered log messages */
+	if (timeout)
+		log_flush();
+
+#ifdef HAVE_SYS_EPOLL_H
+	if ((ret = epoll_pwait(epoll_fd, events, MAX_EVENTS, timeout,
+			       sigmask)) < 0)
+		return ret;
+	for (i = 0; i < ret; i++)
+		fds[i] = events[i].data.fd;
+	return ret;
+#else
 	FD_ZERO(&readfds);
 	FD_SET(control_fd, &readfds);
+	for (fd = 0; fd < conns_size; fd++) {
+		if (conns[fd].fd == -1)
+			continue;
+		FD_SET(fd, &readfds);
+		if (maxfd < fd)
+			maxfd = fd;
+	}
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_nsec = (timeout % 1000) * 1000000;
+	if ((ret = pselect(maxfd + 1, &readfds, NULL, NULL, &tv, sigmask)) <= 0)
+		return ret;
 
-	for (i = 0; i != fds_in_use; i++) {
-		FD_SET(fd_table[i].fd, &readfds);
-		if (maxfd < fd_table[i].fd)
-			maxfd = fd_table[i].fd;
+	ret = 0;
+	for (fd = 0; fd <= maxfd; fd++)
+		if (FD_ISSET(fd, &readfds))
+			fds[ret++] = fd;
+	return ret;
+#endif
+}
+
+/*
+ * Start a new round: wait up to timeout milliseconds for requests and
+ * collect all clients that have one. New clients come in through control_fd. If there are fd_table_size
+ * clients already, the one that has been idle longest is closed to make
+ * space, the affected client will automatically reconnect. Clients idle for
+ * more than client_idle_timeout are closed as well. For an EOF (descriptor is
+ * closed by the client, so a read here returns 0) comm_rcv will take care of
+ * things and clean up. The same happens for any read/write errors.
+ *
+ * Clients on the shared memory transport are polled for a while first, the
+ * socket only carries a wakeup byte for them once we sleep.
+ */
+static int new_round(int timeout, const sigset_t * sigmask, time_t * now)
+{
+	static int *fds;
+	static int fds_size;
+	struct connection *conn;
+	int i, n, fd, spin, ms = timeout, ret;
+	int sleeping = 0;
+	char bell[64];
+	time_t t;
+
+	round_len = round_pos = 0;
+
+	if (fds_size < conns_size + 1 || fds_size < MAX_EVENTS) {
+		free(fds);
+		fds_size = max(conns_size + 1, MAX_EVENTS);
+		if ((fds = malloc(fds_size * sizeof(int))) == NULL) {
+			fds_size = 0;
+			LOG(log_error, logtype_cnid, "Out of memory");
+			return -1;
+		}
 	}
 
-	tv.tv_nsec = 0;
-	tv.tv_sec = timeout;
-	if ((ret =
-	     pselect(maxfd + 1, &readfds, NULL, NULL, &tv, sigmask)) < 0) {
+	if (shms_in_use && ms == 0) {
+		shm_pending();
+	} else if (shms_in_use) {
+		spin = shm_ring_spins(CNID_DBD_SHM_SPIN);
+		for (i = 0; i <= spin && round_len == 0; i++) {
+			shm_pending();
+#if defined(__i386__) || defined(__x86_64__)
+			__asm__ __volatile__("pause");
+#endif
+		}
+		if (round_len)
+			ms = 0;		/* only pick up waiting sockets */
+		else if (shm_sleep())
+			ms = 0;
+		else
+			sleeping = 1;
+	}
+	if (client_idle_timeout && heap_len) {
+		t = time(NULL);
+		i = conns[idle_heap[0]].tm + client_idle_timeout - t;
+		if (i < 0)
+			i = 0;
+		if (i < ms / 1000)
+			ms = i * 1000;
+	}
+
+	n = wait_fds(fds, ms, sigmask);
+	if (sleeping)
+		shm_awake();
+	if (n < 0) {
 		if (errno == EINTR)
-			return 0;
+			return round_len;
 		LOG(log_error, logtype_cnid, "error in select: %s",
 		    strerror(errno));
 		return -1;
@@ -113,63 +418,224 @@ static int check_fd(time_t timeout, const sigset_t * sigmask, time_t * now)
 	if (now)
 		*now = t;
 
-	if (!ret)
-		return 0;
+	for (i = 0; i < n; i++) {
+		fd = fds[i];
+		if (fd == control_fd) {
+			if ((fd = recv_fd(control_fd, 0)) < 0)
+				return -1;
+			if (fds_in_use >= fd_table_size)
+				release_conn(&conns[idle_heap[0]]);
+			add_conn(fd, t);
+			continue;
+		}
+		conn = &conns[fd];
+		if (conn->fd == -1)
+			continue;
+		if (!conn->shm) {
+			add_to_round(conn);
+			continue;
+		}
+		/* the wakeup byte, or EOF */
+		if ((ret = recv(fd, bell, sizeof(bell), MSG_DONTWAIT)) == 0
+		    || (ret < 0 && errno != EAGAIN))
+			release_conn(conn);
+	}
+	if (shms_in_use)
+		shm_pending();
+
+	if (client_idle_timeout) {
+		while (heap_len
+		       && conns[idle_heap[0]].tm + client_idle_timeout <= t
+		       && !conns[idle_heap[0]].ready) {
+			LOG(log_debug, logtype_cnid,
+			    "closing idle connection on fd %d", idle_heap[0]);
+			release_conn(&conns[idle_heap[0]]);
+		}
+	}
 
+	return round_len;
+}
+
+/*
+ * Check for client requests, returns the fd of the next client in the
+ * round. All clients with a request get their turn before we wait again.
+ */
+static int check_fd(int timeout, const sigset_t * sigmask, time_t * now)
+{
+	struct connection *conn;
+	int fd, ret;
 
-	if (FD_ISSET(control_fd, &readfds)) {
-		int l = 0;
+	cur_shm = 0;
+	cur_conn = NULL;
 
-		fd = recv_fd(control_fd, 0);
-		if (fd < 0) {
-			return -1;
-		}
-		if (fds_in_use < fd_table_size) {
-			fd_table[fds_in_use].fd = fd;
-			fd_table[fds_in_use].tm = t;
-			fds_in_use++;
-		} else {
-			time_t older = t;
-
-			for (i = 0; i != fds_in_use; i++) {
-				if (older <= fd_table[i].tm) {
-					older = fd_table[i].tm;
-					l = i;
-				}
-			}
-			close(fd_table[l].fd);
-			fd_table[l].fd = fd;
-			fd_table[l].tm = t;
-		}
-		return 0;
+	if (round_pos == round_len) {
+		if ((ret = new_round(timeout, sigmask, now)) <= 0)
+			return ret;
+	} else if (now) {
+		time(now);
 	}
 
-	for (i = 0; i != fds_in_use; i++) {
-		if (FD_ISSET(fd_table[i].fd, &readfds)) {
-			fd_table[i].tm = t;
-			return fd_table[i].fd;
-		}
+	while (round_pos < round_len) {
+		fd = round_fds[round_pos++];
+		conn = &conns[fd];
+		if (conn->fd != fd || !conn->ready)
+			continue;	/* gone since the round started */
+		conn->ready = 0;
+		if (conn->shm && shm_ring_empty(&conn->rqst))
+			continue;
+
+		conn->tm = now ? *now : time(NULL);
+		heap_down(conn->heapidx);
+		cur_conn = conn;
+		cur_shm = conn->shm != NULL;
+		return fd;
 	}
-	/* We should never get here */
 	return 0;
 }
 
-int comm_init(struct db_param *dbp, int ctrlfd, int clntfd)
+/* ------------
+ * Set up the shared memory transport for the current connection, the reply
+ * to CNID_DBD_OP_SHM_ATTACH carries the name of the segment. The client
+ * runs as the logged in user, the segment is 0600 and given to the uid the
+ * client sends. Claiming somebody else's uid only gets a segment the client
+ * can't open. Without root we can only serve clients of our own uid.
+ */
+int comm_shm_attach(struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
+{
+	static char name[CNID_DBD_SHM_NAMELEN];
+	static unsigned int count;
+	struct cnid_dbd_shm *shm;
+	uid_t uid = rqst->cnid;
+	int fd;
+
+	rply->namelen = 0;
+	rply->result = CNID_DBD_RES_ERR_DB;
+
+	if (!shm_ipc || cur_shm || cur_conn == NULL || cur_conn->shm)
+		return 1;
+
+	snprintf(name, sizeof(name), "/cnid_dbd.%d.%u", (int) getpid(),
+		 count++);
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0
+	    && errno == EEXIST) {
+		/* left over from a crashed cnid_dbd with our pid */
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	}
+	if (fd < 0) {
+		LOG(log_error, logtype_cnid, "comm_shm_attach: shm_open: %s",
+		    strerror(errno));
+		return 1;
+	}
+	if ((uid != geteuid() && fchown(fd, uid, (gid_t) - 1) < 0)
+	    || ftruncate(fd, CNID_DBD_SHM_LEN) < 0
+	    || (shm = mmap(NULL, CNID_DBD_SHM_LEN, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		LOG(log_error, logtype_cnid, "comm_shm_attach: %s",
+		    strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return 1;
+	}
+	close(fd);
+
+	shm->magic = CNID_DBD_SHM_MAGIC;
+	shm->ringsize = CNID_DBD_SHM_RINGSIZE;
+	shm->attached = 0;
+	shm->gen = db_gen;
+	shm_ring_init(CNID_DBD_SHM_RQST(shm), CNID_DBD_SHM_RINGSIZE);
+	shm_ring_init(CNID_DBD_SHM_RPLY(shm), CNID_DBD_SHM_RINGSIZE);
+	shm_ring_attach(&cur_conn->rqst, CNID_DBD_SHM_RQST(shm),
+			CNID_DBD_SHM_RINGSIZE);
+	shm_ring_attach(&cur_conn->rply, CNID_DBD_SHM_RPLY(shm),
+			CNID_DBD_SHM_RINGSIZE);
+	cur_conn->shm = shm;
+	strcpy(cur_conn->shmname, name);
+	cur_conn->shmidx = shms_in_use;
+	shm_fds[shms_in_use++] = cur_conn->fd;
+
+	LOG(log_debug, logtype_cnid, "comm_shm_attach: fd %d uses %s",
+	    cur_fd, name);
+
+	rply->name = name;
+	rply->namelen = strlen(name);
+	rply->result = CNID_DBD_RES_OK;
+	return 1;
+}
+
+/* ------------
+ * The generation of the database changed, tell the clients on the shared
+ * memory transport right away, the others see it in the next reply
+ */
+void comm_gen(u_int32_t gen)
 {
 	int i;
 
+	if (gen == db_gen)
+		return;
+	db_gen = gen;
+	for (i = 0; i != shms_in_use; i++)
+		conns[shm_fds[i]].shm->gen = gen;
+}
+
+int comm_init(struct db_param *dbp, int ctrlfd, int clntfd)
+{
+	struct rlimit rlim;
+
 	fds_in_use = 0;
 	fd_table_size = dbp->fd_table_size;
+	shm_ipc = dbp->shm_ipc;
+	client_idle_timeout = dbp->client_idle_timeout;
+#ifndef HAVE_SYS_EPOLL_H
+	if (fd_table_size > FD_SETSIZE - 1)
+		fd_table_size = FD_SETSIZE - 1;
+#endif
 
-	if ((fd_table =
-	     malloc(fd_table_size * sizeof(struct connection))) == NULL) {
+	/* make sure we can have fd_table_size clients */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0
+	    && rlim.rlim_cur != RLIM_INFINITY
+	    && rlim.rlim_cur < (rlim_t) fd_table_size + 32) {
+		rlim.rlim_cur = fd_table_size + 32;
+		if (rlim.rlim_max != RLIM_INFINITY
+		    && rlim.rlim_cur > rlim.rlim_max)
+			rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	if ((idle_heap = calloc(fd_table_size, sizeof(int))) == NULL
+	    || (shm_fds = calloc(fd_table_size, sizeof(int))) == NULL
+	    || (round_fds = calloc(fd_table_size, sizeof(int))) == NULL
+	    || (held_fds = calloc(fd_table_size, sizeof(int))) == NULL) {
 		LOG(log_error, logtype_cnid, "Out of memory");
 		return -1;
 	}
-	for (i = 0; i != fd_table_size; i++)
-		fd_table[i].fd = -1;
+	heap_len = round_len = round_pos = held_len = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if ((epoll_fd = epoll_create(fd_table_size + 1)) < 0) {
+		LOG(log_error, logtype_cnid, "epoll_create: %s",
+		    strerror(errno));
+		return -1;
+	}
+	fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+#endif
+
 	/* from dup2 */
 	control_fd = ctrlfd;
+#ifdef HAVE_SYS_EPOLL_H
+	{
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = control_fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, control_fd, &ev) < 0) {
+			LOG(log_error, logtype_cnid, "epoll_ctl: %s",
+			    strerror(errno));
+			return -1;
+		}
+	}
+#endif
 #if 0
 	int b = 1;
 	/* this one dump core in recvmsg, great */
@@ -180,11 +646,10 @@ int comm_init(struct db_param *dbp, int ctrlfd, int clntfd)
 		return -1;
 	}
 #endif
-	/* push the first client fd */
-	fd_table[fds_in_use].fd = clntfd;
-	fds_in_use++;
-
-	return 0;
+	/* push the first client fd, a warm instance starts without one */
+	if (clntfd < 0)
+		return 0;
+	return add_conn(clntfd, time(NULL));
 }
 
 /* ------------
@@ -196,7 +661,40 @@ int comm_nbe(void)
 }
 
 /* ------------ */
-int comm_rcv(struct cnid_dbd_rqst *rqst, time_t timeout,
+static int shm_rcv(struct cnid_dbd_rqst *rqst)
+{
+	struct iovec iov[2];
+	char *nametmp = rqst->name;
+	ssize_t b;
+
+	iov[0].iov_base = rqst;
+	iov[0].iov_len = sizeof(struct cnid_dbd_rqst);
+	iov[1].iov_base = nametmp;
+	iov[1].iov_len = DBD_MAX_BATCH_LEN;
+	b = shm_ring_get(&cur_conn->rqst, iov, 2);
+	rqst->name = nametmp;
+	if (b < (ssize_t) sizeof(struct cnid_dbd_rqst)
+	    || rqst->namelen != b - sizeof(struct cnid_dbd_rqst)) {
+		LOG(log_error, logtype_cnid, "error reading message: %s",
+		    b < 0 ? strerror(errno) : "short");
+		invalidate_fd(cur_fd);
+		return 0;
+	}
+	rqst->name[rqst->namelen] = '\0';
+
+	/* the client has it mapped and should have unlinked it already */
+	if (cur_conn->shmname[0]) {
+		shm_unlink(cur_conn->shmname);
+		cur_conn->shmname[0] = '\0';
+	}
+
+	LOG(log_maxdebug, logtype_cnid, "comm_rcv: got %u bytes from ring",
+	    (unsigned int) b);
+	return 1;
+}
+
+/* ------------ */
+int comm_rcv(struct cnid_dbd_rqst *rqst, int timeout,
 	     const sigset_t * sigmask, time_t * now)
 {
 	char *nametmp;
@@ -211,6 +709,9 @@ int comm_rcv(struct cnid_dbd_rqst *rqst, time_t timeout,
 	LOG(log_maxdebug, logtype_cnid, "comm_rcv: got data on fd %u",
 	    cur_fd);
 
+	if (cur_shm)
+		return shm_rcv(rqst);
+
 	if (setnonblock(cur_fd, 1) != 0) {
 		LOG(log_error, logtype_cnid, "comm_rcv: setnonblock: %s",
 		    strerror(errno));
@@ -231,6 +732,13 @@ int comm_rcv(struct cnid_dbd_rqst *rqst, time_t timeout,
 		return 0;
 	}
 	rqst->name = nametmp;
+	if (rqst->namelen > DBD_MAX_BATCH_LEN) {
+		LOG(log_error, logtype_cnid,
+		    "message name too long: %u bytes",
+		    (unsigned int) rqst->namelen);
+		invalidate_fd(cur_fd);
+		return 0;
+	}
 	if (rqst->namelen
 	    && readt(cur_fd, rqst->name, rqst->namelen, 1,
 		     CNID_DBD_TIMEOUT)
@@ -251,18 +759,35 @@ int comm_rcv(struct cnid_dbd_rqst *rqst, time_t timeout,
 }
 
 /* ------------ */
-int comm_snd(struct cnid_dbd_rply *rply)
+static int conn_snd(struct connection *conn, int shm,
+		    struct cnid_dbd_rply *rply)
 {
 	struct iovec iov[2];
 	size_t towrite;
 
+	if (shm) {
+		iov[0].iov_base = rply;
+		iov[0].iov_len = sizeof(struct cnid_dbd_rply);
+		iov[1].iov_base = rply->name;
+		iov[1].iov_len = rply->namelen;
+		if (shm_ring_put(&conn->rply, iov, rply->namelen ? 2 : 1)
+		    < 0) {
+			LOG(log_error, logtype_cnid,
+			    "error writing message: reply ring full");
+			invalidate_fd(conn->fd);
+			return 0;
+		}
+		shm_ring_wake(&conn->rply);
+		return 1;
+	}
+
 	if (!rply->namelen) {
-		if (write(cur_fd, rply, sizeof(struct cnid_dbd_rply)) !=
+		if (write(conn->fd, rply, sizeof(struct cnid_dbd_rply)) !=
 		    sizeof(struct cnid_dbd_rply)) {
 			LOG(log_error, logtype_cnid,
 			    "error writing message header: %s",
 			    strerror(errno));
-			invalidate_fd(cur_fd);
+			invalidate_fd(conn->fd);
 			return 0;
 		}
 		return 1;
@@ -274,11 +799,69 @@ int comm_snd(struct cnid_dbd_rply *rply)
 	iov[1].iov_len = rply->namelen;
 	towrite = sizeof(struct cnid_dbd_rply) + rply->namelen;
 
-	if (writev(cur_fd, iov, 2) != towrite) {
+	if (writev(conn->fd, iov, 2) != towrite) {
 		LOG(log_error, logtype_cnid, "error writing message : %s",
 		    strerror(errno));
-		invalidate_fd(cur_fd);
+		invalidate_fd(conn->fd);
 		return 0;
 	}
 	return 1;
 }
+
+/* ------------ */
+int comm_snd(struct cnid_dbd_rply *rply)
+{
+	if (cur_conn == NULL)
+		return 0;
+	return conn_snd(cur_conn, cur_shm, rply);
+}
+
+/* ------------
+ * Keep the reply for the current client until comm_flush(), used for group
+ * commits: the client must not see the result before it is on disk.
+ */
+int comm_hold(struct cnid_dbd_rply *rply)
+{
+	struct connection *conn = cur_conn;
+	char *tmp;
+
+	if (conn == NULL)
+		return 0;
+
+	if (rply->namelen > conn->held_size) {
+		if ((tmp = realloc(conn->held_name, rply->namelen)) == NULL) {
+			LOG(log_error, logtype_cnid, "Out of memory");
+			return -1;
+		}
+		conn->held_name = tmp;
+		conn->held_size = rply->namelen;
+	}
+	/* rply->name usually points to a static buffer or into the db */
+	conn->held_rply = *rply;
+	if (rply->namelen)
+		memcpy(conn->held_name, rply->name, rply->namelen);
+	conn->held_rply.name = conn->held_name;
+	conn->held_shm = cur_shm;
+	if (!conn->held) {
+		conn->held = 1;
+		conn->heldidx = held_len;
+		held_fds[held_len++] = conn->fd;
+	}
+	return 1;
+}
+
+/* ------------
+ * Send the held replies, release_conn() drops those of closed connections.
+ */
+void comm_flush(void)
+{
+	struct connection *conn;
+	int i;
+
+	for (i = 0; i < held_len; i++) {
+		conn = &conns[held_fds[i]];
+		conn->held = 0;
+		conn_snd(conn, conn->held_shm, &conn->held_rply);
+	}
+	held_len = 0;
+}
@@ -13,9 +13,14 @@
 
 
 int      comm_init  (struct db_param *, int, int);
-int      comm_rcv  (struct cnid_dbd_rqst *,  time_t, const sigset_t *, time_t *);
+/* timeout in milliseconds */
+int      comm_rcv  (struct cnid_dbd_rqst *,  int, const sigset_t *, time_t *);
 int      comm_snd  (struct cnid_dbd_rply *);
+int      comm_hold (struct cnid_dbd_rply *);
+void     comm_flush(void);
 int      comm_nbe  (void);
+int      comm_shm_attach(struct cnid_dbd_rqst *, struct cnid_dbd_rply *);
+void     comm_gen  (u_int32_t);
 
 #endif /* CNID_DBD_COMM_H */
 
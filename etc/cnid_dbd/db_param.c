@@ -67,9 +67,16 @@ static void default_params(struct db_param *dbp, char *dir)
 		dbp->usock_file[0] = '\0';
 	}
 	dbp->fd_table_size = DEFAULT_FD_TABLE_SIZE;
+#ifndef HAVE_SYS_EPOLL_H
 	if (dbp->fd_table_size > FD_SETSIZE - 1)
 		dbp->fd_table_size = FD_SETSIZE - 1;
+#endif
 	dbp->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	dbp->client_idle_timeout = DEFAULT_CLIENT_IDLE_TIMEOUT;
+	dbp->group_commit_ops = DEFAULT_GROUP_COMMIT_OPS;
+	dbp->group_commit_latency = DEFAULT_GROUP_COMMIT_LATENCY;
+	dbp->shm_ipc = DEFAULT_SHM_IPC;
+	dbp->prefault = DEFAULT_PREFAULT;
 
 	return;
 }
@@ -189,6 +196,31 @@ struct db_param *db_param_read(char *dir)
 			LOG(log_info, logtype_cnid,
 			    "db_param: setting idle timeout to %d",
 			    params.idle_timeout);
+		} else if (!strcmp(key, "client_idle_timeout")) {
+			params.client_idle_timeout = parse_int(val);
+			LOG(log_info, logtype_cnid,
+			    "db_param: setting client idle timeout to %d",
+			    params.client_idle_timeout);
+		} else if (!strcmp(key, "group_commit_ops")) {
+			params.group_commit_ops = parse_int(val);
+			LOG(log_info, logtype_cnid,
+			    "db_param: setting group_commit_ops to %d",
+			    params.group_commit_ops);
+		} else if (!strcmp(key, "group_commit_latency")) {
+			params.group_commit_latency = parse_int(val);
+			LOG(log_info, logtype_cnid,
+			    "db_param: setting group_commit_latency to %d ms",
+			    params.group_commit_latency);
+		} else if (!strcmp(key, "shm_ipc")) {
+			params.shm_ipc = parse_int(val);
+			LOG(log_info, logtype_cnid,
+			    "db_param: setting shm_ipc to %d",
+			    params.shm_ipc);
+		} else if (!strcmp(key, "prefault")) {
+			params.prefault = parse_int(val);
+			LOG(log_info, logtype_cnid,
+			    "db_param: setting prefault to %d",
+			    params.prefault);
 		}
 
 		if (parse_err)
@@ -216,6 +248,15 @@ struct db_param *db_param_read(char *dir)
 		if (params.idle_timeout <= 0)
 			params.idle_timeout = 86400;
 
+		if (params.client_idle_timeout < 0)
+			params.client_idle_timeout = 0;
+
+		if (params.group_commit_ops < 0)
+			params.group_commit_ops = 0;
+
+		if (params.group_commit_latency < 0)
+			params.group_commit_latency = 0;
+
 		return &params;
 	} else
 		return NULL;
@@ -19,6 +19,11 @@
 #define DEFAULT_USOCK_FILE         "usock"
 #define DEFAULT_FD_TABLE_SIZE      512
 #define DEFAULT_IDLE_TIMEOUT       (10 * 60)
+#define DEFAULT_SHM_IPC            1
+#define DEFAULT_CLIENT_IDLE_TIMEOUT 0
+#define DEFAULT_GROUP_COMMIT_OPS   0  /* off, a flush per write */
+#define DEFAULT_GROUP_COMMIT_LATENCY 10 /* ms */
+#define DEFAULT_PREFAULT           1
 
 struct db_param {
     char *dir;
@@ -31,6 +36,11 @@ struct db_param {
     char usock_file[MAXPATHLEN + 1];    
     int fd_table_size;
     int idle_timeout;
+    int client_idle_timeout;    /* close afpd connections idle that long */
+    int shm_ipc;                /* offer the shared memory transport */
+    int group_commit_ops;       /* max writes per log flush, 0: off */
+    int group_commit_latency;   /* max ms a reply is held back */
+    int prefault;               /* warm instances read the db into the cache */
     int max_vols;
 };
 
@@ -0,0 +1,141 @@
+/*
+ * All rights reserved. See COPYING.
+ *
+ * CNID_DBD_OP_BATCH_ADD: the CNIDs of a whole enumerate page in one
+ * request and one transaction.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <atalk/logger.h>
+#include <netatalk/endian.h>
+#include <atalk/cnid_dbd_private.h>
+#include <atalk/cnid.h>
+
+#include "pack.h"
+#include "dbif.h"
+#include "dbd.h"
+
+/*
+ * Look up one object of a batch. Only the two simple cases are handled here:
+ * dev/ino and did/name both point to the same CNID of the right type, or
+ * neither is in the database. Everything else needs the fixups of dbd_lookup(),
+ * and some of those depend on the CNID hint from the AppleDouble file, which
+ * afpd only reads for single requests.
+ *
+ * returns -1 on db error, 0 for "ask again with a single request",
+ * 1 with rply->result CNID_DBD_RES_OK or CNID_DBD_RES_NOTFOUND
+ */
+static int batch_lookup(DBD * dbd, struct cnid_dbd_rqst *rqst,
+			struct cnid_dbd_rply *rply)
+{
+	unsigned char *buf;
+	DBT key, devdata, diddata;
+	cnid_t id_devino, id_didname;
+	u_int32_t type;
+	int devino, didname;
+
+	memset(&key, 0, sizeof(key));
+	memset(&devdata, 0, sizeof(devdata));
+	memset(&diddata, 0, sizeof(diddata));
+
+	buf = pack_cnid_data(rqst);
+
+	key.data = buf + CNID_DEVINO_OFS;
+	key.size = CNID_DEVINO_LEN;
+	if ((devino = dbif_get(dbd, DBIF_IDX_DEVINO, &key, &devdata, 0)) < 0)
+		return -1;
+
+	key.data = buf + CNID_DID_OFS;
+	key.size = CNID_DID_LEN + rqst->namelen + 1;
+	if ((didname = dbif_get(dbd, DBIF_IDX_DIDNAME, &key, &diddata, 0)) < 0)
+		return -1;
+
+	if (!devino && !didname) {
+		rply->result = CNID_DBD_RES_NOTFOUND;
+		return 1;
+	}
+	if (!devino || !didname)
+		return 0;
+
+	memcpy(&id_devino, devdata.data, sizeof(cnid_t));
+	memcpy(&id_didname, diddata.data, sizeof(cnid_t));
+	memcpy(&type, (char *) diddata.data + CNID_TYPE_OFS, sizeof(type));
+	if (id_devino != id_didname || ntohl(type) != rqst->type)
+		return 0;
+
+	rply->cnid = id_didname;
+	rply->result = CNID_DBD_RES_OK;
+	return 1;
+}
+
+/*
+ * Add a batch of objects, see CNID_DBD_OP_BATCH_ADD. If a single add fails
+ * the whole batch is rolled back, afpd then falls back to single requests
+ * which report the error for the object in question.
+ */
+int dbd_batch_add(DBD * dbd, struct cnid_dbd_rqst *rqst,
+		  struct cnid_dbd_rply *rply)
+{
+	static cnid_t ids[DBD_MAX_BATCH];
+	struct cnid_dbd_rqst sub;
+	struct cnid_dbd_rply subrply;
+	char name[MAXPATHLEN + 1];
+	char *p = rqst->name, *end = rqst->name + rqst->namelen;
+	int count = 0;
+	int ret;
+
+	rply->namelen = 0;
+
+	while (p < end) {
+		if (count == DBD_MAX_BATCH || (size_t) (end - p) < sizeof(sub))
+			goto bad_batch;
+		memcpy(&sub, p, sizeof(sub));
+		p += sizeof(sub);
+		if (sub.op != CNID_DBD_OP_ADD || sub.namelen == 0
+		    || sub.namelen > MAXPATHLEN
+		    || sub.namelen > (size_t) (end - p))
+			goto bad_batch;
+		memcpy(name, p, sub.namelen);
+		name[sub.namelen] = '\0';
+		p += sub.namelen;
+		sub.name = name;
+
+		memset(&subrply, 0, sizeof(subrply));
+		if ((ret = batch_lookup(dbd, &sub, &subrply)) < 0) {
+			LOG(log_error, logtype_cnid,
+			    "dbd_batch_add: Unable to get CNID %u, name %s",
+			    ntohl(sub.did), sub.name);
+			rply->result = CNID_DBD_RES_ERR_DB;
+			return -1;
+		}
+
+		if (ret == 0) {
+			ids[count] = CNID_INVALID;
+		} else if (subrply.result == CNID_DBD_RES_OK) {
+			ids[count] = subrply.cnid;
+		} else {
+			if ((ret = dbd_add(dbd, &sub, &subrply, 1)) <= 0) {
+				rply->result = subrply.result;
+				return ret;
+			}
+			ids[count] = subrply.cnid;
+		}
+		count++;
+	}
+
+	LOG(log_debug, logtype_cnid, "dbd_batch_add: %d objects", count);
+
+	rply->name = (char *) ids;
+	rply->namelen = count * sizeof(cnid_t);
+	rply->result = CNID_DBD_RES_OK;
+	return 1;
+
+      bad_batch:
+	LOG(log_error, logtype_cnid, "dbd_batch_add: malformed request");
+	rply->result = CNID_DBD_RES_ERR_DB;
+	return 0;
+}
@@ -26,6 +26,8 @@ int dbd_delete(DBD * dbd, struct cnid_dbd_rqst *rqst,
 
 	memset(&key, 0, sizeof(key));
 	rply->namelen = 0;
+	/* what clients have cached may be gone */
+	dbd->gen++;
 
 	switch (idx) {
 	case DBIF_IDX_DEVINO:
@@ -51,6 +51,7 @@ int dbd_getstamp(DBD * dbd, struct cnid_dbd_rqst *rqst _U_,
 
 	rply->namelen = CNID_DEV_LEN;
 	rply->name = (char *) data.data + CNID_DEV_OFS;
+	rply->cnid = CNID_DBD_HAS_BATCH;
 	rply->result = CNID_DBD_RES_OK;
 	return 1;
 }
@@ -32,6 +32,8 @@ int dbd_rebuild_add(DBD * dbd, struct cnid_dbd_rqst *rqst,
 	memset(&data, 0, sizeof(data));
 
 	rply->namelen = 0;
+	/* may overwrite a record clients have cached */
+	dbd->gen++;
 
 	key.data = &rqst->cnid;
 	key.size = sizeof(cnid_t);
@@ -18,35 +18,33 @@
 int dbd_search(DBD * dbd, struct cnid_dbd_rqst *rqst,
 	       struct cnid_dbd_rply *rply)
 {
-	DBT key;
+	static char resbuf[DBD_MAX_SRCH_LEN];
+	cnid_t pos = rqst->cnid;
+	u_int32_t gram = rqst->did;
+	size_t reslen;
 	int results;
-	static char resbuf[DBD_MAX_SRCH_RSLTS * sizeof(cnid_t)];
 
-	LOG(log_debug, logtype_cnid, "dbd_search(\"%s\"):", rqst->name);
+	LOG(log_debug, logtype_cnid, "dbd_search(\"%s\", pos: %u):",
+	    rqst->name, ntohl(pos));
 
-	memset(&key, 0, sizeof(key));
 	rply->name = resbuf;
 	rply->namelen = 0;
 
-	key.data = rqst->name;
-	key.size = rqst->namelen;
-
-	if ((results = dbif_search(dbd, &key, resbuf)) < 0) {
+	if ((results =
+	     dbif_search(dbd, rqst->name, &pos, &gram, resbuf,
+			 &reslen)) < 0) {
 		LOG(log_error, logtype_cnid,
 		    "dbd_search(\"%s\"): db error", rqst->name);
 		rply->result = CNID_DBD_RES_ERR_DB;
 		return -1;
 	}
-	if (results) {
-		LOG(log_debug, logtype_cnid,
-		    "dbd_search(\"%s\"): %d matches", rqst->name, results);
-		rply->namelen = results * sizeof(cnid_t);
-		rply->result = CNID_DBD_RES_OK;
-	} else {
-		LOG(log_debug, logtype_cnid,
-		    "dbd_search(\"%s\"): no matches", rqst->name);
-		rply->result = CNID_DBD_RES_NOTFOUND;
-	}
+
+	LOG(log_debug, logtype_cnid, "dbd_search(\"%s\"): %d matches%s",
+	    rqst->name, results, pos ? ", more to come" : "");
+	rply->namelen = reslen;
+	rply->cnid = pos;
+	rply->did = gram;
+	rply->result = pos ? CNID_DBD_RES_SRCH_CNT : CNID_DBD_RES_SRCH_DONE;
 
 	return 1;
 }
@@ -14,12 +14,14 @@
 #include <sys/stat.h>
 #include <sys/cdefs.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <db.h>
 
 #include <atalk/logger.h>
 #include <atalk/util.h>
 #include <atalk/errchk.h>
+#include <atalk/cnid.h>
 
 #include "db_param.h"
 #include "dbif.h"
@@ -477,22 +479,29 @@ DBD *dbif_init(const char *envhome, const char *filename)
 		}
 	}
 
+	/* a restarted cnid_dbd doesn't repeat the generations of the last one */
+	dbd->gen = (uint32_t) time(NULL);
+
 	dbd->db_table[DBIF_CNID].name = "cnid2.db";
 	dbd->db_table[DBIF_IDX_DEVINO].name = "devino.db";
 	dbd->db_table[DBIF_IDX_DIDNAME].name = "didname.db";
 	dbd->db_table[DBIF_IDX_NAME].name = "name.db";
+	dbd->db_table[DBIF_IDX_TRIGRAM].name = "trigram.db";
 
 	dbd->db_table[DBIF_CNID].type = DB_BTREE;
 	dbd->db_table[DBIF_IDX_DEVINO].type = DB_BTREE;
 	dbd->db_table[DBIF_IDX_DIDNAME].type = DB_BTREE;
 	dbd->db_table[DBIF_IDX_NAME].type = DB_BTREE;
+	dbd->db_table[DBIF_IDX_TRIGRAM].type = DB_BTREE;
 
 	dbd->db_table[DBIF_CNID].openflags = DB_CREATE;
 	dbd->db_table[DBIF_IDX_DEVINO].openflags = DB_CREATE;
 	dbd->db_table[DBIF_IDX_DIDNAME].openflags = DB_CREATE;
 	dbd->db_table[DBIF_IDX_NAME].openflags = DB_CREATE;
+	dbd->db_table[DBIF_IDX_TRIGRAM].openflags = DB_CREATE;
 
 	dbd->db_table[DBIF_IDX_NAME].flags = DB_DUPSORT;
+	dbd->db_table[DBIF_IDX_TRIGRAM].flags = DB_DUPSORT;
 
 	return dbd;
 }
@@ -840,7 +849,7 @@ int dbif_open(DBD * dbd, struct db_param *dbp, int reindex)
 						  db_table[DBIF_IDX_NAME].
 						  db, idxname, (reindex
 								||
-								((CNID_VERSION == CNID_VERSION_1) && (version == CNID_VERSION_0)))
+								(version == CNID_VERSION_0))
 						  ? DB_CREATE : 0)) != 0) {
 		LOG(log_error, logtype_cnid,
 		    "Failed to associate name index: %s",
@@ -850,6 +859,25 @@ int dbif_open(DBD * dbd, struct db_param *dbp, int reindex)
 	if (reindex)
 		LOG(log_info, logtype_cnid, "... done.");
 
+	/* Upgrading to version 2 builds the trigram index from scratch */
+	if (reindex || version < CNID_VERSION_2)
+		LOG(log_info, logtype_cnid, "Indexing name trigrams...");
+	if ((ret = dbd->db_table[0].db->associate(dbd->db_table[0].db,
+						  dbd->db_txn,
+						  dbd->
+						  db_table[DBIF_IDX_TRIGRAM].
+						  db, idxtrigram,
+						  (reindex
+						   || version < CNID_VERSION_2)
+						  ? DB_CREATE : 0)) != 0) {
+		LOG(log_error, logtype_cnid,
+		    "Failed to associate trigram index: %s",
+		    db_strerror(ret));
+		return -1;
+	}
+	if (reindex || version < CNID_VERSION_2)
+		LOG(log_info, logtype_cnid, "... done.");
+
 	if ((dbd->db_envhome) && ((ret = dbif_upgrade(dbd)) != 0)) {
 		LOG(log_error, logtype_cnid,
 		    "Error upgrading CNID database to version %d",
@@ -1095,57 +1123,199 @@ int dbif_del(DBD * dbd, const int dbi, DBT * key, u_int32_t flags)
 		return 1;
 }
 
+/*
+ * Add a match to the search results: CNID, DID and name of the object,
+ * padded to 4 bytes.
+ *
+ * @returns 0 or -1 if it doesn't fit
+ */
+static int search_add(const DBT * pkey, const DBT * data, char *resbuf,
+		      size_t * reslen)
+{
+	const char *name = (const char *) data->data + CNID_NAME_OFS;
+	size_t len = CNID_FIND_RECLEN(strlen(name));
+
+	if (*reslen + len > DBD_MAX_SRCH_LEN)
+		return -1;
+	memset(resbuf + *reslen, 0, len);
+	memcpy(resbuf + *reslen, pkey->data, sizeof(cnid_t));
+	memcpy(resbuf + *reslen + sizeof(cnid_t),
+	       (const char *) data->data + CNID_DID_OFS, sizeof(cnid_t));
+	strcpy(resbuf + *reslen + 2 * sizeof(cnid_t), name);
+	*reslen += len;
+	return 0;
+}
+
+/* does the lowercased name of the object contain the search string? */
+static int search_match(const DBT * data, const char *name)
+{
+	char buffer[MAXPATHLEN + 2];
+
+	if (data->size <= CNID_NAME_OFS)
+		return 0;
+	if (pack_lowername((const char *) data->data + CNID_NAME_OFS,
+			   buffer) == NULL)
+		return 0;
+	return strstr(buffer, name) != NULL;
+}
+
+/*
+ * Pick the trigram of name with the fewest objects
+ *
+ * @returns offset of the trigram + 1, 0 if one of them has no objects at all,
+ *          -1 on error
+ */
+static int search_gram(DBD * dbd, const char *name)
+{
+	DBC *cursorp = NULL;
+	DBT key, pkey, data;
+	db_recno_t count, best = 0;
+	size_t i, len = strlen(name);
+	int ret, gram = 0;
+
+	if ((ret = dbd->db_table[DBIF_IDX_TRIGRAM].db->cursor(dbd->db_table
+							      [DBIF_IDX_TRIGRAM].db,
+							      NULL, &cursorp,
+							      0)) != 0) {
+		LOG(log_error, logtype_cnid, "Couldn't create cursor: %s",
+		    db_strerror(ret));
+		return -1;
+	}
+
+	memset(&pkey, 0, sizeof(pkey));
+	memset(&data, 0, sizeof(data));
+	data.flags = DB_DBT_PARTIAL;	/* we only want the count */
+	for (i = 0; i + CNID_TRIGRAM_LEN <= len; i++) {
+		memset(&key, 0, sizeof(key));
+		key.data = (char *) name + i;
+		key.size = CNID_TRIGRAM_LEN;
+		ret = cursorp->get(cursorp, &key, &data, DB_SET);
+		if (ret == DB_NOTFOUND) {
+			gram = 0;
+			break;
+		}
+		if (ret != 0 || (ret = cursorp->count(cursorp, &count, 0)) != 0) {
+			LOG(log_error, logtype_cnid, "search_gram: %s",
+			    db_strerror(ret));
+			gram = -1;
+			break;
+		}
+		if (gram == 0 || count < best) {
+			best = count;
+			gram = i + 1;
+		}
+	}
+
+	cursorp->close(cursorp);
+	return gram;
+}
+
 /*!
- * Search the database by name
+ * Search the database for names containing a string
  *
- * @param resbuf    (w) buffer for search results CNIDs, maxsize is assumed to be
- *                      DBD_MAX_SRCH_RSLTS * sizefof(cnid_t)
+ * Names of three or more bytes are looked up in the trigram index, shorter
+ * ones by walking all objects. Results come in CNID order, one call returns
+ * as many as fit into DBD_MAX_SRCH_LEN bytes and looks at DBD_MAX_SRCH_SCAN
+ * objects at most, *pos and *gram say where to continue.
  *
- * @returns -1 on error, 0 when nothing found, else the number of matches
+ * @param name      (r)  lowercased search string
+ * @param pos       (rw) last CNID looked at, 0 for a new search, 0 on return
+ *                       when the search is done
+ * @param gram      (rw) trigram in use, 0 for a new search
+ * @param resbuf    (w)  search results, see CNID_FIND_RECLEN, maxsize is
+ *                       assumed to be DBD_MAX_SRCH_LEN
+ * @param reslen    (w)  length of the results
+ *
+ * @returns -1 on error, else the number of matches
  */
-int dbif_search(DBD * dbd, DBT * key, char *resbuf)
+int dbif_search(DBD * dbd, const char *name, cnid_t * pos, u_int32_t * gram,
+		char *resbuf, size_t * reslen)
 {
-	int ret = 0;
-	int count = 0;
+	int ret = 0, dbi, flags;
+	int count = 0, scanned = 0;
 	DBC *cursorp = NULL;
-	DBT pkey, data;
-	char *cnids = resbuf;
-	cnid_t cnid;
-	char *namebkp = key->data;
-	int namelenbkp = key->size;
-
-	memset(&pkey, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-
-	/* Get a cursor */
-	ret =
-	    dbd->db_table[DBIF_IDX_NAME].db->cursor(dbd->
-						    db_table
-						    [DBIF_IDX_NAME].db,
-						    NULL, &cursorp, 0);
-	if (ret != 0) {
+	DBT key, pkey, data;
+	cnid_t cnid = ntohl(*pos) + 1;
+	size_t len = strlen(name);
+
+	*reslen = 0;
+	if (cnid < CNID_START)
+		cnid = CNID_START;
+	cnid = htonl(cnid);
+
+	if (len >= CNID_TRIGRAM_LEN) {
+		if (*gram == 0 || *gram > len - CNID_TRIGRAM_LEN + 1) {
+			if ((ret = search_gram(dbd, name)) <= 0) {
+				/* error or no matches at all */
+				*pos = 0;
+				return ret;
+			}
+			*gram = ret;
+		}
+		dbi = DBIF_IDX_TRIGRAM;
+	} else {
+		*gram = 0;
+		dbi = DBIF_CNID;
+	}
+
+	if ((ret = dbd->db_table[dbi].db->cursor(dbd->db_table[dbi].db,
+						 NULL, &cursorp, 0)) != 0) {
 		LOG(log_error, logtype_cnid, "Couldn't create cursor: %s",
 		    db_strerror(ret));
 		ret = -1;
 		goto exit;
 	}
 
-	ret = cursorp->pget(cursorp, key, &pkey, &data, DB_SET_RANGE);
-	while (count < DBD_MAX_SRCH_RSLTS && ret != DB_NOTFOUND) {
-		if (!
-		    ((namelenbkp <= key->size)
-		     && (strncmp(namebkp, key->data, namelenbkp) == 0)))
-			break;
-		count++;
-		memcpy(cnids, pkey.data, sizeof(cnid_t));
-		memcpy(&cnid, pkey.data, sizeof(cnid_t));
-		cnids += sizeof(cnid_t);
-		LOG(log_debug, logtype_cnid, "match: CNID %" PRIu32,
-		    ntohl(cnid));
+	memset(&key, 0, sizeof(key));
+	memset(&pkey, 0, sizeof(pkey));
+	memset(&data, 0, sizeof(data));
 
-		ret = cursorp->pget(cursorp, key, &pkey, &data, DB_NEXT);
+	if (dbi == DBIF_IDX_TRIGRAM) {
+		/* duplicates are sorted by CNID */
+		key.data = (char *) name + *gram - 1;
+		key.size = CNID_TRIGRAM_LEN;
+		pkey.data = &cnid;
+		pkey.size = sizeof(cnid);
+		ret = cursorp->pget(cursorp, &key, &pkey, &data,
+				    DB_GET_BOTH_RANGE);
+		flags = DB_NEXT_DUP;
+	} else {
+		key.data = &cnid;
+		key.size = sizeof(cnid);
+		ret = cursorp->get(cursorp, &key, &data, DB_SET_RANGE);
+		flags = DB_NEXT;
 	}
 
+	while (ret == 0) {
+		const DBT *id = dbi == DBIF_IDX_TRIGRAM ? &pkey : &key;
+
+		if (id->size == sizeof(cnid_t) && search_match(&data, name)) {
+			if (search_add(id, &data, resbuf, reslen) < 0)
+				/* full, continue with this one next time */
+				break;
+			count++;
+		}
+		memcpy(pos, id->data, sizeof(cnid_t));
+		if (++scanned == DBD_MAX_SRCH_SCAN)
+			goto exit_count;
+
+		if (dbi == DBIF_IDX_TRIGRAM)
+			ret = cursorp->pget(cursorp, &key, &pkey, &data,
+					    flags);
+		else
+			ret = cursorp->get(cursorp, &key, &data, flags);
+	}
+
+	if (ret == DB_NOTFOUND) {
+		*pos = 0;
+	} else if (ret != 0) {
+		LOG(log_error, logtype_cnid, "dbif_search: %s",
+		    db_strerror(ret));
+		ret = -1;
+		goto exit;
+	}
+
+      exit_count:
 	ret = count;
 
       exit:
@@ -1176,7 +1346,7 @@ int dbif_txn_begin(DBD * dbd)
 		return 0;
 }
 
-int dbif_txn_commit(DBD * dbd)
+static int txn_commit(DBD * dbd, u_int32_t flags)
 {
 	int ret;
 
@@ -1187,7 +1357,7 @@ int dbif_txn_commit(DBD * dbd)
 	if (dbd->db_env == NULL)
 		return 0;
 
-	ret = dbd->db_txn->commit(dbd->db_txn, 0);
+	ret = dbd->db_txn->commit(dbd->db_txn, flags);
 	dbd->db_txn = NULL;
 
 	if (ret) {
@@ -1198,6 +1368,35 @@ int dbif_txn_commit(DBD * dbd)
 		return 1;
 }
 
+int dbif_txn_commit(DBD * dbd)
+{
+	return txn_commit(dbd, 0);
+}
+
+/* 
+   Commit without writing the log to disk, the txn is only durable after the
+   next dbif_log_flush() or synchronous commit. Used for group commits.
+*/
+int dbif_txn_commit_nosync(DBD * dbd)
+{
+	return txn_commit(dbd, DB_TXN_NOSYNC);
+}
+
+int dbif_log_flush(DBD * dbd)
+{
+	int ret;
+
+	if (dbd->db_env == NULL)
+		return 0;
+
+	if ((ret = dbd->db_env->log_flush(dbd->db_env, NULL))) {
+		LOG(log_error, logtype_cnid,
+		    "error flushing log: %s", db_strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
 int dbif_txn_abort(DBD * dbd)
 {
 	int ret;
@@ -1263,6 +1462,76 @@ int dbif_txn_checkpoint(DBD * dbd, u_int32_t kbyte, u_int32_t min,
 		return 0;
 }
 
+/*!
+ * Read the databases into the cache, at most budget bytes of records
+ *
+ * A cnid_dbd that cnid_metad keeps running does this before its first
+ * client comes, who then doesn't wait for the disk page by page. The pages
+ * are read through handles of their own: through the secondary indexes a
+ * cursor would fetch every primary record too, in index order.
+ *
+ * @returns bytes read or -1
+ */
+long long dbif_prefault(DBD * dbd, long long budget)
+{
+	static char buf[64 * 1024];
+	long long total = 0;
+	DBT key, data;
+	DB *db;
+	DBC *cur;
+	void *p, *k _U_, *d _U_;	/* only the lengths count */
+	u_int32_t klen, dlen;
+	int i, ret;
+
+	for (i = 0; i < DBIF_DB_CNT && total < budget; i++) {
+		if (dbd->db_table[i].db == NULL)
+			continue;
+		if ((ret = db_create(&db, dbd->db_env, 0))) {
+			LOG(log_error, logtype_cnid, "error creating DB: %s",
+			    db_strerror(ret));
+			return -1;
+		}
+		if ((ret = db->open(db, NULL, dbd->db_filename,
+				    dbd->db_table[i].name, DB_UNKNOWN,
+				    DB_RDONLY, 0))
+		    || (ret = db->cursor(db, NULL, &cur, 0))) {
+			LOG(log_error, logtype_cnid,
+			    "error opening %s for prefaulting: %s",
+			    dbd->db_table[i].name, db_strerror(ret));
+			db->close(db, 0);
+			return -1;
+		}
+
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+		data.data = buf;
+		data.ulen = sizeof(buf);
+		data.flags = DB_DBT_USERMEM;
+		while (total < budget
+		       && (ret =
+			   cur->get(cur, &key, &data,
+				    DB_NEXT | DB_MULTIPLE_KEY)) == 0) {
+			DB_MULTIPLE_INIT(p, &data);
+			while (1) {
+				DB_MULTIPLE_KEY_NEXT(p, &data, k, klen, d,
+						     dlen);
+				if (p == NULL)
+					break;
+				total += klen + dlen;
+			}
+		}
+		cur->close(cur);
+		db->close(db, 0);
+		if (ret && ret != DB_NOTFOUND) {
+			LOG(log_error, logtype_cnid,
+			    "error prefaulting %s: %s",
+			    dbd->db_table[i].name, db_strerror(ret));
+			return -1;
+		}
+	}
+	return total;
+}
+
 int dbif_copy_rootinfokey(DBD * srcdbd, DBD * destdbd)
 {
 	DBT key, data;
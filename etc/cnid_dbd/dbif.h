@@ -58,12 +58,13 @@
 #include <atalk/adouble.h>
 #include "db_param.h"
 
-#define DBIF_DB_CNT 4
+#define DBIF_DB_CNT 5
  
 #define DBIF_CNID          0
 #define DBIF_IDX_DEVINO    1
 #define DBIF_IDX_DIDNAME   2
 #define DBIF_IDX_NAME      3
+#define DBIF_IDX_TRIGRAM   4
 
 /* get_lock cmd and return value */
 #define LOCKFILENAME  "lock"
@@ -90,6 +91,7 @@ typedef struct {
     char     *db_filename;
     FILE     *db_errlog;
     db_table db_table[DBIF_DB_CNT];
+    uint32_t gen;                  /* counted up when records change, see cnid_dbd_rply */
 } DBD;
 
 /* Functions */
@@ -106,13 +108,17 @@ int dbif_pget(DBD *, const int, DBT *, DBT *, DBT *, u_int32_t);
 int dbif_put(DBD *, const int, DBT *, DBT *, u_int32_t);
 int dbif_del(DBD *, const int, DBT *, u_int32_t);
 int dbif_count(DBD *, const int, u_int32_t *);
-int dbif_search(DBD *dbd, DBT *key, char *resbuf);
+int dbif_search(DBD *dbd, const char *name, cnid_t *pos, u_int32_t *gram,
+                char *resbuf, size_t *reslen);
 int dbif_copy_rootinfokey(DBD *srcdbd, DBD *destdbd);
 int dbif_txn_begin(DBD *);
 int dbif_txn_commit(DBD *);
+int dbif_txn_commit_nosync(DBD *);
+int dbif_log_flush(DBD *);
 int dbif_txn_abort(DBD *);
 int dbif_txn_close(DBD *dbd, int ret); /* Switch between commit+abort */
 int dbif_txn_checkpoint(DBD *, u_int32_t, u_int32_t, u_int32_t);
+long long dbif_prefault(DBD *dbd, long long budget);
 
 int dbif_dump(DBD *dbd, int dumpindexes);
 int dbif_idwalk(DBD *dbd, cnid_t *cnid, int close);
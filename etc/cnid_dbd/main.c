@@ -23,6 +23,7 @@
 #include <sys/stat.h>
 #endif				/* HAVE_SYS_STAT_H */
 #include <time.h>
+#include <sys/time.h>
 #include <sys/file.h>
 
 #include <netatalk/endian.h>
@@ -47,6 +48,7 @@ struct volinfo volinfo;
 static DBD *dbd;
 static int exit_sig = 0;
 static int db_locked;
+static int warm;		/* kept running by cnid_metad, see -w there */
 
 static void sig_exit(int signo)
 {
@@ -85,6 +87,61 @@ static void block_sigs_onoff(int block)
 #define min(a,b)        ((a)<(b)?(a):(b))
 #endif
 
+/*
+  Group commit: with group_commit_ops set, writes are committed with
+  DB_TXN_NOSYNC and their replies are held back. Requests of other clients
+  that are ready are served in the meantime, until none is left, the
+  group has group_commit_ops writes or the first one is group_commit_latency
+  ms old. Then one log flush makes the whole group durable and the replies
+  are sent, so a client never sees a result that isn't on disk.
+*/
+#define GROUP_HIST 9            /* 1, 2-3, 4-7, ..., 256+ writes */
+static unsigned long long group_hist[GROUP_HIST];
+static unsigned long long group_writes;
+
+static int ms_since(const struct timeval *tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - tv->tv_sec) * 1000 +
+	    (now.tv_usec - tv->tv_usec) / 1000;
+}
+
+static int group_flush(int writes)
+{
+	int i;
+
+	if (dbif_log_flush(dbd) < 0)
+		return -1;
+	comm_flush();
+
+	for (i = 0; i < GROUP_HIST - 1 && (2 << i) <= writes; i++);
+	group_hist[i]++;
+	group_writes += writes;
+	return 0;
+}
+
+static void log_group_stat(void)
+{
+	unsigned long long batches = 0;
+	int i;
+
+	for (i = 0; i < GROUP_HIST; i++)
+		batches += group_hist[i];
+	if (!batches)
+		return;
+
+	LOG(log_info, logtype_cnid,
+	    "group commit statistics: batches: %llu, writes: %llu, "
+	    "batch sizes 1: %llu, 2-3: %llu, 4-7: %llu, 8-15: %llu, "
+	    "16-31: %llu, 32-63: %llu, 64-127: %llu, 128-255: %llu, "
+	    "256+: %llu", batches, group_writes,
+	    group_hist[0], group_hist[1], group_hist[2], group_hist[3],
+	    group_hist[4], group_hist[5], group_hist[6], group_hist[7],
+	    group_hist[8]);
+}
+
 static int loop(struct db_param *dbp)
 {
 	struct cnid_dbd_rqst rqst;
@@ -92,9 +149,12 @@ static int loop(struct db_param *dbp)
 	time_t timeout;
 	int ret, cret;
 	int count;
+	int group = 0;		/* writes not flushed yet */
+	struct timeval group_start;
 	time_t now, time_next_flush, time_last_rqst;
 	char timebuf[64];
-	static char namebuf[MAXPATHLEN + 1];
+	/* large enough for a CNID_DBD_OP_BATCH_ADD, comm_rcv() checks namelen */
+	static char namebuf[DBD_MAX_BATCH_LEN + 1];
 	sigset_t set;
 
 	sigemptyset(&set);
@@ -116,17 +176,31 @@ static int loop(struct db_param *dbp)
 	    dbp->flush_interval, timebuf);
 
 	while (1) {
-		timeout =
-		    min(time_next_flush,
-			time_last_rqst + dbp->idle_timeout);
-		if (timeout > now)
-			timeout -= now;
-		else
-			timeout = 1;
+		if (group) {
+			/* only pick up what's there already */
+			timeout = 0;
+		} else {
+			timeout =
+			    min(time_next_flush,
+				time_last_rqst + dbp->idle_timeout);
+			if (timeout > now)
+				timeout -= now;
+			else
+				timeout = 1;
+			timeout *= 1000;
+		}
 
 		if ((cret = comm_rcv(&rqst, timeout, &set, &now)) < 0)
 			return -1;
 
+		if (cret == 0 && group) {
+			if (group_flush(group) < 0)
+				return -1;
+			group = 0;
+			if (!exit_sig)
+				continue;
+		}
+
 		if (cret == 0) {
 			/* comm_rcv returned from select without receiving anything. */
 			if (exit_sig) {
@@ -136,7 +210,17 @@ static int loop(struct db_param *dbp)
 			if (now - time_last_rqst >= dbp->idle_timeout
 			    && comm_nbe() <= 0) {
 				/* Idle timeout */
-				return 0;
+				if (!warm)
+					return 0;
+				/* stay, with a short log in case we crash */
+				if (count) {
+					LOG(log_info, logtype_cnid,
+					    "Checkpointing BerkeleyDB for idle volume '%s'",
+					    dbp->dir);
+					if (dbif_txn_checkpoint(dbd, 0, 0, 0) < 0)
+						return -1;
+					count = 0;
+				}
 			}
 			/* still active connections, reset time_last_rqst */
 			time_last_rqst = now;
@@ -182,28 +266,71 @@ static int loop(struct db_param *dbp)
 			case CNID_DBD_OP_SEARCH:
 				ret = dbd_search(dbd, &rqst, &rply);
 				break;
+			case CNID_DBD_OP_BATCH_ADD:
+				ret = dbd_batch_add(dbd, &rqst, &rply);
+				break;
+			case CNID_DBD_OP_SHM_ATTACH:
+				ret = comm_shm_attach(&rqst, &rply);
+				break;
 			default:
 				LOG(log_error, logtype_cnid,
 				    "loop: unknown op %d", rqst.op);
 				ret = -1;
 				break;
 			}
+			rply.gen = dbd->gen;
+			comm_gen(dbd->gen);
 
-			if ((cret = comm_snd(&rply)) < 0 || ret < 0) {
+			if (!dbp->group_commit_ops) {
+				if ((cret = comm_snd(&rply)) < 0 || ret < 0) {
+					dbif_txn_abort(dbd);
+					return -1;
+				}
+
+				if (ret == 0 || cret == 0) {
+					if (dbif_txn_abort(dbd) < 0)
+						return -1;
+				} else {
+					ret = dbif_txn_commit(dbd);
+					if (ret < 0)
+						return -1;
+					else if (ret > 0)
+						/* We had a designated txn because we wrote to the db */
+						count++;
+				}
+			} else if (ret < 0) {
 				dbif_txn_abort(dbd);
+				if (group)
+					group_flush(group);
+				comm_snd(&rply);
 				return -1;
-			}
-
-			if (ret == 0 || cret == 0) {
-				if (dbif_txn_abort(dbd) < 0)
-					return -1;
 			} else {
-				ret = dbif_txn_commit(dbd);
-				if (ret < 0)
+				if (ret == 0) {
+					if (dbif_txn_abort(dbd) < 0)
+						return -1;
+				} else {
+					ret = dbif_txn_commit_nosync(dbd);
+					if (ret < 0)
+						return -1;
+					else if (ret > 0) {
+						if (!group++)
+							gettimeofday(&group_start, NULL);
+						count++;
+					}
+				}
+
+				/* while a write isn't on disk nobody may see it */
+				if ((group ? comm_hold(&rply) : comm_snd(&rply)) < 0)
 					return -1;
-				else if (ret > 0)
-					/* We had a designated txn because we wrote to the db */
-					count++;
+
+				if (group
+				    && (group >= dbp->group_commit_ops
+					|| ms_since(&group_start) >=
+					dbp->group_commit_latency)) {
+					if (group_flush(group) < 0)
+						return -1;
+					group = 0;
+				}
 			}
 		}		/* got a request */
 
@@ -215,6 +342,7 @@ static int loop(struct db_param *dbp)
 			LOG(log_info, logtype_cnid,
 			    "Checkpointing BerkeleyDB for volume '%s'",
 			    dbp->dir);
+			log_group_stat();
 			if (dbif_txn_checkpoint(dbd, 0, 0, 0) < 0)
 				return -1;
 			count = 0;
@@ -305,7 +433,7 @@ int main(int argc, char *argv[])
 
 	set_processname("cnid_dbd");
 
-	while ((ret = getopt(argc, argv, "vVd")) != -1) {
+	while ((ret = getopt(argc, argv, "vVdw")) != -1) {
 		switch (ret) {
 		case 'v':
 		case 'V':
@@ -314,6 +442,9 @@ int main(int argc, char *argv[])
 		case 'd':
 			delete_bdb = 1;
 			break;
+		case 'w':
+			warm = 1;
+			break;
 		}
 	}
 
@@ -422,6 +553,26 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (warm) {
+		/* started ahead of the clients, do now what would keep them waiting */
+		time_t t = time(NULL);
+		long long bytes;
+
+		if (dbif_txn_checkpoint(dbd, 0, 0, DB_FORCE) < 0) {
+			dbif_close(dbd);
+			exit(2);
+		}
+		if (dbp->prefault) {
+			if ((bytes = dbif_prefault(dbd,
+						   1024LL * dbp->cachesize * 3 / 4)) < 0) {
+				dbif_close(dbd);
+				exit(2);
+			}
+			LOG(log_info, logtype_cnid,
+			    "Prefaulted %lld KB of '%s' in %d s", bytes / 1024,
+			    dbpath, (int) (time(NULL) - t));
+		}
+	}
 
 	if (comm_init(dbp, ctrlfd, clntfd) < 0) {
 		dbif_close(dbd);
@@ -430,6 +581,7 @@ int main(int argc, char *argv[])
 
 	if (loop(dbp) < 0)
 		err++;
+	log_group_stat();
 
 	if (dbif_close(dbd) < 0)
 		err++;
@@ -8,7 +8,9 @@
 
 #include <netatalk/endian.h>
 
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <sys/param.h>
 #include <sys/cdefs.h>
@@ -89,20 +91,33 @@ int devino(DB * dbp _U_, const DBT * pkey _U_, const DBT * pdata,
 	return (0);
 }
 
+/*!
+ * Lowercase a name the way the name indexes and searches see it
+ *
+ * @returns buffer or NULL on conversion error
+ */
+char *pack_lowername(const char *name, char *buffer)
+{
+	uint16_t flags = CONV_TOLOWER;
+
+	if (convert_charset(volinfo.v_volcharset,
+			    volinfo.v_volcharset,
+			    volinfo.v_maccharset,
+			    name, strlen(name),
+			    buffer, MAXPATHLEN, &flags) == (size_t) -1)
+		return NULL;
+	return buffer;
+}
+
 /* --------------- */
 int idxname(DB * dbp _U_, const DBT * pkey _U_, const DBT * pdata,
 	    DBT * skey)
 {
 	static char buffer[MAXPATHLEN + 2];
-	uint16_t flags = CONV_TOLOWER;
 	memset(skey, 0, sizeof(DBT));
 
-	if (convert_charset(volinfo.v_volcharset,
-			    volinfo.v_volcharset,
-			    volinfo.v_maccharset,
-			    (char *) pdata->data + CNID_NAME_OFS,
-			    strlen((char *) pdata->data + CNID_NAME_OFS),
-			    buffer, MAXPATHLEN, &flags) == (size_t) -1) {
+	if (pack_lowername((char *) pdata->data + CNID_NAME_OFS,
+			   buffer) == NULL) {
 		LOG(log_error, logtype_cnid, "idxname: conversion error");
 	}
 
@@ -111,6 +126,60 @@ int idxname(DB * dbp _U_, const DBT * pkey _U_, const DBT * pdata,
 	return (0);
 }
 
+/* --------------- */
+static int trigram_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, CNID_TRIGRAM_LEN);
+}
+
+/*
+ * Secondary keys for substring searches: every distinct three byte sequence
+ * of the lowercased name. UTF-8 sequences can't match in the middle of a
+ * character, so byte trigrams work for multibyte names too.
+ */
+int idxtrigram(DB * dbp _U_, const DBT * pkey _U_, const DBT * pdata,
+	       DBT * skey)
+{
+	static char buffer[MAXPATHLEN + 2];
+	static char grams[MAXPATHLEN * CNID_TRIGRAM_LEN];
+	DBT *keys;
+	size_t len, i, n;
+
+	memset(skey, 0, sizeof(DBT));
+
+	if (pack_lowername((char *) pdata->data + CNID_NAME_OFS,
+			   buffer) == NULL) {
+		LOG(log_error, logtype_cnid, "idxtrigram: conversion error");
+		return DB_DONOTINDEX;
+	}
+	if ((len = strlen(buffer)) < CNID_TRIGRAM_LEN)
+		return DB_DONOTINDEX;
+
+	n = len - CNID_TRIGRAM_LEN + 1;
+	for (i = 0; i < n; i++)
+		memcpy(grams + i * CNID_TRIGRAM_LEN, buffer + i,
+		       CNID_TRIGRAM_LEN);
+	/* a duplicate secondary key/primary key pair isn't allowed */
+	qsort(grams, n, CNID_TRIGRAM_LEN, trigram_cmp);
+
+	if ((keys = calloc(n, sizeof(DBT))) == NULL)
+		return ENOMEM;
+	for (i = 0, len = 0; i < n; i++) {
+		if (len && memcmp(keys[len - 1].data,
+				  grams + i * CNID_TRIGRAM_LEN,
+				  CNID_TRIGRAM_LEN) == 0)
+			continue;
+		keys[len].data = grams + i * CNID_TRIGRAM_LEN;
+		keys[len].size = CNID_TRIGRAM_LEN;
+		len++;
+	}
+
+	skey->flags = DB_DBT_MULTIPLE | DB_DBT_APPMALLOC;
+	skey->data = keys;
+	skey->size = len;
+	return (0);
+}
+
 /* The equivalent to make_cnid_data in the cnid library. Non re-entrant. We
    differ from make_cnid_data in that we never return NULL, rqst->name cannot
    ever cause start[] to overflow because name length is checked in libatalk. */
@@ -14,5 +14,9 @@ unsigned char *pack_cnid_data(struct cnid_dbd_rqst *);
 int didname(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
 int devino(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
 int idxname(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
+int idxtrigram(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
+char *pack_lowername(const char *name, char *buffer);
+
+#define CNID_TRIGRAM_LEN 3
 
 #endif /* CNID_DBD_PACK_H */
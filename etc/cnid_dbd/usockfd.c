@@ -123,6 +123,7 @@ int usockfd_check(int sockfd, const sigset_t * sigset)
 	FD_ZERO(&readfds);
 	FD_SET(sockfd, &readfds);
 
+	log_flush();
 	if ((ret =
 	     pselect(sockfd + 1, &readfds, NULL, NULL, NULL,
 		     sigset)) < 0) {
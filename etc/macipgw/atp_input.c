@@ -83,11 +83,9 @@ void atp_print_addr(char *s, struct sockaddr_at *saddr)
 
 int atp_input(ATP ah, struct sockaddr_at *faddr, char *rbuf, int recvlen)
 {
-	struct atpbuf *pq, *cq;
 	struct atphdr ahdr;
 	uint16_t rfunc;
 	uint16_t rtid;
-	int i;
 	struct atpbuf *inbuf;
 
 	bcopy(rbuf + 1, (char *) &ahdr, sizeof(struct atphdr));
@@ -106,36 +104,10 @@ int atp_input(ATP ah, struct sockaddr_at *faddr, char *rbuf, int recvlen)
 		}
 
 		if (rfunc == ATP_TREL) {
-			/* remove response from sent list */
-			for (pq = NULL, cq = ah->atph_sent; cq != NULL;
-			     pq = cq, cq = cq->atpbuf_next) {
-				if (at_addr_eq(faddr, &cq->atpbuf_addr) &&
-				    cq->atpbuf_info.atpbuf_xo.atpxo_tid ==
-				    ntohs(rtid))
-					break;
-			}
-			if (cq != NULL) {
-				if (gDebug)
-					printf
-					    ("<%d> releasing transaction %hu\n",
-					     getpid(), ntohs(rtid));
-				if (pq == NULL) {
-					ah->atph_sent = cq->atpbuf_next;
-				} else {
-					pq->atpbuf_next = cq->atpbuf_next;
-				}
-				for (i = 0; i < 8; ++i) {
-					if (cq->atpbuf_info.atpbuf_xo.
-					    atpxo_packet[i] != NULL) {
-						atp_free_buf(cq->
-							     atpbuf_info.
-							     atpbuf_xo.
-							     atpxo_packet
-							     [i]);
-					}
-				}
-				atp_free_buf(cq);
-			}
+			/* remove response from sent responses */
+			if (atp_xo_release(ah, faddr, ntohs(rtid)) && gDebug)
+				printf("<%d> releasing transaction %hu\n",
+				       getpid(), ntohs(rtid));
 		} else {
 			/* add packet to incoming queue */
 			if (gDebug)
@@ -351,6 +351,7 @@ int main(int ac, char **av)
 		for (pr = printers; pr; pr = pr->p_next) {
 			FD_SET(atp_fileno(pr->p_atp), &fdset);
 		}
+		log_flush();
 		if ((c = select(FD_SETSIZE, &fdset, NULL, NULL, NULL)) < 0) {
 			if (errno == EINTR) {
 				continue;
@@ -458,6 +458,8 @@ static int pam_printer(char *start, char *stop, char *username,
 
 static int uam_setup(const char *path)
 {
+	uam_session_var(&pamh, sizeof(pamh));
+
 	if (uam_register(UAM_SERVER_LOGIN_EXT, path, "Cleartxt Passwrd",
 			 pam_login, NULL, pam_logout, pam_login_ext) < 0)
 		return -1;
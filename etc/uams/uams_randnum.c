@@ -42,7 +42,7 @@
 
 static DES_cblock seskey;
 static DES_key_schedule seskeysched;
-static struct passwd *randpwd;
+static char randuser[UAM_USERNAMELEN + 1];	/* who logs in, for logincont */
 static u_int8_t randbuf[8];
 
 /* hash to a 16-bit number. this will generate completely harmless 
@@ -301,25 +301,32 @@ static int rand_login(void *obj, char *username, int ulen,
 		      size_t ibuflen _U_, char *rbuf, size_t *rbuflen)
 {
 
+	struct passwd *pwd;
 	char *passwdfile;
 	u_int16_t sessid;
 	size_t len;
 	int err;
 
-	if ((randpwd = uam_getname(obj, username, ulen)) == NULL)
+	if ((pwd = uam_getname(obj, username, ulen)) == NULL)
 		return AFPERR_NOTAUTH;	/* unknown user */
 
 	LOG(log_info, logtype_uams, "randnum/rand2num login: %s",
 	    username);
-	if (uam_checkuser(randpwd) < 0)
+	if (uam_checkuser(pwd) < 0)
+		return AFPERR_NOTAUTH;
+
+	/* pwd is getpwnam()'s, which the other sessions of a worker afpd
+	 * overwrite before logincont. keep the name, not the pointer */
+	if (strlen(pwd->pw_name) >= sizeof(randuser))
 		return AFPERR_NOTAUTH;
+	strcpy(randuser, pwd->pw_name);
 
 	len = UAM_PASSWD_FILENAME;
 	if (uam_afpserver_option(obj, UAM_OPTION_PASSWDOPT,
 				 (void *) &passwdfile, &len) < 0)
 		return AFPERR_PARAM;
 
-	if ((err = randpass(randpwd, passwdfile, seskey,
+	if ((err = randpass(pwd, passwdfile, seskey,
 			    sizeof(seskey), 0)) != AFP_OK)
 		return err;
 
@@ -342,6 +349,17 @@ static int rand_login(void *obj, char *username, int ulen,
 }
 
 
+/* the user rand_login() was called for, looked up again */
+static int rand_pwd(struct passwd **uam_pwd)
+{
+	if ((*uam_pwd = getpwnam(randuser)) == NULL) {
+		LOG(log_info, logtype_uams, "randnum/rand2num: %s is gone",
+		    randuser);
+		return AFPERR_NOTAUTH;
+	}
+	return AFP_OK;
+}
+
 /* check encrypted reply. we actually setup the encryption stuff
  * here as the first part of randnum and rand2num are identical. */
 static int randnum_logincont(void *obj, struct passwd **uam_pwd,
@@ -373,8 +391,7 @@ static int randnum_logincont(void *obj, struct passwd **uam_pwd,
 	}
 
 	memset(randbuf, 0, sizeof(randbuf));
-	*uam_pwd = randpwd;
-	return AFP_OK;
+	return rand_pwd(uam_pwd);
 }
 
 
@@ -424,8 +441,7 @@ static int rand2num_logincont(void *obj, struct passwd **uam_pwd,
 	memset(&seskeysched, 0, sizeof(seskeysched));
 	*rbuflen = sizeof(randbuf);
 
-	*uam_pwd = randpwd;
-	return AFP_OK;
+	return rand_pwd(uam_pwd);
 }
 
 /* change password  --
@@ -563,6 +579,12 @@ static int randnum_login_ext(void *obj, char *uname,
 
 static int uam_setup(const char *path)
 {
+	/* between login and logincont */
+	uam_session_var(&seskey, sizeof(seskey));
+	uam_session_var(&seskeysched, sizeof(seskeysched));
+	uam_session_var(randuser, sizeof(randuser));
+	uam_session_var(randbuf, sizeof(randbuf));
+
 	if (uam_register(UAM_SERVER_LOGIN_EXT, path, "Randnum exchange",
 			 randnum_login, randnum_logincont, NULL,
 			 randnum_login_ext) < 0)
@@ -432,6 +432,7 @@ extern int ad_testlock      (struct adouble * /*adp*/, int /*eid*/, off_t /*off*
 
 extern u_int16_t ad_openforks (struct adouble * /*adp*/, u_int16_t);
 extern int ad_excl_lock     (struct adouble * /*adp*/, const u_int32_t /*eid*/);
+extern int ad_lock_ofd      (const int /*on*/);
 
 #define ad_lock ad_fcntl_lock
 #define ad_tmplock ad_fcntl_tmplock
@@ -57,6 +57,8 @@ typedef struct ASP {
 #define asp_slen	asp_u.asu_status.as_slen
 #define asp_seq		asp_u.asu_seq
     int			asp_flags;
+    int			asp_ctlfd;	/* worker: control socket to the master */
+    u_int32_t		asp_serial;	/* worker session: number from the master */
     char		child, inited, *commands;
     char                cmdbuf[ASP_CMDMAXSIZ];
     char                data[ASP_DATAMAXSIZ];  
@@ -66,6 +68,13 @@ typedef struct ASP {
 
 #define ASPFL_SLS	1
 #define ASPFL_SSS	2
+#define ASPFL_WORKER	4	/* serves the sessions passed in by the master */
+
+/* messages between the master and the workers, see asp_worker.c */
+#define ASPWRK_OPEN	1	/* new session */
+#define ASPWRK_CLOSE	2	/* session timed out */
+#define ASPWRK_RETIRE	3	/* no new sessions, exit after the last one */
+#define ASPWRK_CLOSED	4	/* worker -> master: session has ended */
 
 #define ASPFUNC_CLOSE	1
 #define ASPFUNC_CMD	2
@@ -101,5 +110,8 @@ extern int asp_wrtcont      (ASP, char *, size_t *);
 extern void asp_kill        (int);
 extern int asp_tickle      (ASP, const u_int8_t, struct sockaddr_at *);
 extern void asp_stop_tickle (void);
+extern void asp_setworkers  (const int);
+extern int asp_worker_recv  (ASP, ASP *, u_int32_t *);
+extern int asp_worker_closed (ASP, const ASP);
 
 #endif
@@ -68,6 +68,7 @@ struct atphdr {
 #define ATP_MAXDATA	(578+4)		/* maximum ATP data size */
 #define ATP_BUFSIZ	587		/* maximum packet size */
 #define ATP_HDRSIZE	5		/* includes DDP type field */
+#define ATP_USERSIZ	4		/* user bytes, start of the data */
 
 #define ATP_TRELMASK	0x07		/* mask all but TREL */
 #define ATP_RELTIME	30		/* base release timer (in secs) */
@@ -85,6 +86,10 @@ struct atpxobuf {
     struct timeval	atpxo_tv;
     int			atpxo_reltime;
     struct atpbuf	*atpxo_packet[8];
+    struct atpbuf	*atpxo_hnext;		/* hash chain */
+    struct atpbuf	*atpxo_wnext;		/* timer wheel slot */
+    struct atpbuf	*atpxo_wprev;
+    int			atpxo_slot;
 };
 
 struct atpbuf {
@@ -97,6 +102,8 @@ struct atpbuf {
     } atpbuf_info;
 };
 
+struct atp_xocache;
+
 struct atp_handle {
     int			atph_socket;		/* ddp socket */
     struct sockaddr_at	atph_saddr;		/* address */
@@ -104,7 +111,7 @@ struct atp_handle {
     u_int16_t		atph_rtid;		/* last received (rreq) */
     u_int8_t		atph_rxo;		/* XO flag from last rreq */
     int			atph_rreltime;		/* release time (secs) */
-    struct atpbuf	*atph_sent;		/* packets we send (XO) */
+    struct atp_xocache	*atph_xo;		/* packets we send (XO) */
     struct atpbuf	*atph_queue;		/* queue of pending packets */
     int			atph_reqtries;		/* retry count for request */
     int			atph_reqto;		/* retry timeout for request */
@@ -183,6 +190,7 @@ struct atp_block {
 
 extern ATP		atp_open  (u_int8_t, 
 				       const struct at_addr *);
+extern ATP		atp_fdopen (int, const struct sockaddr_at *);
 extern int		atp_close (ATP);
 extern int		atp_sreq  (ATP, struct atp_block *, int, 
 				       u_int8_t);
@@ -190,5 +198,8 @@ extern int		atp_rresp (ATP, struct atp_block *);
 extern int		atp_rsel  (ATP, struct sockaddr_at *, int);
 extern int		atp_rreq  (ATP, struct atp_block *);
 extern int		atp_sresp (ATP, struct atp_block *);
+extern int		atp_sresp_user (ATP, struct atp_block *,
+					const char *);
+extern int		atp_bufs_reserve (int);
 
 #endif
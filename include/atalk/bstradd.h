@@ -38,6 +38,9 @@ typedef struct tagbstring static_bstring;
 extern bstring brefcstr(const char *str);
 extern int bunrefcstr(bstring b);
 
+extern bstring bslabcstr(const char *str, int len);
+extern int bslabdestroy(bstring b);
+
 extern struct bstrList *bstrListCreateMin(int min);
 extern int bstrListPush(struct bstrList *sl, bstring bs);
 extern bstring bstrListPop(struct bstrList *sl);
@@ -0,0 +1,56 @@
+/*
+ * Per volume catalog index for FPCatSearch, see libatalk/util/catindex.c
+ */
+
+#ifndef ATALK_CATINDEX_H
+#define ATALK_CATINDEX_H 1
+
+#include <sys/types.h>
+
+#include <atalk/unicode.h>
+#include <atalk/cnid.h>
+
+/* in the .AppleDB directory of the volume */
+#define CATINDEX_NAME "catindex"
+
+/*
+ * One record, followed by the name: cr_namelen lowercase UCS-2 characters,
+ * padded to a multiple of 4 bytes. FinderInfo fields and attributes are
+ * stored as they are in the AppleDouble file, CNIDs in network byte order.
+ */
+struct catindex_rec {
+    u_int16_t cr_len;       /* whole record */
+    u_int8_t  cr_op;        /* CATINDEX_OP_* */
+    u_int8_t  cr_isdir;
+    cnid_t    cr_cnid;
+    cnid_t    cr_did;       /* parent */
+    u_int32_t cr_cdate;     /* unix times */
+    u_int32_t cr_mdate;
+    u_int32_t cr_bdate;
+    u_int32_t cr_type;
+    u_int32_t cr_creator;
+    u_int16_t cr_fdflags;
+    u_int16_t cr_attr;
+    u_int16_t cr_namelen;
+    u_int16_t cr_pad;
+};
+
+#define CATINDEX_OP_PUT 1   /* add or replace cr_cnid */
+#define CATINDEX_OP_DEL 2   /* remove cr_cnid */
+
+#define CATINDEX_NAMEP(rec) ((const ucs2_t *) ((const struct catindex_rec *) (rec) + 1))
+
+typedef struct catindex catindex_t;
+
+extern catindex_t *catindex_open(const char *dbdir);
+extern catindex_t *catindex_create(const char *dbdir);
+extern int        catindex_commit(catindex_t *ci);
+extern void       catindex_close(catindex_t *ci);
+extern int        catindex_put(catindex_t *ci, struct catindex_rec *rec, const char *name);
+extern int        catindex_del(catindex_t *ci, cnid_t cnid);
+extern int        catindex_refresh(catindex_t *ci);
+extern u_int32_t  catindex_gen(const catindex_t *ci);
+extern u_int32_t  catindex_slots(const catindex_t *ci);
+extern const struct catindex_rec *catindex_get(const catindex_t *ci, u_int32_t slot);
+
+#endif /* ATALK_CATINDEX_H */
@@ -34,6 +34,7 @@
 #define CNID_FLAG_LAZY_INIT    0x20      /* */
 #define CNID_FLAG_MEMORY       0x40  /* this is a memory only db */
 #define CNID_FLAG_INODE        0x80  /* in cnid_add the inode is authoritative */
+#define CNID_FLAG_BULK         0x100 /* load a new db, nothing can be looked up until closed */
 
 #define CNID_INVALID   0
 /* first valid ID */
@@ -45,6 +46,24 @@
 #define CNID_ERR_CLOSE 0x80000004   /* the db was not open */
 #define CNID_ERR_MAX   0x80000005
 
+/*
+ * One object of a cnid_add_batch() request, cnid is the result.
+ */
+struct cnid_batch {
+    const struct stat *st;
+    cnid_t      did;
+    const char  *name;
+    size_t      len;
+    cnid_t      cnid;
+};
+
+/*
+ * cnid_find() fills the buffer with one record per match: CNID and parent
+ * DID (network byte order) followed by the NUL terminated name, padded to
+ * a multiple of 4 bytes.
+ */
+#define CNID_FIND_RECLEN(namelen) ((2 * sizeof(cnid_t) + (namelen) + 1 + 3) & ~3)
+
 /*
  * This is instance of CNID database object.
  */
@@ -68,7 +87,8 @@ struct _cnid_db {
     cnid_t (*cnid_rebuild_add) (struct _cnid_db *, const struct stat *, const cnid_t,
                                 char *, const size_t, cnid_t);
     int    (*cnid_find)        (struct _cnid_db *cdb, const char *name, size_t namelen,
-                                void *buffer, size_t buflen);
+                                u_int32_t *pos, void *buffer, size_t buflen);
+    int    (*cnid_add_batch)   (struct _cnid_db *cdb, struct cnid_batch *batch, int count);
 };
 typedef struct _cnid_db cnid_db;
 
@@ -122,7 +142,8 @@ int    cnid_update     (struct _cnid_db *cdb, const cnid_t id, const struct stat
 cnid_t cnid_rebuild_add(struct _cnid_db *cdb, const struct stat *st, const cnid_t did,
                         char *name, const size_t len, cnid_t hint);
 int    cnid_find       (struct _cnid_db *cdb, const char *name, size_t namelen,
-                        void *buffer, size_t buflen);
+                        u_int32_t *pos, void *buffer, size_t buflen);
+int    cnid_add_batch  (struct _cnid_db *cdb, struct cnid_batch *batch, int count);
 void   cnid_close      (struct _cnid_db *db);
 
 #endif
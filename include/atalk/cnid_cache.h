@@ -0,0 +1,42 @@
+/*
+ * A per process cache of what a CNID backend answered: DID/name -> CNID,
+ * CNID -> DID/name and dev/ino -> CNID. The backend tells it the generation
+ * of its database, a new one throws away everything cached.
+ */
+
+#ifndef _ATALK_CNID_CACHE_H
+#define _ATALK_CNID_CACHE_H 1
+
+#include <sys/types.h>
+#include <netatalk/endian.h>
+#include <atalk/cnid.h>
+
+#define CNID_CACHE_ENTRIES  8192    /* 128 bytes each */
+#define CNID_CACHE_NAMEMAX  84      /* longer names aren't cached */
+
+struct cnid_cache_stats {
+    u_int64_t requests;             /* gets, resolves and lookups asked */
+    u_int64_t hits;                 /* ... answered from the cache */
+    u_int64_t flushes;              /* generation changes */
+    u_int64_t evictions;
+};
+
+typedef struct cnid_cache cnid_cache;
+
+extern cnid_cache *cnid_cache_new(unsigned int entries, int ttl);
+extern void        cnid_cache_free(cnid_cache *cache);
+extern void        cnid_cache_gen(cnid_cache *cache, u_int32_t gen);
+extern void        cnid_cache_flush(cnid_cache *cache);
+extern void        cnid_cache_add(cnid_cache *cache, cnid_t cnid, cnid_t did,
+                                  const char *name, size_t len, int type,
+                                  u_int64_t dev, u_int64_t ino);
+extern cnid_t      cnid_cache_get(cnid_cache *cache, cnid_t did,
+                                  const char *name, size_t len);
+extern char       *cnid_cache_resolve(cnid_cache *cache, cnid_t *id,
+                                      void *buffer, size_t len);
+extern cnid_t      cnid_cache_lookup(cnid_cache *cache, u_int64_t dev,
+                                     u_int64_t ino, int type, cnid_t did,
+                                     const char *name, size_t len);
+extern const struct cnid_cache_stats *cnid_cache_stats(const cnid_cache *cache);
+
+#endif /* _ATALK_CNID_CACHE_H */
@@ -11,6 +11,8 @@
 #include <sys/param.h>
 
 #include <atalk/cnid_private.h>
+#include <atalk/shm_ring.h>
+#include <atalk/cnid_cache.h>
 
 #define CNID_DBD_OP_OPEN        0x01
 #define CNID_DBD_OP_CLOSE       0x02
@@ -25,6 +27,8 @@
 #define CNID_DBD_OP_GETSTAMP    0x0b
 #define CNID_DBD_OP_REBUILD_ADD 0x0c
 #define CNID_DBD_OP_SEARCH      0x0d
+#define CNID_DBD_OP_BATCH_ADD   0x0e
+#define CNID_DBD_OP_SHM_ATTACH  0x0f
 
 #define CNID_DBD_RES_OK            0x00
 #define CNID_DBD_RES_NOTFOUND      0x01
@@ -34,7 +38,56 @@
 #define CNID_DBD_RES_SRCH_CNT      0x05
 #define CNID_DBD_RES_SRCH_DONE     0x06
 
-#define DBD_MAX_SRCH_RSLTS 100
+/*
+ * CNID_DBD_OP_SEARCH: the name of the request is the lowercased search
+ * string, cnid and did are the position from the last reply, 0 for a new
+ * search. The name of the reply carries the matches as described for
+ * cnid_find(), cnid and did are the position to continue from, the result is
+ * CNID_DBD_RES_SRCH_CNT if there's more to come, CNID_DBD_RES_SRCH_DONE if not.
+ */
+#define DBD_MAX_SRCH_LEN   (16 * 1024)  /* bytes of matches per reply */
+#define DBD_MAX_SRCH_SCAN  10000        /* objects looked at per request */
+
+/*
+ * CNID_DBD_OP_BATCH_ADD: the name of the request carries up to DBD_MAX_BATCH
+ * CNID_DBD_OP_ADD requests, each a struct cnid_dbd_rqst followed by its name,
+ * DBD_MAX_BATCH_LEN bytes at most. They are executed in one transaction.
+ * The name of the reply is a vector of one cnid_t per request, CNID_INVALID
+ * for objects cnid_dbd could only handle with the CNID hint from the
+ * AppleDouble file, the client has to send those as single CNID_DBD_OP_ADD.
+ * cnid_dbd sets CNID_DBD_HAS_BATCH in the cnid of its CNID_DBD_OP_GETSTAMP
+ * reply. Older versions leave it 0 and hang up on the unknown request.
+ */
+#define DBD_MAX_BATCH      128
+#define DBD_MAX_BATCH_LEN  (64 * 1024)
+#define CNID_DBD_HAS_BATCH 0x01
+
+/*
+ * CNID_DBD_OP_SHM_ATTACH: a client on the same host asks cnid_dbd for a
+ * shared memory segment, the reply carries its shm_open() name. The cnid of
+ * the request is the client's effective uid, the segment is mode 0600 and
+ * owned by it; the client unlinks the name once it has it mapped. Afterwards
+ * requests and replies go through the two rings in the segment, with the
+ * same layout as on the socket. The socket stays open: the client writes a
+ * byte to it when cnid_dbd sleeps in select(), and either side closing it
+ * ends the connection as before.
+ */
+#define CNID_DBD_SHM_MAGIC     0x434e4944
+#define CNID_DBD_SHM_RINGSIZE  (128 * 1024)
+#define CNID_DBD_SHM_NAMELEN   64
+#define CNID_DBD_SHM_SPIN      2000  /* polls before going to sleep */
+
+struct cnid_dbd_shm {
+    u_int32_t magic;
+    u_int32_t ringsize;
+    volatile u_int32_t attached;    /* set by the client after mmap() */
+    volatile u_int32_t gen;         /* cnid_dbd's current generation */
+    char      pad[48];
+};
+
+#define CNID_DBD_SHM_LEN  (sizeof(struct cnid_dbd_shm) + 2 * SHM_RING_LEN(CNID_DBD_SHM_RINGSIZE))
+#define CNID_DBD_SHM_RQST(p) ((char *)(p) + sizeof(struct cnid_dbd_shm))
+#define CNID_DBD_SHM_RPLY(p) (CNID_DBD_SHM_RQST(p) + SHM_RING_LEN(CNID_DBD_SHM_RINGSIZE))
 
 struct cnid_dbd_rqst {
     int     op;
@@ -47,10 +100,18 @@ struct cnid_dbd_rqst {
     size_t  namelen;
 };
 
+/*
+ * Every reply carries the generation of the database, cnid_dbd counts it up
+ * whenever records are deleted or overwritten. As long as it stays the same
+ * clients may keep what they got from earlier replies, see cnid_cache.h.
+ * Clients on the shared memory transport see it change in the segment
+ * header without asking.
+ */
 struct cnid_dbd_rply {
     int     result;    
     cnid_t  cnid;
     cnid_t  did;
+    u_int32_t gen;
     char    *name;
     size_t  namelen;
 };
@@ -66,6 +127,12 @@ typedef struct CNID_private {
     size_t    stamp_size;
     int       notfirst;   /* already open before */
     int       changed;  /* stamp differ */
+    struct cnid_dbd_shm *shm; /* shared memory transport or NULL */
+    shm_ring_t shm_rqst;
+    shm_ring_t shm_rply;
+    int       noshm;    /* cnid_dbd doesn't do shared memory */
+    int       nobatch;  /* cnid_dbd doesn't do CNID_DBD_OP_BATCH_ADD */
+    cnid_cache *cache;  /* what cnid_dbd answered, or NULL */
 } CNID_private;
 
 
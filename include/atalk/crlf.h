@@ -0,0 +1,20 @@
+/*
+ * CR/LF translation and newline scanning, see libatalk/util/crlf.c
+ */
+
+#ifndef ATALK_CRLF_H
+#define ATALK_CRLF_H 1
+
+#include <sys/types.h>
+
+/* swap \012 and \015 in place */
+extern void   crlf_swap(char *buf, size_t len);
+
+/* offset of the first byte with (byte & mask) == ch, len if there's none */
+extern size_t nl_scan(const char *buf, size_t len, u_int8_t mask, u_int8_t ch);
+
+/* kernels in use: "scalar", "sse2", "avx2" or "neon" */
+extern const char *crlf_kernel(void);
+extern int    crlf_use(const char *name);
+
+#endif /* ATALK_CRLF_H */
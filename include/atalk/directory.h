@@ -58,8 +58,6 @@ struct dir {
     bstring     d_u_name;            /* unix name                                          */
                                      /* be careful here! if d_m_name == d_u_name, d_u_name */
                                      /* will just point to the same storage as d_m_name !! */
-    ucs2_t      *d_m_name_ucs2;       /* mac name as UCS2 */
-    qnode_t     *qidx_node;           /* pointer to position in queue index */
     time_t      d_ctime;                /* inode ctime, used and modified by reenumeration */
 
     int         d_flags;              /* directory flags */
@@ -73,6 +71,10 @@ struct dir {
     /* Stuff used in the dircache */
     time_t      dcache_ctime;         /* inode ctime, used and modified by dircache */
     ino_t       dcache_ino;           /* inode number, used to detect changes in the dircache */
+    struct dir  *dcache_prev;         /* position in the dircache replacement queue */
+    struct dir  *dcache_next;
+    uint8_t     dcache_queue;         /* which queue, see dircache.c */
+    uint8_t     dcache_ref;           /* referenced since the clock hand passed */
 };
 
 struct path {
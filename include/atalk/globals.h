@@ -56,6 +56,9 @@ struct afp_volume_name {
 
 struct afp_options {
     int connections, transports, tickleval, timeout, server_notif, flags, dircachesize;
+    int shareddircache;         /* entries in the dircache shared by all children, 0: off */
+    int prefetchthreads;        /* threads for the enumerate stat prefetch, 0: off */
+    int aspworkers;             /* processes serving all ASP sessions, 0: one per session */
     int sleep;                  /* Maximum time allowed to sleep (in tickles) */
     int disconnected;           /* Maximum time in disconnected state (in tickles) */
     int fce_fmodwait;           /* number of seconds FCE file mod events are put on hold */
@@ -196,7 +196,11 @@ void set_processname(const char *processname);
 UAM_MODULE_EXPORT void make_log_entry(enum loglevels loglevel,
 				      enum logtypes logtype,
 				      const char *file, int line,
-				      char *message, ...);
+				      const char *message, ...);
+
+/* write out file log messages still sitting in the log buffer, daemons
+   call it before they block waiting for input */
+void log_flush(void);
 
 /*
  * How to write a LOG macro:
@@ -206,6 +210,10 @@ UAM_MODULE_EXPORT void make_log_entry(enum loglevels loglevel,
  * to parse for human beings and facilitates expanding the macro for
  * inline checks for debug levels.
  *
+ * The level check is done inline, before any argument is evaluated or
+ * formatted, so a disabled LOG costs one compare. Enabled file log
+ * messages are batched by make_log_entry, see log_flush().
+ *
  * How to properly enclose multistatement macros:
  * http://en.wikipedia.org/wiki/C_macro#Multiple_statements
  */
@@ -213,65 +221,11 @@ UAM_MODULE_EXPORT void make_log_entry(enum loglevels loglevel,
 #define LOG_MAX log_info
 
 
-static inline void LOG(int log_level, int type, char *fmt, ...)
-{
-	va_list args;
-	char buffer[256];
-	FILE *logfile = NULL;
-	char logpath[256];
-	char *lognames[] = {
-		"default",
-		"logger",
-		"cnid",
-		"afpd",
-		"dsi",
-		"atalkd",
-		"papd",
-		"uams",
-		"end-of-list"
-	};
-
-	char *loglevel_names[] = {
-		"none",
-		"severe",
-		"error",
-		"warning",
-		"note",
-		"info",
-		"debug",
-		"debug6",
-		"debug7",
-		"debug8",
-		"debug9",
-		"maxdebug"
-	};
-
-	time_t now;
-	char timestring[256];
-
-	va_start(args, fmt);
-	vsnprintf(buffer, 255, fmt, args);
-	va_end(args);
-
-#if defined(linux)
-	snprintf(logpath, 255, "/var/log/netatalk/%s.log",
-		 program_invocation_short_name);
-#else
-	snprintf(logpath, 255, "/var/log/netatalk/%s.log", getprogname());
-#endif
-	if (log_level <= type_configs[type].level) {
-		syslog(LOG_WARNING, buffer);
-		now = time(NULL);
-		strftime(timestring, sizeof(timestring) - 1,
-			 "%Y-%m-%d %H:%M:%S", localtime(&now));
-		logfile = fopen(logpath, "a");
-		if (logfile != NULL) {
-			fprintf(logfile, "%s %s: (%s) %s\n", timestring,
-				lognames[type], loglevel_names[log_level],
-				buffer);
-			fclose(logfile);
-		}
-	}
-}
+#define LOG(log_level, type, ...)					\
+	do {								\
+		if ((log_level) <= type_configs[(type)].level)		\
+			make_log_entry((log_level), (type),		\
+				       __FILE__, __LINE__, __VA_ARGS__);	\
+	} while (0)
 
 #endif				/* _ATALK_LOGGER_H */
@@ -6,8 +6,9 @@
  *
  * this provides a generic interface to the ddp layer. with this, we
  * should be able to interact with any appletalk stack that allows
- * direct access to the ddp layer. right now, only os x server's ddp
- * layer and the generic socket based interfaces are understood.  
+ * direct access to the ddp layer. right now, the generic socket based
+ * interface and DDP carried in UDP datagrams (for testing on hosts
+ * without a kernel appletalk stack) are understood.
  */
 
 #ifndef _ATALK_NETDDP_H
@@ -19,14 +20,12 @@
 #include <sys/socket.h>
 #include <netatalk/at.h>
 
-extern int netddp_open   (struct sockaddr_at *, struct sockaddr_at *);
-
-#include <unistd.h>
-#include <sys/types.h>
-
-#define netddp_close(a)  close(a)
-#define netddp_sendto    sendto
-#define netddp_recvfrom  recvfrom
+extern int     netddp_open     (struct sockaddr_at *, struct sockaddr_at *);
+extern int     netddp_close    (int);
+extern ssize_t netddp_sendto   (int, const void *, size_t, int,
+                                const struct sockaddr *, socklen_t);
+extern ssize_t netddp_recvfrom (int, void *, size_t, int,
+                                struct sockaddr *, socklen_t *);
 
 #endif /* netddp.h */
 
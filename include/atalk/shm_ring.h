@@ -0,0 +1,45 @@
+/*
+ * Single producer single consumer message ring in shared memory.
+ *
+ * The ring header and the data live in memory shared by two processes,
+ * shm_ring_t is the private handle of each side. Indices are masked with
+ * the private size, so a misbehaving peer can garble messages but can't
+ * make us read or write outside the mapping.
+ */
+
+#ifndef ATALK_SHM_RING_H
+#define ATALK_SHM_RING_H 1
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct shm_ring {
+    volatile u_int32_t tail;     /* written by the producer */
+    char               pad1[60];
+    volatile u_int32_t head;     /* written by the consumer */
+    volatile u_int32_t waiting;  /* consumer is (about to go) asleep */
+    char               pad2[56];
+};
+
+typedef struct {
+    struct shm_ring *hdr;
+    unsigned char   *data;
+    u_int32_t       size;        /* power of 2 */
+} shm_ring_t;
+
+/* bytes needed for a ring with size bytes of data */
+#define SHM_RING_LEN(size) (sizeof(struct shm_ring) + (size))
+
+extern int     shm_ring_spins(int spin);
+extern void    shm_ring_init(void *mem, u_int32_t size);
+extern void    shm_ring_attach(shm_ring_t *ring, void *mem, u_int32_t size);
+extern int     shm_ring_put(shm_ring_t *ring, const struct iovec *iov, int cnt);
+extern ssize_t shm_ring_get(shm_ring_t *ring, const struct iovec *iov, int cnt);
+extern int     shm_ring_empty(shm_ring_t *ring);
+extern int     shm_ring_sleep(shm_ring_t *ring);
+extern void    shm_ring_awake(shm_ring_t *ring);
+extern int     shm_ring_waiting(shm_ring_t *ring);
+extern void    shm_ring_wake(shm_ring_t *ring);
+extern int     shm_ring_wait(shm_ring_t *ring, int spin, int ms);
+
+#endif /* ATALK_SHM_RING_H */
@@ -0,0 +1,37 @@
+/*
+ * Slab allocator for small objects, see libatalk/util/slab.c
+ */
+
+#ifndef ATALK_SLAB_H
+#define ATALK_SLAB_H 1
+
+#include <sys/types.h>
+
+/* objects are carved from chunks of this size */
+#define SLAB_CHUNK     (64 * 1024)
+#define SLAB_MAX_OBJ   (SLAB_CHUNK / 8)
+
+/* size classes of slab_alloc_size(), bigger objects come from malloc() */
+#define SLAB_MIN_CLASS 16
+#define SLAB_MAX_CLASS 1024
+
+typedef struct slab slab_t;
+
+struct slab_stat {
+    u_int64_t    allocs;
+    u_int64_t    frees;
+    unsigned int inuse;     /* objects */
+    unsigned int chunks;
+};
+
+extern slab_t *slab_create(size_t size);
+extern void   slab_destroy(slab_t *slab);
+extern void   *slab_alloc(slab_t *slab);
+extern void   slab_free(slab_t *slab, void *obj);
+extern void   slab_stat(const slab_t *slab, struct slab_stat *st);
+
+extern void   *slab_alloc_size(size_t size);
+extern void   slab_free_size(void *obj, size_t size);
+extern void   slab_stat_size(struct slab_stat *st);
+
+#endif /* ATALK_SLAB_H */
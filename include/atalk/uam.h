@@ -90,5 +90,8 @@ extern UAM_MODULE_EXPORT int uam_afp_read (void *, char *, size_t *,
 			     int (*)(void *, void *, const int));
 extern UAM_MODULE_EXPORT int uam_afpserver_option (void *, const int, void *, size_t *);
 
+/* login state kept in globals, a worker afpd switches it with the session */
+extern UAM_MODULE_EXPORT void uam_session_var (void *, const size_t);
+
 
 #endif
@@ -41,6 +41,7 @@ struct vol {
     int             v_ad_options; /* adouble option NODEV, NOCACHE, etc.. */
     char            *(*ad_path)(const char *, int);
     struct _cnid_db *v_cdb;
+    struct catindex *v_catindex; /* FPCatSearch index, dbd scheme only */
     char            v_stamp[ADEDLEN_PRIVSYN];
     VolSpace        v_limitsize; /* Size limit, if any, in MiB */
     mode_t          v_umask;
@@ -34,6 +34,9 @@
  ((type) == ADLOCK_CLR ? LOCK_UN : -1)))
 
 
+/* lock per open file description instead of per process, see ad_lock_ofd() */
+static int lock_ofd;
+
 /* ----------------------- */
 static int set_lock(int fd, int cmd, struct flock *lock)
 {
@@ -43,9 +46,56 @@ static int set_lock(int fd, int cmd, struct flock *lock)
 			lock->l_type = F_UNLCK;
 		return 0;
 	}
+#ifdef F_OFD_SETLK
+	if (lock_ofd) {
+		lock->l_pid = 0;
+		cmd = (cmd == F_GETLK) ? F_OFD_GETLK : F_OFD_SETLK;
+	}
+#endif
 	return fcntl(fd, cmd, lock);
 }
 
+/*!
+ * Switch to open file description locks
+ *
+ * fcntl locks belong to the process, an afpd serving several sessions
+ * in one process would never see the locks of its other sessions, and
+ * closing a fork in one session would drop the locks the others hold on
+ * the same file. Open file description locks behave between two opens of
+ * a file as process locks do between two processes. Within a session a
+ * file is only opened once anyway, the adouble is shared by its forks.
+ *
+ * @returns 0, -1 if the system has no open file description locks
+ */
+int ad_lock_ofd(const int on)
+{
+#ifdef F_OFD_SETLK
+	struct flock lock;
+	FILE *fp;
+	int ret;
+
+	/* the kernel may still not know them (Linux < 3.15) */
+	if (on) {
+		if ((fp = tmpfile()) == NULL)
+			return -1;
+		memset(&lock, 0, sizeof(lock));
+		lock.l_type = F_WRLCK;
+		lock.l_whence = SEEK_SET;
+		ret = fcntl(fileno(fp), F_OFD_GETLK, &lock);
+		fclose(fp);
+		if (ret < 0)
+			return -1;
+	}
+	lock_ofd = on;
+	return 0;
+#else
+	if (!on)
+		return 0;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 /* ----------------------- */
 static int XLATE_FCNTL_LOCK(int type)
 {
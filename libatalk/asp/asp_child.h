@@ -30,10 +30,31 @@ struct asp_child {
     int			ac_pid;
     int			ac_state;
     struct sockaddr_at	ac_sat;
+    u_int32_t		ac_serial;	/* worker mode: tells reused sids apart */
 };
 
 #define ACSTATE_DEAD	0
 #define ACSTATE_OK	1
 #define ACSTATE_BAD	7
 
+/* what the master and the workers tell each other, see asp_worker.c */
+struct asp_wmsg {
+    int			aw_type;	/* ASPWRK_* */
+    u_int8_t		aw_sid;
+    u_int8_t		aw_wss;		/* ASPWRK_OPEN */
+    u_int32_t		aw_serial;
+    struct sockaddr_at	aw_sat;		/* ASPWRK_OPEN: workstation */
+    struct sockaddr_at	aw_local;	/* ASPWRK_OPEN: session socket */
+};
+
+extern void asp_worker_retire (void);
+extern int asp_worker_pick   (void);
+extern pid_t asp_worker_pid  (const int);
+extern pid_t asp_worker_fork (const int, int *);
+extern int asp_worker_send   (const int, const struct asp_wmsg *, const int);
+extern int asp_worker_close  (const pid_t, const u_int8_t, const u_int32_t);
+extern void asp_worker_drain (void (*)(const u_int8_t, const u_int32_t));
+extern void asp_worker_gone  (const pid_t);
+extern int asp_workers       (void);
+
 #endif /* _ASP_CHILD_H */
@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
+#include <sys/param.h>
 
 #include <atalk/atp.h>
 #include <atalk/asp.h>
@@ -37,11 +38,13 @@ int asp_cmdreply(ASP asp, int result)
 {
 	struct iovec iov[ASP_MAXPACKETS];
 	struct atp_block atpb;
+	char user[ASP_MAXPACKETS * ASP_HDRSIZ];
 	int iovcnt, buflen;
 	char *buf;
 
-	/* unpack data into a format that atp likes. it needs to get
-	 * 4-byte headers prepended before each ASP_CMDSIZ chunk. */
+	/* cut the reply into ASP_CMDSIZ chunks where it is. atp copies
+	 * every chunk into its packet anyway, it puts the 4-byte header in
+	 * front of it: the result for the first one, zero for the others. */
 	buf = (char *) asp->data;
 	buflen = asp->datalen;
 	asp->write_count += buflen;
@@ -50,29 +53,19 @@ int asp_cmdreply(ASP asp, int result)
 	iovcnt = 0;
 	do {
 		iov[iovcnt].iov_base = buf;
-		memmove(buf + ASP_HDRSIZ, buf, buflen);
-
-		if (iovcnt == 0) {
-			memcpy(iov[iovcnt].iov_base, &result, ASP_HDRSIZ);
-		} else {
-			memset(iov[iovcnt].iov_base, 0, ASP_HDRSIZ);
-		}
-
-		if (buflen > ASP_CMDSIZ) {
-			buf += ASP_CMDMAXSIZ;
-			buflen -= ASP_CMDSIZ;
-			iov[iovcnt].iov_len = ASP_CMDMAXSIZ;
-		} else {
-			iov[iovcnt].iov_len = buflen + ASP_HDRSIZ;
-			buflen = 0;
-		}
+		iov[iovcnt].iov_len = MIN(buflen, ASP_CMDSIZ);
+		buf += iov[iovcnt].iov_len;
+		buflen -= iov[iovcnt].iov_len;
 		iovcnt++;
 	} while (buflen > 0);
 
+	memcpy(user, &result, ASP_HDRSIZ);
+	memset(user + ASP_HDRSIZ, 0, (iovcnt - 1) * ASP_HDRSIZ);
+
 	atpb.atp_saddr = &asp->asp_sat;
 	atpb.atp_sresiov = iov;
 	atpb.atp_sresiovcnt = iovcnt;
-	if (atp_sresp(asp->asp_atp, &atpb) < 0) {
+	if (atp_sresp_user(asp->asp_atp, &atpb, user) < 0) {
 		return (-1);
 	}
 	asp->asp_seq++;
@@ -47,6 +47,25 @@
 static ASP server_asp;
 static struct server_child *children = NULL;
 static struct asp_child **asp_ac = NULL;
+static u_int32_t asp_serial;	/* worker mode */
+
+/* a worker has ended a session */
+static void session_closed(const u_int8_t sid, const u_int32_t serial)
+{
+	if (asp_ac[sid] && asp_ac[sid]->ac_serial == serial)
+		asp_ac[sid]->ac_state = ACSTATE_DEAD;
+}
+
+/* with workers children->count is the number of workers, not of sessions */
+static int session_count(void)
+{
+	int sid, count = 0;
+
+	for (sid = 0; sid < children->nsessions; sid++)
+		if (asp_ac[sid] && asp_ac[sid]->ac_state != ACSTATE_DEAD)
+			count++;
+	return count;
+}
 
 /* send tickles and check tickle status of connections
  * thoughts on using a hashed list:
@@ -60,6 +79,9 @@ static void tickle_handler(int sig _U_)
 {
 	int sid;
 
+	if (asp_workers())
+		asp_worker_drain(session_closed);
+
 	/* check status */
 	for (sid = 0; sid < children->nsessions; sid++) {
 		if (asp_ac[sid] == NULL
@@ -67,8 +89,17 @@ static void tickle_handler(int sig _U_)
 			continue;
 
 		if (++asp_ac[sid]->ac_state >= ACSTATE_BAD) {
+			/* a worker closes just this session */
+			if (asp_workers()) {
+				if (asp_worker_close(asp_ac[sid]->ac_pid, sid,
+						     asp_ac[sid]->ac_serial)
+				    == 0)
+					LOG(log_info, logtype_default,
+					    "asp_alrm: session %d of %d timed out",
+					    sid, asp_ac[sid]->ac_pid);
+			}
 			/* kill. if already dead, just continue */
-			if (kill(asp_ac[sid]->ac_pid, SIGTERM) == 0)
+			else if (kill(asp_ac[sid]->ac_pid, SIGTERM) == 0)
 				LOG(log_info, logtype_default,
 				    "asp_alrm: %d timed out",
 				    asp_ac[sid]->ac_pid);
@@ -82,15 +113,15 @@ static void tickle_handler(int sig _U_)
 	}
 }
 
+/* a worker takes all its sessions with it */
 static void child_cleanup(const pid_t pid)
 {
 	int i;
 
 	for (i = 0; i < children->nsessions; i++)
-		if (asp_ac[i] && (asp_ac[i]->ac_pid == pid)) {
+		if (asp_ac[i] && (asp_ac[i]->ac_pid == pid))
 			asp_ac[i]->ac_state = ACSTATE_DEAD;
-			break;
-		}
+	asp_worker_gone(pid);
 }
 
 
@@ -111,14 +142,98 @@ void asp_stop_tickle(void)
 	}
 }
 
+/* the child gets the asp */
+static void child_reset(ASP asp)
+{
+	int i;
+
+	parent_or_child = 1;
+	server_reset_signal();
+	/* free/close some things */
+	for (i = 0; i < children->nsessions; i++) {
+		if (asp_ac[i] != NULL)
+			free(asp_ac[i]);
+	}
+	free(asp_ac);
+	asp_ac = NULL;
+
+	server_child_free(children);
+	children = NULL;
+	atp_close(asp->asp_atp);
+	atp_bufs_reserve(0);
+	asp->child = 1;
+}
+
+static void set_asp_ac(int sid, struct asp_child *tmp);
+
+/* worker mode: hand the new session to a worker, forking it first if it's
+ * a new one. returns the asp with ASPFL_WORKER in a new worker */
+static ASP worker_open(ASP asp, ATP atp, struct sockaddr_at *sat,
+		       const int sid, u_int16_t * asperr)
+{
+	struct asp_child *asp_ac_tmp;
+	struct asp_wmsg msg;
+	pid_t pid;
+	int i, fd;
+
+	*asperr = ASPERR_SERVBUSY;
+	if ((i = asp_worker_pick()) < 0)
+		return NULL;
+
+	if ((pid = asp_worker_pid(i)) == 0) {
+		switch ((pid = asp_worker_fork(i, &fd))) {
+		case 0:
+			atp_close(atp);
+			child_reset(asp);
+			asp->asp_atp = NULL;
+			asp->asp_flags = ASPFL_WORKER;
+			asp->asp_ctlfd = fd;
+			return asp;
+		case -1:
+			return NULL;
+		default:
+			if (!server_child_add(children, CHILD_ASPFORK, pid, -1)) {
+				kill(pid, SIGQUIT);
+				return NULL;
+			}
+			break;
+		}
+	}
+
+	if ((asp_ac_tmp = malloc(sizeof(struct asp_child))) == NULL)
+		return NULL;
+	if (++asp_serial == 0)
+		asp_serial = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.aw_type = ASPWRK_OPEN;
+	msg.aw_sid = sid;
+	msg.aw_wss = asp->cmdbuf[1];
+	msg.aw_serial = asp_serial;
+	msg.aw_sat = *sat;
+	msg.aw_local = *atp_sockaddr(atp);
+	if (asp_worker_send(i, &msg, atp_fileno(atp)) < 0) {
+		free(asp_ac_tmp);
+		return NULL;
+	}
+
+	asp_ac_tmp->ac_pid = pid;
+	asp_ac_tmp->ac_state = ACSTATE_OK;
+	asp_ac_tmp->ac_sat = *sat;
+	asp_ac_tmp->ac_sat.sat_port = asp->cmdbuf[1];
+	asp_ac_tmp->ac_serial = asp_serial;
+	set_asp_ac(sid, asp_ac_tmp);
+	*asperr = ASPERR_OK;
+	return NULL;
+}
+
 /*
  * This call handles open, tickle, and getstatus requests. On a
- * successful open, it forks a child process. 
+ * successful open, it forks a child process, or with workers passes
+ * the session to one.
  * It returns an ASP to the child and parent and NULL if there is
  * an error.
  */
-static void set_asp_ac(int sid, struct asp_child *tmp);
-
 ASP asp_getsession(ASP asp, server_child * server_children,
 		   const int tickleval)
 {
@@ -133,6 +248,7 @@ ASP asp_getsession(ASP asp, server_child * server_children,
 	u_int16_t asperr = 0;
 	char *buf;
 	int buflen;
+	char user[ASP_MAXPACKETS * ASP_HDRSIZ];
 
 	if (!asp->inited) {
 		if (!(children = server_children))
@@ -147,6 +263,14 @@ ASP asp_getsession(ASP asp, server_child * server_children,
 
 		server_asp = asp;
 
+		/* after a reload new sessions go to new workers */
+		asp_worker_retire();
+
+		/* every session opened holds an XO response until it's
+		 * released, don't grow the ATP buffers one by one
+		 */
+		atp_bufs_reserve(2 * server_children->nsessions);
+
 		/* install cleanup pointer */
 		server_child_setup(children, CHILD_ASPFORK, child_cleanup);
 
@@ -175,6 +299,9 @@ ASP asp_getsession(ASP asp, server_child * server_children,
 		asp->inited = 1;
 	}
 
+	if (asp_workers())
+		asp_worker_drain(session_closed);
+
 	memset(&sat, 0, sizeof(struct sockaddr_at));
 #ifdef __NetBSD__
 	sat.sat_len = sizeof(struct sockaddr_at);
@@ -212,12 +339,8 @@ ASP asp_getsession(ASP asp, server_child * server_children,
 				atpb.atp_bitmap >>= 1;
 			}
 
-			/* asp->data is big enough ... */
-			memcpy(asp->data, asp->asp_status,
-			       MIN(asp->asp_slen, i * ASP_CMDSIZ));
-
+			buf = asp->asp_status;
 			buflen = MIN(asp->asp_slen, i * ASP_CMDSIZ);
-			buf = asp->data;
 			iovcnt = 0;
 
 			/* If status information is too big to fit into the available
@@ -226,34 +349,27 @@ ASP asp_getsession(ASP asp, server_child * server_children,
 			 * the additional information anyway, like directory services
 			 * or UTF8 server name. A very long fqdn could be a problem,
 			 * we could end up with an invalid address list.
+			 * The packets are sent straight from the status buffer, ATP
+			 * puts the (zero) ASP headers in front of them.
 			 */
 			do {
 				iov[iovcnt].iov_base = buf;
-				memmove(buf + ASP_HDRSIZ, buf, buflen);
-				memset(iov[iovcnt].iov_base, 0,
-				       ASP_HDRSIZ);
-
-				if (buflen > ASP_CMDSIZ) {
-					buf += ASP_CMDMAXSIZ;
-					buflen -= ASP_CMDSIZ;
-					iov[iovcnt].iov_len =
-					    ASP_CMDMAXSIZ;
-				} else {
-					iov[iovcnt].iov_len =
-					    buflen + ASP_HDRSIZ;
-					buflen = 0;
-				}
+				iov[iovcnt].iov_len = MIN(buflen, ASP_CMDSIZ);
+				buf += iov[iovcnt].iov_len;
+				buflen -= iov[iovcnt].iov_len;
 				iovcnt++;
 			} while (iovcnt < i && buflen > 0);
 
+			memset(user, 0, sizeof(user));
 			atpb.atp_sresiovcnt = iovcnt;
 			atpb.atp_sresiov = iov;
-			atp_sresp(asp->asp_atp, &atpb);
+			atp_sresp_user(asp->asp_atp, &atpb, user);
 		}
 		break;
 
 	case ASPFUNC_OPEN:
-		if (children->count < children->nsessions) {
+		if ((asp_workers() ? session_count() : children->count)
+		    < children->nsessions) {
 			struct asp_child *asp_ac_tmp;
 
 			/* find a slot */
@@ -273,23 +389,24 @@ ASP asp_getsession(ASP asp, server_child * server_children,
 					      sat_addr))) == NULL)
 				return NULL;
 
-			int dummy[2];
-			switch ((pid = fork())) {
-			case 0:	/* child */
-				parent_or_child = 1;
-				server_reset_signal();
-				/* free/close some things */
-				for (i = 0; i < children->nsessions; i++) {
-					if (asp_ac[i] != NULL)
-						free(asp_ac[i]);
+			if (asp_workers()) {
+				if (worker_open(asp, atp, &sat, sid, &asperr))
+					return asp;	/* new worker */
+				if (asperr == ASPERR_OK) {
+					asp->cmdbuf[0] =
+					    atp_sockaddr(atp)->sat_port;
+					asp->cmdbuf[1] = sid;
+				} else {
+					asp->cmdbuf[0] = asp->cmdbuf[1] = 0;
 				}
-				free(asp_ac);
-
-				server_child_free(children);
-				children = NULL;
-				atp_close(asp->asp_atp);
+				/* the worker has its own copy */
+				atp_close(atp);
+				goto open_reply;
+			}
 
-				asp->child = 1;
+			switch ((pid = fork())) {
+			case 0:	/* child */
+				child_reset(asp);
 				asp->asp_atp = atp;
 				asp->asp_sat = sat;
 				asp->asp_wss = asp->cmdbuf[1];
@@ -307,8 +424,7 @@ ASP asp_getsession(ASP asp, server_child * server_children,
 			default:	/* parent process */
 				/* we need atomic setting or pb with tickle_handler */
 				if (server_child_add
-				    (children, CHILD_ASPFORK, pid,
-				     (long)dummy)) {
+				    (children, CHILD_ASPFORK, pid, -1)) {
 					if ((asp_ac_tmp =
 					     malloc(sizeof
 						    (struct asp_child))) ==
@@ -332,15 +448,17 @@ ASP asp_getsession(ASP asp, server_child * server_children,
 					kill(pid, SIGQUIT);
 					break;
 				}
-				atp_close(atp);
-				break;
 			}
+			/* the child has its own copy */
+			atp_close(atp);
 
 		} else {
 			asp->cmdbuf[0] = asp->cmdbuf[1] = 0;
 			asperr = ASPERR_SERVBUSY;
 		}
 
+	      open_reply:
+		asperr = htons(asperr);
 		memcpy(asp->cmdbuf + 2, &asperr, sizeof(asperr));
 		iov[0].iov_base = asp->cmdbuf;
 		iov[0].iov_len = 4;
@@ -0,0 +1,378 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * ASP sessions served by worker processes.
+ *
+ * With asp_setworkers(n) the master doesn't fork an afpd for every
+ * session. It forks up to n workers and hands the socket of a new session
+ * to the least loaded one, a worker serves all the sessions it got.
+ * Tickles stay with the master: when a session times out the master tells
+ * its worker to close it, and a worker tells the master when a session has
+ * ended so that the session id can be given out again. The messages carry
+ * a serial number with the session id, a late message about a session
+ * doesn't hit a new one that got the same id in the meantime.
+ *
+ * The control sockets are SOCK_SEQPACKET: one message per read, and the
+ * queue is bounded by the socket buffer instead of the (small) datagram
+ * queue length.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include <netatalk/at.h>
+#include <atalk/logger.h>
+#include <atalk/atp.h>
+#include <atalk/asp.h>
+
+#include "asp_child.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct asp_worker {
+	pid_t aw_pid;		/* 0: free slot */
+	int aw_fd;		/* control socket */
+	int aw_sessions;
+	int aw_retired;		/* gets no new sessions */
+};
+
+static int maxworkers;
+static struct asp_worker *workers;
+static int nworkers;		/* slots in workers[] */
+
+/* send a message, with a file descriptor if fd isn't -1 */
+static int ctl_send(const int s, const struct asp_wmsg *msg, const int fd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	ssize_t ret;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = (void *) msg;
+	iov.iov_len = sizeof(*msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (fd != -1) {
+		memset(&ctl, 0, sizeof(ctl));
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = sizeof(ctl.buf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	do {
+		ret = sendmsg(s, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+	return (ret == sizeof(*msg)) ? 0 : -1;
+}
+
+/* receive a message, *fd is the file descriptor that came with it or -1.
+ * @returns size read, 0 if the other end is gone, -1 on error */
+static ssize_t ctl_recv(const int s, struct asp_wmsg *msg, int *fd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	ssize_t ret;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+
+	do {
+		ret = recvmsg(s, &mh, MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+
+	*fd = -1;
+	if (ret <= 0)
+		return ret;
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET
+		    && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (ret != sizeof(*msg) || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		if (*fd != -1)
+			close(*fd);
+		*fd = -1;
+		errno = EPROTO;
+		return -1;
+	}
+	return ret;
+}
+
+/* ---------------------- master side */
+
+/* n workers serve all ASP sessions, 0 forks a process per session */
+void asp_setworkers(const int n)
+{
+	maxworkers = (n > 0) ? n : 0;
+}
+
+int asp_workers(void)
+{
+	return maxworkers;
+}
+
+/* the master sets up its asp again after a reload: the workers it has
+ * keep their sessions, new ones go to new workers */
+void asp_worker_retire(void)
+{
+	struct asp_wmsg msg;
+	int i;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.aw_type = ASPWRK_RETIRE;
+	for (i = 0; i < nworkers; i++) {
+		if (!workers[i].aw_pid || workers[i].aw_retired)
+			continue;
+		workers[i].aw_retired = 1;
+		asp_worker_send(i, &msg, -1);
+	}
+}
+
+/*
+ * Choose the worker for a new session: a new one while there are fewer
+ * than configured and none is idle, else the one with the fewest sessions.
+ * @returns the worker's slot, its aw_pid is 0 if it has to be forked first.
+ * -1 if there's none
+ */
+int asp_worker_pick(void)
+{
+	struct asp_worker *tmp;
+	int i, best = -1, slot = -1, active = 0;
+
+	for (i = 0; i < nworkers; i++) {
+		if (!workers[i].aw_pid) {
+			if (slot < 0)
+				slot = i;
+			continue;
+		}
+		if (workers[i].aw_retired)
+			continue;
+		active++;
+		if (best < 0
+		    || workers[i].aw_sessions < workers[best].aw_sessions)
+			best = i;
+	}
+
+	if (active >= maxworkers || (best >= 0 && !workers[best].aw_sessions))
+		return best;
+
+	if (slot < 0) {
+		if ((tmp = realloc(workers, (nworkers + 1) * sizeof(*tmp)))
+		    == NULL)
+			return best;
+		workers = tmp;
+		slot = nworkers++;
+		workers[slot].aw_pid = 0;
+	}
+	return slot;
+}
+
+/* 0 if the worker for slot i has yet to be forked */
+pid_t asp_worker_pid(const int i)
+{
+	return workers[i].aw_pid;
+}
+
+/*
+ * Fork the worker for slot i.
+ * @returns like fork(), the child gets its end of the control socket in *fd
+ */
+pid_t asp_worker_fork(const int i, int *fd)
+{
+	int sv[2], j;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		return -1;
+
+	switch ((pid = fork())) {
+	case -1:
+		close(sv[0]);
+		close(sv[1]);
+		break;
+
+	case 0:		/* the worker doesn't talk to the others */
+		close(sv[0]);
+		for (j = 0; j < nworkers; j++)
+			if (workers[j].aw_pid)
+				close(workers[j].aw_fd);
+		free(workers);
+		workers = NULL;
+		nworkers = 0;
+		*fd = sv[1];
+		break;
+
+	default:
+		close(sv[1]);
+		fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+		workers[i].aw_pid = pid;
+		workers[i].aw_fd = sv[0];
+		workers[i].aw_sessions = 0;
+		workers[i].aw_retired = 0;
+		break;
+	}
+	return pid;
+}
+
+/* fd is the session socket for ASPWRK_OPEN, -1 otherwise */
+int asp_worker_send(const int i, const struct asp_wmsg *msg, const int fd)
+{
+	if (ctl_send(workers[i].aw_fd, msg, fd) < 0) {
+		LOG(log_error, logtype_default,
+		    "asp_worker_send: worker %d: %s", workers[i].aw_pid,
+		    strerror(errno));
+		return -1;
+	}
+	if (msg->aw_type == ASPWRK_OPEN)
+		workers[i].aw_sessions++;
+	return 0;
+}
+
+/* the session timed out. called from the tickle handler */
+int asp_worker_close(const pid_t pid, const u_int8_t sid,
+		     const u_int32_t serial)
+{
+	struct asp_wmsg msg;
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].aw_pid != pid)
+			continue;
+		memset(&msg, 0, sizeof(msg));
+		msg.aw_type = ASPWRK_CLOSE;
+		msg.aw_sid = sid;
+		msg.aw_serial = serial;
+		return asp_worker_send(i, &msg, -1);
+	}
+	return -1;
+}
+
+/* pick up the sessions the workers have ended */
+void asp_worker_drain(void (*closed) (const u_int8_t, const u_int32_t))
+{
+	struct asp_wmsg msg;
+	int i, fd;
+
+	for (i = 0; i < nworkers; i++) {
+		if (!workers[i].aw_pid)
+			continue;
+		while (ctl_recv(workers[i].aw_fd, &msg, &fd) > 0) {
+			if (fd != -1)
+				close(fd);
+			if (msg.aw_type != ASPWRK_CLOSED)
+				continue;
+			if (workers[i].aw_sessions > 0)
+				workers[i].aw_sessions--;
+			closed(msg.aw_sid, msg.aw_serial);
+		}
+	}
+}
+
+/* the worker has exited */
+void asp_worker_gone(const pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++)
+		if (workers[i].aw_pid == pid) {
+			close(workers[i].aw_fd);
+			workers[i].aw_pid = 0;
+			break;
+		}
+}
+
+/* ---------------------- worker side */
+
+/*
+ * Get the next message from the master. For ASPWRK_OPEN *sess is the new
+ * session, its socket is non-blocking. *serial is the session's serial for
+ * ASPWRK_OPEN and ASPWRK_CLOSE.
+ * @returns the message type, 0 if the master has gone, -1 on error
+ * (EAGAIN: no message)
+ */
+int asp_worker_recv(ASP worker, ASP * sess, u_int32_t * serial)
+{
+	struct asp_wmsg msg;
+	ssize_t ret;
+	ATP atp;
+	ASP asp;
+	int fd;
+
+	if ((ret = ctl_recv(worker->asp_ctlfd, &msg, &fd)) <= 0)
+		return ret;
+
+	*serial = msg.aw_serial;
+	if (msg.aw_type != ASPWRK_OPEN) {
+		if (fd != -1)
+			close(fd);
+		return msg.aw_type;
+	}
+
+	if (fd == -1) {
+		errno = EPROTO;
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if ((atp = atp_fdopen(fd, &msg.aw_local)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	if ((asp = asp_init(atp)) == NULL) {
+		atp_close(atp);
+		return -1;
+	}
+
+	asp->child = 1;
+	asp->asp_sat = msg.aw_sat;
+	asp->asp_wss = msg.aw_wss;
+	asp->asp_seq = 0;
+	asp->asp_sid = msg.aw_sid;
+	asp->asp_flags = ASPFL_SSS;
+	asp->asp_ctlfd = -1;
+	asp->asp_serial = msg.aw_serial;
+	*sess = asp;
+	return ASPWRK_OPEN;
+}
+
+/* tell the master the session has ended, before it's closed */
+int asp_worker_closed(ASP worker, const ASP sess)
+{
+	struct asp_wmsg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.aw_type = ASPWRK_CLOSED;
+	msg.aw_sid = sess->asp_sid;
+	msg.aw_serial = sess->asp_serial;
+	return ctl_send(worker->asp_ctlfd, &msg, -1);
+}
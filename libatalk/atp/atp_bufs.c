@@ -39,42 +39,64 @@
 
 #include <netatalk/at.h>
 #include <atalk/atp.h>
+#include <atalk/slab.h>
 #include "atp_internals.h"
 
-#define			N_MORE_BUFS		10
+/* buffers are carved from a slab, a reserve of them is kept on the free
+ * list so a burst of requests doesn't map and unmap slab chunks. The reserve
+ * is ATP_BUFS_MIN or what atp_bufs_reserve() was asked for.
+ */
+#define			ATP_BUFS_MIN		32
 
+static slab_t *buf_slab = NULL;
 static struct atpbuf *free_list = NULL;	/* free buffers */
+static int free_count = 0;
+static int free_reserve = ATP_BUFS_MIN;
 
 #ifdef EBUG
 static int numbufs = 0;
 #endif				/* EBUG */
 
-/* only call this when the free_list is empty...
- * N_MORE_BUFS must be >= one
-*/
-static int more_bufs(void)
+static int buf_slab_init(void)
+{
+	if (buf_slab == NULL
+	    && (buf_slab = slab_create(sizeof(struct atpbuf))) == NULL) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Keep count buffers around, preallocated or freed down to that many.
+ * An XO transaction holds up to 9 of them until it's released, a server
+ * passes what the transactions it expects to have in flight need.
+ */
+int atp_bufs_reserve(int count)
 {
-	int i;
-	char *mem;
 	struct atpbuf *bp;
 
-	/* get the whole chunk in one malloc call
-	 */
-	if ((mem = malloc(N_MORE_BUFS * sizeof(struct atpbuf))) == NULL) {
-		errno = ENOBUFS;
+	if (count < ATP_BUFS_MIN)
+		count = ATP_BUFS_MIN;
+	free_reserve = count;
+
+	if (buf_slab_init() < 0)
 		return -1;
+	while (free_count < count) {
+		if ((bp = slab_alloc(buf_slab)) == NULL) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		bp->atpbuf_next = free_list;
+		free_list = bp;
+		free_count++;
 	}
-	/* now split into separate bufs
-	 */
-	bp = free_list = (struct atpbuf *) mem;
-	for (i = 1; i < N_MORE_BUFS; ++i) {
-		bp->atpbuf_next = (struct atpbuf *) (mem +=
-						     sizeof(struct
-							    atpbuf));
-		bp = bp->atpbuf_next;
+	while (free_count > count) {
+		bp = free_list;
+		free_list = bp->atpbuf_next;
+		free_count--;
+		slab_free(buf_slab, bp);
 	}
-	bp->atpbuf_next = NULL;
-
 	return 0;
 }
 
@@ -85,16 +107,7 @@ void atp_print_bufuse(ATP ah, char *s)
 	struct atpbuf *bp;
 	int i, sentcount, incount, respcount;
 
-	sentcount = 0;
-	for (bp = ah->atph_sent; bp != NULL; bp = bp->atpbuf_next) {
-		++sentcount;
-		for (i = 0; i < 8; ++i) {
-			if (bp->atpbuf_info.atpbuf_xo.atpxo_packet[i] !=
-			    NULL) {
-				++sentcount;
-			}
-		}
-	}
+	sentcount = atp_xo_bufs(ah);
 
 	if (ah->atph_reqpkt != NULL) {
 		++sentcount;
@@ -124,11 +137,22 @@ struct atpbuf *atp_alloc_buf(void)
 {
 	struct atpbuf *bp;
 
-	if (free_list == NULL && more_bufs())
-		return NULL;
+	if (free_list == NULL) {
+		if (buf_slab_init() < 0)
+			return NULL;
+		if ((bp = slab_alloc(buf_slab)) == NULL) {
+			errno = ENOBUFS;
+			return NULL;
+		}
+#ifdef EBUG
+		++numbufs;
+#endif				/* EBUG */
+		return bp;
+	}
 
 	bp = free_list;
 	free_list = free_list->atpbuf_next;
+	free_count--;
 #ifdef EBUG
 	++numbufs;
 #endif				/* EBUG */
@@ -141,8 +165,13 @@ int atp_free_buf(struct atpbuf *bp)
 	if (bp == NULL) {
 		return -1;
 	}
-	bp->atpbuf_next = free_list;
-	free_list = bp;
+	if (free_count >= free_reserve) {
+		slab_free(buf_slab, bp);
+	} else {
+		bp->atpbuf_next = free_list;
+		free_list = bp;
+		free_count++;
+	}
 #ifdef EBUG
 	--numbufs;
 #endif				/* EBUG */
@@ -37,18 +37,7 @@ int atp_close(ATP ah)
 		atp_free_buf(cq);
 	}
 
-	while (ah->atph_sent != NULL) {
-		cq = ah->atph_sent;
-		for (i = 0; i < 8; ++i) {
-			if (cq->atpbuf_info.atpbuf_xo.atpxo_packet[i] !=
-			    NULL) {
-				atp_free_buf(cq->atpbuf_info.atpbuf_xo.
-					     atpxo_packet[i]);
-			}
-		}
-		ah->atph_sent = cq->atpbuf_next;
-		atp_free_buf(cq);
-	}
+	atp_xo_free(ah);
 
 	if (ah->atph_reqpkt != NULL) {
 		atp_free_buf(ah->atph_reqpkt);
@@ -43,12 +43,23 @@ extern struct atpbuf *atp_alloc_buf(void);
 extern void atp_print_bufuse(ATP, char *);
 extern int atp_free_buf(struct atpbuf *);
 
+/* in atp_xo.c */
+extern int atp_xo_add(ATP, struct atpbuf *);
+extern struct atpbuf *atp_xo_find(ATP, const struct sockaddr_at *,
+				  u_int16_t);
+extern void atp_xo_touch(ATP, struct atpbuf *, const struct timeval *);
+extern int atp_xo_release(ATP, const struct sockaddr_at *, u_int16_t);
+extern void atp_xo_expire(ATP, time_t);
+extern int atp_xo_bufs(ATP);
+extern void atp_xo_free(ATP);
+
 /* in atp_packet.c */
 extern int at_addr_eq(struct sockaddr_at *, struct sockaddr_at *);
 extern void atp_build_req_packet(struct atpbuf *, u_int16_t,
 				 u_int8_t, struct atp_block *);
 extern void atp_build_resp_packet(struct atpbuf *, u_int16_t,
-				  u_int8_t, struct atp_block *, u_int8_t);
+				  u_int8_t, struct atp_block *, u_int8_t,
+				  const char *);
 extern int atp_recv_atp(ATP, struct sockaddr_at *,
 			u_int8_t *, u_int16_t, char *, int);
 #ifdef EBUG
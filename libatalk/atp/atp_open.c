@@ -46,8 +46,6 @@ ATP atp_open(u_int8_t port, const struct at_addr *saddr)
 	struct sockaddr_at addr;
 	int s;
 	ATP atp;
-	struct timeval tv;
-	int pid;
 
 #ifdef DEBUG
 	printf("<%d> atp_open\n", getpid());
@@ -60,14 +58,27 @@ ATP atp_open(u_int8_t port, const struct at_addr *saddr)
 	if ((s = netddp_open(&addr, NULL)) < 0)
 		return NULL;
 
-	if ((atp = (ATP) atp_alloc_buf()) == NULL) {
+	if ((atp = atp_fdopen(s, &addr)) == NULL) {
 		netddp_close(s);
 		return NULL;
 	}
+	return atp;
+}
+
+/* make an atp handle for a ddp socket opened elsewhere, eg. one passed
+ * in from another process. addr is the address it's bound to. */
+ATP atp_fdopen(int s, const struct sockaddr_at *addr)
+{
+	ATP atp;
+	struct timeval tv;
+	int pid;
+
+	if ((atp = (ATP) atp_alloc_buf()) == NULL)
+		return NULL;
 
 	/* initialize the atp handle */
 	memset(atp, 0, sizeof(struct atp_handle));
-	memcpy(&atp->atph_saddr, &addr, sizeof(addr));
+	memcpy(&atp->atph_saddr, addr, sizeof(*addr));
 
 	atp->atph_socket = s;
 	atp->atph_reqto = -1;
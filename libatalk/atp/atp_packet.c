@@ -120,9 +120,11 @@ void atp_build_req_packet(struct atpbuf *pktbuf,
 void atp_build_resp_packet(struct atpbuf *pktbuf,
 			   u_int16_t tid,
 			   u_int8_t ctrl,
-			   struct atp_block *atpb, u_int8_t seqnum)
+			   struct atp_block *atpb, u_int8_t seqnum,
+			   const char *user)
 {
 	struct atphdr hdr;
+	char *data;
 
 	/* fill in the packet fields */
 	*(pktbuf->atpbuf_info.atpbuf_data) = DDPTYPE_ATP;
@@ -131,14 +133,20 @@ void atp_build_resp_packet(struct atpbuf *pktbuf,
 	hdr.atphd_tid = htons(tid);
 	memcpy(pktbuf->atpbuf_info.atpbuf_data + 1, &hdr,
 	       sizeof(struct atphdr));
-	memcpy(pktbuf->atpbuf_info.atpbuf_data + ATP_HDRSIZE,
-	       atpb->atp_sresiov[seqnum].iov_base,
+	data = pktbuf->atpbuf_info.atpbuf_data + ATP_HDRSIZE;
+
+	/* user bytes given apart from the data, see atp_sresp_user() */
+	if (user != NULL) {
+		memcpy(data, user + seqnum * ATP_USERSIZ, ATP_USERSIZ);
+		data += ATP_USERSIZ;
+	}
+	memcpy(data, atpb->atp_sresiov[seqnum].iov_base,
 	       atpb->atp_sresiov[seqnum].iov_len);
 
 	/* set length
 	 */
-	pktbuf->atpbuf_dlen =
-	    ATP_HDRSIZE + (size_t) atpb->atp_sresiov[seqnum].iov_len;
+	pktbuf->atpbuf_dlen = data - pktbuf->atpbuf_info.atpbuf_data
+	    + (size_t) atpb->atp_sresiov[seqnum].iov_len;
 }
 
 
@@ -160,7 +168,6 @@ atp_recv_atp(ATP ah,
 	struct atphdr ahdr;
 	u_int16_t rfunc;
 	u_int16_t rtid;
-	int i;
 	int dlen = -1;
 	int recvlen;
 	struct sockaddr_at faddr;
@@ -204,7 +211,7 @@ atp_recv_atp(ATP ah,
 		/* remove packet from queue and free buffer
 		 */
 		if (pq == NULL) {
-			ah->atph_queue = NULL;
+			ah->atph_queue = cq->atpbuf_next;
 		} else {
 			pq->atpbuf_next = cq->atpbuf_next;
 		}
@@ -250,42 +257,13 @@ atp_recv_atp(ATP ah,
 			bprint(rbuf, recvlen);
 #endif				/* EBUG */
 			if (rfunc == ATP_TREL) {
-				/* remove response from sent list */
-				for (pq = NULL, cq = ah->atph_sent;
-				     cq != NULL;
-				     pq = cq, cq = cq->atpbuf_next) {
-					if (at_addr_eq
-					    (&faddr, &cq->atpbuf_addr)
-					    && cq->atpbuf_info.atpbuf_xo.
-					    atpxo_tid == ntohs(rtid))
-						break;
-				}
-				if (cq != NULL) {
+				/* remove response from sent responses */
+				if (atp_xo_release(ah, &faddr, ntohs(rtid))) {
 #ifdef EBUG
 					printf
 					    ("<%d> releasing transaction %hu\n",
 					     getpid(), ntohs(rtid));
 #endif				/* EBUG */
-					if (pq == NULL) {
-						ah->atph_sent =
-						    cq->atpbuf_next;
-					} else {
-						pq->atpbuf_next =
-						    cq->atpbuf_next;
-					}
-					for (i = 0; i < 8; ++i) {
-						if (cq->atpbuf_info.
-						    atpbuf_xo.
-						    atpxo_packet[i]
-						    != NULL) {
-							atp_free_buf(cq->
-								     atpbuf_info.
-								     atpbuf_xo.
-								     atpxo_packet
-								     [i]);
-						}
-					}
-					atp_free_buf(cq);
 				}
 
 			} else if (((tid & rtid) == rtid) && ((*func & rfunc) == rfunc) && at_addr_eq(fromaddr, &faddr)) {	/* got what we wanted */
@@ -309,6 +287,7 @@ atp_recv_atp(ATP ah,
 				inbuf->atpbuf_dlen = (size_t) recvlen;
 				memcpy(inbuf->atpbuf_info.atpbuf_data,
 				       rbuf, recvlen);
+				ah->atph_queue = inbuf;
 			}
 		}
 		if (!wait && dlen < 0) {
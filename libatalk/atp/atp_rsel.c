@@ -74,7 +74,7 @@ int atp_rsel(ATP ah,		/* open atp handle */
 	     int func)
 {				/* which function(s) to wait for;
 				   0 means request or response */
-	struct atpbuf *abuf, *pb, *cb;
+	struct atpbuf *abuf, *cb;
 	struct atphdr req_hdr, resp_hdr;
 	fd_set fds;
 	int i, recvlen, requesting, mask, c;
@@ -184,60 +184,14 @@ int atp_rsel(ATP ah,		/* open atp handle */
 	if (rfunc == ATP_TREQ) {
 		/*
 		 * we got a request: check to see if it is a duplicate (XO)
-		 * while we are at it, we expire old XO responses from sent list
+		 * while we are at it, we expire old XO responses
 		 */
 		memcpy(&req_hdr, abuf->atpbuf_info.atpbuf_data + 1,
 		       sizeof(struct atphdr));
 		tid = ntohs(req_hdr.atphd_tid);
 		gettimeofday(&tv, (struct timezone *) 0);
-		for (pb = NULL, cb = ah->atph_sent; cb != NULL;
-		     pb = cb, cb = cb->atpbuf_next) {
-#ifdef EBUG
-			printf("<%d>", getpid());
-			atp_print_addr(" examining", &cb->atpbuf_addr);
-			printf(" %hu",
-			       cb->atpbuf_info.atpbuf_xo.atpxo_tid);
-			atp_print_addr(" (looking for", &saddr);
-			printf(" %hu)\n", tid);
-#endif				/* EBUG */
-			if (tv.tv_sec -
-			    cb->atpbuf_info.atpbuf_xo.atpxo_tv.tv_sec >
-			    cb->atpbuf_info.atpbuf_xo.atpxo_reltime) {
-				/* discard expired response */
-#ifdef EBUG
-				printf("<%d> expiring tid %hu\n", getpid(),
-				       cb->atpbuf_info.atpbuf_xo.
-				       atpxo_tid);
-#endif				/* EBUG */
-				if (pb == NULL) {
-					ah->atph_sent = cb->atpbuf_next;
-				} else {
-					pb->atpbuf_next = cb->atpbuf_next;
-				}
-
-				for (i = 0; i < 8; ++i) {
-					if (cb->atpbuf_info.atpbuf_xo.
-					    atpxo_packet[i]
-					    != NULL) {
-						atp_free_buf(cb->
-							     atpbuf_info.
-							     atpbuf_xo.
-							     atpxo_packet
-							     [i]);
-					}
-				}
-				atp_free_buf(cb);
-
-				if ((cb = pb) == NULL)
-					break;
-
-			} else if (at_addr_eq(&saddr, &cb->atpbuf_addr)) {
-				if (cb->atpbuf_info.atpbuf_xo.atpxo_tid ==
-				    tid) {
-					break;
-				}
-			}
-		}
+		atp_xo_expire(ah, tv.tv_sec);
+		cb = atp_xo_find(ah, &saddr, tid);
 
 		if (cb != NULL) {
 #ifdef EBUG
@@ -246,7 +200,7 @@ int atp_rsel(ATP ah,		/* open atp handle */
 			     getpid());
 #endif				/* EBUG */
 			/* matches an old response -- just re-send and reset expire */
-			cb->atpbuf_info.atpbuf_xo.atpxo_tv = tv;
+			atp_xo_touch(ah, cb, &tv);
 			for (i = 0; i < 8; ++i) {
 				if (cb->atpbuf_info.atpbuf_xo.
 				    atpxo_packet[i] != NULL
@@ -43,11 +43,14 @@
 #include "atp_internals.h"
 
 /* send a transaction response
+ * with user != NULL the iovecs hold only the data, the 4 user bytes of
+ * every packet are taken from user, so a caller like ASP doesn't have to
+ * make room for its headers in front of each packet's data
 */
-int atp_sresp(ATP ah,		/* open atp handle */
-	      struct atp_block *atpb)
-{				/* parameter block */
+static int sresp(ATP ah, struct atp_block *atpb, const char *user)
+{
 	int i;
+	size_t maxdata = user ? ATP_MAXDATA - ATP_USERSIZ : ATP_MAXDATA;
 	u_int8_t ctrlinfo;
 	struct atpbuf *resp_buf = NULL;
 	struct atpbuf *save_buf = NULL;
@@ -59,7 +62,7 @@ int atp_sresp(ATP ah,		/* open atp handle */
 	/* check parameters
 	 */
 	for (i = atpb->atp_sresiovcnt - 1; i >= 0; --i) {
-		if (atpb->atp_sresiov[i].iov_len > ATP_MAXDATA)
+		if (atpb->atp_sresiov[i].iov_len > maxdata)
 			break;
 	}
 	if (i >= 0 || atpb->atp_sresiovcnt < 1 || atpb->atp_sresiovcnt > 8) {
@@ -99,7 +102,7 @@ int atp_sresp(ATP ah,		/* open atp handle */
 			ctrlinfo |= ATP_EOM;
 		}
 		atp_build_resp_packet(resp_buf, ah->atph_rtid, ctrlinfo,
-				      atpb, i);
+				      atpb, i, user);
 
 		if (ah->atph_rxo) {
 			save_buf->atpbuf_info.atpbuf_xo.atpxo_packet[i] =
@@ -156,13 +159,32 @@ int atp_sresp(ATP ah,		/* open atp handle */
 		memcpy(&save_buf->atpbuf_addr, atpb->atp_saddr,
 		       sizeof(struct sockaddr_at));
 
-		/* add to list of packets we have sent
+		/* add to the packets we have sent
 		 */
-		save_buf->atpbuf_next = ah->atph_sent;
-		ah->atph_sent = save_buf;
+		if (atp_xo_add(ah, save_buf) < 0) {
+			for (i = 0; i < atpb->atp_sresiovcnt; ++i) {
+				atp_free_buf(save_buf->atpbuf_info.
+					     atpbuf_xo.atpxo_packet[i]);
+			}
+			atp_free_buf(save_buf);
+			return -1;
+		}
 #ifdef EBUG
 		printf("<%d> saved XO response\n", getpid());
 #endif				/* EBUG */
 	}
 	return 0;
 }
+
+int atp_sresp(ATP ah,		/* open atp handle */
+	      struct atp_block *atpb)
+{				/* parameter block */
+	return sresp(ah, atpb, NULL);
+}
+
+/* user: ATP_USERSIZ bytes for each of the atp_sresiovcnt packets
+*/
+int atp_sresp_user(ATP ah, struct atp_block *atpb, const char *user)
+{
+	return sresp(ah, atpb, user);
+}
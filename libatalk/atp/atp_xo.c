@@ -0,0 +1,278 @@
+/*
+ * Cache of the XO responses an ATP handle has sent
+ *
+ * An exactly-once response is kept until the requester releases it or its
+ * release timer runs out, a duplicate request gets it re-sent. Responses are
+ * found by (address, TID) in a hash table and sit in a timer wheel of one
+ * second slots by the time they are due, so neither a duplicate nor a release
+ * nor the expiry has to walk all responses of the handle. A response with a
+ * release time longer than the wheel is passed over until it's due.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <netatalk/at.h>
+#include <netatalk/endian.h>
+#include <atalk/atp.h>
+
+#include "atp_internals.h"
+
+#define ATP_XO_HASH_MIN	32	/* buckets, a power of 2 */
+#define ATP_XO_WHEEL	64	/* one second slots, a power of 2 */
+
+struct atp_xocache {
+	struct atpbuf **xc_hash;
+	unsigned int xc_mask;
+	unsigned int xc_count;	/* responses */
+	unsigned int xc_bufs;	/* buffers they hold */
+	time_t xc_swept;	/* expired up to this second */
+	struct atpbuf *xc_wheel[ATP_XO_WHEEL];
+};
+
+#define XO(b)		(&(b)->atpbuf_info.atpbuf_xo)
+#define XO_DUE(b)	(XO(b)->atpxo_tv.tv_sec + XO(b)->atpxo_reltime)
+
+static unsigned int xo_hash(const struct sockaddr_at *sat, u_int16_t tid)
+{
+	u_int32_t h;
+
+	h = ((u_int32_t) ntohs(sat->sat_addr.s_net) << 16)
+	    | (sat->sat_addr.s_node << 8) | sat->sat_port;
+	h ^= tid * 0x9e3779b1U;
+	return h ^ (h >> 15);
+}
+
+static int xo_match(const struct atpbuf *b, const struct sockaddr_at *sat,
+		    u_int16_t tid)
+{
+	return XO(b)->atpxo_tid == tid
+	    && b->atpbuf_addr.sat_port == sat->sat_port
+	    && b->atpbuf_addr.sat_addr.s_node == sat->sat_addr.s_node
+	    && b->atpbuf_addr.sat_addr.s_net == sat->sat_addr.s_net;
+}
+
+/* double the buckets when there are more responses than buckets */
+static void xo_rehash(struct atp_xocache *xc)
+{
+	struct atpbuf **hash, *b, *next;
+	unsigned int i, mask, h;
+
+	mask = 2 * xc->xc_mask + 1;
+	if ((hash = calloc(mask + 1, sizeof(*hash))) == NULL)
+		return;		/* longer chains, that's all */
+
+	for (i = 0; i <= xc->xc_mask; i++) {
+		for (b = xc->xc_hash[i]; b != NULL; b = next) {
+			next = XO(b)->atpxo_hnext;
+			h = xo_hash(&b->atpbuf_addr, XO(b)->atpxo_tid) & mask;
+			XO(b)->atpxo_hnext = hash[h];
+			hash[h] = b;
+		}
+	}
+	free(xc->xc_hash);
+	xc->xc_hash = hash;
+	xc->xc_mask = mask;
+}
+
+static void wheel_link(struct atp_xocache *xc, struct atpbuf *b)
+{
+	struct atpbuf **slot;
+	time_t due = XO_DUE(b);
+
+	/* overdue already, it goes with the next second swept */
+	if (due <= xc->xc_swept)
+		due = xc->xc_swept + 1;
+	XO(b)->atpxo_slot = due & (ATP_XO_WHEEL - 1);
+	slot = &xc->xc_wheel[XO(b)->atpxo_slot];
+
+	XO(b)->atpxo_wprev = NULL;
+	if ((XO(b)->atpxo_wnext = *slot) != NULL)
+		XO(*slot)->atpxo_wprev = b;
+	*slot = b;
+}
+
+static void wheel_unlink(struct atp_xocache *xc, struct atpbuf *b)
+{
+	if (XO(b)->atpxo_wprev != NULL)
+		XO(XO(b)->atpxo_wprev)->atpxo_wnext = XO(b)->atpxo_wnext;
+	else
+		xc->xc_wheel[XO(b)->atpxo_slot] = XO(b)->atpxo_wnext;
+	if (XO(b)->atpxo_wnext != NULL)
+		XO(XO(b)->atpxo_wnext)->atpxo_wprev = XO(b)->atpxo_wprev;
+}
+
+/* take a response out of the cache and free its buffers */
+static void xo_drop(struct atp_xocache *xc, struct atpbuf *b)
+{
+	struct atpbuf **pp;
+	int i;
+
+	pp = &xc->xc_hash[xo_hash(&b->atpbuf_addr, XO(b)->atpxo_tid)
+			  & xc->xc_mask];
+	while (*pp != b)
+		pp = &XO(*pp)->atpxo_hnext;
+	*pp = XO(b)->atpxo_hnext;
+	wheel_unlink(xc, b);
+
+	for (i = 0; i < 8; ++i) {
+		if (XO(b)->atpxo_packet[i] != NULL) {
+			atp_free_buf(XO(b)->atpxo_packet[i]);
+			xc->xc_bufs--;
+		}
+	}
+	atp_free_buf(b);
+	xc->xc_bufs--;
+	xc->xc_count--;
+}
+
+/*!
+ * Add a response, its TID, address, timestamp and release time must be set
+ */
+int atp_xo_add(ATP ah, struct atpbuf *b)
+{
+	struct atp_xocache *xc;
+	unsigned int h;
+	int i;
+
+	if ((xc = ah->atph_xo) == NULL) {
+		if ((xc = calloc(1, sizeof(*xc))) == NULL)
+			return -1;
+		if ((xc->xc_hash = calloc(ATP_XO_HASH_MIN,
+					  sizeof(*xc->xc_hash))) == NULL) {
+			free(xc);
+			return -1;
+		}
+		xc->xc_mask = ATP_XO_HASH_MIN - 1;
+		xc->xc_swept = XO(b)->atpxo_tv.tv_sec - 1;
+		ah->atph_xo = xc;
+	}
+
+	/* a response we haven't seen released expires in the meantime */
+	atp_xo_expire(ah, XO(b)->atpxo_tv.tv_sec);
+
+	if (xc->xc_count > xc->xc_mask)
+		xo_rehash(xc);
+
+	h = xo_hash(&b->atpbuf_addr, XO(b)->atpxo_tid) & xc->xc_mask;
+	XO(b)->atpxo_hnext = xc->xc_hash[h];
+	xc->xc_hash[h] = b;
+	wheel_link(xc, b);
+
+	xc->xc_count++;
+	xc->xc_bufs++;
+	for (i = 0; i < 8; ++i) {
+		if (XO(b)->atpxo_packet[i] != NULL)
+			xc->xc_bufs++;
+	}
+	return 0;
+}
+
+/*!
+ * The response to the request with TID tid from sat, or NULL
+ */
+struct atpbuf *atp_xo_find(ATP ah, const struct sockaddr_at *sat,
+			   u_int16_t tid)
+{
+	struct atp_xocache *xc = ah->atph_xo;
+	struct atpbuf *b;
+
+	if (xc == NULL)
+		return NULL;
+
+	for (b = xc->xc_hash[xo_hash(sat, tid) & xc->xc_mask]; b != NULL;
+	     b = XO(b)->atpxo_hnext) {
+		if (xo_match(b, sat, tid))
+			return b;
+	}
+	return NULL;
+}
+
+/*!
+ * Restart the release timer of a response
+ */
+void atp_xo_touch(ATP ah, struct atpbuf *b, const struct timeval *tv)
+{
+	wheel_unlink(ah->atph_xo, b);
+	XO(b)->atpxo_tv = *tv;
+	wheel_link(ah->atph_xo, b);
+}
+
+/*!
+ * Forget the response released by the requester, returns 1 if there was one
+ */
+int atp_xo_release(ATP ah, const struct sockaddr_at *sat, u_int16_t tid)
+{
+	struct atpbuf *b;
+
+	if ((b = atp_xo_find(ah, sat, tid)) == NULL)
+		return 0;
+	xo_drop(ah->atph_xo, b);
+	return 1;
+}
+
+/*!
+ * Drop the responses whose release time ran out before now
+ */
+void atp_xo_expire(ATP ah, time_t now)
+{
+	struct atp_xocache *xc = ah->atph_xo;
+	struct atpbuf *b, *next;
+	int n;
+
+	if (xc == NULL)
+		return;
+
+	/* every slot once at most, however long we haven't looked */
+	for (n = 0; xc->xc_swept < now - 1 && n < ATP_XO_WHEEL; n++) {
+		xc->xc_swept++;
+		b = xc->xc_wheel[xc->xc_swept & (ATP_XO_WHEEL - 1)];
+		for (; b != NULL; b = next) {
+			next = XO(b)->atpxo_wnext;
+			if (XO_DUE(b) < now) {
+#ifdef EBUG
+				printf("<%d> expiring tid %hu\n", getpid(),
+				       XO(b)->atpxo_tid);
+#endif				/* EBUG */
+				xo_drop(xc, b);
+			}
+		}
+	}
+	if (xc->xc_swept < now - 1)
+		xc->xc_swept = now - 1;
+}
+
+/*!
+ * Number of buffers held by cached responses
+ */
+int atp_xo_bufs(ATP ah)
+{
+	return ah->atph_xo ? (int) ah->atph_xo->xc_bufs : 0;
+}
+
+/*!
+ * Drop all responses and the cache
+ */
+void atp_xo_free(ATP ah)
+{
+	struct atp_xocache *xc = ah->atph_xo;
+	int i;
+
+	if (xc == NULL)
+		return;
+
+	for (i = 0; i < ATP_XO_WHEEL; i++) {
+		while (xc->xc_wheel[i] != NULL)
+			xo_drop(xc, xc->xc_wheel[i]);
+	}
+	free(xc->xc_hash);
+	free(xc);
+	ah->atph_xo = NULL;
+}
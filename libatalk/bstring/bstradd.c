@@ -26,6 +26,7 @@
 #include <ctype.h>
 
 #include <atalk/bstrlib.h>
+#include <atalk/slab.h>
 
 /* Optionally include a mechanism for debugging memory */
 
@@ -114,6 +115,50 @@ int bunrefcstr(bstring b)
 	return BSTR_OK;
 }
 
+/*************************************************************************
+ * Read-only bstrings from the slab allocator
+ ************************************************************************/
+
+/*!
+ * @brief Create a read-only copy of the first len bytes of "str"
+ *
+ * Header and data are one object from slab_alloc_size(), so a short string
+ * costs one slab object instead of two mallocs. Like with brefcstr() the
+ * bstring can't be modified, it must be freed with bslabdestroy().
+ */
+bstring bslabcstr(const char *str, int len)
+{
+	bstring b;
+
+	if (str == NULL || len < 0)
+		return NULL;
+
+	b = slab_alloc_size(sizeof(struct tagbstring) + len + 1);
+	if (NULL == b)
+		return NULL;
+
+	b->slen = len;
+	b->mlen = -1;
+	b->data = (unsigned char *) (b + 1);
+	bstr__memcpy(b->data, str, len);
+	b->data[len] = '\0';
+
+	return b;
+}
+
+/*!
+ * @brief Free a bstring from bslabcstr()
+ */
+int bslabdestroy(bstring b)
+{
+	if (b == NULL || b->slen < 0 || b->mlen > 0
+	    || b->data != (unsigned char *) (b + 1))
+		return BSTR_ERR;
+
+	slab_free_size(b, sizeof(struct tagbstring) + b->slen + 1);
+	return BSTR_OK;
+}
+
 /*************************************************************************
  * stuff for bstrList
  ************************************************************************/
@@ -262,6 +262,32 @@ cnid_t cnid_add(struct _cnid_db *cdb, const struct stat *st,
 	return ret;
 }
 
+/* ---------------
+ * Add several objects in one go. Objects the backend could not handle in a
+ * batch get CNID_INVALID, the caller has to use cnid_add() for those.
+ * Returns -1 if the backend doesn't support batches or the request failed.
+ */
+int cnid_add_batch(struct _cnid_db *cdb, struct cnid_batch *batch,
+		   int count)
+{
+	int i, ret;
+
+	if (cdb->cnid_add_batch == NULL)
+		return -1;
+
+	block_signal(cdb->flags);
+	ret = cdb->cnid_add_batch(cdb, batch, count);
+	unblock_signal(cdb->flags);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < count; i++) {
+		if (batch[i].cnid != CNID_INVALID)
+			batch[i].cnid = valide(batch[i].cnid);
+	}
+	return ret;
+}
+
 /* --------------- */
 int cnid_delete(struct _cnid_db *cdb, cnid_t id)
 {
@@ -319,9 +345,17 @@ cnid_t cnid_lookup(struct _cnid_db *cdb, const struct stat *st,
 	return ret;
 }
 
-/* --------------- */
+/*!
+ * Find objects whose lowercased name contains name
+ *
+ * @param pos    (rw) two words of search position, zeroed for a new search,
+ *                    pos[0] is 0 again after the last batch
+ * @param buffer (w)  matches, see CNID_FIND_RECLEN
+ *
+ * @returns number of matches in buffer or -1 on error
+ */
 int cnid_find(struct _cnid_db *cdb, const char *name, size_t namelen,
-	      void *buffer, size_t buflen)
+	      u_int32_t * pos, void *buffer, size_t buflen)
 {
 	int ret;
 
@@ -332,7 +366,7 @@ int cnid_find(struct _cnid_db *cdb, const char *name, size_t namelen,
 	}
 
 	block_signal(cdb->flags);
-	ret = cdb->cnid_find(cdb, name, namelen, buffer, buflen);
+	ret = cdb->cnid_find(cdb, name, namelen, pos, buffer, buflen);
 	unblock_signal(cdb->flags);
 	return ret;
 }
@@ -0,0 +1,404 @@
+/*
+  CNID cache
+  ==========
+
+  Asking cnid_dbd is a round trip to another process, often for things the
+  process asked a moment ago: the CNIDs of a directory Finder enumerates
+  again, the parents of a path resolved before. The cache keeps the
+  records the backend returned, the newest CNID_CACHE_ENTRIES of them.
+
+  An entry is one record, 128 bytes in two cache lines: CNID, DID, dev,
+  ino, type and name. Records from a get only have the DID and name, they
+  answer gets and resolves but not lookups. The entries are a ring, a new
+  one takes the place of the oldest. Three chained hash tables lead to
+  them by CNID, by DID/name and by dev/ino.
+
+  The backend passes the generation of its database with every reply to
+  cnid_cache_gen(). A different one means records may have changed and
+  everything cached is void; instead of clearing the tables the cache
+  counts up its epoch and ignores entries of older ones.
+
+  With a ttl the cache only answers for ttl seconds after the last
+  cnid_cache_gen(), a backend that doesn't learn about new generations
+  without asking has to ask now and then.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <atalk/logger.h>
+#include <atalk/cnid.h>
+#include <atalk/cnid_private.h>
+#include <atalk/cnid_cache.h>
+
+#define NOENT     0xffffffffU
+#define CE_DEVINO 1		/* dev, ino and type are known */
+
+#define H_ID      0
+#define H_DIDNAME 1
+#define H_DEVINO  2
+#define H_NUM     3
+
+struct centry {
+	cnid_t cnid;
+	cnid_t did;
+	u_int64_t dev;
+	u_int64_t ino;
+	u_int32_t epoch;
+	u_int32_t next[H_NUM];
+	u_int8_t type;
+	u_int8_t flags;
+	u_int8_t namelen;
+	char name[CNID_CACHE_NAMEMAX + 1];
+};
+
+struct cnid_cache {
+	struct centry *e;
+	u_int32_t *head[H_NUM];
+	u_int32_t size;		/* entries, a power of 2 */
+	u_int32_t used;
+	u_int32_t oldest;	/* the next one to go */
+	u_int32_t epoch;
+	u_int32_t gen;
+	int havegen;
+	int ttl;
+	time_t confirmed;
+	struct cnid_cache_stats stats;
+};
+
+/* ------------------------ hashes */
+static u_int32_t hash_id(cnid_t cnid)
+{
+	return ntohl(cnid) * 2654435761U;
+}
+
+static u_int32_t hash_didname(cnid_t did, const char *name, size_t len)
+{
+	u_int32_t h = 2166136261U ^ did;
+
+	while (len--)
+		h = (h ^ (unsigned char) *name++) * 16777619U;
+	return h;
+}
+
+static u_int32_t hash_devino(u_int64_t dev, u_int64_t ino)
+{
+	u_int64_t h = (ino ^ (dev << 32) ^ (dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+
+	return h >> 32;
+}
+
+static u_int32_t hash_of(const struct centry *e, int t)
+{
+	switch (t) {
+	case H_ID:
+		return hash_id(e->cnid);
+	case H_DIDNAME:
+		return hash_didname(e->did, e->name, e->namelen);
+	default:
+		return hash_devino(e->dev, e->ino);
+	}
+}
+
+/* ------------------------ entries */
+static int valid(const cnid_cache * c, const struct centry *e)
+{
+	return e->epoch == c->epoch && e->cnid != CNID_INVALID;
+}
+
+static void link_entry(cnid_cache * c, u_int32_t i)
+{
+	struct centry *e = &c->e[i];
+	u_int32_t h;
+	int t;
+
+	for (t = 0; t < H_NUM; t++) {
+		if (t == H_DEVINO && !(e->flags & CE_DEVINO)) {
+			e->next[t] = NOENT;
+			continue;
+		}
+		h = hash_of(e, t) & (c->size - 1);
+		e->next[t] = c->head[t][h];
+		c->head[t][h] = i;
+	}
+}
+
+static void unlink_entry(cnid_cache * c, u_int32_t i)
+{
+	struct centry *e = &c->e[i];
+	u_int32_t *p;
+	int t;
+
+	for (t = 0; t < H_NUM; t++) {
+		if (t == H_DEVINO && !(e->flags & CE_DEVINO))
+			continue;
+		for (p = &c->head[t][hash_of(e, t) & (c->size - 1)];
+		     *p != NOENT; p = &c->e[*p].next[t])
+			if (*p == i) {
+				*p = e->next[t];
+				break;
+			}
+	}
+}
+
+static struct centry *find_id(cnid_cache * c, cnid_t cnid)
+{
+	u_int32_t i;
+
+	for (i = c->head[H_ID][hash_id(cnid) & (c->size - 1)]; i != NOENT;
+	     i = c->e[i].next[H_ID])
+		if (c->e[i].cnid == cnid && valid(c, &c->e[i]))
+			return &c->e[i];
+	return NULL;
+}
+
+static struct centry *find_didname(cnid_cache * c, cnid_t did,
+				   const char *name, size_t len)
+{
+	struct centry *e;
+	u_int32_t i;
+
+	for (i =
+	     c->head[H_DIDNAME][hash_didname(did, name, len) & (c->size - 1)];
+	     i != NOENT; i = e->next[H_DIDNAME]) {
+		e = &c->e[i];
+		if (e->did == did && e->namelen == len
+		    && !memcmp(e->name, name, len) && valid(c, e))
+			return e;
+	}
+	return NULL;
+}
+
+static struct centry *find_devino(cnid_cache * c, u_int64_t dev,
+				  u_int64_t ino)
+{
+	struct centry *e;
+	u_int32_t i;
+
+	for (i = c->head[H_DEVINO][hash_devino(dev, ino) & (c->size - 1)];
+	     i != NOENT; i = e->next[H_DEVINO]) {
+		e = &c->e[i];
+		if (e->ino == ino && e->dev == dev && valid(c, e))
+			return e;
+	}
+	return NULL;
+}
+
+/* may the cache answer? counts the request */
+static int answering(cnid_cache * c)
+{
+	c->stats.requests++;
+	if (!c->havegen || !c->used)
+		return 0;
+	if (c->ttl && time(NULL) - c->confirmed > c->ttl)
+		return 0;
+	return 1;
+}
+
+/* ------------------------ interface */
+
+/*!
+ * A cache of entries records, at least 1024
+ *
+ * @param ttl  seconds it answers after the last cnid_cache_gen(), 0 for
+ *             as long as the generation stays the same
+ */
+cnid_cache *cnid_cache_new(unsigned int entries, int ttl)
+{
+	cnid_cache *c;
+	u_int32_t n;
+	void *p;
+	int t;
+
+	for (n = 1024; n < entries && n < (1U << 24); n *= 2);
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+	if (posix_memalign(&p, 64, n * sizeof(struct centry)) != 0) {
+		free(c);
+		return NULL;
+	}
+	c->e = p;
+	for (t = 0; t < H_NUM; t++) {
+		if ((c->head[t] = malloc(n * sizeof(u_int32_t))) == NULL) {
+			cnid_cache_free(c);
+			return NULL;
+		}
+		memset(c->head[t], 0xff, n * sizeof(u_int32_t));
+	}
+	c->size = n;
+	c->ttl = ttl;
+	return c;
+}
+
+void cnid_cache_free(cnid_cache * c)
+{
+	int t;
+
+	if (c == NULL)
+		return;
+	for (t = 0; t < H_NUM; t++)
+		free(c->head[t]);
+	free(c->e);
+	free(c);
+}
+
+/*!
+ * The backend's database has generation gen now
+ */
+void cnid_cache_gen(cnid_cache * c, u_int32_t gen)
+{
+	if (c->havegen && gen != c->gen)
+		cnid_cache_flush(c);
+	c->gen = gen;
+	c->havegen = 1;
+	c->confirmed = time(NULL);
+}
+
+/*!
+ * Forget everything, e.g. after the connection to the backend was lost
+ */
+void cnid_cache_flush(cnid_cache * c)
+{
+	if (c->used)
+		c->stats.flushes++;
+	c->epoch++;
+	c->havegen = 0;
+}
+
+/*!
+ * The backend said CNID cnid is name in did. type is -1 if dev, ino and
+ * type aren't known, else 1 for directories and 0 for files, like in the
+ * database.
+ */
+void cnid_cache_add(cnid_cache * c, cnid_t cnid, cnid_t did,
+		    const char *name, size_t len, int type, u_int64_t dev,
+		    u_int64_t ino)
+{
+	struct centry *e;
+	u_int32_t i;
+
+	if (!c->havegen || cnid == CNID_INVALID || len > CNID_CACHE_NAMEMAX)
+		return;
+
+	if ((e = find_id(c, cnid)) != NULL) {
+		if (e->did == did && e->namelen == len
+		    && !memcmp(e->name, name, len)) {
+			if (type < 0 || (e->flags & CE_DEVINO))
+				return;
+			/* now we know dev/ino too */
+			i = e - c->e;
+			unlink_entry(c, i);
+			e->dev = dev;
+			e->ino = ino;
+			e->type = type;
+			e->flags |= CE_DEVINO;
+			link_entry(c, i);
+			return;
+		}
+		/* can't be, don't trust either */
+		e->cnid = CNID_INVALID;
+	}
+
+	i = c->oldest;
+	c->oldest = (c->oldest + 1) & (c->size - 1);
+	e = &c->e[i];
+	if (c->used == c->size) {
+		unlink_entry(c, i);
+		c->stats.evictions++;
+	} else {
+		c->used++;
+	}
+
+	e->cnid = cnid;
+	e->did = did;
+	e->epoch = c->epoch;
+	e->namelen = len;
+	memcpy(e->name, name, len);
+	e->name[len] = '\0';
+	if (type < 0) {
+		e->flags = 0;
+		e->dev = e->ino = 0;
+		e->type = 0;
+	} else {
+		e->flags = CE_DEVINO;
+		e->dev = dev;
+		e->ino = ino;
+		e->type = type;
+	}
+	link_entry(c, i);
+}
+
+/*!
+ * cnid_get(): the CNID of name in did, CNID_INVALID if it isn't cached
+ */
+cnid_t cnid_cache_get(cnid_cache * c, cnid_t did, const char *name,
+		      size_t len)
+{
+	struct centry *e;
+
+	if (!answering(c) || (e = find_didname(c, did, name, len)) == NULL)
+		return CNID_INVALID;
+	c->stats.hits++;
+	return e->cnid;
+}
+
+/*!
+ * cnid_resolve(): fills buffer like cnid_dbd does and returns the name in
+ * it, *id is the DID then. NULL if *id isn't cached.
+ */
+char *cnid_cache_resolve(cnid_cache * c, cnid_t * id, void *buffer,
+			 size_t len)
+{
+	char *buf = buffer;
+	struct centry *e;
+	u_int64_t v;
+	u_int32_t type;
+	int j;
+
+	if (!answering(c) || (e = find_id(c, *id)) == NULL
+	    || CNID_HEADER_LEN + e->namelen + 1 > len)
+		return NULL;
+
+	memcpy(buf + CNID_OFS, &e->cnid, CNID_LEN);
+	/* dev and ino big endian */
+	for (v = e->dev, j = CNID_DEV_LEN - 1; j >= 0; j--, v >>= 8)
+		buf[CNID_DEV_OFS + j] = v;
+	for (v = e->ino, j = CNID_INO_LEN - 1; j >= 0; j--, v >>= 8)
+		buf[CNID_INO_OFS + j] = v;
+	type = htonl(e->type);
+	memcpy(buf + CNID_TYPE_OFS, &type, CNID_TYPE_LEN);
+	memcpy(buf + CNID_DID_OFS, &e->did, CNID_DID_LEN);
+	memcpy(buf + CNID_NAME_OFS, e->name, e->namelen + 1);
+
+	c->stats.hits++;
+	*id = e->did;
+	return buf + CNID_NAME_OFS;
+}
+
+/*!
+ * cnid_lookup(): the CNID of the object if the record for dev/ino has the
+ * same type, DID and name, as the backend would find it. CNID_INVALID if
+ * it isn't cached or the backend has to sort it out.
+ */
+cnid_t cnid_cache_lookup(cnid_cache * c, u_int64_t dev, u_int64_t ino,
+			 int type, cnid_t did, const char *name, size_t len)
+{
+	struct centry *e;
+
+	if (!answering(c) || (e = find_devino(c, dev, ino)) == NULL
+	    || e->type != type || e->did != did || e->namelen != len
+	    || memcmp(e->name, name, len))
+		return CNID_INVALID;
+	c->stats.hits++;
+	return e->cnid;
+}
+
+const struct cnid_cache_stats *cnid_cache_stats(const cnid_cache * c)
+{
+	return &c->stats;
+}
@@ -39,6 +39,10 @@ extern struct _cnid_module cnid_last_module;
 extern struct _cnid_module cnid_dbd_module;
 #endif
 
+#ifdef CNID_BACKEND_LSM
+extern struct _cnid_module cnid_lsm_module;
+#endif
+
 
 void cnid_init(void)
 {
@@ -54,4 +58,8 @@ void cnid_init(void)
 	cnid_register(&cnid_dbd_module);
 #endif
 
+#ifdef CNID_BACKEND_LSM
+	cnid_register(&cnid_lsm_module);
+#endif
+
 }
@@ -29,6 +29,9 @@
 #include <errno.h>
 #include <netdb.h>
 #include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
 
 #include <netatalk/endian.h>
 #include <atalk/logger.h>
@@ -43,6 +46,10 @@
 #define MAX_DELAY 20
 #define ONE_DELAY 5
 
+/* Over the socket we only hear of other clients' changes when we ask
+   cnid_dbd something, don't answer from the cache longer than that */
+#define CACHE_TTL 2
+
 static void RQST_RESET(struct cnid_dbd_rqst *r)
 {
 	memset(r, 0, sizeof(struct cnid_dbd_rqst));
@@ -334,6 +341,193 @@ static int dbd_reply_stamp(struct cnid_dbd_rply *rply)
 	return 0;
 }
 
+static int dbd_rpc(CNID_private * db, struct cnid_dbd_rqst *rqst,
+		   struct cnid_dbd_rply *rply);
+
+/* ---------------------
+ * Is the other end of the socket on this host?
+ */
+static int dbd_sock_local(int fd)
+{
+	struct sockaddr_storage me, peer;
+	socklen_t melen = sizeof(me), peerlen = sizeof(peer);
+
+	if (getsockname(fd, (struct sockaddr *) &me, &melen) < 0
+	    || getpeername(fd, (struct sockaddr *) &peer, &peerlen) < 0
+	    || me.ss_family != peer.ss_family)
+		return 0;
+
+	switch (me.ss_family) {
+	case AF_UNIX:
+		return 1;
+	case AF_INET:
+		return !memcmp(&((struct sockaddr_in *) &me)->sin_addr,
+			       &((struct sockaddr_in *) &peer)->sin_addr,
+			       sizeof(struct in_addr));
+#ifdef AF_INET6
+	case AF_INET6:
+		return !memcmp(&((struct sockaddr_in6 *) &me)->sin6_addr,
+			       &((struct sockaddr_in6 *) &peer)->sin6_addr,
+			       sizeof(struct in6_addr));
+#endif
+	}
+	return 0;
+}
+
+/* --------------------- */
+static void dbd_shm_detach(CNID_private * db)
+{
+	if (db->shm) {
+		munmap(db->shm, CNID_DBD_SHM_LEN);
+		db->shm = NULL;
+	}
+}
+
+/* ---------------------
+ * Switch a new connection to the shared memory transport if cnid_dbd runs
+ * on this host and supports it. If anything goes wrong we stay with
+ * the socket for good.
+ *
+ * returns -1 if the connection is unusable now
+ */
+static int dbd_shm_attach(CNID_private * db)
+{
+	struct cnid_dbd_rqst rqst;
+	struct cnid_dbd_rply rply;
+	char name[CNID_DBD_SHM_NAMELEN];
+	struct stat st;
+	struct cnid_dbd_shm *shm;
+	int fd;
+
+	if (db->noshm)
+		return 0;
+
+	if (!dbd_sock_local(db->fd)) {
+		db->noshm = 1;
+		return 0;
+	}
+
+	RQST_RESET(&rqst);
+	rqst.op = CNID_DBD_OP_SHM_ATTACH;
+	rqst.cnid = geteuid();	/* the owner of the segment */
+	rply.name = name;
+	rply.namelen = sizeof(name) - 1;
+
+	/* older versions of cnid_dbd hang up on unknown requests */
+	db->noshm = 1;
+	if (dbd_rpc(db, &rqst, &rply) < 0)
+		return -1;
+	if (rply.result != CNID_DBD_RES_OK)
+		return 0;
+	name[rply.namelen] = '\0';
+
+	/* from here on cnid_dbd expects us on the rings */
+	if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+		LOG(log_error, logtype_cnid, "dbd_shm_attach: shm_open(%s): %s",
+		    name, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) CNID_DBD_SHM_LEN
+	    || (shm = mmap(NULL, CNID_DBD_SHM_LEN, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		LOG(log_error, logtype_cnid, "dbd_shm_attach: mmap(%s): %s",
+		    name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	close(fd);
+	/* nobody else needs to find it */
+	shm_unlink(name);
+
+	if (shm->magic != CNID_DBD_SHM_MAGIC
+	    || shm->ringsize != CNID_DBD_SHM_RINGSIZE) {
+		LOG(log_error, logtype_cnid, "dbd_shm_attach: bad segment %s",
+		    name);
+		munmap(shm, CNID_DBD_SHM_LEN);
+		return -1;
+	}
+
+	shm_ring_attach(&db->shm_rqst, CNID_DBD_SHM_RQST(shm),
+			CNID_DBD_SHM_RINGSIZE);
+	shm_ring_attach(&db->shm_rply, CNID_DBD_SHM_RPLY(shm),
+			CNID_DBD_SHM_RINGSIZE);
+	shm->attached = 1;
+	db->shm = shm;
+	db->noshm = 0;
+
+	LOG(log_debug, logtype_cnid,
+	    "dbd_shm_attach: using shared memory %s for '%s'", name,
+	    db->db_dir);
+	return 0;
+}
+
+/* ---------------------
+ * dbd_rpc() over the shared memory rings
+ */
+static int dbd_shm_rpc(CNID_private * db, struct cnid_dbd_rqst *rqst,
+		       struct cnid_dbd_rply *rply)
+{
+	struct iovec iov[2];
+	struct pollfd pfd;
+	time_t start;
+	char *nametmp;
+	size_t len;
+	ssize_t ret;
+	int vecs = 1;
+
+	iov[0].iov_base = rqst;
+	iov[0].iov_len = sizeof(struct cnid_dbd_rqst);
+	if (rqst->namelen) {
+		iov[1].iov_base = rqst->name;
+		iov[1].iov_len = rqst->namelen;
+		vecs++;
+	}
+	if (shm_ring_put(&db->shm_rqst, iov, vecs) < 0) {
+		LOG(log_error, logtype_cnid,
+		    "dbd_shm_rpc: request ring full (db_dir %s)", db->db_dir);
+		return -1;
+	}
+	/* cnid_dbd sleeps in select(), ring the bell */
+	if (shm_ring_waiting(&db->shm_rqst)
+	    && write(db->fd, "", 1) < 0 && errno != EAGAIN) {
+		LOG(log_debug, logtype_cnid, "dbd_shm_rpc: write: %s",
+		    strerror(errno));
+		return -1;
+	}
+
+	start = time(NULL);
+	pfd.fd = db->fd;
+	pfd.events = POLLIN;
+	while (!shm_ring_wait(&db->shm_rply, CNID_DBD_SHM_SPIN, 100)) {
+		/* cnid_dbd never writes to the socket now, so it's EOF */
+		if (poll(&pfd, 1, 0) > 0 || time(NULL) - start > ONE_DELAY) {
+			LOG(log_debug, logtype_cnid,
+			    "dbd_shm_rpc: no reply (db_dir %s)", db->db_dir);
+			return -1;
+		}
+	}
+
+	len = rply->namelen;
+	nametmp = rply->name;
+	iov[0].iov_base = rply;
+	iov[0].iov_len = sizeof(struct cnid_dbd_rply);
+	iov[1].iov_base = nametmp;
+	iov[1].iov_len = len;
+	ret = shm_ring_get(&db->shm_rply, iov, 2);
+	rply->name = nametmp;
+	if (ret < (ssize_t) sizeof(struct cnid_dbd_rply)
+	    || rply->namelen != ret - sizeof(struct cnid_dbd_rply)) {
+		LOG(log_error, logtype_cnid,
+		    "dbd_shm_rpc: bad reply (db_dir %s): %s", db->db_dir,
+		    ret < 0 ? strerror(errno) : "short");
+		return -1;
+	}
+
+	LOG(log_maxdebug, logtype_cnid, "dbd_shm_rpc: {done}");
+	return 0;
+}
+
 /* ---------------------
  * send a request and get reply
  * assume send is non blocking
@@ -346,6 +540,9 @@ static int dbd_rpc(CNID_private * db, struct cnid_dbd_rqst *rqst,
 	char *nametmp;
 	size_t len;
 
+	if (db->shm)
+		return dbd_shm_rpc(db, rqst, rply);
+
 	if (send_packet(db, rqst) < 0) {
 		return -1;
 	}
@@ -417,6 +614,9 @@ static int transmit(CNID_private * db, struct cnid_dbd_rqst *rqst,
 				goto transmit_fail;
 			if (dbd_reply_stamp(&rply_stamp) < 0)
 				goto transmit_fail;
+			/* for good, even if a newer one comes up later */
+			if (!(rply_stamp.cnid & CNID_DBD_HAS_BATCH))
+				db->nobatch = 1;
 
 			if (db->notfirst) {
 				LOG(log_debug7, logtype_cnid,
@@ -440,13 +640,26 @@ static int transmit(CNID_private * db, struct cnid_dbd_rqst *rqst,
 			LOG(log_debug, logtype_cnid,
 			    "transmit: attached to '%s', stamp: '%08lx'.",
 			    db->db_dir, *(uint64_t *) stamp);
+
+			if (dbd_shm_attach(db) < 0)
+				goto transmit_fail;
 		}
+		if (rqst->op == CNID_DBD_OP_BATCH_ADD && db->nobatch)
+			return -1;
 		if (!dbd_rpc(db, rqst, rply)) {
 			LOG(log_maxdebug, logtype_cnid,
 			    "transmit: {done}");
+			if (db->cache)
+				cnid_cache_gen(db->cache, rply->gen);
 			return 0;
 		}
+		/* don't resend a batch cnid_dbd may have died of */
+		if (rqst->op == CNID_DBD_OP_BATCH_ADD)
+			db->nobatch = 1;
 	      transmit_fail:
+		if (db->cache)
+			cnid_cache_flush(db->cache);
+		dbd_shm_detach(db);
 		if (db->fd != -1) {
 			close(db->fd);
 			db->fd = -1;	/* FD not valid... will need to reconnect */
@@ -478,6 +691,19 @@ static int transmit(CNID_private * db, struct cnid_dbd_rqst *rqst,
 	return -1;
 }
 
+/* ----------------------
+ * The cache if it may answer now. On the shared memory transport
+ * cnid_dbd's generation is in the segment, no need to wait for a reply.
+ */
+static cnid_cache *dbd_cache(CNID_private * db)
+{
+	if (db->cache == NULL || db->fd == -1)
+		return NULL;
+	if (db->shm)
+		cnid_cache_gen(db->cache, db->shm->gen);
+	return db->cache;
+}
+
 /* ---------------------- */
 static struct _cnid_db *cnid_dbd_new(const char *volpath)
 {
@@ -500,6 +726,7 @@ static struct _cnid_db *cnid_dbd_new(const char *volpath)
 	cdb->cnid_get = cnid_dbd_get;
 	cdb->cnid_lookup = cnid_dbd_lookup;
 	cdb->cnid_find = cnid_dbd_find;
+	cdb->cnid_add_batch = cnid_dbd_add_batch;
 	cdb->cnid_nextid = NULL;
 	cdb->cnid_resolve = cnid_dbd_resolve;
 	cdb->cnid_getstamp = cnid_dbd_getstamp;
@@ -542,6 +769,10 @@ struct _cnid_db *cnid_dbd_open(struct cnid_open_args *args)
 	db->fd = -1;
 	db->cnidserver = strdup(args->cnidserver);
 	db->cnidport = strdup(args->cnidport);
+	if ((db->cache =
+	     cnid_cache_new(CNID_CACHE_ENTRIES, CACHE_TTL)) == NULL)
+		LOG(log_warning, logtype_cnid,
+		    "cnid_open: no memory for the CNID cache");
 
 	LOG(log_debug, logtype_cnid,
 	    "cnid_dbd_open: Finished initializing cnid dbd module for volume '%s'",
@@ -578,6 +809,18 @@ void cnid_dbd_close(struct _cnid_db *cdb)
 		    "closing database connection for volume '%s'",
 		    db->db_dir);
 
+		if (db->cache) {
+			const struct cnid_cache_stats *st =
+			    cnid_cache_stats(db->cache);
+
+			LOG(log_info, logtype_cnid,
+			    "CNID cache for '%s': %llu of %llu requests answered, %llu flushes",
+			    db->db_dir, (unsigned long long) st->hits,
+			    (unsigned long long) st->requests,
+			    (unsigned long long) st->flushes);
+			cnid_cache_free(db->cache);
+		}
+		dbd_shm_detach(db);
 		if (db->fd >= 0)
 			close(db->fd);
 		free(db);
@@ -597,6 +840,7 @@ cnid_t cnid_dbd_add(struct _cnid_db *cdb, const struct stat *st,
 	CNID_private *db;
 	struct cnid_dbd_rqst rqst;
 	struct cnid_dbd_rply rply;
+	cnid_cache *cache;
 	cnid_t id;
 
 	if (!cdb || !(db = cdb->_private) || !st || !name) {
@@ -630,6 +874,12 @@ cnid_t cnid_dbd_add(struct _cnid_db *cdb, const struct stat *st,
 	    "cnid_dbd_add: CNID: %u, name: '%s', inode: 0x%llx, type: %d (0=file, 1=dir)",
 	    ntohl(did), name, (long long) st->st_ino, rqst.type);
 
+	/* an unchanged object, cnid_dbd would only look it up */
+	if ((cache = dbd_cache(db)) != NULL
+	    && (id = cnid_cache_lookup(cache, rqst.dev, rqst.ino, rqst.type,
+				       did, name, len)) != CNID_INVALID)
+		return id;
+
 	rply.namelen = 0;
 	if (transmit(db, &rqst, &rply) < 0) {
 		errno = CNID_ERR_DB;
@@ -641,6 +891,9 @@ cnid_t cnid_dbd_add(struct _cnid_db *cdb, const struct stat *st,
 		id = rply.cnid;
 		LOG(log_debug, logtype_cnid, "cnid_dbd_add: got CNID: %u",
 		    ntohl(id));
+		if (db->cache)
+			cnid_cache_add(db->cache, id, did, name, len,
+				       rqst.type, rqst.dev, rqst.ino);
 		break;
 	case CNID_DBD_RES_ERR_MAX:
 		errno = CNID_ERR_MAX;
@@ -658,6 +911,121 @@ cnid_t cnid_dbd_add(struct _cnid_db *cdb, const struct stat *st,
 	return id;
 }
 
+/* ----------------------
+ * Send one CNID_DBD_OP_BATCH_ADD for batch[0..count-1], the caller makes
+ * sure it fits in DBD_MAX_BATCH_LEN. Names cnid_dbd can't take are skipped.
+ */
+static int dbd_add_chunk(struct _cnid_db *cdb, CNID_private * db,
+			 struct cnid_batch *batch, int count)
+{
+	static char buf[DBD_MAX_BATCH_LEN];
+	cnid_t ids[DBD_MAX_BATCH];
+	int idx[DBD_MAX_BATCH];
+	struct cnid_dbd_rqst rqst, sub;
+	struct cnid_dbd_rply rply;
+	size_t len = 0;
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		if (batch[i].len == 0 || batch[i].len > MAXPATHLEN)
+			continue;
+		idx[n++] = i;
+		RQST_RESET(&sub);
+		sub.op = CNID_DBD_OP_ADD;
+		if (!(cdb->flags & CNID_FLAG_NODEV))
+			sub.dev = batch[i].st->st_dev;
+		sub.ino = batch[i].st->st_ino;
+		sub.type = S_ISDIR(batch[i].st->st_mode) ? 1 : 0;
+		sub.did = batch[i].did;
+		sub.namelen = batch[i].len;
+		memcpy(buf + len, &sub, sizeof(sub));
+		len += sizeof(sub);
+		memcpy(buf + len, batch[i].name, batch[i].len);
+		len += batch[i].len;
+	}
+
+	RQST_RESET(&rqst);
+	rqst.op = CNID_DBD_OP_BATCH_ADD;
+	rqst.name = buf;
+	rqst.namelen = len;
+
+	rply.name = (char *) ids;
+	rply.namelen = sizeof(ids);
+
+	if (transmit(db, &rqst, &rply) < 0) {
+		errno = CNID_ERR_DB;
+		return -1;
+	}
+
+	if (rply.result != CNID_DBD_RES_OK
+	    || rply.namelen != n * sizeof(cnid_t)) {
+		/* rolled back, the caller will add them one by one */
+		LOG(log_debug, logtype_cnid,
+		    "cnid_dbd_add_batch: batch of %d failed, result: %d",
+		    n, rply.result);
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct cnid_batch *b = &batch[idx[i]];
+
+		b->cnid = ids[i];
+		if (db->cache)
+			cnid_cache_add(db->cache, b->cnid, b->did, b->name,
+				       b->len, S_ISDIR(b->st->st_mode) ? 1 : 0,
+				       (cdb->flags & CNID_FLAG_NODEV) ? 0 :
+				       b->st->st_dev, b->st->st_ino);
+	}
+	return 0;
+}
+
+/* ---------------------- */
+int cnid_dbd_add_batch(struct _cnid_db *cdb, struct cnid_batch *batch,
+		       int count)
+{
+	CNID_private *db;
+	size_t len = 0;
+	int i, first = 0;
+
+	if (!cdb || !(db = cdb->_private) || !batch || count < 0) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_add_batch: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return -1;
+	}
+
+	LOG(log_debug, logtype_cnid, "cnid_dbd_add_batch: %d objects",
+	    count);
+
+	/* the caller adds them one by one */
+	if (db->nobatch) {
+		errno = CNID_ERR_DB;
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		batch[i].cnid = CNID_INVALID;
+		if (batch[i].len == 0 || batch[i].len > MAXPATHLEN) {
+			/* cnid_add() reports the error */
+			continue;
+		}
+		if (i - first == DBD_MAX_BATCH
+		    || len + sizeof(struct cnid_dbd_rqst) + batch[i].len >
+		    DBD_MAX_BATCH_LEN) {
+			if (dbd_add_chunk(cdb, db, batch + first, i - first)
+			    < 0)
+				return -1;
+			first = i;
+			len = 0;
+		}
+		len += sizeof(struct cnid_dbd_rqst) + batch[i].len;
+	}
+	if (len && dbd_add_chunk(cdb, db, batch + first, count - first) < 0)
+		return -1;
+
+	return 0;
+}
+
 /* ---------------------- */
 cnid_t cnid_dbd_get(struct _cnid_db *cdb, const cnid_t did, char *name,
 		    const size_t len)
@@ -665,6 +1033,7 @@ cnid_t cnid_dbd_get(struct _cnid_db *cdb, const cnid_t did, char *name,
 	CNID_private *db;
 	struct cnid_dbd_rqst rqst;
 	struct cnid_dbd_rply rply;
+	cnid_cache *cache;
 	cnid_t id;
 
 	if (!cdb || !(db = cdb->_private) || !name) {
@@ -684,6 +1053,10 @@ cnid_t cnid_dbd_get(struct _cnid_db *cdb, const cnid_t did, char *name,
 	LOG(log_debug, logtype_cnid, "cnid_dbd_get: DID: %u, name: '%s'",
 	    ntohl(did), name);
 
+	if ((cache = dbd_cache(db)) != NULL
+	    && (id = cnid_cache_get(cache, did, name, len)) != CNID_INVALID)
+		return id;
+
 	RQST_RESET(&rqst);
 	rqst.op = CNID_DBD_OP_GET;
 	rqst.did = did;
@@ -701,6 +1074,9 @@ cnid_t cnid_dbd_get(struct _cnid_db *cdb, const cnid_t did, char *name,
 		id = rply.cnid;
 		LOG(log_debug, logtype_cnid, "cnid_dbd_get: got CNID: %u",
 		    ntohl(id));
+		if (db->cache)
+			cnid_cache_add(db->cache, id, did, name, len, -1, 0,
+				       0);
 		break;
 	case CNID_DBD_RES_NOTFOUND:
 		id = CNID_INVALID;
@@ -716,6 +1092,33 @@ cnid_t cnid_dbd_get(struct _cnid_db *cdb, const cnid_t did, char *name,
 	return id;
 }
 
+/* ----------------------
+ * Cache a record the way cnid_dbd sends it for a resolve
+ */
+static void dbd_cache_record(cnid_cache * cache, const char *buf,
+			     size_t len)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+	u_int64_t dev = 0, ino = 0;
+	u_int32_t type;
+	cnid_t cnid, did;
+	size_t namelen;
+	int i;
+
+	for (i = 0; i < CNID_DEV_LEN; i++)
+		dev = dev << 8 | p[CNID_DEV_OFS + i];
+	for (i = 0; i < CNID_INO_LEN; i++)
+		ino = ino << 8 | p[CNID_INO_OFS + i];
+	memcpy(&cnid, buf + CNID_OFS, CNID_LEN);
+	memcpy(&type, buf + CNID_TYPE_OFS, CNID_TYPE_LEN);
+	memcpy(&did, buf + CNID_DID_OFS, CNID_DID_LEN);
+	namelen = strnlen(buf + CNID_NAME_OFS, len - CNID_NAME_OFS);
+	if (namelen == len - CNID_NAME_OFS)
+		return;
+	cnid_cache_add(cache, cnid, did, buf + CNID_NAME_OFS, namelen,
+		       ntohl(type) ? 1 : 0, dev, ino);
+}
+
 /* ---------------------- */
 char *cnid_dbd_resolve(struct _cnid_db *cdb, cnid_t * id, void *buffer,
 		       size_t len)
@@ -723,6 +1126,7 @@ char *cnid_dbd_resolve(struct _cnid_db *cdb, cnid_t * id, void *buffer,
 	CNID_private *db;
 	struct cnid_dbd_rqst rqst;
 	struct cnid_dbd_rply rply;
+	cnid_cache *cache;
 	char *name;
 
 	if (!cdb || !(db = cdb->_private) || !id || !(*id)) {
@@ -740,6 +1144,10 @@ char *cnid_dbd_resolve(struct _cnid_db *cdb, cnid_t * id, void *buffer,
 	   CNID_HEADER_LEN plus 1 byte, which is large enough for the maximum that
 	   can come from the database. */
 
+	if ((cache = dbd_cache(db)) != NULL
+	    && (name = cnid_cache_resolve(cache, id, buffer, len)) != NULL)
+		return name;
+
 	RQST_RESET(&rqst);
 	rqst.op = CNID_DBD_OP_RESOLVE;
 	rqst.cnid = *id;
@@ -761,6 +1169,9 @@ char *cnid_dbd_resolve(struct _cnid_db *cdb, cnid_t * id, void *buffer,
 		LOG(log_debug, logtype_cnid,
 		    "cnid_dbd_resolve: resolved did: %u, name: '%s'",
 		    ntohl(*id), name);
+		if (db->cache && rply.namelen > CNID_NAME_OFS)
+			dbd_cache_record(db->cache, rply.name,
+					 rply.namelen);
 		break;
 	case CNID_DBD_RES_NOTFOUND:
 		*id = CNID_INVALID;
@@ -802,6 +1213,7 @@ cnid_t cnid_dbd_lookup(struct _cnid_db *cdb, const struct stat *st,
 	CNID_private *db;
 	struct cnid_dbd_rqst rqst;
 	struct cnid_dbd_rply rply;
+	cnid_cache *cache;
 	cnid_t id;
 
 	if (!cdb || !(db = cdb->_private) || !st || !name) {
@@ -835,6 +1247,11 @@ cnid_t cnid_dbd_lookup(struct _cnid_db *cdb, const struct stat *st,
 	    "cnid_dbd_lookup: CNID: %u, name: '%s', inode: 0x%llx, type: %d (0=file, 1=dir)",
 	    ntohl(did), name, (long long) st->st_ino, rqst.type);
 
+	if ((cache = dbd_cache(db)) != NULL
+	    && (id = cnid_cache_lookup(cache, rqst.dev, rqst.ino, rqst.type,
+				       did, name, len)) != CNID_INVALID)
+		return id;
+
 	rply.namelen = 0;
 	if (transmit(db, &rqst, &rply) < 0) {
 		errno = CNID_ERR_DB;
@@ -846,6 +1263,9 @@ cnid_t cnid_dbd_lookup(struct _cnid_db *cdb, const struct stat *st,
 		id = rply.cnid;
 		LOG(log_debug, logtype_cnid,
 		    "cnid_dbd_lookup: got CNID: %u", ntohl(id));
+		if (db->cache)
+			cnid_cache_add(db->cache, id, did, name, len,
+				       rqst.type, rqst.dev, rqst.ino);
 		break;
 	case CNID_DBD_RES_NOTFOUND:
 		id = CNID_INVALID;
@@ -863,11 +1283,12 @@ cnid_t cnid_dbd_lookup(struct _cnid_db *cdb, const struct stat *st,
 
 /* ---------------------- */
 int cnid_dbd_find(struct _cnid_db *cdb, const char *name, size_t namelen,
-		  void *buffer, size_t buflen)
+		  u_int32_t * pos, void *buffer, size_t buflen)
 {
 	CNID_private *db;
 	struct cnid_dbd_rqst rqst;
 	struct cnid_dbd_rply rply;
+	size_t off;
 	int count;
 
 	if (!cdb || !(db = cdb->_private) || !name) {
@@ -890,6 +1311,8 @@ int cnid_dbd_find(struct _cnid_db *cdb, const char *name, size_t namelen,
 
 	rqst.name = (char *) name;
 	rqst.namelen = namelen;
+	rqst.cnid = pos[0];
+	rqst.did = pos[1];
 
 	rply.name = buffer;
 	rply.namelen = buflen;
@@ -900,14 +1323,21 @@ int cnid_dbd_find(struct _cnid_db *cdb, const char *name, size_t namelen,
 	}
 
 	switch (rply.result) {
-	case CNID_DBD_RES_OK:
-		count = rply.namelen / sizeof(cnid_t);
+	case CNID_DBD_RES_SRCH_CNT:
+	case CNID_DBD_RES_SRCH_DONE:
+		for (count = 0, off = 0;
+		     off + 2 * sizeof(cnid_t) < rply.namelen; count++)
+			off += CNID_FIND_RECLEN(strlen((char *) buffer + off +
+							 2 * sizeof(cnid_t)));
+		if (rply.result == CNID_DBD_RES_SRCH_DONE) {
+			pos[0] = pos[1] = 0;
+		} else {
+			pos[0] = rply.cnid;
+			pos[1] = rply.did;
+		}
 		LOG(log_debug, logtype_cnid, "cnid_find: got %d matches",
 		    count);
 		break;
-	case CNID_DBD_RES_NOTFOUND:
-		count = 0;
-		break;
 	case CNID_DBD_RES_ERR_DB:
 		errno = CNID_ERR_DB;
 		count = -1;
@@ -967,6 +1397,9 @@ int cnid_dbd_update(struct _cnid_db *cdb, const cnid_t id,
 	switch (rply.result) {
 	case CNID_DBD_RES_OK:
 		LOG(log_debug, logtype_cnid, "cnid_dbd_update: updated");
+		if (db->cache)
+			cnid_cache_add(db->cache, id, did, name, len,
+				       rqst.type, rqst.dev, rqst.ino);
 	case CNID_DBD_RES_NOTFOUND:
 		return 0;
 	case CNID_DBD_RES_ERR_DB:
@@ -1030,6 +1463,9 @@ cnid_t cnid_dbd_rebuild_add(struct _cnid_db *cdb, const struct stat *st,
 		id = rply.cnid;
 		LOG(log_debug, logtype_cnid,
 		    "cnid_dbd_rebuild_add: got CNID: %u", ntohl(id));
+		if (db->cache)
+			cnid_cache_add(db->cache, id, did, name, len,
+				       rqst.type, rqst.dev, rqst.ino);
 		break;
 	case CNID_DBD_RES_ERR_MAX:
 		errno = CNID_ERR_MAX;
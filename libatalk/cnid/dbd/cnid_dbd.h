@@ -29,7 +29,9 @@ extern int cnid_dbd_getstamp(struct _cnid_db *, void *, const size_t);
 extern cnid_t cnid_dbd_lookup(struct _cnid_db *, const struct stat *,
 			      const cnid_t, char *, const size_t);
 extern int cnid_dbd_find(struct _cnid_db *cdb, const char *name,
-			 size_t namelen, void *buffer, size_t buflen);
+			 size_t namelen, u_int32_t *pos, void *buffer,
+			 size_t buflen);
+extern int cnid_dbd_add_batch(struct _cnid_db *, struct cnid_batch *, int);
 extern int cnid_dbd_update(struct _cnid_db *, const cnid_t,
 			   const struct stat *, const cnid_t, char *,
 			   size_t);
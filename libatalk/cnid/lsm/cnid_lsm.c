@@ -0,0 +1,681 @@
+/*
+ * The lsm CNID backend: afpd keeps the CNIDs of a volume itself, in the
+ * store of lsm_store.c in .AppleDB of the volume, no cnid_dbd involved.
+ * Several afpd can use the same database, the store locks it for every
+ * operation. What a lookup does with records that don't match is what
+ * dbd_lookup() in cnid_dbd does.
+ *
+ * With CNID_FLAG_BULK a new database is loaded by cnid_add() and
+ * cnid_rebuild_add() and written by cnid_close(), until then nothing can
+ * be looked up.
+ */
+
+#include "config.h"
+
+#ifdef CNID_BACKEND_LSM
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+
+#include <atalk/logger.h>
+#include <atalk/adouble.h>
+#include <atalk/cnid_private.h>
+
+#include "cnid_lsm.h"
+
+/* ---------------------- */
+static void lsm_makerec(struct _cnid_db *cdb, struct lsm_rec *rec,
+			cnid_t cnid, const struct stat *st, cnid_t did,
+			const char *name, size_t len)
+{
+	rec->cnid = cnid;
+	rec->dev = (cdb->flags & CNID_FLAG_NODEV) ? 0 : st->st_dev;
+	rec->ino = st->st_ino;
+	rec->type = S_ISDIR(st->st_mode) ? 1 : 0;
+	rec->did = did;
+	rec->name = name;
+	rec->namelen = len;
+}
+
+/* ----------------------
+ * Lock for changes, for reading only if the database is read-only
+ *
+ * @returns 0, 1 if read-only, -1 on error
+ */
+static int lsm_wrlock(lsm_db * db)
+{
+	if (lsm_lock(db, 1) == 0)
+		return 0;
+	if (errno == EROFS && lsm_lock(db, 0) == 0)
+		return 1;
+	return -1;
+}
+
+/* ----------------------
+ * dbd_lookup(): the CNID of rec, records that don't match any more are
+ * deleted unless roflag is set. rec->cnid is a hint from the AppleDouble
+ * header or CNID_INVALID.
+ *
+ * @returns the CNID, CNID_INVALID if there's none, errno CNID_ERR_DB on error
+ */
+static cnid_t lsm_lookup(lsm_db * db, struct lsm_rec *rec, int roflag)
+{
+	char buf[MAXPATHLEN + 1];
+	struct lsm_rec found;
+	cnid_t id_devino = CNID_INVALID, id_didname = CNID_INVALID;
+	u_int32_t type_devino = 0, type_didname = 0;
+	int rc;
+
+	if ((rc = lsm_get_devino(db, rec->dev, rec->ino, &found, buf)) < 0)
+		goto fail;
+	if (rc) {
+		id_devino = found.cnid;
+		type_devino = found.type;
+	}
+	if ((rc = lsm_get_didname(db, rec->did, rec->name, rec->namelen,
+				  &found, buf)) < 0)
+		goto fail;
+	if (rc) {
+		id_didname = found.cnid;
+		type_didname = found.type;
+	}
+
+	if (!id_devino && !id_didname)
+		return CNID_INVALID;
+
+	/* one is a dir one is a file */
+	if ((id_devino && type_devino != rec->type)
+	    || (id_didname && type_didname != rec->type)) {
+		if (!roflag && id_devino && type_devino != rec->type
+		    && lsm_del(db, id_devino) < 0)
+			goto fail;
+		if (!roflag && id_didname && type_didname != rec->type
+		    && lsm_del(db, id_didname) < 0)
+			goto fail;
+		return CNID_INVALID;
+	}
+
+	if (id_devino && id_didname) {
+		if (id_devino == id_didname)
+			return id_didname;
+		/* CNIDs don't match, e.g. emacs' backup files */
+		LOG(log_debug, logtype_cnid,
+		    "cnid_lsm_lookup: CNID mismatch: (DID:%u/'%s') --> %u, (0x%llx/0x%llx) --> %u",
+		    ntohl(rec->did), rec->name, ntohl(id_didname),
+		    (unsigned long long) rec->dev,
+		    (unsigned long long) rec->ino, ntohl(id_devino));
+		if (!roflag && (lsm_del(db, id_devino) < 0
+				|| lsm_del(db, id_didname) < 0))
+			goto fail;
+		return CNID_INVALID;
+	}
+
+	if (id_devino) {
+		/* server side rename or reused inode, keep it if the hint says so */
+		if (rec->cnid != id_devino) {
+			if (!roflag && lsm_del(db, id_devino) < 0)
+				goto fail;
+			return CNID_INVALID;
+		}
+		if (roflag)
+			return CNID_INVALID;
+		if (lsm_put(db, rec) < 0)
+			goto fail;
+		return id_devino;
+	}
+
+	/* changed dev/ino */
+	if (!roflag && lsm_del(db, id_didname) < 0)
+		goto fail;
+	return CNID_INVALID;
+
+      fail:
+	errno = CNID_ERR_DB;
+	return CNID_INVALID;
+}
+
+/* ---------------------- */
+static struct _cnid_db *cnid_lsm_new(const char *volpath)
+{
+	struct _cnid_db *cdb;
+
+	if ((cdb =
+	     (struct _cnid_db *) calloc(1,
+					sizeof(struct _cnid_db))) == NULL)
+		return NULL;
+
+	if ((cdb->volpath = strdup(volpath)) == NULL) {
+		free(cdb);
+		return NULL;
+	}
+
+	cdb->flags = CNID_FLAG_PERSISTENT;
+
+	cdb->cnid_add = cnid_lsm_add;
+	cdb->cnid_delete = cnid_lsm_delete;
+	cdb->cnid_get = cnid_lsm_get;
+	cdb->cnid_lookup = cnid_lsm_lookup;
+	cdb->cnid_find = NULL;
+	cdb->cnid_add_batch = cnid_lsm_add_batch;
+	cdb->cnid_nextid = NULL;
+	cdb->cnid_resolve = cnid_lsm_resolve;
+	cdb->cnid_getstamp = cnid_lsm_getstamp;
+	cdb->cnid_update = cnid_lsm_update;
+	cdb->cnid_rebuild_add = cnid_lsm_rebuild_add;
+	cdb->cnid_close = cnid_lsm_close;
+
+	return cdb;
+}
+
+/* ---------------------- */
+struct _cnid_db *cnid_lsm_open(struct cnid_open_args *args)
+{
+	struct _cnid_lsm_private *db = NULL;
+	struct _cnid_db *cdb = NULL;
+
+	if (!args->dir) {
+		return NULL;
+	}
+
+	if ((cdb = cnid_lsm_new(args->dir)) == NULL) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_open: Unable to allocate memory for database");
+		return NULL;
+	}
+
+	if ((db = calloc(1, sizeof(struct _cnid_lsm_private))) == NULL) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_open: Unable to allocate memory for database");
+		goto cnid_lsm_open_fail;
+	}
+
+	if ((db->db =
+	     lsm_open(args->dir, args->mask,
+		      (args->flags & CNID_FLAG_BULK) ? LSM_BULK : 0)) ==
+	    NULL) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_open: Can't open the database of '%s': %s",
+		    args->dir, strerror(errno));
+		goto cnid_lsm_open_fail;
+	}
+	cdb->_private = db;
+
+	LOG(log_debug, logtype_cnid,
+	    "cnid_lsm_open: Finished initializing cnid lsm module for volume '%s'",
+	    args->dir);
+
+	return cdb;
+
+      cnid_lsm_open_fail:
+	free(cdb->volpath);
+	free(cdb);
+	free(db);
+
+	return NULL;
+}
+
+/* ---------------------- */
+void cnid_lsm_close(struct _cnid_db *cdb)
+{
+	struct _cnid_lsm_private *db;
+
+	if (!cdb) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_close called with NULL argument !");
+		return;
+	}
+
+	if ((db = cdb->_private) != NULL) {
+		if (lsm_close(db->db) < 0)
+			LOG(log_error, logtype_cnid,
+			    "cnid_lsm_close: Can't write the database of '%s'",
+			    cdb->volpath);
+		free(db);
+	}
+
+	free(cdb->volpath);
+	free(cdb);
+}
+
+/* ---------------------- */
+cnid_t cnid_lsm_add(struct _cnid_db *cdb, const struct stat *st,
+		    const cnid_t did, const char *name, const size_t len,
+		    cnid_t hint)
+{
+	struct _cnid_lsm_private *db;
+	struct lsm_rec rec;
+	cnid_t id;
+	int roflag;
+
+	if (!cdb || !(db = cdb->_private) || !st || !name) {
+		LOG(log_error, logtype_cnid, "cnid_add: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return CNID_INVALID;
+	}
+
+	if (len > MAXPATHLEN) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_add: Path name is too long");
+		errno = CNID_ERR_PATH;
+		return CNID_INVALID;
+	}
+
+	lsm_makerec(cdb, &rec, hint, st, did, name, len);
+
+	if (lsm_bulk(db->db)) {
+		if (rec.cnid == CNID_INVALID
+		    && (rec.cnid = lsm_nextid(db->db)) == CNID_INVALID) {
+			errno = CNID_ERR_MAX;
+			return CNID_INVALID;
+		}
+		if (lsm_bulk_add(db->db, &rec) < 0) {
+			errno = CNID_ERR_DB;
+			return CNID_INVALID;
+		}
+		return rec.cnid;
+	}
+
+	if ((roflag = lsm_wrlock(db->db)) < 0) {
+		errno = CNID_ERR_DB;
+		return CNID_INVALID;
+	}
+	errno = 0;
+	if ((id = lsm_lookup(db->db, &rec, roflag)) == CNID_INVALID
+	    && errno != CNID_ERR_DB) {
+		if (roflag) {
+			errno = CNID_ERR_DB;
+		} else if ((rec.cnid = lsm_nextid(db->db)) == CNID_INVALID) {
+			errno = CNID_ERR_MAX;
+		} else if (lsm_put(db->db, &rec) < 0) {
+			errno = CNID_ERR_DB;
+		} else {
+			id = rec.cnid;
+		}
+	}
+	if (lsm_unlock(db->db) < 0) {
+		errno = CNID_ERR_DB;
+		id = CNID_INVALID;
+	}
+
+	LOG(log_debug, logtype_cnid,
+	    "cnid_lsm_add: DID: %u, name: '%s', inode: 0x%llx: CNID: %u",
+	    ntohl(did), name, (long long) st->st_ino, ntohl(id));
+
+	return id;
+}
+
+/* ----------------------
+ * All of the batch under one lock, the names cnid_add() would reject
+ * are left to it
+ */
+int cnid_lsm_add_batch(struct _cnid_db *cdb, struct cnid_batch *batch,
+		       int count)
+{
+	struct _cnid_lsm_private *db;
+	struct lsm_rec rec;
+	int i, roflag, ret = 0;
+
+	if (!cdb || !(db = cdb->_private) || !batch || count < 0) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_add_batch: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+		batch[i].cnid = CNID_INVALID;
+
+	if (lsm_bulk(db->db)) {
+		for (i = 0; i < count; i++)
+			if (batch[i].len && batch[i].len <= MAXPATHLEN)
+				batch[i].cnid =
+				    cnid_lsm_add(cdb, batch[i].st,
+						 batch[i].did, batch[i].name,
+						 batch[i].len, 0);
+		return 0;
+	}
+
+	if ((roflag = lsm_wrlock(db->db)) < 0) {
+		errno = CNID_ERR_DB;
+		return -1;
+	}
+	if (roflag) {
+		/* nothing can be added, cnid_add() reports it */
+		lsm_unlock(db->db);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (batch[i].len == 0 || batch[i].len > MAXPATHLEN)
+			continue;
+		lsm_makerec(cdb, &rec, CNID_INVALID, batch[i].st,
+			    batch[i].did, batch[i].name, batch[i].len);
+		errno = 0;
+		if ((batch[i].cnid =
+		     lsm_lookup(db->db, &rec, 0)) != CNID_INVALID)
+			continue;
+		if (errno == CNID_ERR_DB
+		    || (rec.cnid = lsm_nextid(db->db)) == CNID_INVALID
+		    || lsm_put(db->db, &rec) < 0) {
+			/* the rest one by one */
+			break;
+		}
+		batch[i].cnid = rec.cnid;
+	}
+
+	if (lsm_unlock(db->db) < 0) {
+		for (i = 0; i < count; i++)
+			batch[i].cnid = CNID_INVALID;
+		errno = CNID_ERR_DB;
+		ret = -1;
+	}
+
+	LOG(log_debug, logtype_cnid, "cnid_lsm_add_batch: %d objects",
+	    count);
+
+	return ret;
+}
+
+/* ---------------------- */
+cnid_t cnid_lsm_get(struct _cnid_db *cdb, const cnid_t did, char *name,
+		    const size_t len)
+{
+	struct _cnid_lsm_private *db;
+	char buf[MAXPATHLEN + 1];
+	struct lsm_rec rec;
+	cnid_t id = CNID_INVALID;
+	int rc;
+
+	if (!cdb || !(db = cdb->_private) || !name) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_lsm_get: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return CNID_INVALID;
+	}
+
+	if (len > MAXPATHLEN) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_lsm_get: Path name is too long");
+		errno = CNID_ERR_PATH;
+		return CNID_INVALID;
+	}
+
+	if (lsm_lock(db->db, 0) < 0) {
+		errno = CNID_ERR_DB;
+		return CNID_INVALID;
+	}
+	if ((rc = lsm_get_didname(db->db, did, name, len, &rec, buf)) < 0)
+		errno = CNID_ERR_DB;
+	else if (rc)
+		id = rec.cnid;
+	lsm_unlock(db->db);
+
+	LOG(log_debug, logtype_cnid,
+	    "cnid_lsm_get: DID: %u, name: '%s': CNID: %u", ntohl(did), name,
+	    ntohl(id));
+
+	return id;
+}
+
+/* ----------------------
+ * The buffer is filled like cnid_dbd's: a record of the CNID database with
+ * the NUL terminated name
+ */
+char *cnid_lsm_resolve(struct _cnid_db *cdb, cnid_t * id, void *buffer,
+		       size_t len)
+{
+	struct _cnid_lsm_private *db;
+	char *buf = buffer;
+	struct lsm_rec rec;
+	u_int32_t type;
+	int rc;
+
+	if (!cdb || !(db = cdb->_private) || !id || !(*id) || !buffer) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_resolve: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return NULL;
+	}
+
+	if (len < CNID_HEADER_LEN + 1) {
+		*id = CNID_INVALID;
+		errno = CNID_ERR_PARAM;
+		return NULL;
+	}
+
+	if (lsm_lock(db->db, 0) < 0) {
+		*id = CNID_INVALID;
+		errno = CNID_ERR_DB;
+		return NULL;
+	}
+	rc = lsm_get_id(db->db, *id, &rec, buf + CNID_NAME_OFS);
+	lsm_unlock(db->db);
+
+	if (rc < 0) {
+		*id = CNID_INVALID;
+		errno = CNID_ERR_DB;
+		return NULL;
+	}
+	if (rc == 0) {
+		*id = CNID_INVALID;
+		return NULL;
+	}
+	if (CNID_HEADER_LEN + rec.namelen + 1 > len) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_lsm_resolve: buffer too small for CNID: %u",
+		    ntohl(*id));
+		*id = CNID_INVALID;
+		errno = CNID_ERR_PARAM;
+		return NULL;
+	}
+
+	memcpy(buf + CNID_OFS, &rec.cnid, CNID_LEN);
+	memcpy(buf + CNID_DEV_OFS, &rec.dev, CNID_DEV_LEN);
+	memcpy(buf + CNID_INO_OFS, &rec.ino, CNID_INO_LEN);
+	type = htonl(rec.type);
+	memcpy(buf + CNID_TYPE_OFS, &type, CNID_TYPE_LEN);
+	memcpy(buf + CNID_DID_OFS, &rec.did, CNID_DID_LEN);
+	buf[CNID_NAME_OFS + rec.namelen] = '\0';
+
+	*id = rec.did;
+	LOG(log_debug, logtype_cnid,
+	    "cnid_lsm_resolve: resolved did: %u, name: '%s'", ntohl(*id),
+	    buf + CNID_NAME_OFS);
+
+	return buf + CNID_NAME_OFS;
+}
+
+/* ---------------------- */
+int cnid_lsm_getstamp(struct _cnid_db *cdb, void *buffer, const size_t len)
+{
+	struct _cnid_lsm_private *db;
+
+	if (!cdb || !(db = cdb->_private) || len != ADEDLEN_PRIVSYN) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_getstamp: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return -1;
+	}
+	lsm_getstamp(db->db, buffer);
+	return 0;
+}
+
+/* ---------------------- */
+cnid_t cnid_lsm_lookup(struct _cnid_db *cdb, const struct stat *st,
+		       const cnid_t did, char *name, const size_t len)
+{
+	struct _cnid_lsm_private *db;
+	struct lsm_rec rec;
+	cnid_t id;
+	int roflag;
+
+	if (!cdb || !(db = cdb->_private) || !st || !name) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_lookup: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return CNID_INVALID;
+	}
+
+	if (len > MAXPATHLEN) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_lookup: Path name is too long");
+		errno = CNID_ERR_PATH;
+		return CNID_INVALID;
+	}
+
+	if (lsm_bulk(db->db))
+		return CNID_INVALID;
+
+	lsm_makerec(cdb, &rec, CNID_INVALID, st, did, name, len);
+	if ((roflag = lsm_wrlock(db->db)) < 0) {
+		errno = CNID_ERR_DB;
+		return CNID_INVALID;
+	}
+	id = lsm_lookup(db->db, &rec, roflag);
+	if (lsm_unlock(db->db) < 0) {
+		errno = CNID_ERR_DB;
+		id = CNID_INVALID;
+	}
+
+	LOG(log_debug, logtype_cnid,
+	    "cnid_lsm_lookup: DID: %u, name: '%s', inode: 0x%llx: CNID: %u",
+	    ntohl(did), name, (long long) st->st_ino, ntohl(id));
+
+	return id;
+}
+
+/* ---------------------- */
+int cnid_lsm_update(struct _cnid_db *cdb, const cnid_t id,
+		    const struct stat *st, const cnid_t did, char *name,
+		    const size_t len)
+{
+	struct _cnid_lsm_private *db;
+	struct lsm_rec rec;
+	int ret = 0;
+
+	if (!cdb || !(db = cdb->_private) || !id || !st || !name) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_update: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return -1;
+	}
+
+	if (len > MAXPATHLEN) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_update: Path name is too long");
+		errno = CNID_ERR_PATH;
+		return -1;
+	}
+
+	LOG(log_debug, logtype_cnid,
+	    "cnid_lsm_update: CNID: %u, name: '%s', inode: 0x%llx",
+	    ntohl(id), name, (long long) st->st_ino);
+
+	lsm_makerec(cdb, &rec, id, st, did, name, len);
+	if (lsm_lock(db->db, 1) < 0) {
+		errno = CNID_ERR_DB;
+		return -1;
+	}
+	if (lsm_put(db->db, &rec) < 0)
+		ret = -1;
+	if (lsm_unlock(db->db) < 0)
+		ret = -1;
+	if (ret < 0)
+		errno = CNID_ERR_DB;
+
+	return ret;
+}
+
+/* ---------------------- */
+cnid_t cnid_lsm_rebuild_add(struct _cnid_db *cdb, const struct stat *st,
+			    const cnid_t did, char *name, const size_t len,
+			    cnid_t hint)
+{
+	struct _cnid_lsm_private *db;
+	struct lsm_rec rec;
+	cnid_t id = hint;
+
+	if (!cdb || !(db = cdb->_private) || !st || !name
+	    || hint == CNID_INVALID) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_rebuild_add: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return CNID_INVALID;
+	}
+
+	if (len > MAXPATHLEN) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_rebuild_add: Path name is too long");
+		errno = CNID_ERR_PATH;
+		return CNID_INVALID;
+	}
+
+	LOG(log_debug, logtype_cnid,
+	    "cnid_lsm_rebuild_add: CNID: %u, DID: %u, name: '%s'",
+	    ntohl(hint), ntohl(did), name);
+
+	lsm_makerec(cdb, &rec, hint, st, did, name, len);
+	if (lsm_bulk(db->db)) {
+		if (lsm_bulk_add(db->db, &rec) < 0) {
+			errno = CNID_ERR_DB;
+			return CNID_INVALID;
+		}
+		return hint;
+	}
+
+	if (lsm_lock(db->db, 1) < 0) {
+		errno = CNID_ERR_DB;
+		return CNID_INVALID;
+	}
+	if (lsm_put(db->db, &rec) < 0)
+		id = CNID_INVALID;
+	if (lsm_unlock(db->db) < 0)
+		id = CNID_INVALID;
+	if (id == CNID_INVALID)
+		errno = CNID_ERR_DB;
+
+	return id;
+}
+
+/* ---------------------- */
+int cnid_lsm_delete(struct _cnid_db *cdb, const cnid_t id)
+{
+	struct _cnid_lsm_private *db;
+	int ret;
+
+	if (!cdb || !(db = cdb->_private) || !id) {
+		LOG(log_error, logtype_cnid,
+		    "cnid_delete: Parameter error");
+		errno = CNID_ERR_PARAM;
+		return -1;
+	}
+
+	LOG(log_debug, logtype_cnid, "cnid_lsm_delete: delete CNID: %u",
+	    ntohl(id));
+
+	if (lsm_lock(db->db, 1) < 0) {
+		errno = CNID_ERR_DB;
+		return -1;
+	}
+	ret = lsm_del(db->db, id);
+	if (lsm_unlock(db->db) < 0)
+		ret = -1;
+	if (ret < 0) {
+		errno = CNID_ERR_DB;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct _cnid_module cnid_lsm_module = {
+	"lsm",
+	{NULL, NULL},
+	cnid_lsm_open,
+	CNID_FLAG_SETUID | CNID_FLAG_BLOCK
+};
+
+#endif				/* CNID_BACKEND_LSM */
@@ -0,0 +1,44 @@
+/*
+ * interface of the lsm CNID backend, the database in .AppleDB of the
+ * volume is used by the afpd processes themselves, see lsm_store.c.
+ */
+
+#ifndef _ATALK_CNID_LSM__H
+#define _ATALK_CNID_LSM__H 1
+
+#include <sys/cdefs.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <netatalk/endian.h>
+#include <atalk/cnid.h>
+
+#include "lsm_store.h"
+
+struct _cnid_lsm_private {
+	lsm_db *db;
+};
+
+extern struct _cnid_module cnid_lsm_module;
+extern struct _cnid_db *cnid_lsm_open(struct cnid_open_args *args);
+extern void cnid_lsm_close(struct _cnid_db *);
+extern cnid_t cnid_lsm_add(struct _cnid_db *, const struct stat *,
+			   const cnid_t, const char *, const size_t,
+			   cnid_t);
+extern int cnid_lsm_add_batch(struct _cnid_db *, struct cnid_batch *, int);
+extern cnid_t cnid_lsm_get(struct _cnid_db *, const cnid_t, char *,
+			   const size_t);
+extern char *cnid_lsm_resolve(struct _cnid_db *, cnid_t *, void *, size_t);
+extern int cnid_lsm_getstamp(struct _cnid_db *, void *, const size_t);
+extern cnid_t cnid_lsm_lookup(struct _cnid_db *, const struct stat *,
+			      const cnid_t, char *, const size_t);
+extern int cnid_lsm_update(struct _cnid_db *, const cnid_t,
+			   const struct stat *, const cnid_t, char *,
+			   size_t);
+extern int cnid_lsm_delete(struct _cnid_db *, const cnid_t);
+extern cnid_t cnid_lsm_rebuild_add(struct _cnid_db *, const struct stat *,
+				   const cnid_t, char *, const size_t,
+				   cnid_t);
+
+#endif				/* include/atalk/cnid_lsm.h */
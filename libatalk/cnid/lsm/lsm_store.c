@@ -0,0 +1,1948 @@
+/*
+  The store of the lsm CNID backend
+  =================================
+
+  A record is a CNID with device, inode, type, parent DID and name, and
+  there are three ways to find one: by CNID, by DID and name, and by device
+  and inode. The store keeps at most one record per DID/name and per
+  device/inode; lsm_put() takes them away from whoever had them before.
+
+  Files in .AppleDB of the volume:
+
+  cnid.log   appended to by every change, and the lock of the database
+  cnid.lsm   the base run
+  cnid.lsm1  the L1 run, changes since the base was written
+
+  A run is written once and never changed, it's replaced by renaming a new
+  one over it. It has three tables sorted by key, one per way of finding a
+  record:
+
+  CNID       -> device, inode, type, DID, name  (a deleted one without value)
+  DID, name  -> CNID
+  dev, ino   -> CNID
+
+  CNIDs and DIDs are in network byte order, devices and inodes big endian,
+  so memcmp() sorts them by number. A table is a sequence of entries cut
+  into blocks of about LSM_BLOCK bytes followed by the offsets of the
+  blocks. Every entry has three varints, the length of the key prefix it
+  shares with the entry before, the length of the rest of the key and the
+  length of the value, followed by the rest of the key and the value. The
+  first entry of a block shares nothing, so a lookup searches the first
+  keys of the blocks and then decodes one block. The names of a directory
+  share the DID and often the beginning of the name, the inodes of a
+  device share most of their bytes.
+
+  The two index tables aren't changed when a record is, so what they say
+  is checked against the record, the newest one of memory, L1 and base. An
+  entry of a record that changed later is stale and ignored.
+
+  Every process keeps the changes of the log in memory, three hash tables
+  by CNID, DID/name and device/inode. A process takes a read or write
+  fcntl() lock on the log for every operation and first reads whatever the
+  others appended since. Changes are appended in one write() when the
+  write lock is released.
+
+  When the changes in memory reach LSM_MEMMAX, or the log LSM_LOGMAX bytes,
+  the writer merges them with L1 into a new L1, or with L1 and the base
+  into a new base once L1 is a 1/LSM_L1RATIO of the base. Then the log is
+  truncated and its generation counted up. The header of every run has the
+  generation of the log it was merged from, so a process can tell that it
+  has to remap the runs, and after a crash which of the files are current:
+  an L1 older than the base was merged already, as was a log older than
+  the newest run.
+
+  For rebuilds a database can be bulk loaded (LSM_BULK): all records are
+  collected in memory, sorted and written as the new base in one go,
+  without log and merges. The write lock is held from lsm_open() to
+  lsm_close().
+*/
+
+#include "config.h"
+
+#ifdef CNID_BACKEND_LSM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include <atalk/logger.h>
+#include <atalk/cnid.h>
+
+#include "lsm_store.h"
+
+#define LSM_LOGMAGIC   0x434e4c4cU	/* CNLL */
+#define LSM_RUNMAGIC   0x434e4c52U	/* CNLR */
+#define LSM_VERSION    1
+
+#define LSM_LOGHDR     32
+#define LSM_RUNHDR     128
+#define LSM_BLOCK      1024
+#define LSM_MEMMAX     65536	/* records changed before a merge */
+#define LSM_LOGMAX     (8 * 1024 * 1024)
+#define LSM_L1RATIO    4
+
+#define LOG_PUT        1
+#define LOG_DEL        2
+#define LOG_ENTRYHDR   8	/* length, checksum */
+#define LOG_PUTLEN     26	/* op, cnid, dev, ino, type, did */
+
+#define T_ID           0
+#define T_DIDNAME      1
+#define T_DEVINO       2
+#define T_NUM          3
+
+#define RUN_BASE       0
+#define RUN_L1         1
+
+#define KEYMAX         (4 + MAXPATHLEN)	/* DID and name */
+#define VAL_ID         21	/* dev, ino, type, DID, then the name */
+#define VALMAX         (VAL_ID + MAXPATHLEN)
+
+#define NOGEN          ((u_int64_t) -1)
+
+struct table {
+	const unsigned char *data;
+	u_int64_t len;
+	const unsigned char *idx;	/* block offsets */
+	u_int64_t nblocks;
+};
+
+struct run {
+	char *map;
+	size_t size;
+	u_int64_t gen;
+	u_int32_t last;
+	struct table t[T_NUM];
+};
+
+/* a record in memory, a deleted one is only in the CNID hash */
+struct mrec {
+	struct mrec *idnext, *dnnext, *dinext;
+	cnid_t cnid;
+	u_int64_t dev, ino;
+	u_int32_t type;
+	cnid_t did;
+	int deleted;
+	size_t namelen;
+	char name[1];
+};
+
+struct lsm_db {
+	char dir[MAXPATHLEN + 1 - 16];	/* room for the names of the files */
+	mode_t mask;
+	int logfd;
+	int rdonly;
+	int locked;		/* 1 read, 2 write */
+	int bulk;
+	int reload;		/* memory is off, start over at the next lock */
+	u_int64_t gen;		/* of the log replayed */
+	off_t logoff;		/* replayed up to */
+	char stamp[LSM_STAMPLEN];
+	u_int32_t last;		/* highest CNID ever, host order */
+	struct run run[2];
+
+	struct mrec **idtab, **dntab, **ditab;
+	u_int32_t buckets;
+	u_int32_t nmem;
+
+	unsigned char *pend;	/* log entries of this operation */
+	size_t pendlen, pendsize;
+
+	unsigned char *arena;	/* bulk load */
+	size_t arenalen, arenasize;
+	u_int64_t *bulkoff;
+	u_int32_t nbulk, bulkalloc;
+};
+
+/* ------------------------ bytes */
+static void put32(unsigned char *p, u_int32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static u_int32_t get32(const unsigned char *p)
+{
+	return ((u_int32_t) p[0] << 24) | ((u_int32_t) p[1] << 16)
+	    | ((u_int32_t) p[2] << 8) | p[3];
+}
+
+static void put64(unsigned char *p, u_int64_t v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static u_int64_t get64(const unsigned char *p)
+{
+	return ((u_int64_t) get32(p) << 32) | get32(p + 4);
+}
+
+static unsigned char *put_varint(unsigned char *p, u_int32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p,
+				       const unsigned char *end,
+				       u_int32_t * v)
+{
+	u_int32_t r = 0;
+	int shift;
+
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		r |= (u_int32_t) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*v = r;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static int keycmp(const unsigned char *a, size_t alen,
+		  const unsigned char *b, size_t blen)
+{
+	int c;
+
+	if ((c = memcmp(a, b, alen < blen ? alen : blen)) != 0)
+		return c;
+	return alen < blen ? -1 : alen > blen;
+}
+
+static u_int32_t checksum(const unsigned char *p, size_t len)
+{
+	u_int32_t h = 2166136261U;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619U;
+	return h;
+}
+
+/* keys and values as the tables have them */
+static size_t didname_key(unsigned char *key, cnid_t did, const char *name,
+			  size_t namelen)
+{
+	memcpy(key, &did, sizeof(did));
+	memcpy(key + 4, name, namelen);
+	return 4 + namelen;
+}
+
+static size_t devino_key(unsigned char *key, u_int64_t dev, u_int64_t ino)
+{
+	put64(key, dev);
+	put64(key + 8, ino);
+	return 16;
+}
+
+static size_t id_val(unsigned char *val, const struct lsm_rec *rec)
+{
+	put64(val, rec->dev);
+	put64(val + 8, rec->ino);
+	val[16] = rec->type;
+	memcpy(val + 17, &rec->did, sizeof(rec->did));
+	memcpy(val + VAL_ID, rec->name, rec->namelen);
+	return VAL_ID + rec->namelen;
+}
+
+/* ------------------------ reading runs */
+struct entry {
+	unsigned char key[KEYMAX];
+	size_t klen;
+	const unsigned char *val;
+	size_t vlen;
+};
+
+/* the entry at p, whose key shares a prefix with the one in e */
+static const unsigned char *entry_next(const unsigned char *p,
+				       const unsigned char *end,
+				       struct entry *e)
+{
+	u_int32_t shared, rest, vlen;
+
+	if ((p = get_varint(p, end, &shared)) == NULL
+	    || (p = get_varint(p, end, &rest)) == NULL
+	    || (p = get_varint(p, end, &vlen)) == NULL)
+		return NULL;
+	if (shared > e->klen || rest > KEYMAX - shared
+	    || (size_t) (end - p) < (size_t) rest + vlen)
+		return NULL;
+	memcpy(e->key + shared, p, rest);
+	e->klen = shared + rest;
+	e->val = p + rest;
+	e->vlen = vlen;
+	return p + rest + vlen;
+}
+
+static const unsigned char *block_start(const struct table *t, u_int64_t i)
+{
+	return t->data + get64(t->idx + 8 * i);
+}
+
+static const unsigned char *block_end(const struct table *t, u_int64_t i)
+{
+	return i + 1 < t->nblocks ? block_start(t, i + 1) : t->data + t->len;
+}
+
+/*
+ * Find key in table t
+ *
+ * @returns 1 and the entry in e, 0 if it's not there, -1 on garbage
+ */
+static int table_get(const struct table *t, const unsigned char *key,
+		     size_t klen, struct entry *e)
+{
+	const unsigned char *p, *end;
+	u_int64_t lo = 0, hi = t->nblocks, mid;
+	int c;
+
+	if (t->nblocks == 0)
+		return 0;
+
+	/* the last block starting with a key <= key */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		e->klen = 0;
+		if (entry_next(block_start(t, mid), block_end(t, mid), e) ==
+		    NULL)
+			return -1;
+		if (keycmp(e->key, e->klen, key, klen) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	p = block_start(t, lo);
+	end = block_end(t, lo);
+	e->klen = 0;
+	while (p < end) {
+		if ((p = entry_next(p, end, e)) == NULL)
+			return -1;
+		if ((c = keycmp(e->key, e->klen, key, klen)) == 0)
+			return 1;
+		if (c > 0)
+			break;
+	}
+	return 0;
+}
+
+static void run_unmap(struct run *r)
+{
+	if (r->map)
+		munmap(r->map, r->size);
+	memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Map the run in file name
+ *
+ * @returns 1, 0 if there's none, -1 if it's broken
+ */
+static int run_map(lsm_db * db, const char *name, struct run *r)
+{
+	char path[MAXPATHLEN + 1];
+	const unsigned char *h;
+	struct stat st;
+	u_int64_t off, len, n, i, prev;
+	int fd, j;
+
+	memset(r, 0, sizeof(*r));
+	snprintf(path, sizeof(path), "%s/%s", db->dir, name);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		LOG(log_error, logtype_cnid, "lsm: can't open %s: %s", path,
+		    strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < LSM_RUNHDR
+	    || (r->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd,
+			      0)) == MAP_FAILED) {
+		r->map = NULL;
+		close(fd);
+		goto broken;
+	}
+	close(fd);
+	r->size = st.st_size;
+
+	h = (const unsigned char *) r->map;
+	if (get32(h) != LSM_RUNMAGIC || get32(h + 4) != LSM_VERSION)
+		goto broken;
+	r->gen = get64(h + 8);
+	r->last = get32(h + 16);
+	for (j = 0; j < T_NUM; j++) {
+		off = get64(h + 32 + 24 * j);
+		len = get64(h + 40 + 24 * j);
+		n = get64(h + 48 + 24 * j);
+		if (off < LSM_RUNHDR || off > r->size || len > r->size - off
+		    || n > (r->size - off - len) / 8)
+			goto broken;
+		r->t[j].data = h + off;
+		r->t[j].len = len;
+		r->t[j].idx = h + off + len;
+		r->t[j].nblocks = n;
+		for (i = 0, prev = 0; i < n; i++) {
+			off = get64(r->t[j].idx + 8 * i);
+			if (off >= len || (i && off <= prev) || (!i && off))
+				goto broken;
+			prev = off;
+		}
+	}
+	return 1;
+
+      broken:
+	LOG(log_error, logtype_cnid, "lsm: %s is broken", path);
+	run_unmap(r);
+	return -1;
+}
+
+/* ------------------------ memory */
+static u_int32_t hash_id(cnid_t cnid)
+{
+	/* the buckets are the low bits, which are the high ones of cnid */
+	return ntohl(cnid) * 2654435761U;
+}
+
+static u_int32_t hash_didname(cnid_t did, const char *name, size_t len)
+{
+	u_int32_t h = 2166136261U ^ did;
+
+	while (len--)
+		h = (h ^ (unsigned char) *name++) * 16777619U;
+	return h;
+}
+
+static u_int32_t hash_devino(u_int64_t dev, u_int64_t ino)
+{
+	u_int64_t h = (ino ^ (dev << 32) ^ (dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+
+	return h >> 32;
+}
+
+static void mem_link(lsm_db * db, struct mrec *m)
+{
+	u_int32_t mask = db->buckets - 1, h;
+
+	h = hash_id(m->cnid) & mask;
+	m->idnext = db->idtab[h];
+	db->idtab[h] = m;
+	if (m->deleted)
+		return;
+	h = hash_didname(m->did, m->name, m->namelen) & mask;
+	m->dnnext = db->dntab[h];
+	db->dntab[h] = m;
+	h = hash_devino(m->dev, m->ino) & mask;
+	m->dinext = db->ditab[h];
+	db->ditab[h] = m;
+}
+
+/* take a live record out of the DID/name and dev/ino hashes */
+static void mem_unindex(lsm_db * db, struct mrec *m)
+{
+	u_int32_t mask = db->buckets - 1;
+	struct mrec **pp;
+
+	for (pp = &db->dntab[hash_didname(m->did, m->name, m->namelen) & mask];
+	     *pp; pp = &(*pp)->dnnext)
+		if (*pp == m) {
+			*pp = m->dnnext;
+			break;
+		}
+	for (pp = &db->ditab[hash_devino(m->dev, m->ino) & mask]; *pp;
+	     pp = &(*pp)->dinext)
+		if (*pp == m) {
+			*pp = m->dinext;
+			break;
+		}
+}
+
+static int mem_grow(lsm_db * db)
+{
+	struct mrec **id, **dn, **di, *m, *next;
+	u_int32_t n = db->buckets ? 2 * db->buckets : 1024, i, old;
+
+	id = calloc(n, sizeof(*id));
+	dn = calloc(n, sizeof(*dn));
+	di = calloc(n, sizeof(*di));
+	if (!id || !dn || !di) {
+		free(id);
+		free(dn);
+		free(di);
+		return -1;
+	}
+	old = db->buckets;
+	m = NULL;
+	for (i = 0; i < old; i++)
+		for (next = db->idtab[i]; next;) {
+			struct mrec *r = next;
+
+			next = r->idnext;
+			r->idnext = m;
+			m = r;
+		}
+	free(db->idtab);
+	free(db->dntab);
+	free(db->ditab);
+	db->idtab = id;
+	db->dntab = dn;
+	db->ditab = di;
+	db->buckets = n;
+	for (; m; m = next) {
+		next = m->idnext;
+		mem_link(db, m);
+	}
+	return 0;
+}
+
+static void mem_clear(lsm_db * db)
+{
+	struct mrec *m, *next;
+	u_int32_t i;
+
+	for (i = 0; i < db->buckets; i++)
+		for (m = db->idtab[i]; m; m = next) {
+			next = m->idnext;
+			free(m);
+		}
+	free(db->idtab);
+	free(db->dntab);
+	free(db->ditab);
+	db->idtab = db->dntab = db->ditab = NULL;
+	db->buckets = db->nmem = 0;
+}
+
+static struct mrec *mem_id(lsm_db * db, cnid_t cnid)
+{
+	struct mrec *m;
+
+	if (!db->nmem)
+		return NULL;
+	for (m = db->idtab[hash_id(cnid) & (db->buckets - 1)]; m;
+	     m = m->idnext)
+		if (m->cnid == cnid)
+			return m;
+	return NULL;
+}
+
+static struct mrec *mem_didname(lsm_db * db, cnid_t did, const char *name,
+				size_t len)
+{
+	struct mrec *m;
+
+	if (!db->nmem)
+		return NULL;
+	for (m =
+	     db->dntab[hash_didname(did, name, len) & (db->buckets - 1)]; m;
+	     m = m->dnnext)
+		if (m->did == did && m->namelen == len
+		    && !memcmp(m->name, name, len))
+			return m;
+	return NULL;
+}
+
+static struct mrec *mem_devino(lsm_db * db, u_int64_t dev, u_int64_t ino)
+{
+	struct mrec *m;
+
+	if (!db->nmem)
+		return NULL;
+	for (m = db->ditab[hash_devino(dev, ino) & (db->buckets - 1)]; m;
+	     m = m->dinext)
+		if (m->dev == dev && m->ino == ino)
+			return m;
+	return NULL;
+}
+
+/* replace whatever memory has for the CNID, with a deleted record for NULL */
+static int mem_apply(lsm_db * db, cnid_t cnid, const struct lsm_rec *rec)
+{
+	struct mrec *m, **pp;
+	size_t namelen = rec ? rec->namelen : 0;
+
+	if (db->nmem >= db->buckets && mem_grow(db) < 0)
+		return -1;
+
+	for (pp = &db->idtab[hash_id(cnid) & (db->buckets - 1)]; *pp;
+	     pp = &(*pp)->idnext)
+		if ((*pp)->cnid == cnid) {
+			m = *pp;
+			*pp = m->idnext;
+			if (!m->deleted)
+				mem_unindex(db, m);
+			free(m);
+			db->nmem--;
+			break;
+		}
+
+	if ((m = malloc(sizeof(*m) + namelen)) == NULL)
+		return -1;
+	m->cnid = cnid;
+	if (rec) {
+		m->dev = rec->dev;
+		m->ino = rec->ino;
+		m->type = rec->type;
+		m->did = rec->did;
+		m->deleted = 0;
+		memcpy(m->name, rec->name, namelen);
+		if (ntohl(cnid) > db->last)
+			db->last = ntohl(cnid);
+	} else {
+		m->dev = m->ino = 0;
+		m->type = 0;
+		m->did = 0;
+		m->deleted = 1;
+	}
+	m->namelen = namelen;
+	m->name[namelen] = 0;
+	mem_link(db, m);
+	db->nmem++;
+	return 0;
+}
+
+static void mrec_get(const struct mrec *m, struct lsm_rec *rec,
+		     char *namebuf)
+{
+	rec->cnid = m->cnid;
+	rec->dev = m->dev;
+	rec->ino = m->ino;
+	rec->type = m->type;
+	rec->did = m->did;
+	memcpy(namebuf, m->name, m->namelen + 1);
+	rec->name = namebuf;
+	rec->namelen = m->namelen;
+}
+
+/* ------------------------ the current state */
+static int find_id(lsm_db * db, cnid_t cnid, struct lsm_rec *rec,
+		   char *namebuf)
+{
+	struct entry e;
+	struct mrec *m;
+	int i, ret;
+
+	if ((m = mem_id(db, cnid)) != NULL) {
+		if (m->deleted)
+			return 0;
+		mrec_get(m, rec, namebuf);
+		return 1;
+	}
+	for (i = RUN_L1; i >= RUN_BASE; i--) {
+		if (!db->run[i].map)
+			continue;
+		if ((ret =
+		     table_get(&db->run[i].t[T_ID],
+			       (const unsigned char *) &cnid, sizeof(cnid),
+			       &e)) < 0)
+			return -1;
+		if (ret == 0)
+			continue;
+		if (e.vlen == 0)
+			return 0;
+		if (e.vlen < VAL_ID || e.vlen - VAL_ID > MAXPATHLEN)
+			return -1;
+		rec->cnid = cnid;
+		rec->dev = get64(e.val);
+		rec->ino = get64(e.val + 8);
+		rec->type = e.val[16];
+		memcpy(&rec->did, e.val + 17, sizeof(rec->did));
+		rec->namelen = e.vlen - VAL_ID;
+		memcpy(namebuf, e.val + VAL_ID, rec->namelen);
+		namebuf[rec->namelen] = 0;
+		rec->name = namebuf;
+		return 1;
+	}
+	return 0;
+}
+
+/* look key up in the index table t of the runs, rec must still have it */
+static int find_index(lsm_db * db, int t, const unsigned char *key,
+		      size_t klen, struct lsm_rec *rec, char *namebuf)
+{
+	unsigned char k[KEYMAX];
+	struct entry e;
+	cnid_t cnid;
+	int i, ret;
+
+	for (i = RUN_L1; i >= RUN_BASE; i--) {
+		if (!db->run[i].map)
+			continue;
+		if ((ret = table_get(&db->run[i].t[t], key, klen, &e)) < 0)
+			return -1;
+		if (ret == 0 || e.vlen != sizeof(cnid))
+			continue;
+		memcpy(&cnid, e.val, sizeof(cnid));
+		if ((ret = find_id(db, cnid, rec, namebuf)) < 0)
+			return -1;
+		if (ret == 0)
+			continue;
+		if (t == T_DIDNAME)
+			ret = didname_key(k, rec->did, rec->name, rec->namelen);
+		else
+			ret = devino_key(k, rec->dev, rec->ino);
+		if ((size_t) ret == klen && !memcmp(k, key, klen))
+			return 1;
+	}
+	return 0;
+}
+
+static int find_didname(lsm_db * db, cnid_t did, const char *name,
+			size_t namelen, struct lsm_rec *rec, char *namebuf)
+{
+	unsigned char key[KEYMAX];
+	struct mrec *m;
+
+	if ((m = mem_didname(db, did, name, namelen)) != NULL) {
+		mrec_get(m, rec, namebuf);
+		return 1;
+	}
+	return find_index(db, T_DIDNAME, key,
+			  didname_key(key, did, name, namelen), rec, namebuf);
+}
+
+static int find_devino(lsm_db * db, u_int64_t dev, u_int64_t ino,
+		       struct lsm_rec *rec, char *namebuf)
+{
+	unsigned char key[16];
+	struct mrec *m;
+
+	if ((m = mem_devino(db, dev, ino)) != NULL) {
+		mrec_get(m, rec, namebuf);
+		return 1;
+	}
+	return find_index(db, T_DEVINO, key, devino_key(key, dev, ino), rec,
+			  namebuf);
+}
+
+/* ------------------------ the log */
+static int pend_reserve(lsm_db * db, size_t len)
+{
+	unsigned char *p;
+	size_t n;
+
+	if (db->pendlen + len <= db->pendsize)
+		return 0;
+	for (n = db->pendsize ? db->pendsize : 4096; n < db->pendlen + len;
+	     n *= 2);
+	if ((p = realloc(db->pend, n)) == NULL)
+		return -1;
+	db->pend = p;
+	db->pendsize = n;
+	return 0;
+}
+
+/* append a change to the ones of this operation and make it */
+static int log_change(lsm_db * db, cnid_t cnid, const struct lsm_rec *rec)
+{
+	unsigned char *p;
+	size_t len = rec ? LOG_PUTLEN + rec->namelen : 1 + sizeof(cnid);
+
+	if (pend_reserve(db, LOG_ENTRYHDR + len) < 0
+	    || mem_apply(db, cnid, rec) < 0) {
+		db->reload = 1;
+		return -1;
+	}
+	p = db->pend + db->pendlen + LOG_ENTRYHDR;
+	p[0] = rec ? LOG_PUT : LOG_DEL;
+	memcpy(p + 1, &cnid, sizeof(cnid));
+	if (rec) {
+		put64(p + 5, rec->dev);
+		put64(p + 13, rec->ino);
+		p[21] = rec->type;
+		memcpy(p + 22, &rec->did, sizeof(rec->did));
+		memcpy(p + LOG_PUTLEN, rec->name, rec->namelen);
+	}
+	put32(p - LOG_ENTRYHDR, len);
+	put32(p - 4, checksum(p, len));
+	db->pendlen += LOG_ENTRYHDR + len;
+	return 0;
+}
+
+/*
+ * Replay the log from db->logoff to size
+ *
+ * @returns 0, 1 if it ends with garbage, which starts at db->logoff then
+ */
+static int log_replay(lsm_db * db, off_t size)
+{
+	unsigned char *buf, *p, *end;
+	struct lsm_rec rec;
+	u_int32_t len;
+	cnid_t cnid;
+	ssize_t n;
+	int ret = 0;
+
+	if (size <= db->logoff)
+		return 0;
+	if ((buf = malloc(size - db->logoff)) == NULL)
+		return -1;
+	if ((n = pread(db->logfd, buf, size - db->logoff, db->logoff)) < 0) {
+		free(buf);
+		return -1;
+	}
+
+	for (p = buf, end = buf + n; p < end; p += LOG_ENTRYHDR + len) {
+		if (end - p < LOG_ENTRYHDR
+		    || (len = get32(p)) > (size_t) (end - p) - LOG_ENTRYHDR
+		    || len < 1 + sizeof(cnid)
+		    || checksum(p + LOG_ENTRYHDR, len) != get32(p + 4)) {
+			ret = 1;
+			break;
+		}
+		memcpy(&cnid, p + LOG_ENTRYHDR + 1, sizeof(cnid));
+		switch (p[LOG_ENTRYHDR]) {
+		case LOG_PUT:
+			if (len < LOG_PUTLEN || len - LOG_PUTLEN > MAXPATHLEN) {
+				ret = 1;
+				break;
+			}
+			rec.cnid = cnid;
+			rec.dev = get64(p + LOG_ENTRYHDR + 5);
+			rec.ino = get64(p + LOG_ENTRYHDR + 13);
+			rec.type = p[LOG_ENTRYHDR + 21];
+			memcpy(&rec.did, p + LOG_ENTRYHDR + 22, sizeof(rec.did));
+			rec.name = (char *) p + LOG_ENTRYHDR + LOG_PUTLEN;
+			rec.namelen = len - LOG_PUTLEN;
+			if (mem_apply(db, cnid, &rec) < 0)
+				ret = -1;
+			break;
+		case LOG_DEL:
+			if (mem_apply(db, cnid, NULL) < 0)
+				ret = -1;
+			break;
+		default:
+			ret = 1;
+		}
+		if (ret)
+			break;
+		db->logoff += LOG_ENTRYHDR + len;
+	}
+	free(buf);
+	return ret;
+}
+
+static int log_header(lsm_db * db, u_int64_t gen)
+{
+	unsigned char h[LSM_LOGHDR];
+
+	memset(h, 0, sizeof(h));
+	put32(h, LSM_LOGMAGIC);
+	put32(h + 4, LSM_VERSION);
+	put64(h + 8, gen);
+	memcpy(h + 16, db->stamp, LSM_STAMPLEN);
+	if (pwrite(db->logfd, h, sizeof(h), 0) != sizeof(h)) {
+		LOG(log_error, logtype_cnid, "lsm: can't write log: %s",
+		    strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* empty the log, its changes are in the runs of generation gen */
+static int log_reset(lsm_db * db, u_int64_t gen)
+{
+	if (ftruncate(db->logfd, LSM_LOGHDR) < 0 || log_header(db, gen) < 0) {
+		LOG(log_error, logtype_cnid, "lsm: can't reset log: %s",
+		    strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Map the runs, forget the changes in memory
+ *
+ * @returns the generation of the newest run
+ */
+static int reload(lsm_db * db, u_int64_t * gen)
+{
+	run_unmap(&db->run[RUN_BASE]);
+	run_unmap(&db->run[RUN_L1]);
+	mem_clear(db);
+	db->last = CNID_START - 1;
+	*gen = 0;
+
+	if (run_map(db, LSM_BASENAME, &db->run[RUN_BASE]) < 0
+	    || run_map(db, LSM_L1NAME, &db->run[RUN_L1]) < 0)
+		return -1;
+	/* merged into the base already */
+	if (db->run[RUN_L1].map && db->run[RUN_BASE].map
+	    && db->run[RUN_L1].gen < db->run[RUN_BASE].gen)
+		run_unmap(&db->run[RUN_L1]);
+
+	if (db->run[RUN_BASE].map) {
+		*gen = db->run[RUN_BASE].gen;
+		if (db->run[RUN_BASE].last > db->last)
+			db->last = db->run[RUN_BASE].last;
+	}
+	if (db->run[RUN_L1].map) {
+		if (db->run[RUN_L1].gen > *gen)
+			*gen = db->run[RUN_L1].gen;
+		if (db->run[RUN_L1].last > db->last)
+			db->last = db->run[RUN_L1].last;
+	}
+	db->reload = 0;
+	return 0;
+}
+
+static void new_stamp(lsm_db * db)
+{
+	unsigned char s[LSM_STAMPLEN];
+
+	memset(s, 0, sizeof(s));
+	put32(s, time(NULL));
+	put32(s + 4, getpid() ^ (u_int32_t) clock());
+	memcpy(db->stamp, s, sizeof(db->stamp));
+}
+
+/* read what the others did since, with the lock held */
+static int catch_up(lsm_db * db)
+{
+	unsigned char h[LSM_LOGHDR];
+	u_int64_t loggen, rungen;
+	struct stat st;
+	int ret;
+
+	if (db->logfd < 0) {
+		/* a read-only database without a log */
+		if (db->gen == NOGEN && reload(db, &rungen) < 0)
+			return -1;
+		db->gen = 0;
+		return 0;
+	}
+
+	if (fstat(db->logfd, &st) < 0)
+		return -1;
+	if (st.st_size < LSM_LOGHDR) {
+		/* a new log, its generation is the one of the runs */
+		if (reload(db, &rungen) < 0)
+			return -1;
+		if (db->run[RUN_BASE].map)
+			memcpy(db->stamp, db->run[RUN_BASE].map + 24,
+			       LSM_STAMPLEN);
+		else
+			new_stamp(db);
+		if (db->locked == 2 && log_reset(db, rungen) < 0)
+			return -1;
+		db->gen = rungen;
+		db->logoff = LSM_LOGHDR;
+		return 0;
+	}
+
+	if (pread(db->logfd, h, sizeof(h), 0) != sizeof(h)
+	    || get32(h) != LSM_LOGMAGIC || get32(h + 4) != LSM_VERSION) {
+		LOG(log_error, logtype_cnid, "lsm: %s/%s is broken", db->dir,
+		    LSM_LOGNAME);
+		return -1;
+	}
+	loggen = get64(h + 8);
+
+	if (db->reload || loggen != db->gen) {
+		if (reload(db, &rungen) < 0)
+			return -1;
+		memcpy(db->stamp, h + 16, LSM_STAMPLEN);
+		db->gen = loggen;
+		db->logoff = LSM_LOGHDR;
+		if (loggen < rungen) {
+			/* a merge didn't get to resetting the log */
+			if (db->locked == 2) {
+				if (log_reset(db, rungen) < 0)
+					return -1;
+				db->gen = rungen;
+			} else {
+				db->logoff = st.st_size;
+			}
+			return 0;
+		}
+	}
+
+	if ((ret = log_replay(db, st.st_size)) < 0) {
+		db->reload = 1;
+		return -1;
+	}
+	if (ret && db->locked == 2) {
+		/* torn by a crash, the rest can't be trusted */
+		LOG(log_warning, logtype_cnid,
+		    "lsm: dropping garbage at the end of %s/%s", db->dir,
+		    LSM_LOGNAME);
+		if (ftruncate(db->logfd, db->logoff) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* ------------------------ writing runs */
+struct wbuf {
+	int fd;
+	unsigned char *buf;
+	size_t len, size;
+	u_int64_t off;		/* in the file */
+	int err;
+};
+
+static void wb_write(struct wbuf *w, const void *p, size_t len)
+{
+	size_t n;
+
+	while (len && !w->err) {
+		if (w->len == w->size) {
+			if (write(w->fd, w->buf, w->len) != (ssize_t) w->len) {
+				w->err = errno ? errno : EIO;
+				return;
+			}
+			w->len = 0;
+		}
+		n = w->size - w->len < len ? w->size - w->len : len;
+		memcpy(w->buf + w->len, p, n);
+		w->len += n;
+		w->off += n;
+		p = (const char *) p + n;
+		len -= n;
+	}
+}
+
+static void wb_flush(struct wbuf *w)
+{
+	if (!w->err && w->len
+	    && write(w->fd, w->buf, w->len) != (ssize_t) w->len)
+		w->err = errno ? errno : EIO;
+	w->len = 0;
+}
+
+struct tw {
+	struct wbuf *w;
+	u_int64_t start;	/* of the table in the file */
+	u_int64_t block;	/* start of the current block in the table */
+	unsigned char last[KEYMAX];
+	size_t lastlen;
+	u_int64_t *idx;
+	u_int64_t nblocks, idxalloc;
+};
+
+static void tw_begin(struct tw *t, struct wbuf *w)
+{
+	memset(t, 0, sizeof(*t));
+	t->w = w;
+	t->start = w->off;
+}
+
+static void tw_add(struct tw *t, const unsigned char *key, size_t klen,
+		   const unsigned char *val, size_t vlen)
+{
+	unsigned char hdr[15], *p;
+	u_int64_t pos = t->w->off - t->start, *idx;
+	size_t shared = 0;
+
+	if (t->nblocks == 0 || pos - t->block >= LSM_BLOCK) {
+		if (t->nblocks == t->idxalloc) {
+			t->idxalloc = t->idxalloc ? 2 * t->idxalloc : 256;
+			if ((idx =
+			     realloc(t->idx,
+				     t->idxalloc * sizeof(*idx))) == NULL) {
+				t->w->err = ENOMEM;
+				return;
+			}
+			t->idx = idx;
+		}
+		t->idx[t->nblocks++] = pos;
+		t->block = pos;
+	} else {
+		while (shared < klen && shared < t->lastlen
+		       && key[shared] == t->last[shared])
+			shared++;
+	}
+	p = put_varint(hdr, shared);
+	p = put_varint(p, klen - shared);
+	p = put_varint(p, vlen);
+	wb_write(t->w, hdr, p - hdr);
+	wb_write(t->w, key + shared, klen - shared);
+	wb_write(t->w, val, vlen);
+	memcpy(t->last, key, klen);
+	t->lastlen = klen;
+}
+
+/* the block offsets after the entries, the table into the run header h */
+static void tw_end(struct tw *t, unsigned char *h)
+{
+	unsigned char b[8];
+	u_int64_t len = t->w->off - t->start, i;
+
+	for (i = 0; i < t->nblocks; i++) {
+		put64(b, t->idx[i]);
+		wb_write(t->w, b, 8);
+	}
+	put64(h, t->start);
+	put64(h + 8, len);
+	put64(h + 16, t->nblocks);
+	free(t->idx);
+	t->idx = NULL;
+}
+
+struct newrun {
+	char tmp[MAXPATHLEN + 1];
+	struct wbuf w;
+	unsigned char h[LSM_RUNHDR];
+	struct tw t;
+	int tn;
+};
+
+static int newrun_begin(lsm_db * db, struct newrun *nr)
+{
+	static unsigned char buf[256 * 1024];
+
+	memset(nr, 0, sizeof(*nr));
+	snprintf(nr->tmp, sizeof(nr->tmp), "%s/cnid.XXXXXX", db->dir);
+	if ((nr->w.fd = mkstemp(nr->tmp)) < 0) {
+		LOG(log_error, logtype_cnid, "lsm: can't create %s: %s",
+		    nr->tmp, strerror(errno));
+		return -1;
+	}
+	fchmod(nr->w.fd, 0666 & ~db->mask);
+	nr->w.buf = buf;
+	nr->w.size = sizeof(buf);
+	wb_write(&nr->w, nr->h, sizeof(nr->h));
+	return 0;
+}
+
+static void newrun_table(struct newrun *nr)
+{
+	if (nr->tn)
+		tw_end(&nr->t, nr->h + 32 + 24 * (nr->tn - 1));
+	if (nr->tn < T_NUM)
+		tw_begin(&nr->t, &nr->w);
+	nr->tn++;
+}
+
+static void newrun_abort(struct newrun *nr)
+{
+	free(nr->t.idx);
+	close(nr->w.fd);
+	unlink(nr->tmp);
+}
+
+/* header, sync and rename to name */
+static int newrun_end(lsm_db * db, struct newrun *nr, const char *name,
+		      u_int64_t gen)
+{
+	char path[MAXPATHLEN + 1];
+
+	newrun_table(nr);
+	wb_flush(&nr->w);
+	put32(nr->h, LSM_RUNMAGIC);
+	put32(nr->h + 4, LSM_VERSION);
+	put64(nr->h + 8, gen);
+	put32(nr->h + 16, db->last);
+	memcpy(nr->h + 24, db->stamp, LSM_STAMPLEN);
+	if (!nr->w.err
+	    && pwrite(nr->w.fd, nr->h, sizeof(nr->h), 0) != sizeof(nr->h))
+		nr->w.err = errno ? errno : EIO;
+	if (!nr->w.err && fsync(nr->w.fd) < 0)
+		nr->w.err = errno;
+	snprintf(path, sizeof(path), "%s/%s", db->dir, name);
+	if (!nr->w.err && rename(nr->tmp, path) < 0)
+		nr->w.err = errno;
+	if (nr->w.err) {
+		LOG(log_error, logtype_cnid, "lsm: can't write %s: %s", path,
+		    strerror(nr->w.err));
+		newrun_abort(nr);
+		return -1;
+	}
+	close(nr->w.fd);
+	return 0;
+}
+
+/* ------------------------ merging */
+
+/* a sorted stream of entries of one table */
+struct src {
+	int eof;
+	const unsigned char *key;
+	size_t klen;
+	const unsigned char *val;
+	size_t vlen;
+
+	/* a table of a run */
+	const unsigned char *p, *end;
+	struct entry e;
+	const unsigned char *skip;	/* bitmap of CNIDs whose entries are stale */
+	u_int32_t skipmax;
+
+	/* records in memory */
+	struct mrec **m;
+	size_t nm, i;
+	int t;
+	unsigned char kbuf[KEYMAX];
+	unsigned char vbuf[VALMAX];
+};
+
+static int skipped(const unsigned char *skip, u_int32_t max, cnid_t cnid)
+{
+	u_int32_t id = ntohl(cnid);
+
+	return skip && id <= max && (skip[id >> 3] & (1 << (id & 7)));
+}
+
+static void src_next(struct src *s)
+{
+	struct lsm_rec rec;
+	struct mrec *m;
+	cnid_t cnid;
+
+	if (s->m) {
+		if (s->i == s->nm) {
+			s->eof = 1;
+			return;
+		}
+		m = s->m[s->i++];
+		s->key = s->kbuf;
+		s->val = s->vbuf;
+		switch (s->t) {
+		case T_ID:
+			memcpy(s->kbuf, &m->cnid, sizeof(m->cnid));
+			s->klen = sizeof(m->cnid);
+			if (m->deleted) {
+				s->vlen = 0;
+				break;
+			}
+			rec.dev = m->dev;
+			rec.ino = m->ino;
+			rec.type = m->type;
+			rec.did = m->did;
+			rec.name = m->name;
+			rec.namelen = m->namelen;
+			s->vlen = id_val(s->vbuf, &rec);
+			break;
+		case T_DIDNAME:
+			s->klen =
+			    didname_key(s->kbuf, m->did, m->name, m->namelen);
+			memcpy(s->vbuf, &m->cnid, sizeof(m->cnid));
+			s->vlen = sizeof(m->cnid);
+			break;
+		default:
+			s->klen = devino_key(s->kbuf, m->dev, m->ino);
+			memcpy(s->vbuf, &m->cnid, sizeof(m->cnid));
+			s->vlen = sizeof(m->cnid);
+		}
+		return;
+	}
+
+	while (s->p && s->p < s->end) {
+		if ((s->p = entry_next(s->p, s->end, &s->e)) == NULL)
+			break;
+		s->key = s->e.key;
+		s->klen = s->e.klen;
+		s->val = s->e.val;
+		s->vlen = s->e.vlen;
+		if (s->skip && s->vlen == sizeof(cnid)) {
+			memcpy(&cnid, s->val, sizeof(cnid));
+			if (skipped(s->skip, s->skipmax, cnid))
+				continue;
+		}
+		return;
+	}
+	s->eof = 1;
+}
+
+static void src_table(struct src *s, const struct run *r, int t,
+		      const unsigned char *skip, u_int32_t skipmax)
+{
+	memset(s, 0, sizeof(*s));
+	if (r && r->map) {
+		s->p = r->t[t].data;
+		s->end = r->t[t].data + r->t[t].len;
+		s->skip = skip;
+		s->skipmax = skipmax;
+	}
+	src_next(s);
+}
+
+static void src_mem(struct src *s, struct mrec **m, size_t n, int t)
+{
+	memset(s, 0, sizeof(*s));
+	s->m = m;
+	s->nm = n;
+	s->t = t;
+	src_next(s);
+}
+
+/*
+ * Merge the streams into the table being written, the first one wins
+ * if they have the same key
+ *
+ * @returns the entries written
+ */
+static u_int64_t merge(struct tw *t, struct src **s, int n, int tombstones)
+{
+	u_int64_t count = 0;
+	int i, min;
+
+	for (;;) {
+		for (min = -1, i = 0; i < n; i++)
+			if (!s[i]->eof
+			    && (min < 0
+				|| keycmp(s[i]->key, s[i]->klen, s[min]->key,
+					  s[min]->klen) < 0))
+				min = i;
+		if (min < 0 || t->w->err)
+			break;
+		if (s[min]->vlen || tombstones) {
+			tw_add(t, s[min]->key, s[min]->klen, s[min]->val,
+			       s[min]->vlen);
+			count++;
+		}
+		for (i = n - 1; i >= 0; i--)
+			if (i != min && !s[i]->eof
+			    && keycmp(s[i]->key, s[i]->klen, s[min]->key,
+				      s[min]->klen) == 0)
+				src_next(s[i]);
+		src_next(s[min]);
+	}
+	return count;
+}
+
+static int cmp_id(const void *a, const void *b)
+{
+	cnid_t x = ntohl((*(struct mrec * const *) a)->cnid);
+	cnid_t y = ntohl((*(struct mrec * const *) b)->cnid);
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_didname(const void *a, const void *b)
+{
+	const struct mrec *x = *(struct mrec * const *) a;
+	const struct mrec *y = *(struct mrec * const *) b;
+	int c;
+
+	if ((c = memcmp(&x->did, &y->did, sizeof(x->did))) != 0)
+		return c;
+	return keycmp((const unsigned char *) x->name, x->namelen,
+		      (const unsigned char *) y->name, y->namelen);
+}
+
+static int cmp_devino(const void *a, const void *b)
+{
+	const struct mrec *x = *(struct mrec * const *) a;
+	const struct mrec *y = *(struct mrec * const *) b;
+
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static void skip_set(unsigned char *skip, cnid_t cnid)
+{
+	u_int32_t id = ntohl(cnid);
+
+	skip[id >> 3] |= 1 << (id & 7);
+}
+
+/*
+ * Merge the changes in memory into a new L1, or with L1 into a new base
+ */
+static int compact(lsm_db * db)
+{
+	struct mrec **all, **live, *m;
+	unsigned char *memskip = NULL, *l1skip = NULL;
+	struct src mem, l1, base, *s[3];
+	struct run *b = &db->run[RUN_BASE], *l = &db->run[RUN_L1];
+	struct newrun nr;
+	u_int64_t gen = db->gen + 1;
+	size_t nall = 0, nlive = 0, skiplen;
+	u_int32_t i;
+	int full, ret = -1;
+	struct entry e;
+	const unsigned char *p, *end;
+	cnid_t cnid;
+
+	full = !b->map
+	    || ((u_int64_t) l->size + (u_int64_t) db->nmem * 64) *
+	    LSM_L1RATIO >= b->size;
+
+	LOG(log_debug, logtype_cnid,
+	    "lsm: merging %u changes into a new %s", db->nmem,
+	    full ? "base" : "L1");
+
+	all = malloc((db->nmem + 1) * sizeof(*all));
+	live = malloc((db->nmem + 1) * sizeof(*live));
+	skiplen = db->last / 8 + 1;
+	memskip = calloc(1, skiplen);
+	if (full && l->map)
+		l1skip = calloc(1, skiplen);
+	if (!all || !live || !memskip || (full && l->map && !l1skip))
+		goto exit;
+
+	for (i = 0; i < db->buckets; i++)
+		for (m = db->idtab[i]; m; m = m->idnext) {
+			all[nall++] = m;
+			if (!m->deleted)
+				live[nlive++] = m;
+			skip_set(memskip, m->cnid);
+		}
+	if (l1skip) {
+		/* entries in the base of anything in L1 or memory are stale */
+		memcpy(l1skip, memskip, skiplen);
+		p = l->t[T_ID].data;
+		end = p + l->t[T_ID].len;
+		e.klen = 0;
+		while (p < end && (p = entry_next(p, end, &e)) != NULL)
+			if (e.klen == sizeof(cnid)) {
+				memcpy(&cnid, e.key, sizeof(cnid));
+				if (ntohl(cnid) <= db->last)
+					skip_set(l1skip, cnid);
+			}
+	}
+
+	if (newrun_begin(db, &nr) < 0)
+		goto exit;
+	s[0] = &mem;
+	s[1] = &l1;
+	s[2] = &base;
+
+	newrun_table(&nr);
+	qsort(all, nall, sizeof(*all), cmp_id);
+	src_mem(&mem, all, nall, T_ID);
+	src_table(&l1, l, T_ID, NULL, 0);
+	src_table(&base, full ? b : NULL, T_ID, NULL, 0);
+	merge(&nr.t, s, 3, !full);
+
+	newrun_table(&nr);
+	qsort(live, nlive, sizeof(*live), cmp_didname);
+	src_mem(&mem, live, nlive, T_DIDNAME);
+	src_table(&l1, l, T_DIDNAME, memskip, db->last);
+	src_table(&base, full ? b : NULL, T_DIDNAME, l1skip ? l1skip : memskip,
+		  db->last);
+	merge(&nr.t, s, 3, 0);
+
+	newrun_table(&nr);
+	qsort(live, nlive, sizeof(*live), cmp_devino);
+	src_mem(&mem, live, nlive, T_DEVINO);
+	src_table(&l1, l, T_DEVINO, memskip, db->last);
+	src_table(&base, full ? b : NULL, T_DEVINO, l1skip ? l1skip : memskip,
+		  db->last);
+	merge(&nr.t, s, 3, 0);
+
+	if (newrun_end(db, &nr, full ? LSM_BASENAME : LSM_L1NAME, gen) < 0)
+		goto exit;
+	if (full) {
+		char path[MAXPATHLEN + 1];
+
+		snprintf(path, sizeof(path), "%s/%s", db->dir, LSM_L1NAME);
+		unlink(path);
+	}
+	if (log_reset(db, gen) < 0)
+		goto exit;
+	db->logoff = LSM_LOGHDR;
+	ret = 0;
+
+      exit:
+	free(all);
+	free(live);
+	free(memskip);
+	free(l1skip);
+	/* start over with the new runs */
+	db->reload = 1;
+	return ret;
+}
+
+
+/* ------------------------ bulk load */
+
+/*
+ * A record of a bulk load in the arena is the length of the name as 2 bytes,
+ * the CNID and the value of the CNID table. bulkoff has the offset of the
+ * CNID, the DID and name after the inode are the DID/name key.
+ */
+static const unsigned char *bulk_arena;
+static int bulk_table;		/* qsort() has no argument */
+
+static size_t bulk_namelen(const unsigned char *r)
+{
+	return ((size_t) r[-2] << 8) | r[-1];
+}
+
+static const unsigned char *bulk_key(const unsigned char *r, int t,
+				     size_t * klen)
+{
+	switch (t) {
+	case T_ID:
+		*klen = 4;
+		return r;
+	case T_DIDNAME:
+		*klen = 4 + bulk_namelen(r);
+		return r + 4 + 17;
+	default:
+		*klen = 16;
+		return r + 4;
+	}
+}
+
+static int bulk_cmp(const u_int64_t * off, u_int32_t x, u_int32_t y, int t)
+{
+	const unsigned char *a, *b;
+	size_t alen, blen;
+	int c;
+
+	a = bulk_key(bulk_arena + off[x], t, &alen);
+	b = bulk_key(bulk_arena + off[y], t, &blen);
+	if ((c = keycmp(a, alen, b, blen)) != 0)
+		return c;
+	/* the earlier one of two first */
+	return x < y ? -1 : x > y;
+}
+
+static const u_int64_t *bulk_off;
+
+static int bulk_qcmp(const void *a, const void *b)
+{
+	return bulk_cmp(bulk_off, *(const u_int32_t *) a,
+			*(const u_int32_t *) b, bulk_table);
+}
+
+/*!
+ * Add a record to a bulk load. If two have the same CNID, DID/name or
+ * dev/ino, the one added first is dropped.
+ *
+ * @returns 0, -1 on error
+ */
+int lsm_bulk_add(lsm_db * db, const struct lsm_rec *rec)
+{
+	size_t len = 2 + 4 + VAL_ID + rec->namelen, n;
+	unsigned char *p;
+	u_int64_t *off;
+
+	if (!db->bulk || rec->namelen > MAXPATHLEN
+	    || rec->cnid == CNID_INVALID || db->nbulk == 0xffffffffU) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (db->arenalen + len > db->arenasize) {
+		for (n = db->arenasize ? db->arenasize : 1024 * 1024;
+		     n < db->arenalen + len; n *= 2);
+		if ((p = realloc(db->arena, n)) == NULL)
+			return -1;
+		db->arena = p;
+		db->arenasize = n;
+	}
+	if (db->nbulk == db->bulkalloc) {
+		n = db->bulkalloc ? 2 * (size_t) db->bulkalloc : 65536;
+		if (n > 0xffffffffU)
+			n = 0xffffffffU;
+		if ((off = realloc(db->bulkoff, n * sizeof(*off))) == NULL)
+			return -1;
+		db->bulkoff = off;
+		db->bulkalloc = n;
+	}
+
+	p = db->arena + db->arenalen;
+	p[0] = rec->namelen >> 8;
+	p[1] = rec->namelen;
+	memcpy(p + 2, &rec->cnid, sizeof(rec->cnid));
+	id_val(p + 6, rec);
+	db->bulkoff[db->nbulk++] = db->arenalen + 2;
+	db->arenalen += len;
+	if (ntohl(rec->cnid) > db->last)
+		db->last = ntohl(rec->cnid);
+	return 0;
+}
+
+/* sort what was added and write it as the new base */
+static int bulk_write(lsm_db * db)
+{
+	u_int32_t *perm[T_NUM], n = db->nbulk, i;
+	unsigned char *dead;
+	const unsigned char *r, *key;
+	struct newrun nr;
+	u_int64_t gen = db->gen + 1;
+	size_t klen;
+	int t, sorted, ret = -1;
+
+	LOG(log_info, logtype_cnid, "lsm: loading %u records into %s", n,
+	    db->dir);
+
+	memset(perm, 0, sizeof(perm));
+	if ((dead = calloc(1, n / 8 + 1)) == NULL)
+		goto exit;
+	bulk_arena = db->arena;
+	bulk_off = db->bulkoff;
+
+	/* every table sorted, a record loses against a later one with its key */
+	for (t = 0; t < T_NUM; t++) {
+		if ((perm[t] = malloc((n + 1) * sizeof(u_int32_t))) == NULL)
+			goto exit;
+		for (i = 0, sorted = 1; i < n; i++) {
+			perm[t][i] = i;
+			if (i && sorted
+			    && bulk_cmp(db->bulkoff, i - 1, i, t) > 0)
+				sorted = 0;
+		}
+		if (!sorted) {
+			bulk_table = t;
+			qsort(perm[t], n, sizeof(u_int32_t), bulk_qcmp);
+		}
+		for (i = 0; i + 1 < n; i++) {
+			size_t alen, blen;
+			const unsigned char *a, *b;
+
+			a = bulk_key(db->arena + db->bulkoff[perm[t][i]], t,
+				     &alen);
+			b = bulk_key(db->arena + db->bulkoff[perm[t][i + 1]],
+				     t, &blen);
+			if (alen == blen && !memcmp(a, b, alen))
+				dead[perm[t][i] >> 3] |= 1 << (perm[t][i] & 7);
+		}
+	}
+
+	if (newrun_begin(db, &nr) < 0)
+		goto exit;
+	for (t = 0; t < T_NUM; t++) {
+		newrun_table(&nr);
+		for (i = 0; i < n && !nr.w.err; i++) {
+			if (dead[perm[t][i] >> 3] & (1 << (perm[t][i] & 7)))
+				continue;
+			r = db->arena + db->bulkoff[perm[t][i]];
+			key = bulk_key(r, t, &klen);
+			if (t == T_ID)
+				tw_add(&nr.t, key, klen, r + 4,
+				       VAL_ID + bulk_namelen(r));
+			else
+				tw_add(&nr.t, key, klen, r, 4);
+		}
+	}
+	if (newrun_end(db, &nr, LSM_BASENAME, gen) < 0)
+		goto exit;
+	ret = 0;
+
+      exit:
+	if (ret == 0) {
+		char path[MAXPATHLEN + 1];
+
+		snprintf(path, sizeof(path), "%s/%s", db->dir, LSM_L1NAME);
+		unlink(path);
+		ret = log_reset(db, gen);
+	} else {
+		LOG(log_error, logtype_cnid, "lsm: bulk load of %s failed",
+		    db->dir);
+	}
+	for (t = 0; t < T_NUM; t++)
+		free(perm[t]);
+	free(dead);
+	free(db->arena);
+	free(db->bulkoff);
+	db->arena = NULL;
+	db->bulkoff = NULL;
+	db->arenalen = db->arenasize = 0;
+	db->nbulk = db->bulkalloc = 0;
+	db->reload = 1;
+	return ret;
+}
+
+/* ------------------------ interface */
+
+static int setlock(lsm_db * db, int type)
+{
+	struct flock fl;
+
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;
+	while (fcntl(db->logfd, type == F_UNLCK ? F_SETLK : F_SETLKW, &fl) <
+	       0) {
+		if (errno != EINTR) {
+			LOG(log_error, logtype_cnid, "lsm: can't lock %s: %s",
+			    db->dir, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*!
+ * Open the database in .AppleDB of volpath, create it if there's none
+ */
+lsm_db *lsm_open(const char *volpath, mode_t mask, int flags)
+{
+	char path[MAXPATHLEN + 1];
+	lsm_db *db;
+
+	if ((db = calloc(1, sizeof(*db))) == NULL)
+		return NULL;
+	db->mask = mask;
+	db->gen = NOGEN;
+	db->logfd = -1;
+
+	if ((size_t) snprintf(db->dir, sizeof(db->dir), "%s/%s", volpath,
+			      LSM_DIRNAME) >= sizeof(db->dir)
+	    || (size_t) snprintf(path, sizeof(path), "%s/%s", db->dir,
+				 LSM_LOGNAME) >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		goto fail;
+	}
+	if (mkdir(db->dir, 0777 & ~mask) < 0 && errno != EEXIST
+	    && errno != EROFS && errno != EACCES) {
+		LOG(log_error, logtype_cnid, "lsm: can't create %s: %s",
+		    db->dir, strerror(errno));
+		goto fail;
+	}
+
+	if ((db->logfd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666)) >= 0) {
+		fchmod(db->logfd, 0666 & ~mask);
+	} else if (errno == EEXIST) {
+		db->logfd = open(path, O_RDWR);
+	}
+	if (db->logfd < 0) {
+		if (errno != EACCES && errno != EROFS) {
+			LOG(log_error, logtype_cnid, "lsm: can't open %s: %s",
+			    path, strerror(errno));
+			goto fail;
+		}
+		/* read-only, without a log if there is none */
+		db->rdonly = 1;
+		if ((db->logfd = open(path, O_RDONLY)) < 0 && errno != ENOENT) {
+			LOG(log_error, logtype_cnid, "lsm: can't open %s: %s",
+			    path, strerror(errno));
+			goto fail;
+		}
+	}
+
+	if ((flags & LSM_BULK)) {
+		if (db->rdonly) {
+			errno = EROFS;
+			goto fail;
+		}
+		if (lsm_lock(db, 1) < 0)
+			goto fail;
+		db->bulk = 1;
+	} else if (!db->rdonly) {
+		/* sets up a new log, with the stamp of the database */
+		if (lsm_lock(db, 1) < 0 || lsm_unlock(db) < 0)
+			goto fail;
+	}
+	return db;
+
+      fail:
+	if (db->logfd >= 0)
+		close(db->logfd);
+	free(db);
+	return NULL;
+}
+
+/*!
+ * Close the database, a bulk load is written now
+ *
+ * @returns 0, -1 if the bulk load failed
+ */
+int lsm_close(lsm_db * db)
+{
+	int ret = 0;
+
+	if (db->bulk) {
+		ret = bulk_write(db);
+		db->bulk = 0;
+	}
+	if (db->locked)
+		lsm_unlock(db);
+	run_unmap(&db->run[RUN_BASE]);
+	run_unmap(&db->run[RUN_L1]);
+	mem_clear(db);
+	free(db->pend);
+	if (db->logfd >= 0)
+		close(db->logfd);
+	free(db);
+	return ret;
+}
+
+/*!
+ * Lock the database for reading or writing, and catch up with the others
+ */
+int lsm_lock(lsm_db * db, int write)
+{
+	if (db->bulk)
+		return 0;
+	if (write && db->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if (db->logfd >= 0 && setlock(db, write ? F_WRLCK : F_RDLCK) < 0)
+		return -1;
+	db->locked = write ? 2 : 1;
+	db->pendlen = 0;
+	if (catch_up(db) < 0) {
+		LOG(log_error, logtype_cnid, "lsm: can't read %s", db->dir);
+		lsm_unlock(db);
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Append the changes to the log and unlock, merge them if it's time
+ *
+ * @returns 0, -1 if the changes didn't make it to the log
+ */
+int lsm_unlock(lsm_db * db)
+{
+	int ret = 0;
+
+	if (db->bulk || !db->locked)
+		return 0;
+
+	if (db->pendlen) {
+		if (pwrite(db->logfd, db->pend, db->pendlen, db->logoff) !=
+		    (ssize_t) db->pendlen) {
+			LOG(log_error, logtype_cnid,
+			    "lsm: can't write %s/%s: %s", db->dir,
+			    LSM_LOGNAME, strerror(errno));
+			db->reload = 1;
+			ret = -1;
+		} else {
+			db->logoff += db->pendlen;
+			if (db->nmem >= LSM_MEMMAX || db->logoff >= LSM_LOGMAX)
+				compact(db);
+		}
+		db->pendlen = 0;
+	}
+
+	if (db->logfd >= 0)
+		setlock(db, F_UNLCK);
+	db->locked = 0;
+	return ret;
+}
+
+/*!
+ * The record with CNID cnid
+ *
+ * @param rec     (w) the record, its name in namebuf
+ * @param namebuf (w) MAXPATHLEN + 1 bytes
+ *
+ * @returns 1, 0 if there's none, -1 on error
+ */
+int lsm_get_id(lsm_db * db, cnid_t cnid, struct lsm_rec *rec,
+	       char *namebuf)
+{
+	if (db->bulk)
+		return 0;
+	return find_id(db, cnid, rec, namebuf);
+}
+
+/*!
+ * The record of the object name in the directory did, see lsm_get_id()
+ */
+int lsm_get_didname(lsm_db * db, cnid_t did, const char *name,
+		    size_t namelen, struct lsm_rec *rec, char *namebuf)
+{
+	if (db->bulk || namelen > MAXPATHLEN)
+		return 0;
+	return find_didname(db, did, name, namelen, rec, namebuf);
+}
+
+/*!
+ * The record of the object with device dev and inode ino, see lsm_get_id()
+ */
+int lsm_get_devino(lsm_db * db, u_int64_t dev, u_int64_t ino,
+		   struct lsm_rec *rec, char *namebuf)
+{
+	if (db->bulk)
+		return 0;
+	return find_devino(db, dev, ino, rec, namebuf);
+}
+
+/*!
+ * Add or replace the record with rec's CNID. Records with its DID/name or
+ * dev/ino are deleted.
+ *
+ * @returns 0, -1 on error
+ */
+int lsm_put(lsm_db * db, const struct lsm_rec *rec)
+{
+	char namebuf[MAXPATHLEN + 1];
+	struct lsm_rec cur;
+	int ret;
+
+	if (db->bulk)
+		return lsm_bulk_add(db, rec);
+	if (db->locked != 2 || rec->namelen > MAXPATHLEN
+	    || rec->cnid == CNID_INVALID) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((ret =
+	     find_didname(db, rec->did, rec->name, rec->namelen, &cur,
+			  namebuf)) < 0)
+		return -1;
+	if (ret && cur.cnid != rec->cnid
+	    && log_change(db, cur.cnid, NULL) < 0)
+		return -1;
+	if ((ret = find_devino(db, rec->dev, rec->ino, &cur, namebuf)) < 0)
+		return -1;
+	if (ret && cur.cnid != rec->cnid
+	    && log_change(db, cur.cnid, NULL) < 0)
+		return -1;
+	return log_change(db, rec->cnid, rec);
+}
+
+/*!
+ * Delete the record with CNID cnid
+ *
+ * @returns 1, 0 if there's none, -1 on error
+ */
+int lsm_del(lsm_db * db, cnid_t cnid)
+{
+	char namebuf[MAXPATHLEN + 1];
+	struct lsm_rec cur;
+	int ret;
+
+	if (db->bulk || db->locked != 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((ret = find_id(db, cnid, &cur, namebuf)) <= 0)
+		return ret;
+	if (log_change(db, cnid, NULL) < 0)
+		return -1;
+	return 1;
+}
+
+/*!
+ * A CNID that was never used, CNID_INVALID if there are none left
+ */
+cnid_t lsm_nextid(lsm_db * db)
+{
+	if (db->last == 0xffffffffU)
+		return CNID_INVALID;
+	return htonl(++db->last);
+}
+
+/*!
+ * The stamp of the database, a new database has a new one
+ */
+void lsm_getstamp(lsm_db * db, char *stamp)
+{
+	memcpy(stamp, db->stamp, LSM_STAMPLEN);
+}
+
+/*!
+ * Is this a bulk load?
+ */
+int lsm_bulk(lsm_db * db)
+{
+	return db->bulk;
+}
+
+#endif				/* CNID_BACKEND_LSM */
@@ -0,0 +1,58 @@
+/*
+ * The store of the lsm CNID backend, see lsm_store.c. The backend decides
+ * what goes in, the store keeps one record per CNID and finds it by CNID,
+ * by DID and name and by device and inode.
+ */
+
+#ifndef _ATALK_CNID_LSM_STORE_H
+#define _ATALK_CNID_LSM_STORE_H 1
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <netatalk/endian.h>
+#include <atalk/adouble.h>
+
+#define LSM_DIRNAME    ".AppleDB"
+#define LSM_LOGNAME    "cnid.log"
+#define LSM_BASENAME   "cnid.lsm"
+#define LSM_L1NAME     "cnid.lsm1"
+
+#define LSM_STAMPLEN   ADEDLEN_PRIVSYN
+
+/* one object as the backend sees it, cnid and did in network byte order */
+struct lsm_rec {
+    cnid_t      cnid;
+    u_int64_t   dev;
+    u_int64_t   ino;
+    u_int32_t   type;           /* 1: directory, 0: anything else */
+    cnid_t      did;
+    const char  *name;
+    size_t      namelen;
+};
+
+typedef struct lsm_db lsm_db;
+
+/* lsm_open() flags */
+#define LSM_BULK       (1 << 0) /* load from scratch, see lsm_bulk_add() */
+
+extern lsm_db *lsm_open(const char *volpath, mode_t mask, int flags);
+extern int     lsm_close(lsm_db *db);
+
+extern int     lsm_lock(lsm_db *db, int write);
+extern int     lsm_unlock(lsm_db *db);
+
+extern int     lsm_get_id(lsm_db *db, cnid_t cnid, struct lsm_rec *rec, char *namebuf);
+extern int     lsm_get_didname(lsm_db *db, cnid_t did, const char *name, size_t namelen,
+                               struct lsm_rec *rec, char *namebuf);
+extern int     lsm_get_devino(lsm_db *db, u_int64_t dev, u_int64_t ino,
+                              struct lsm_rec *rec, char *namebuf);
+extern int     lsm_put(lsm_db *db, const struct lsm_rec *rec);
+extern int     lsm_del(lsm_db *db, cnid_t cnid);
+extern cnid_t  lsm_nextid(lsm_db *db);
+extern void    lsm_getstamp(lsm_db *db, char *stamp);
+
+extern int     lsm_bulk(lsm_db *db);
+extern int     lsm_bulk_add(lsm_db *db, const struct lsm_rec *rec);
+
+#endif /* _ATALK_CNID_LSM_STORE_H */
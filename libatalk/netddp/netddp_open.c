@@ -13,6 +13,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -20,6 +21,8 @@
 #include <netatalk/at.h>
 #include <atalk/netddp.h>
 
+#include "netddp_private.h"
+
 int netddp_open(struct sockaddr_at *addr, struct sockaddr_at *bridge)
 {
 
@@ -28,6 +31,9 @@ int netddp_open(struct sockaddr_at *addr, struct sockaddr_at *bridge)
 
     socklen_t len;
 
+    if (netddp_udp_enabled())
+        return netddp_udp_open(addr);
+
     if ((s = socket( AF_APPLETALK, SOCK_DGRAM, 0 )) < 0) 
 	return -1;
     
@@ -50,3 +56,8 @@ int netddp_open(struct sockaddr_at *addr, struct sockaddr_at *bridge)
 
     return s;
 }
+
+int netddp_close(int s)
+{
+    return close(s);
+}
@@ -0,0 +1,23 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * transports behind the netddp interface. the kernel AF_APPLETALK
+ * socket is the default, DDP over UDP is selected at runtime by
+ * setting NETDDP_TRANSPORT=udp in the environment, see netddp_udp.c.
+ */
+
+#ifndef _NETDDP_PRIVATE_H
+#define _NETDDP_PRIVATE_H 1
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netatalk/at.h>
+
+extern int     netddp_udp_enabled  (void);
+extern int     netddp_udp_open     (struct sockaddr_at *);
+extern ssize_t netddp_udp_sendto   (int, const void *, size_t, int,
+                                    const struct sockaddr *, socklen_t);
+extern ssize_t netddp_udp_recvfrom (int, void *, size_t, int,
+                                    struct sockaddr *, socklen_t *);
+
+#endif /* netddp_private.h */
@@ -22,7 +22,18 @@
 #include <netatalk/ddp.h>
 #include <atalk/netddp.h>
 
+#include "netddp_private.h"
+
 #ifndef MAX
 #define MAX(a, b)  ((a) < (b) ? (b) : (a))
 #endif /* ! MAX */
 
+
+ssize_t netddp_recvfrom(int s, void *buf, size_t len, int flags,
+			struct sockaddr *from, socklen_t *fromlen)
+{
+    if (netddp_udp_enabled())
+	return netddp_udp_recvfrom(s, buf, len, flags, from, fromlen);
+
+    return recvfrom(s, buf, len, flags, from, fromlen);
+}
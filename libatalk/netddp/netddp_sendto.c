@@ -23,7 +23,18 @@
 #include <netatalk/ddp.h>
 #include <atalk/netddp.h>
 
+#include "netddp_private.h"
+
 #ifndef MAX
 #define MAX(a, b)  ((a) < (b) ? (b) : (a))
 #endif /* ! MAX */
 
+
+ssize_t netddp_sendto(int s, const void *buf, size_t len, int flags,
+		      const struct sockaddr *to, socklen_t tolen)
+{
+    if (netddp_udp_enabled())
+	return netddp_udp_sendto(s, buf, len, flags, to, tolen);
+
+    return sendto(s, buf, len, flags, to, tolen);
+}
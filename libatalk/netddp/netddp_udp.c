@@ -0,0 +1,280 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * DDP over UDP. every DDP socket is a UDP socket, the datagram payload
+ * is exactly what would have been handed to an AF_APPLETALK socket
+ * (starting with the DDP type byte). this lets atp, asp, nbp, afpd and
+ * papd talk to each other on a host without a kernel appletalk stack,
+ * e.g. for load testing on loopback.
+ *
+ * configured from the environment:
+ *   NETDDP_TRANSPORT=udp        enable
+ *   NETDDP_UDP_ADDR=net.node    our appletalk address [65280.1]
+ *   NETDDP_UDP_HOST=a.b.c.d     host all nodes live on [127.0.0.1]
+ *   NETDDP_UDP_PORTBASE=n       udp port = n + node * 256 + ddp port [10000]
+ *   NETDDP_UDP_MAP=file         per node exceptions, lines of
+ *                               "net.node host portbase", the udp port
+ *                               for such a node is portbase + ddp port
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <netatalk/at.h>
+#include <atalk/logger.h>
+#include <atalk/netddp.h>
+
+#include "netddp_private.h"
+
+#define UDP_DEFAULT_NET      65280
+#define UDP_DEFAULT_NODE     1
+#define UDP_DEFAULT_HOST     "127.0.0.1"
+#define UDP_DEFAULT_PORTBASE 10000
+#define UDP_MAXMAP           256
+
+struct udp_map {
+    u_short        net;
+    u_char         node;
+    struct in_addr host;
+    unsigned int   portbase;
+};
+
+static int udp_enabled = -1;            /* -1: environment not read yet */
+static struct at_addr udp_local;
+static struct in_addr udp_host;
+static unsigned int udp_portbase;
+static struct udp_map udp_maps[UDP_MAXMAP];
+static int udp_nmaps;
+
+static int parse_ataddr(const char *s, struct at_addr *addr)
+{
+    unsigned int net, node;
+
+    if (sscanf(s, "%u.%u", &net, &node) != 2 || net > 0xffff || node > 0xff)
+        return -1;
+    addr->s_net = htons(net);
+    addr->s_node = node;
+    return 0;
+}
+
+static void read_map(const char *file)
+{
+    FILE *fp;
+    char line[256], addr[64], host[64];
+    struct at_addr at;
+    unsigned int base;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        LOG(log_error, logtype_default, "netddp_udp: can't open map %s: %s",
+            file, strerror(errno));
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) && udp_nmaps < UDP_MAXMAP) {
+        if (*line == '#' || sscanf(line, "%63s %63s %u", addr, host, &base) != 3)
+            continue;
+        if (parse_ataddr(addr, &at) < 0
+            || inet_aton(host, &udp_maps[udp_nmaps].host) == 0
+            || base + 0xff > 0xffff) {
+            LOG(log_error, logtype_default, "netddp_udp: bad map entry: %s", line);
+            continue;
+        }
+        udp_maps[udp_nmaps].net = at.s_net;
+        udp_maps[udp_nmaps].node = at.s_node;
+        udp_maps[udp_nmaps].portbase = base;
+        udp_nmaps++;
+    }
+    fclose(fp);
+}
+
+int netddp_udp_enabled(void)
+{
+    const char *p;
+
+    if (udp_enabled != -1)
+        return udp_enabled;
+
+    if ((p = getenv("NETDDP_TRANSPORT")) == NULL || strcasecmp(p, "udp") != 0)
+        return (udp_enabled = 0);
+
+    udp_local.s_net = htons(UDP_DEFAULT_NET);
+    udp_local.s_node = UDP_DEFAULT_NODE;
+    if ((p = getenv("NETDDP_UDP_ADDR")) && parse_ataddr(p, &udp_local) < 0)
+        LOG(log_error, logtype_default, "netddp_udp: bad NETDDP_UDP_ADDR: %s", p);
+
+    if ((p = getenv("NETDDP_UDP_HOST")) == NULL || inet_aton(p, &udp_host) == 0)
+        inet_aton(UDP_DEFAULT_HOST, &udp_host);
+
+    udp_portbase = UDP_DEFAULT_PORTBASE;
+    if ((p = getenv("NETDDP_UDP_PORTBASE")))
+        udp_portbase = atoi(p);
+
+    if ((p = getenv("NETDDP_UDP_MAP")))
+        read_map(p);
+
+    LOG(log_info, logtype_default, "netddp: DDP over UDP, we are %u.%u",
+        ntohs(udp_local.s_net), udp_local.s_node);
+
+    return (udp_enabled = 1);
+}
+
+/* appletalk address -> udp address */
+static int at2udp(const struct sockaddr_at *sat, struct sockaddr_in *sin)
+{
+    u_short net = sat->sat_addr.s_net;
+    u_char node = sat->sat_addr.s_node;
+    unsigned int port;
+    int i;
+
+    /* there's only one segment, broadcasts end up at our own node */
+    if (net == ATADDR_ANYNET)
+        net = udp_local.s_net;
+    if (node == ATADDR_ANYNODE || node == ATADDR_BCAST)
+        node = udp_local.s_node;
+
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+
+    for (i = 0; i < udp_nmaps; i++) {
+        if (udp_maps[i].net == net && udp_maps[i].node == node) {
+            sin->sin_addr = udp_maps[i].host;
+            sin->sin_port = htons(udp_maps[i].portbase + sat->sat_port);
+            return 0;
+        }
+    }
+
+    port = udp_portbase + (node << 8) + sat->sat_port;
+    if (port > 0xffff) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+    sin->sin_addr = udp_host;
+    sin->sin_port = htons(port);
+    return 0;
+}
+
+/* udp address -> appletalk address */
+static int udp2at(const struct sockaddr_in *sin, struct sockaddr_at *sat)
+{
+    unsigned int port = ntohs(sin->sin_port);
+    int i;
+
+    memset(sat, 0, sizeof(*sat));
+    sat->sat_family = AF_APPLETALK;
+
+    for (i = 0; i < udp_nmaps; i++) {
+        if (udp_maps[i].host.s_addr == sin->sin_addr.s_addr
+            && port >= udp_maps[i].portbase
+            && port <= udp_maps[i].portbase + 0xff) {
+            sat->sat_addr.s_net = udp_maps[i].net;
+            sat->sat_addr.s_node = udp_maps[i].node;
+            sat->sat_port = port - udp_maps[i].portbase;
+            return 0;
+        }
+    }
+
+    if (port < udp_portbase)
+        return -1;
+    port -= udp_portbase;
+    sat->sat_addr.s_net = udp_local.s_net;
+    sat->sat_addr.s_node = port >> 8;
+    sat->sat_port = port & 0xff;
+    return 0;
+}
+
+int netddp_udp_open(struct sockaddr_at *addr)
+{
+    struct sockaddr_at sat;
+    struct sockaddr_in sin;
+    int s, port, first, last;
+
+    if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -1;
+
+    if (!addr)
+        return s;
+
+    sat = *addr;
+    if (sat.sat_addr.s_net == ATADDR_ANYNET)
+        sat.sat_addr.s_net = udp_local.s_net;
+    if (sat.sat_addr.s_node == ATADDR_ANYNODE)
+        sat.sat_addr.s_node = udp_local.s_node;
+
+    /* dynamic ports are handed out like the kernel does */
+    if (sat.sat_port == ATADDR_ANYPORT) {
+        first = ATPORT_RESERVED;
+        last = ATPORT_LAST - 1;
+    } else {
+        first = last = sat.sat_port;
+    }
+
+    for (port = first; port <= last; port++) {
+        sat.sat_port = port;
+        if (at2udp(&sat, &sin) < 0)
+            break;
+        sin.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(s, (struct sockaddr *) &sin, sizeof(sin)) == 0) {
+            sat.sat_family = AF_APPLETALK;
+            *addr = sat;
+            return s;
+        }
+        if (errno != EADDRINUSE)
+            break;
+    }
+
+    close(s);
+    return -1;
+}
+
+ssize_t netddp_udp_sendto(int s, const void *buf, size_t len, int flags,
+                          const struct sockaddr *to, socklen_t tolen)
+{
+    struct sockaddr_in sin;
+
+    if (to == NULL)
+        return send(s, buf, len, flags);
+
+    if (tolen < sizeof(struct sockaddr_at)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (at2udp((const struct sockaddr_at *) to, &sin) < 0)
+        return -1;
+
+    return sendto(s, buf, len, flags, (struct sockaddr *) &sin, sizeof(sin));
+}
+
+ssize_t netddp_udp_recvfrom(int s, void *buf, size_t len, int flags,
+                            struct sockaddr *from, socklen_t *fromlen)
+{
+    struct sockaddr_in sin;
+    struct sockaddr_at sat;
+    socklen_t sinlen;
+    ssize_t cc;
+
+    for (;;) {
+        sinlen = sizeof(sin);
+        if ((cc = recvfrom(s, buf, len, flags, (struct sockaddr *) &sin, &sinlen)) < 0)
+            return cc;
+        /* drop datagrams from senders we can't name */
+        if (udp2at(&sin, &sat) == 0)
+            break;
+    }
+
+    if (from && fromlen) {
+        if (*fromlen > sizeof(sat))
+            *fromlen = sizeof(sat);
+        memcpy(from, &sat, *fromlen);
+        *fromlen = sizeof(sat);
+    }
+    return cc;
+}
@@ -0,0 +1,689 @@
+/*
+ * Per volume catalog index for FPCatSearch, see include/atalk/catindex.h.
+ *
+ * The index is a log in .AppleDB/catindex: a header followed by records,
+ * each of them puts (adds or replaces) or deletes the metadata of one CNID.
+ * dbd writes a complete index while it scans a volume, afpd appends a record
+ * whenever it creates, changes, moves or deletes an object. Appends are done
+ * with O_APPEND under a shared flock(), so many afpd processes can write at
+ * the same time.
+ *
+ * Readers map the file and index it: slots in log order, each pointing to the
+ * newest record of a CNID or to nothing if the CNID has been replaced by a
+ * later record or deleted, and a hash from CNID to slot. A grown file is
+ * indexed incrementally from where the last refresh stopped. Slot numbers are
+ * stable as long as the file isn't replaced, which makes them usable as
+ * FPCatSearch positions.
+ *
+ * When more than half of the slots are dead an appender rewrites the live
+ * records into a new file under an exclusive lock and renames it over the old
+ * one. The header carries a generation number, a new file gets a new one, so
+ * positions into an old file can be told from positions into the new one.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include <atalk/logger.h>
+#include <atalk/unicode.h>
+#include <atalk/catindex.h>
+
+#define CI_MAGIC       0x43494458	/* "CIDX" */
+#define CI_VERSION     1
+#define CI_NAMEMAX     255		/* UCS-2 characters */
+#define CI_RECMAX      (sizeof(struct catindex_rec) + CI_NAMEMAX * sizeof(ucs2_t) + 2)
+#define CI_BUFSIZE     65536		/* catindex_create() write buffer */
+#define CI_COMPACT_MIN 4096		/* dead slots before we bother */
+
+#define CI_ALIGN(len)  (((len) + 3) & ~3)
+
+struct catindex_hdr {
+	u_int32_t ch_magic;
+	u_int32_t ch_version;
+	u_int32_t ch_gen;
+	u_int32_t ch_pad;
+};
+
+struct ci_hent {
+	cnid_t he_cnid;
+	u_int32_t he_slot;	/* slot + 1, 0: deleted */
+};
+
+struct catindex {
+	char *ci_path;
+	int ci_fd;
+	int ci_rdonly;
+	dev_t ci_dev;
+	ino_t ci_ino;
+	u_int32_t ci_gen;
+
+	/* reader */
+	unsigned char *ci_map;
+	size_t ci_maplen;
+	size_t ci_len;		/* indexed */
+	u_int32_t *ci_off;	/* record by slot, 0: dead */
+	u_int32_t ci_slots;
+	u_int32_t ci_alloc;
+	u_int32_t ci_live;
+	struct ci_hent *ci_hash;
+	u_int32_t ci_hused;
+	u_int32_t ci_hmask;
+
+	/* catindex_create() */
+	char *ci_tmp;		/* file being written */
+	char *ci_buf;
+	size_t ci_buflen;
+	int ci_oldfd;		/* index we replace */
+	off_t ci_oldlen;
+};
+
+static u_int32_t new_gen(void)
+{
+	static u_int32_t count;
+	u_int32_t gen = ((u_int32_t) time(NULL) ^ ((u_int32_t) getpid() << 16))
+	    + count++;
+
+	return gen ? gen : 1;
+}
+
+/* ------------------- */
+static char *ci_mkpath(const char *dbdir)
+{
+	char *path;
+
+	if ((path = malloc(strlen(dbdir) + sizeof(CATINDEX_NAME) + 1)) == NULL)
+		return NULL;
+	strcpy(path, dbdir);
+	strcat(path, "/");
+	strcat(path, CATINDEX_NAME);
+	return path;
+}
+
+/* ------------------- */
+static void ci_reset(catindex_t *ci)
+{
+	if (ci->ci_map)
+		munmap(ci->ci_map, ci->ci_maplen);
+	ci->ci_map = NULL;
+	ci->ci_maplen = 0;
+	ci->ci_len = 0;
+	ci->ci_slots = 0;
+	ci->ci_live = 0;
+	ci->ci_hused = 0;
+	if (ci->ci_hash)
+		memset(ci->ci_hash, 0,
+		       (ci->ci_hmask + 1) * sizeof(struct ci_hent));
+}
+
+/* ------------------- */
+static int ci_hgrow(catindex_t *ci)
+{
+	struct ci_hent *old = ci->ci_hash, *h;
+	u_int32_t osize = old ? ci->ci_hmask + 1 : 0;
+	u_int32_t size = osize ? osize * 2 : 1024;
+	u_int32_t i, j;
+
+	if ((h = calloc(size, sizeof(*h))) == NULL)
+		return -1;
+	for (i = 0; i < osize; i++) {
+		if (old[i].he_cnid == 0)
+			continue;
+		for (j = ntohl(old[i].he_cnid) * 2654435761U & (size - 1);
+		     h[j].he_cnid; j = (j + 1) & (size - 1));
+		h[j] = old[i];
+	}
+	free(old);
+	ci->ci_hash = h;
+	ci->ci_hmask = size - 1;
+	return 0;
+}
+
+/* hash entry of cnid, a new one if add is set */
+static struct ci_hent *ci_lookup(catindex_t *ci, cnid_t cnid, int add)
+{
+	struct ci_hent *h;
+	u_int32_t i;
+
+	if (cnid == 0)
+		return NULL;
+	if (add && (ci->ci_hash == NULL
+		    || (ci->ci_hused + 1) * 2 > ci->ci_hmask + 1)
+	    && ci_hgrow(ci) < 0)
+		return NULL;
+	if (ci->ci_hash == NULL)
+		return NULL;
+
+	for (i = ntohl(cnid) * 2654435761U & ci->ci_hmask;;
+	     i = (i + 1) & ci->ci_hmask) {
+		h = &ci->ci_hash[i];
+		if (h->he_cnid == cnid)
+			return h;
+		if (h->he_cnid == 0)
+			break;
+	}
+	if (!add)
+		return NULL;
+	h->he_cnid = cnid;
+	h->he_slot = 0;
+	ci->ci_hused++;
+	return h;
+}
+
+/* ------------------- */
+static int ci_apply(catindex_t *ci, const struct catindex_rec *rec)
+{
+	struct ci_hent *h;
+	u_int32_t *tmp;
+
+	if (rec->cr_op == CATINDEX_OP_DEL) {
+		if ((h = ci_lookup(ci, rec->cr_cnid, 0)) && h->he_slot) {
+			ci->ci_off[h->he_slot - 1] = 0;
+			ci->ci_live--;
+			h->he_slot = 0;
+		}
+		return 0;
+	}
+
+	if ((h = ci_lookup(ci, rec->cr_cnid, 1)) == NULL)
+		return -1;
+	if (ci->ci_slots == ci->ci_alloc) {
+		if ((tmp = realloc(ci->ci_off, (ci->ci_alloc + 4096) *
+				   sizeof(u_int32_t))) == NULL)
+			return -1;
+		ci->ci_off = tmp;
+		ci->ci_alloc += 4096;
+	}
+	if (h->he_slot) {
+		ci->ci_off[h->he_slot - 1] = 0;
+		ci->ci_live--;
+	}
+	ci->ci_off[ci->ci_slots++] = (unsigned char *) rec - ci->ci_map;
+	h->he_slot = ci->ci_slots;
+	ci->ci_live++;
+	return 0;
+}
+
+/*
+ * Map the file and index the records we haven't seen yet. A record that is
+ * still being written is left for the next time.
+ */
+static int ci_load(catindex_t *ci)
+{
+	const struct catindex_hdr *hdr;
+	const struct catindex_rec *rec;
+	struct stat st;
+	size_t size;
+
+	if (fstat(ci->ci_fd, &st) < 0)
+		return -1;
+	size = st.st_size;
+	if (size == ci->ci_maplen)
+		return 0;
+	if (size < ci->ci_maplen || size < sizeof(*hdr)) {
+		/* somebody truncated it, start over */
+		ci_reset(ci);
+		if (size < sizeof(*hdr)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (ci->ci_map)
+		munmap(ci->ci_map, ci->ci_maplen);
+	ci->ci_maplen = 0;
+	if ((ci->ci_map = mmap(NULL, size, PROT_READ, MAP_SHARED, ci->ci_fd,
+			       0)) == MAP_FAILED) {
+		ci->ci_map = NULL;
+		LOG(log_error, logtype_default, "catindex(%s): mmap: %s",
+		    ci->ci_path, strerror(errno));
+		ci_reset(ci);
+		return -1;
+	}
+	ci->ci_maplen = size;
+
+	if (ci->ci_len == 0) {
+		hdr = (const struct catindex_hdr *) ci->ci_map;
+		if (hdr->ch_magic != CI_MAGIC || hdr->ch_version != CI_VERSION) {
+			LOG(log_error, logtype_default,
+			    "catindex(%s): not an index or wrong version",
+			    ci->ci_path);
+			ci_reset(ci);
+			errno = EINVAL;
+			return -1;
+		}
+		ci->ci_gen = hdr->ch_gen;
+		ci->ci_len = sizeof(*hdr);
+	}
+
+	while (ci->ci_len + sizeof(*rec) <= size) {
+		rec = (const struct catindex_rec *) (ci->ci_map + ci->ci_len);
+		if (rec->cr_len < sizeof(*rec) || (rec->cr_len & 3)
+		    || (rec->cr_op != CATINDEX_OP_PUT
+			&& rec->cr_op != CATINDEX_OP_DEL)
+		    || sizeof(*rec) + rec->cr_namelen * sizeof(ucs2_t) >
+		    rec->cr_len) {
+			LOG(log_error, logtype_default,
+			    "catindex(%s): garbled record at %lu, ignoring the rest",
+			    ci->ci_path, (unsigned long) ci->ci_len);
+			ci->ci_len = size;
+			break;
+		}
+		if (rec->cr_len > size - ci->ci_len)
+			break;
+		if (ci_apply(ci, rec) < 0) {
+			LOG(log_error, logtype_default,
+			    "catindex(%s): out of memory", ci->ci_path);
+			ci_reset(ci);
+			errno = ENOMEM;
+			return -1;
+		}
+		ci->ci_len += rec->cr_len;
+	}
+	return 0;
+}
+
+/* ------------------- */
+static int ci_openfile(catindex_t *ci)
+{
+	struct stat st;
+	int fd;
+
+	ci->ci_rdonly = 0;
+	if ((fd = open(ci->ci_path, O_RDWR | O_APPEND)) < 0) {
+		if (errno != EACCES && errno != EROFS)
+			return -1;
+		if ((fd = open(ci->ci_path, O_RDONLY)) < 0)
+			return -1;
+		ci->ci_rdonly = 1;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (ci->ci_fd != -1)
+		close(ci->ci_fd);
+	ci->ci_fd = fd;
+	ci->ci_dev = st.st_dev;
+	ci->ci_ino = st.st_ino;
+	ci_reset(ci);
+	return 0;
+}
+
+/*!
+ * Open the index in the CNID database directory dbdir
+ *
+ * @returns handle or NULL if there's none (errno ENOENT) or it's unusable
+ */
+catindex_t *catindex_open(const char *dbdir)
+{
+	catindex_t *ci;
+
+	if ((ci = calloc(1, sizeof(*ci))) == NULL)
+		return NULL;
+	ci->ci_fd = -1;
+	ci->ci_oldfd = -1;
+	if ((ci->ci_path = ci_mkpath(dbdir)) == NULL
+	    || ci_openfile(ci) < 0 || ci_load(ci) < 0) {
+		catindex_close(ci);
+		return NULL;
+	}
+	return ci;
+}
+
+/*!
+ * Pick up changes: records appended by others or a new file
+ *
+ * @returns 0 or -1 if the index is gone or unusable
+ */
+int catindex_refresh(catindex_t *ci)
+{
+	struct stat st;
+
+	if (ci->ci_tmp) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (stat(ci->ci_path, &st) < 0)
+		return -1;
+	if ((st.st_dev != ci->ci_dev || st.st_ino != ci->ci_ino)
+	    && ci_openfile(ci) < 0)
+		return -1;
+	return ci_load(ci);
+}
+
+/* ------------------- */
+u_int32_t catindex_gen(const catindex_t *ci)
+{
+	return ci->ci_gen;
+}
+
+/* ------------------- */
+u_int32_t catindex_slots(const catindex_t *ci)
+{
+	return ci->ci_slots;
+}
+
+/*!
+ * Record in a slot
+ *
+ * @returns record or NULL if the slot is dead, valid until the next
+ *          catindex_refresh(), catindex_put() or catindex_del()
+ */
+const struct catindex_rec *catindex_get(const catindex_t *ci,
+					u_int32_t slot)
+{
+	if (slot >= ci->ci_slots || ci->ci_off[slot] == 0)
+		return NULL;
+	return (const struct catindex_rec *) (ci->ci_map + ci->ci_off[slot]);
+}
+
+/* ------------------- */
+static int ci_writeall(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* ------------------- */
+static int ci_flush(catindex_t *ci)
+{
+	if (ci->ci_buflen && ci_writeall(ci->ci_fd, ci->ci_buf,
+					 ci->ci_buflen) < 0) {
+		LOG(log_error, logtype_default, "catindex(%s): write: %s",
+		    ci->ci_tmp, strerror(errno));
+		return -1;
+	}
+	ci->ci_buflen = 0;
+	return 0;
+}
+
+/*
+ * Write the live records into a new file and rename it over the index,
+ * with the old one locked exclusively.
+ */
+static int ci_compact(catindex_t *ci)
+{
+	const struct catindex_rec *rec;
+	struct catindex_hdr hdr;
+	struct stat st;
+	char *tmp = NULL;
+	int fd = -1, ret = -1;
+	u_int32_t i;
+
+	if (flock(ci->ci_fd, LOCK_EX) < 0)
+		return -1;
+	if (stat(ci->ci_path, &st) < 0 || st.st_dev != ci->ci_dev
+	    || st.st_ino != ci->ci_ino || ci_load(ci) < 0)
+		goto exit;
+
+	if ((tmp = malloc(strlen(ci->ci_path) + 8)) == NULL)
+		goto exit;
+	strcpy(tmp, ci->ci_path);
+	strcat(tmp, ".XXXXXX");
+	if ((fd = mkstemp(tmp)) < 0)
+		goto exit;
+	fchmod(fd, st.st_mode & 0666);
+
+	hdr.ch_magic = CI_MAGIC;
+	hdr.ch_version = CI_VERSION;
+	/* must differ from the one it replaces */
+	hdr.ch_gen = ci->ci_gen + 1 ? ci->ci_gen + 1 : 1;
+	hdr.ch_pad = 0;
+	if (ci_writeall(fd, &hdr, sizeof(hdr)) < 0)
+		goto exit;
+	for (i = 0; i < ci->ci_slots; i++) {
+		if ((rec = catindex_get(ci, i)) == NULL)
+			continue;
+		if (ci_writeall(fd, rec, rec->cr_len) < 0)
+			goto exit;
+	}
+	if (rename(tmp, ci->ci_path) < 0)
+		goto exit;
+	LOG(log_debug, logtype_default,
+	    "catindex(%s): compacted %u slots to %u", ci->ci_path,
+	    ci->ci_slots, ci->ci_live);
+	ret = 0;
+
+      exit:
+	if (fd != -1) {
+		close(fd);
+		if (ret < 0)
+			unlink(tmp);
+	}
+	free(tmp);
+	flock(ci->ci_fd, LOCK_UN);
+	if (ret == 0)
+		ret = catindex_refresh(ci);
+	return ret;
+}
+
+/* ------------------- */
+static int ci_append(catindex_t *ci, const struct catindex_rec *rec)
+{
+	struct stat st;
+	int i, ret;
+
+	if (ci->ci_tmp) {
+		if (ci->ci_buflen + rec->cr_len > CI_BUFSIZE
+		    && ci_flush(ci) < 0)
+			return -1;
+		memcpy(ci->ci_buf + ci->ci_buflen, rec, rec->cr_len);
+		ci->ci_buflen += rec->cr_len;
+		return 0;
+	}
+
+	if (ci->ci_rdonly) {
+		errno = EACCES;
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (flock(ci->ci_fd, LOCK_SH) < 0)
+			return -1;
+		/* compacted in the meantime? */
+		if (stat(ci->ci_path, &st) == 0 && st.st_dev == ci->ci_dev
+		    && st.st_ino == ci->ci_ino) {
+			ret = ci_writeall(ci->ci_fd, rec, rec->cr_len);
+			flock(ci->ci_fd, LOCK_UN);
+			if (ret < 0) {
+				LOG(log_error, logtype_default,
+				    "catindex(%s): write: %s", ci->ci_path,
+				    strerror(errno));
+				return -1;
+			}
+			if (ci_load(ci) == 0
+			    && ci->ci_slots - ci->ci_live > CI_COMPACT_MIN
+			    && ci->ci_slots - ci->ci_live > ci->ci_live)
+				ci_compact(ci);
+			return 0;
+		}
+		flock(ci->ci_fd, LOCK_UN);
+		if (catindex_refresh(ci) < 0 || ci->ci_rdonly)
+			return -1;
+	}
+	return -1;
+}
+
+/*!
+ * Add or replace the metadata of rec->cr_cnid. name is the Mac name in
+ * UTF8-MAC, the other fields must be set by the caller.
+ */
+int catindex_put(catindex_t *ci, struct catindex_rec *rec,
+		 const char *name)
+{
+	union {
+		struct catindex_rec rec;
+		char buf[CI_RECMAX];
+	} r;
+	ucs2_t *p;
+	u_int16_t flags = CONV_PRECOMPOSE;
+	size_t len, i;
+
+	p = (ucs2_t *) (&r.rec + 1);
+	if ((len = convert_charset(CH_UTF8_MAC, CH_UCS2, CH_UTF8, name,
+				   strlen(name), (char *) p,
+				   CI_NAMEMAX * sizeof(ucs2_t),
+				   &flags)) == (size_t) -1) {
+		errno = EINVAL;
+		return -1;
+	}
+	len /= sizeof(ucs2_t);
+	for (i = 0; i < len; i++)
+		p[i] = tolower_w(p[i]);
+	p[len] = 0;
+
+	rec->cr_op = CATINDEX_OP_PUT;
+	rec->cr_namelen = len;
+	rec->cr_pad = 0;
+	rec->cr_len = CI_ALIGN(sizeof(*rec) + len * sizeof(ucs2_t));
+	memcpy(&r.rec, rec, sizeof(*rec));
+	return ci_append(ci, &r.rec);
+}
+
+/* ------------------- */
+int catindex_del(catindex_t *ci, cnid_t cnid)
+{
+	struct catindex_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.cr_len = sizeof(rec);
+	rec.cr_op = CATINDEX_OP_DEL;
+	rec.cr_cnid = cnid;
+	return ci_append(ci, &rec);
+}
+
+/*!
+ * Start writing a new index for dbdir, catindex_commit() replaces the
+ * current one with it
+ */
+catindex_t *catindex_create(const char *dbdir)
+{
+	struct catindex_hdr hdr;
+	catindex_t *ci;
+
+	if ((ci = calloc(1, sizeof(*ci))) == NULL)
+		return NULL;
+	ci->ci_fd = -1;
+	ci->ci_oldfd = -1;
+	if ((ci->ci_path = ci_mkpath(dbdir)) == NULL
+	    || (ci->ci_buf = malloc(CI_BUFSIZE)) == NULL
+	    || (ci->ci_tmp = malloc(strlen(ci->ci_path) + 8)) == NULL)
+		goto error;
+	strcpy(ci->ci_tmp, ci->ci_path);
+	strcat(ci->ci_tmp, ".XXXXXX");
+	if ((ci->ci_fd = mkstemp(ci->ci_tmp)) < 0) {
+		LOG(log_error, logtype_default, "catindex(%s): %s",
+		    ci->ci_tmp, strerror(errno));
+		free(ci->ci_tmp);
+		ci->ci_tmp = NULL;
+		goto error;
+	}
+
+	/* what afpd appends to the old one while we're busy is carried over */
+	if ((ci->ci_oldfd = open(ci->ci_path, O_RDONLY)) != -1)
+		ci->ci_oldlen = lseek(ci->ci_oldfd, 0, SEEK_END);
+
+	hdr.ch_magic = CI_MAGIC;
+	hdr.ch_version = CI_VERSION;
+	hdr.ch_gen = new_gen();
+	hdr.ch_pad = 0;
+	memcpy(ci->ci_buf, &hdr, sizeof(hdr));
+	ci->ci_buflen = sizeof(hdr);
+	return ci;
+
+      error:
+	catindex_close(ci);
+	return NULL;
+}
+
+/*!
+ * Replace the index with the one written since catindex_create()
+ */
+int catindex_commit(catindex_t *ci)
+{
+	struct stat st, ost;
+	char buf[8192];
+	ssize_t n;
+	int ret = -1;
+
+	if (ci->ci_tmp == NULL || ci_flush(ci) < 0)
+		return -1;
+
+	if (ci->ci_oldfd != -1) {
+		flock(ci->ci_oldfd, LOCK_EX);
+		if (stat(ci->ci_path, &st) == 0
+		    && fstat(ci->ci_oldfd, &ost) == 0
+		    && st.st_dev == ost.st_dev && st.st_ino == ost.st_ino
+		    && ci->ci_oldlen > 0
+		    && lseek(ci->ci_oldfd, ci->ci_oldlen, SEEK_SET) >= 0) {
+			while ((n = read(ci->ci_oldfd, buf, sizeof(buf))) > 0)
+				if (ci_writeall(ci->ci_fd, buf, n) < 0)
+					goto exit;
+		}
+	}
+
+	/* every afpd must be able to append */
+	if (fchmod(ci->ci_fd, 0666) < 0 || fsync(ci->ci_fd) < 0
+	    || rename(ci->ci_tmp, ci->ci_path) < 0) {
+		LOG(log_error, logtype_default, "catindex(%s): %s",
+		    ci->ci_path, strerror(errno));
+		goto exit;
+	}
+	free(ci->ci_tmp);
+	ci->ci_tmp = NULL;
+	ret = 0;
+
+      exit:
+	if (ci->ci_oldfd != -1) {
+		flock(ci->ci_oldfd, LOCK_UN);
+		close(ci->ci_oldfd);
+		ci->ci_oldfd = -1;
+	}
+	return ret;
+}
+
+/*!
+ * Close the index, an uncommitted new index is thrown away
+ */
+void catindex_close(catindex_t *ci)
+{
+	if (ci == NULL)
+		return;
+	if (ci->ci_tmp) {
+		unlink(ci->ci_tmp);
+		free(ci->ci_tmp);
+	}
+	if (ci->ci_map)
+		munmap(ci->ci_map, ci->ci_maplen);
+	if (ci->ci_fd != -1)
+		close(ci->ci_fd);
+	if (ci->ci_oldfd != -1)
+		close(ci->ci_oldfd);
+	free(ci->ci_buf);
+	free(ci->ci_off);
+	free(ci->ci_hash);
+	free(ci->ci_path);
+	free(ci);
+}
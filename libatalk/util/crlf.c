@@ -0,0 +1,259 @@
+/*
+ * CR/LF translation and newline scanning
+ *
+ * afpd swaps \012 and \015 in every FPRead and FPWrite of a TEXT file on a
+ * crlf volume, and FPRead with a newline mask looks for the first byte with
+ * (byte & mask) == char. Both go through the kernels here, a scalar version
+ * and vector versions for SSE2, AVX2 and NEON. The best kernels the CPU can
+ * run are picked at the first call, crlf_use() picks others (for
+ * bin/misc/crlf_bench).
+ *
+ * \012 ^ \015 == 007, so the swap is an xor with 007 of the bytes that are
+ * either, no branches needed.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/types.h>
+
+#include <atalk/crlf.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define CRLF_SSE2 1
+#include <emmintrin.h>
+#if defined(HAVE_CPU_DISPATCH)
+#define CRLF_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) && (defined(__aarch64__) || defined(__ARM_NEON))
+#define CRLF_NEON 1
+#include <arm_neon.h>
+#endif
+
+struct crlf_kernels {
+	const char *name;
+	int (*usable) (void);
+	void (*swap) (char *buf, size_t len);
+	size_t (*scan) (const char *buf, size_t len, u_int8_t mask,
+			u_int8_t ch);
+};
+
+/* ------------------------- scalar */
+static int always(void)
+{
+	return 1;
+}
+
+static void swap_scalar(char *buf, size_t len)
+{
+	unsigned char *p = (unsigned char *) buf, *q = p + len;
+
+	for (; p < q; p++) {
+		if (*p == '\012' || *p == '\015')
+			*p ^= 007;
+	}
+}
+
+static size_t scan_scalar(const char *buf, size_t len, u_int8_t mask,
+			  u_int8_t ch)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (((u_int8_t) buf[i] & mask) == ch)
+			return i;
+	}
+	return len;
+}
+
+/* ------------------------- SSE2, 16 bytes at a time */
+#ifdef CRLF_SSE2
+static void swap_sse2(char *buf, size_t len)
+{
+	const __m128i lf = _mm_set1_epi8('\012');
+	const __m128i cr = _mm_set1_epi8('\015');
+	const __m128i x = _mm_set1_epi8(007);
+	__m128i v, m;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (buf + i));
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr));
+		v = _mm_xor_si128(v, _mm_and_si128(m, x));
+		_mm_storeu_si128((__m128i *) (buf + i), v);
+	}
+	swap_scalar(buf + i, len - i);
+}
+
+static size_t scan_sse2(const char *buf, size_t len, u_int8_t mask,
+			u_int8_t ch)
+{
+	const __m128i m = _mm_set1_epi8((char) mask);
+	const __m128i c = _mm_set1_epi8((char) ch);
+	__m128i v;
+	unsigned int bits;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (buf + i));
+		v = _mm_cmpeq_epi8(_mm_and_si128(v, m), c);
+		if ((bits = _mm_movemask_epi8(v)) != 0)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scan_scalar(buf + i, len - i, mask, ch);
+}
+#endif /* CRLF_SSE2 */
+
+/* ------------------------- AVX2, 32 bytes at a time */
+#ifdef CRLF_AVX2
+static int avx2_usable(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__ ((target("avx2")))
+static void swap_avx2(char *buf, size_t len)
+{
+	const __m256i lf = _mm256_set1_epi8('\012');
+	const __m256i cr = _mm256_set1_epi8('\015');
+	const __m256i x = _mm256_set1_epi8(007);
+	__m256i v, m;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (buf + i));
+		m = _mm256_or_si256(_mm256_cmpeq_epi8(v, lf),
+				    _mm256_cmpeq_epi8(v, cr));
+		v = _mm256_xor_si256(v, _mm256_and_si256(m, x));
+		_mm256_storeu_si256((__m256i *) (buf + i), v);
+	}
+	swap_sse2(buf + i, len - i);
+}
+
+__attribute__ ((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, u_int8_t mask,
+			u_int8_t ch)
+{
+	const __m256i m = _mm256_set1_epi8((char) mask);
+	const __m256i c = _mm256_set1_epi8((char) ch);
+	__m256i v;
+	unsigned int bits;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (buf + i));
+		v = _mm256_cmpeq_epi8(_mm256_and_si256(v, m), c);
+		if ((bits = _mm256_movemask_epi8(v)) != 0)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scan_sse2(buf + i, len - i, mask, ch);
+}
+#endif /* CRLF_AVX2 */
+
+/* ------------------------- NEON, 16 bytes at a time */
+#ifdef CRLF_NEON
+static void swap_neon(char *buf, size_t len)
+{
+	const uint8x16_t lf = vdupq_n_u8('\012');
+	const uint8x16_t cr = vdupq_n_u8('\015');
+	const uint8x16_t x = vdupq_n_u8(007);
+	uint8x16_t v, m;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = vld1q_u8((const uint8_t *) (buf + i));
+		m = vorrq_u8(vceqq_u8(v, lf), vceqq_u8(v, cr));
+		vst1q_u8((uint8_t *) (buf + i), veorq_u8(v, vandq_u8(m, x)));
+	}
+	swap_scalar(buf + i, len - i);
+}
+
+static size_t scan_neon(const char *buf, size_t len, u_int8_t mask,
+			u_int8_t ch)
+{
+	const uint8x16_t m = vdupq_n_u8(mask);
+	const uint8x16_t c = vdupq_n_u8(ch);
+	uint8x16_t v;
+	uint8x8_t any;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = vld1q_u8((const uint8_t *) (buf + i));
+		v = vceqq_u8(vandq_u8(v, m), c);
+		any = vorr_u8(vget_low_u8(v), vget_high_u8(v));
+		/* no movemask, the scalar loop finds the byte in these 16 */
+		if (vget_lane_u64(vreinterpret_u64_u8(any), 0) != 0)
+			return i + scan_scalar(buf + i, 16, mask, ch);
+	}
+	return i + scan_scalar(buf + i, len - i, mask, ch);
+}
+#endif /* CRLF_NEON */
+
+/* best first */
+static const struct crlf_kernels kernels[] = {
+#ifdef CRLF_AVX2
+	{"avx2", avx2_usable, swap_avx2, scan_avx2},
+#endif
+#ifdef CRLF_SSE2
+	{"sse2", always, swap_sse2, scan_sse2},
+#endif
+#ifdef CRLF_NEON
+	{"neon", always, swap_neon, scan_neon},
+#endif
+	{"scalar", always, swap_scalar, scan_scalar},
+};
+
+static const struct crlf_kernels *use;
+
+static const struct crlf_kernels *pick(void)
+{
+	const struct crlf_kernels *k;
+
+	for (k = kernels; !k->usable(); k++);
+	return use = k;
+}
+
+/* -------------------------- */
+void crlf_swap(char *buf, size_t len)
+{
+	(use ? use : pick())->swap(buf, len);
+}
+
+/*!
+ * Offset of the first byte of buf with (byte & mask) == ch, len if none
+ */
+size_t nl_scan(const char *buf, size_t len, u_int8_t mask, u_int8_t ch)
+{
+	const char *p;
+
+	/* the libc has a fast one for this */
+	if (mask == 0xff)
+		return (p = memchr(buf, ch, len)) ? (size_t) (p - buf) : len;
+	return (use ? use : pick())->scan(buf, len, mask, ch);
+}
+
+/* -------------------------- */
+const char *crlf_kernel(void)
+{
+	return (use ? use : pick())->name;
+}
+
+/*!
+ * Use the kernels called name, -1 if there are none the CPU can run
+ */
+int crlf_use(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (!strcmp(kernels[i].name, name) && kernels[i].usable()) {
+			use = &kernels[i];
+			return 0;
+		}
+	}
+	return -1;
+}
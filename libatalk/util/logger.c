@@ -26,6 +26,7 @@ Netatalk 2001 (c)
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include <atalk/util.h>
 #include <atalk/logger.h>
@@ -36,6 +37,11 @@ Netatalk 2001 (c)
 
 #define MAXLOGSIZE 512
 
+#define LOGBUF_SIZE 16384	/* batched file log output */
+#define LOGBUF_FLUSH_INTERVAL 1	/* max age of buffered messages in seconds */
+
+#define PROGLOG_DIR "/var/log/netatalk"
+
 #define LOGLEVEL_STRING_IDENTIFIERS { \
   "LOG_NOTHING",                      \
   "LOG_SEVERE",                       \
@@ -120,10 +126,164 @@ static const char *arr_loglevel_strings[] = LOGLEVEL_STRING_IDENTIFIERS;
 static const unsigned int num_loglevel_strings =
 COUNT_ARRAY(arr_loglevel_strings);
 
+/* Names used in the per program logfile in PROGLOG_DIR */
+static const char *arr_proglog_types[] = {
+	"default", "logger", "cnid", "afpd", "dsi", "atalkd", "papd", "uams"
+};
+static const char *arr_proglog_levels[] = {
+	"none", "severe", "error", "warning", "note", "info", "debug",
+	"debug6", "debug7", "debug8", "debug9", "maxdebug"
+};
+
+/*
+ * File log output is collected here and written to the logfile in one
+ * go. Only one fd is buffered at a time, switching fds drains the buffer.
+ */
+static struct {
+	int fd;			/* fd the buffered data belongs to */
+	size_t len;		/* bytes buffered */
+	time_t stamp;		/* time the oldest buffered message was queued */
+	bool hooked;		/* atexit/atfork handlers installed ? */
+	char data[LOGBUF_SIZE];
+} log_buf = { -1, 0, 0, false };
+
+/* -1: not opened yet, -2: not available */
+static int proglog_fd = -1;
+
+/* cached, it's in every message and getpid() is a syscall */
+static pid_t log_pid;
+
+/* strftime() results are cached per second */
+struct log_timecache {
+	const char *fmt;
+	time_t sec;
+	char str[32];
+};
+static struct log_timecache details_time = { "%b %d %H:%M:%S.", -1 };
+static struct log_timecache proglog_time = { "%Y-%m-%d %H:%M:%S", -1 };
+
 /* =========================================================================
    Internal function definitions
    ========================================================================= */
 
+static const char *log_strftime(struct log_timecache *tc, time_t sec)
+{
+	if (tc->sec != sec) {
+		strftime(tc->str, sizeof(tc->str), tc->fmt, localtime(&sec));
+		tc->sec = sec;
+	}
+	return tc->str;
+}
+
+static void log_atfork_child(void)
+{
+	log_pid = 0;
+}
+
+/*
+ * Queue a message for fd. Messages below log_debug are written through
+ * (after what's already queued, to keep ordering), debug chatter is
+ * written when the buffer fills, when a message finds it older than
+ * LOGBUF_FLUSH_INTERVAL, before fork() and at exit. Nothing checks the
+ * age while no messages come, so the daemons call log_flush() before
+ * they wait for input.
+ */
+static void log_write(int fd, const struct iovec *iov, int iovcnt,
+		      enum loglevels loglevel)
+{
+	size_t total = 0;
+	time_t now;
+	int i;
+
+	/* stdout/tty logging from cli tools goes out unbuffered */
+	if (fd <= 2) {
+		writev(fd, iov, iovcnt);
+		return;
+	}
+
+	if (!log_buf.hooked) {
+		atexit(log_flush);
+		pthread_atfork(log_flush, NULL, log_atfork_child);
+		log_buf.hooked = true;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	if (log_buf.len
+	    && (log_buf.fd != fd
+		|| log_buf.len + total > sizeof(log_buf.data)))
+		log_flush();
+
+	if (total > sizeof(log_buf.data)) {
+		writev(fd, iov, iovcnt);
+		return;
+	}
+
+	now = time(NULL);
+	if (log_buf.len == 0) {
+		log_buf.fd = fd;
+		log_buf.stamp = now;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(log_buf.data + log_buf.len, iov[i].iov_base,
+		       iov[i].iov_len);
+		log_buf.len += iov[i].iov_len;
+	}
+
+	if (loglevel < log_debug
+	    || now - log_buf.stamp >= LOGBUF_FLUSH_INTERVAL)
+		log_flush();
+}
+
+/*
+ * Messages going to syslog are also appended to PROGLOG_DIR/<progname>.log
+ * if that directory exists.
+ */
+static void make_proglog_entry(enum loglevels loglevel,
+			       enum logtypes logtype, const char *message)
+{
+	char path[PATH_MAX];
+	char prefix[128];
+	struct iovec iov[3];
+	const char *progname;
+
+	if (proglog_fd == -2)
+		return;
+
+	if (proglog_fd == -1) {
+#if defined(linux)
+		progname = program_invocation_short_name;
+#else
+		progname = getprogname();
+#endif
+		snprintf(path, sizeof(path), PROGLOG_DIR "/%s.log",
+			 progname);
+		if ((proglog_fd = open(path, O_CREAT | O_WRONLY | O_APPEND,
+				       S_IRUSR | S_IWUSR | S_IRGRP |
+				       S_IROTH)) == -1) {
+			proglog_fd = -2;
+			return;
+		}
+		fcntl(proglog_fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	snprintf(prefix, sizeof(prefix), "%s %s: (%s) ",
+		 log_strftime(&proglog_time, time(NULL)),
+		 logtype < COUNT_ARRAY(arr_proglog_types) ?
+		 arr_proglog_types[logtype] : "unknown",
+		 loglevel < COUNT_ARRAY(arr_proglog_levels) ?
+		 arr_proglog_levels[loglevel] : "unknown");
+
+	iov[0].iov_base = prefix;
+	iov[0].iov_len = strlen(prefix);
+	iov[1].iov_base = (void *) message;
+	iov[1].iov_len = strlen(message);
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = 1;
+	log_write(proglog_fd, iov, 3, loglevel);
+}
+
 /* Hash a log message */
 static unsigned int hash_message(const char *message)
 {
@@ -208,7 +368,7 @@ static void generate_message_details(char *message_details_buffer,
 
 	/* Print time */
 	gettimeofday(&tv, NULL);
-	strftime(ptr, len, "%b %d %H:%M:%S.", localtime(&tv.tv_sec));
+	strlcpy(ptr, log_strftime(&details_time, tv.tv_sec), len);
 	templen = strlen(ptr);
 	len -= templen;
 	ptr += templen;
@@ -221,7 +381,9 @@ static void generate_message_details(char *message_details_buffer,
 	ptr += templen;
 
 	/* Process name &&  PID */
-	pid = getpid();
+	if (log_pid == 0)
+		log_pid = getpid();
+	pid = log_pid;
 	templen =
 	    snprintf(ptr, len, "%s[%d]", log_config.processname, pid);
 	if (templen == -1 || templen >= len)
@@ -312,6 +474,7 @@ void log_setup(const char *filename, enum loglevels loglevel,
 	if (loglevel == 0) {
 		/* Disable */
 		if (type_configs[logtype].set) {
+			log_flush();
 			if (type_configs[logtype].fd != -1)
 				close(type_configs[logtype].fd);
 			type_configs[logtype].fd = -1;
@@ -338,6 +501,7 @@ void log_setup(const char *filename, enum loglevels loglevel,
 
 	/* Resetting existing config ? */
 	if (type_configs[logtype].set) {
+		log_flush();
 		if (type_configs[logtype].fd != -1)
 			close(type_configs[logtype].fd);
 		type_configs[logtype].fd = -1;
@@ -466,6 +630,27 @@ void syslog_setup(int loglevel, enum logtypes logtype, int display_options,
 
 void log_close(void)
 {
+	log_flush();
+}
+
+void log_flush(void)
+{
+	const char *p = log_buf.data;
+	size_t left = log_buf.len;
+	ssize_t n;
+	int saved_errno = errno;
+
+	while (left) {
+		if ((n = write(log_buf.fd, p, left)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	log_buf.len = 0;
+	errno = saved_errno;
 }
 
 /* This function sets up the processname */
@@ -477,7 +662,7 @@ void set_processname(const char *processname)
 
 /* Called by the LOG macro for syslog messages */
 static void make_syslog_entry(enum loglevels loglevel,
-			      enum logtypes logtype _U_, char *message)
+			      enum logtypes logtype, char *message)
 {
 	if (!log_config.syslog_opened) {
 		openlog(log_config.processname,
@@ -487,6 +672,7 @@ static void make_syslog_entry(enum loglevels loglevel,
 	}
 
 	syslog(get_syslog_equivalent(loglevel), "%s", message);
+	make_proglog_entry(loglevel, logtype, message);
 }
 
 /* -------------------------------------------------------------------------
@@ -495,7 +681,7 @@ static void make_syslog_entry(enum loglevels loglevel,
    So it must be shorter than MAXLOGSIZE
    ------------------------------------------------------------------------- */
 void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
-		    const char *file, int line, char *message, ...)
+		    const char *file, int line, const char *message, ...)
 {
 	/* fn is not reentrant but is used in signal handler
 	 * with LOGGER it's a little late source name and line number
@@ -506,6 +692,7 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
 	char log_details_buffer[MAXLOGSIZE];
 	va_list args;
 	struct iovec iov[2];
+	int saved_errno = errno;
 
 	if (inlog)
 		return;
@@ -526,6 +713,7 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
 			temp_buffer[MAXLOGSIZE - 1] = 0;
 			make_syslog_entry(loglevel, logtype, temp_buffer);
 		}
+		errno = saved_errno;
 		inlog = 0;
 		return;
 	}
@@ -585,8 +773,9 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
 				sprintf(log_details_buffer,
 					"message repeated %i times\n",
 					LOG_FLOODING_MAXCOUNT - 1);
-				write(fd, log_details_buffer,
-				      strlen(log_details_buffer));
+				iov[0].iov_base = log_details_buffer;
+				iov[0].iov_len = strlen(log_details_buffer);
+				log_write(fd, iov, 1, loglevel);
 
 				if ((i + 1) == LOG_FLOODING_ARRAY_SIZE) {
 					/* last array element, just decrement count */
@@ -619,8 +808,9 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
 				"message repeated %i times\n",
 				log_flood_array[0].count -
 				LOG_FLOODING_MINCOUNT + 1);
-			write(fd, log_details_buffer,
-			      strlen(log_details_buffer));
+			iov[0].iov_base = log_details_buffer;
+			iov[0].iov_len = strlen(log_details_buffer);
+			log_write(fd, iov, 1, loglevel);
 		}
 		for (int i = 1; i < LOG_FLOODING_ARRAY_SIZE; i++) {
 			log_flood_array[i - 1] = log_flood_array[i];
@@ -647,12 +837,13 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
 		iov[0].iov_len = strlen(log_details_buffer);
 		iov[1].iov_base = temp_buffer;
 		iov[1].iov_len = strlen(temp_buffer);
-		writev(fd, iov, 2);
+		log_write(fd, iov, 2, loglevel);
 	} else {
 		write(fd, temp_buffer, strlen(temp_buffer));
 	}
 
       exit:
+	errno = saved_errno;
 	inlog = 0;
 }
 
@@ -0,0 +1,253 @@
+/*
+ * Single producer single consumer message ring in shared memory,
+ * see include/atalk/shm_ring.h.
+ *
+ * A message is a 32 bit length followed by the payload, head and tail are
+ * free running byte counters. The producer publishes a message by moving
+ * tail after the payload is written, the consumer frees it by moving head.
+ * A consumer that wants to sleep sets waiting and checks the ring once more,
+ * the producer checks waiting after publishing. With a full barrier on
+ * both sides one of them always sees the other.
+ *
+ * On Linux the sleeping is done with a futex on tail, elsewhere we poll.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include <atalk/shm_ring.h>
+
+#define barrier() __sync_synchronize()
+
+/* copy from/to the ring at position pos, wrapping around */
+static void ring_write(shm_ring_t *ring, u_int32_t pos, const void *buf,
+		       size_t len)
+{
+	u_int32_t off = pos & (ring->size - 1);
+	size_t n = ring->size - off;
+
+	if (n > len)
+		n = len;
+	memcpy(ring->data + off, buf, n);
+	if (n < len)
+		memcpy(ring->data, (const char *) buf + n, len - n);
+}
+
+static void ring_read(shm_ring_t *ring, u_int32_t pos, void *buf,
+		      size_t len)
+{
+	u_int32_t off = pos & (ring->size - 1);
+	size_t n = ring->size - off;
+
+	if (n > len)
+		n = len;
+	memcpy(buf, ring->data + off, n);
+	if (n < len)
+		memcpy((char *) buf + n, ring->data, len - n);
+}
+
+/*!
+ * How often to poll before sleeping: spinning only makes sense if the
+ * other side can run at the same time.
+ */
+int shm_ring_spins(int spin)
+{
+	static long cpus;
+
+	if (cpus == 0 && (cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		cpus = 1;
+	return cpus > 1 ? spin : 0;
+}
+
+/* -------------------- */
+void shm_ring_init(void *mem, u_int32_t size)
+{
+	memset(mem, 0, SHM_RING_LEN(size));
+}
+
+/* -------------------- */
+void shm_ring_attach(shm_ring_t *ring, void *mem, u_int32_t size)
+{
+	ring->hdr = mem;
+	ring->data = (unsigned char *) mem + sizeof(struct shm_ring);
+	ring->size = size;
+}
+
+/*!
+ * Put one message, the concatenation of the iovecs.
+ *
+ * @returns 0 or -1 if there isn't enough space
+ */
+int shm_ring_put(shm_ring_t *ring, const struct iovec *iov, int cnt)
+{
+	u_int32_t tail = ring->hdr->tail;
+	u_int32_t len = 0;
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		len += iov[i].iov_len;
+
+	if (len == 0
+	    || sizeof(len) + len > ring->size - (tail - ring->hdr->head)) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	ring_write(ring, tail, &len, sizeof(len));
+	tail += sizeof(len);
+	for (i = 0; i < cnt; i++) {
+		ring_write(ring, tail, iov[i].iov_base, iov[i].iov_len);
+		tail += iov[i].iov_len;
+	}
+
+	barrier();
+	ring->hdr->tail = tail;
+	return 0;
+}
+
+/*!
+ * Get one message, scattered over the iovecs.
+ *
+ * @returns length of the message, 0 if the ring is empty, -1 if the message
+ *          doesn't fit or the ring is garbled
+ */
+ssize_t shm_ring_get(shm_ring_t *ring, const struct iovec *iov, int cnt)
+{
+	u_int32_t head = ring->hdr->head;
+	u_int32_t used = ring->hdr->tail - head;
+	u_int32_t len, left;
+	size_t n;
+	int i;
+
+	if (used == 0)
+		return 0;
+
+	/* at least a whole length and no more than fits */
+	if (used < sizeof(len) || used > ring->size) {
+		errno = EPROTO;
+		return -1;
+	}
+	barrier();
+	ring_read(ring, head, &len, sizeof(len));
+	if (len == 0 || len > used - sizeof(len)) {
+		errno = EPROTO;
+		return -1;
+	}
+	head += sizeof(len);
+
+	for (i = 0, left = len; i < cnt && left; i++) {
+		n = iov[i].iov_len < left ? iov[i].iov_len : left;
+		ring_read(ring, head, iov[i].iov_base, n);
+		head += n;
+		left -= n;
+	}
+	if (left) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	barrier();
+	ring->hdr->head = head;
+	return len;
+}
+
+/* -------------------- */
+int shm_ring_empty(shm_ring_t *ring)
+{
+	return ring->hdr->tail == ring->hdr->head;
+}
+
+/*!
+ * Consumer: announce we're going to sleep by other means than
+ * shm_ring_wait(), e.g. in select() on a socket the producer pokes.
+ *
+ * @returns 1 if there's a message already and we mustn't sleep
+ */
+int shm_ring_sleep(shm_ring_t *ring)
+{
+	ring->hdr->waiting = 1;
+	barrier();
+	if (!shm_ring_empty(ring)) {
+		ring->hdr->waiting = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* -------------------- */
+void shm_ring_awake(shm_ring_t *ring)
+{
+	ring->hdr->waiting = 0;
+}
+
+/*!
+ * Producer: after shm_ring_put(), does the consumer need a wakeup?
+ */
+int shm_ring_waiting(shm_ring_t *ring)
+{
+	barrier();
+	return ring->hdr->waiting;
+}
+
+/*!
+ * Producer: wake a consumer sleeping in shm_ring_wait()
+ */
+void shm_ring_wake(shm_ring_t *ring)
+{
+	if (!shm_ring_waiting(ring))
+		return;
+#if defined(__linux__)
+	syscall(SYS_futex, &ring->hdr->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+/*!
+ * Consumer: wait for a message, spinning spin times before going to sleep.
+ *
+ * @returns 1 if there's a message, 0 on timeout or signal
+ */
+int shm_ring_wait(shm_ring_t *ring, int spin, int ms)
+{
+	struct timespec ts;
+	u_int32_t tail;
+
+	for (spin = shm_ring_spins(spin); spin > 0; spin--) {
+		if (!shm_ring_empty(ring))
+			return 1;
+#if defined(__i386__) || defined(__x86_64__)
+		__asm__ __volatile__("pause");
+#endif
+	}
+
+	ring->hdr->waiting = 1;
+	barrier();
+	tail = ring->hdr->tail;
+	if (tail != ring->hdr->head) {
+		shm_ring_awake(ring);
+		return 1;
+	}
+
+#if defined(__linux__)
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	syscall(SYS_futex, &ring->hdr->tail, FUTEX_WAIT, tail, &ts, NULL, 0);
+#else
+	/* no futex, poll */
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000;
+	for (; ms > 0 && ring->hdr->tail == tail; ms--)
+		nanosleep(&ts, NULL);
+#endif
+	shm_ring_awake(ring);
+	return !shm_ring_empty(ring);
+}
@@ -0,0 +1,254 @@
+/*
+ * Slab allocator for small objects of one size, see include/atalk/slab.h
+ *
+ * A long lived afpd child allocates and frees millions of small objects in
+ * random order while a client browses, with malloc() they end up scattered
+ * over a heap that never shrinks. Here objects of one size are carved from
+ * SLAB_CHUNK sized chunks, aligned to their size so the chunk of an object is
+ * found by masking its address. Every chunk has its own free list and count
+ * of used objects, the slab links the chunks that have room. A chunk that
+ * becomes empty is unmapped unless it's the only empty one, so memory goes
+ * back to the system after the objects are gone.
+ *
+ * slab_alloc_size() serves objects of any size from a set of slabs with
+ * power of 2 size classes, the caller has to pass the same size to
+ * slab_free_size().
+ *
+ * Not thread safe.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <atalk/slab.h>
+
+struct slab_chunk {
+	struct slab_chunk *next;	/* chunks with room */
+	struct slab_chunk *prev;
+	void *free;		/* freed objects */
+	char *unused;		/* never handed out up to the end of the chunk */
+	unsigned int inuse;
+};
+
+struct slab {
+	size_t size;
+	struct slab_chunk *room;
+	unsigned int empty;	/* chunks without objects */
+	struct slab_stat stat;
+};
+
+/* objects start behind the chunk header */
+#define CHUNK_HDR   ((sizeof(struct slab_chunk) + 15) & ~15)
+#define CHUNK_OF(p) ((struct slab_chunk *) ((uintptr_t) (p) & ~((uintptr_t) SLAB_CHUNK - 1)))
+#define CHUNK_END(c) ((char *) (c) + SLAB_CHUNK)
+
+/* map twice the size and cut off what's not aligned */
+static struct slab_chunk *chunk_map(void)
+{
+	char *p, *c;
+	size_t head;
+
+	p = mmap(NULL, 2 * SLAB_CHUNK, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	c = (char *) CHUNK_OF(p + SLAB_CHUNK - 1);
+	head = c - p;
+	if (head)
+		munmap(p, head);
+	munmap(c + SLAB_CHUNK, SLAB_CHUNK - head);
+	return (struct slab_chunk *) c;
+}
+
+static void chunk_link(slab_t *slab, struct slab_chunk *c)
+{
+	c->prev = NULL;
+	c->next = slab->room;
+	if (slab->room)
+		slab->room->prev = c;
+	slab->room = c;
+}
+
+static void chunk_unlink(slab_t *slab, struct slab_chunk *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		slab->room = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	c->next = c->prev = NULL;
+}
+
+static int chunk_full(const slab_t *slab, const struct slab_chunk *c)
+{
+	return c->free == NULL && c->unused + slab->size > CHUNK_END(c);
+}
+
+/*!
+ * Create a slab for objects of size bytes, up to SLAB_MAX_OBJ
+ */
+slab_t *slab_create(size_t size)
+{
+	slab_t *slab;
+
+	if (size == 0 || size > SLAB_MAX_OBJ) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((slab = calloc(1, sizeof(slab_t))) == NULL)
+		return NULL;
+	slab->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	return slab;
+}
+
+/*!
+ * Free the slab and its chunks, all objects must have been freed
+ */
+void slab_destroy(slab_t *slab)
+{
+	struct slab_chunk *c;
+
+	while ((c = slab->room) != NULL) {
+		chunk_unlink(slab, c);
+		munmap(c, SLAB_CHUNK);
+	}
+	free(slab);
+}
+
+/* -------------------- */
+void *slab_alloc(slab_t *slab)
+{
+	struct slab_chunk *c;
+	void *obj;
+
+	if ((c = slab->room) == NULL) {
+		if ((c = chunk_map()) == NULL)
+			return NULL;
+		c->free = NULL;
+		c->unused = (char *) c + CHUNK_HDR;
+		c->inuse = 0;
+		chunk_link(slab, c);
+		slab->stat.chunks++;
+		slab->empty++;
+	}
+
+	if (c->free) {
+		obj = c->free;
+		c->free = *(void **) obj;
+	} else {
+		obj = c->unused;
+		c->unused += slab->size;
+	}
+	if (c->inuse++ == 0)
+		slab->empty--;
+	if (chunk_full(slab, c))
+		chunk_unlink(slab, c);
+
+	slab->stat.allocs++;
+	slab->stat.inuse++;
+	return obj;
+}
+
+/* -------------------- */
+void slab_free(slab_t *slab, void *obj)
+{
+	struct slab_chunk *c;
+
+	if (obj == NULL)
+		return;
+
+	c = CHUNK_OF(obj);
+	if (chunk_full(slab, c))
+		chunk_link(slab, c);
+	*(void **) obj = c->free;
+	c->free = obj;
+	slab->stat.frees++;
+	slab->stat.inuse--;
+
+	if (--c->inuse)
+		return;
+	if (slab->empty) {
+		/* keep one empty chunk, unmap the others */
+		chunk_unlink(slab, c);
+		munmap(c, SLAB_CHUNK);
+		slab->stat.chunks--;
+	} else {
+		slab->empty++;
+	}
+}
+
+/* -------------------- */
+void slab_stat(const slab_t *slab, struct slab_stat *st)
+{
+	*st = slab->stat;
+}
+
+/*******************************************************************
+ * size classes
+ *******************************************************************/
+
+#define SLAB_CLASSES 7		/* 16 .. 1024 */
+
+static slab_t *classes[SLAB_CLASSES];
+
+static int size_class(size_t size)
+{
+	int i;
+	size_t cs = SLAB_MIN_CLASS;
+
+	for (i = 0; cs < size; i++)
+		cs *= 2;
+	return i;
+}
+
+/*!
+ * Allocate size bytes, from a slab if it's not more than SLAB_MAX_CLASS
+ */
+void *slab_alloc_size(size_t size)
+{
+	int i;
+
+	if (size > SLAB_MAX_CLASS)
+		return malloc(size);
+
+	i = size_class(size);
+	if (classes[i] == NULL
+	    && (classes[i] = slab_create(SLAB_MIN_CLASS << i)) == NULL)
+		return NULL;
+	return slab_alloc(classes[i]);
+}
+
+/* -------------------- */
+void slab_free_size(void *obj, size_t size)
+{
+	if (size > SLAB_MAX_CLASS)
+		free(obj);
+	else
+		slab_free(classes[size_class(size)], obj);
+}
+
+/*!
+ * Sum of the size class slabs
+ */
+void slab_stat_size(struct slab_stat *st)
+{
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < SLAB_CLASSES; i++) {
+		if (classes[i] == NULL)
+			continue;
+		st->allocs += classes[i]->stat.allocs;
+		st->frees += classes[i]->stat.frees;
+		st->inuse += classes[i]->stat.inuse;
+		st->chunks += classes[i]->stat.chunks;
+	}
+}
@@ -55,6 +55,32 @@ AC_DEFUN([AC_NETATALK_CNID], [
     fi
     AM_CONDITIONAL(USE_LAST_BACKEND, test x"$use_last_backend" = x"yes")
 
+    dnl Determine whether or not to use the lsm CNID backend
+    AC_MSG_CHECKING([whether or not to use the lsm CNID backend])
+    AC_ARG_WITH(cnid-lsm-backend,
+	[  --with-cnid-lsm-backend	build lsm CNID backend, afpd keeps the db itself [[yes]]],
+	[
+        if test x"$withval" = x"no"; then
+            use_lsm_backend=no
+        else
+            use_lsm_backend=yes
+        fi
+    ],[
+        use_lsm_backend=yes
+    ])
+
+    if test $use_lsm_backend = yes; then
+        AC_MSG_RESULT([yes])
+        AC_DEFINE(CNID_BACKEND_LSM, 1, [Define if the lsm CNID backend should be compiled.])
+        if test x"$DEFAULT_CNID_SCHEME" = x; then
+            DEFAULT_CNID_SCHEME=lsm
+        fi
+        compiled_backends="$compiled_backends lsm"
+    else
+        AC_MSG_RESULT([no])
+    fi
+    AM_CONDITIONAL(USE_LSM_BACKEND, test x"$use_lsm_backend" = x"yes")
+
     dnl Set default DID scheme
     AC_MSG_CHECKING([default DID scheme])
     AC_ARG_WITH(cnid-default-backend,
@@ -0,0 +1,250 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * libatalk/cnid/cnid_cache.c: hits by CNID, DID/name and dev/ino, misses
+ * after a new generation, a flush or the ttl, eviction of the oldest and
+ * names that are too long.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <atalk/cnid.h>
+#include <atalk/cnid_private.h>
+#include <atalk/cnid_cache.h>
+
+#include "test.h"
+
+#define ENTRIES 1024            /* the smallest cache */
+#define FIRST   100             /* CNID of record 0 */
+
+static cnid_cache *cache;
+
+/* record i, files in directories of ten */
+static cnid_t cnid_of(int i)
+{
+    return htonl(FIRST + i);
+}
+
+static cnid_t did_of(int i)
+{
+    return htonl(CNID_START + i / 10);
+}
+
+static size_t name_of(int i, char *name)
+{
+    return sprintf(name, "name of %d", i);
+}
+
+static u_int64_t ino_of(int i)
+{
+    return ((u_int64_t)i << 33) | 5;
+}
+
+static void add(int from, int to, int devino)
+{
+    char name[32];
+    size_t len;
+    int i;
+
+    for (i = from; i < to; i++) {
+        len = name_of(i, name);
+        cnid_cache_add(cache, cnid_of(i), did_of(i), name, len,
+                       devino ? i % 2 : -1, 7, ino_of(i));
+    }
+}
+
+static u_int64_t hits(void)
+{
+    return cnid_cache_stats(cache)->hits;
+}
+
+/* how records from .. to answer: 0 none, 1 get and resolve, 2 lookup too */
+static int cached(int from, int to, int how)
+{
+    char name[32], buf[CNID_HEADER_LEN + 64];
+    u_int64_t v;
+    cnid_t id, cnid, did;
+    size_t len;
+    char *p;
+    int i, j;
+
+    for (i = from; i < to; i++) {
+        len = name_of(i, name);
+        if (cnid_cache_get(cache, did_of(i), name, len) != (how ? cnid_of(i) : CNID_INVALID))
+            return -1;
+        if (cnid_cache_lookup(cache, 7, ino_of(i), i % 2, did_of(i), name, len)
+            != (how == 2 ? cnid_of(i) : CNID_INVALID))
+            return -1;
+
+        id = cnid_of(i);
+        p = cnid_cache_resolve(cache, &id, buf, sizeof(buf));
+        if (!how) {
+            if (p != NULL || id != cnid_of(i))
+                return -1;
+            continue;
+        }
+        /* the reply of cnid_dbd */
+        if (p != buf + CNID_NAME_OFS || strcmp(p, name) || id != did_of(i))
+            return -1;
+        cnid = cnid_of(i);
+        did = did_of(i);
+        if (memcmp(buf + CNID_OFS, &cnid, CNID_LEN)
+            || memcmp(buf + CNID_DID_OFS, &did, CNID_DID_LEN))
+            return -1;
+        if (how < 2)
+            continue;
+        for (v = 0, j = 0; j < CNID_INO_LEN; j++)
+            v = (v << 8) | (unsigned char)buf[CNID_INO_OFS + j];
+        if (v != ino_of(i) || buf[CNID_DEV_OFS + CNID_DEV_LEN - 1] != 7
+            || buf[CNID_TYPE_OFS + CNID_TYPE_LEN - 1] != i % 2)
+            return -1;
+    }
+    return 0;
+}
+
+/* what the backend says is checked against what's cached */
+static int mismatch(void)
+{
+    char name[32], buf[CNID_HEADER_LEN + 64];
+    size_t len = name_of(3, name);
+    cnid_t id;
+
+    if (cnid_cache_lookup(cache, 7, ino_of(3), 0, did_of(3), name, len) != CNID_INVALID
+        || cnid_cache_lookup(cache, 7, ino_of(3), 1, did_of(13), name, len) != CNID_INVALID
+        || cnid_cache_lookup(cache, 7, ino_of(3), 1, did_of(3), name, len - 1) != CNID_INVALID
+        || cnid_cache_lookup(cache, 8, ino_of(3), 1, did_of(3), name, len) != CNID_INVALID)
+        return -1;
+    if (cnid_cache_get(cache, did_of(3), name, len - 1) != CNID_INVALID)
+        return -1;
+
+    /* too small for the name */
+    id = cnid_of(3);
+    if (cnid_cache_resolve(cache, &id, buf, CNID_HEADER_LEN + len) != NULL)
+        return -1;
+    return cnid_cache_resolve(cache, &id, buf, CNID_HEADER_LEN + len + 1) ? 0 : -1;
+}
+
+/* record 0 moves to another name, the old one is gone */
+static int moved(void)
+{
+    char name[32];
+    size_t len = name_of(0, name);
+
+    cnid_cache_add(cache, cnid_of(0), did_of(0), "moved", 5, 0, 7, ino_of(0));
+    if (cnid_cache_get(cache, did_of(0), name, len) != CNID_INVALID)
+        return -1;
+    if (cnid_cache_get(cache, did_of(0), "moved", 5) != cnid_of(0))
+        return -1;
+    /* and back */
+    cnid_cache_add(cache, cnid_of(0), did_of(0), name, len, 0, 7, ino_of(0));
+    if (cnid_cache_get(cache, did_of(0), "moved", 5) != CNID_INVALID)
+        return -1;
+    return cached(0, 1, 2);
+}
+
+static int names(void)
+{
+    char name[CNID_CACHE_NAMEMAX + 2];
+
+    memset(name, 'x', sizeof(name));
+    cnid_cache_add(cache, htonl(50), htonl(CNID_START), name, CNID_CACHE_NAMEMAX + 1,
+                   0, 1, 1);
+    if (cnid_cache_get(cache, htonl(CNID_START), name, CNID_CACHE_NAMEMAX + 1) != CNID_INVALID)
+        return -1;
+    cnid_cache_add(cache, htonl(51), htonl(CNID_START), name, CNID_CACHE_NAMEMAX,
+                   0, 1, 2);
+    if (cnid_cache_get(cache, htonl(CNID_START), name, CNID_CACHE_NAMEMAX) != htonl(51))
+        return -1;
+    /* no such CNID */
+    cnid_cache_add(cache, CNID_INVALID, htonl(CNID_START), "invalid", 7, 0, 1, 3);
+    return cnid_cache_get(cache, htonl(CNID_START), "invalid", 7) == CNID_INVALID ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    const struct cnid_cache_stats *st;
+    u_int64_t n;
+    int reti;
+
+    printf("Running tests\n=============\n");
+
+    TEST_expr(cache = cnid_cache_new(0, 0), cache != NULL);
+    TEST_expr(st = cnid_cache_stats(cache), st != NULL);
+
+    /* nothing before the backend told the generation */
+    TEST(add(0, 100, 1));
+    TEST_int(cached(0, 100, 0), 0);
+    TEST_expr(n = st->requests, n == 300);
+
+    TEST(cnid_cache_gen(cache, 1));
+    TEST(add(0, 500, 1));
+    TEST(add(500, 1000, 0));
+    TEST(n = hits());
+    TEST_int(cached(0, 500, 2), 0);
+    TEST_int(cached(500, 1000, 1), 0);
+    TEST_expr(n = hits() - n, n == 500 * 3 + 500 * 2);
+
+    /* dev/ino learned later */
+    TEST(add(500, 600, 1));
+    TEST_int(cached(500, 600, 2), 0);
+    TEST_int(mismatch(), 0);
+    TEST_int(moved(), 0);
+    TEST_int(names(), 0);
+
+    /* the same generation again */
+    TEST(cnid_cache_gen(cache, 1));
+    TEST_int(cached(0, 600, 2), 0);
+    TEST_expr(n = st->flushes, n == 0);
+
+    /* a new one voids everything */
+    TEST(cnid_cache_gen(cache, 2));
+    TEST_expr(n = st->flushes, n == 1);
+    TEST_int(cached(0, 1000, 0), 0);
+    TEST(add(0, 100, 1));
+    TEST_int(cached(0, 100, 2), 0);
+    TEST_int(cached(100, 1000, 0), 0);
+
+    /* and a flush until the next generation */
+    TEST(cnid_cache_flush(cache));
+    TEST_expr(n = st->flushes, n == 2);
+    TEST_int(cached(0, 100, 0), 0);
+    TEST(add(0, 100, 1));
+    TEST_int(cached(0, 100, 0), 0);
+    TEST(cnid_cache_gen(cache, 2));
+    TEST_int(cached(0, 100, 0), 0);
+    TEST(add(0, 100, 1));
+    TEST_int(cached(0, 100, 2), 0);
+
+    /* the oldest go first */
+    TEST(cnid_cache_gen(cache, 3));
+    TEST(n = st->evictions);
+    TEST(add(0, ENTRIES + 500, 1));
+    TEST_int(cached(0, 500, 0), 0);
+    TEST_int(cached(500, ENTRIES + 500, 2), 0);
+    TEST(add(0, 500, 1));
+    TEST_int(cached(0, 500, 2), 0);
+    TEST_int(cached(500, 1000, 0), 0);
+    TEST_int(cached(1000, ENTRIES + 500, 2), 0);
+    TEST_expr(n = st->evictions - n, n == ENTRIES + 1000);
+    TEST(cnid_cache_free(cache));
+
+    /* with a ttl it asks the backend now and then */
+    TEST_expr(cache = cnid_cache_new(ENTRIES, 1), cache != NULL);
+    TEST(cnid_cache_gen(cache, 1));
+    TEST(add(0, 100, 1));
+    TEST_int(cached(0, 100, 2), 0);
+    TEST(sleep(2));
+    TEST_int(cached(0, 100, 0), 0);
+    TEST(cnid_cache_gen(cache, 1));
+    TEST_int(cached(0, 100, 2), 0);
+    TEST(cnid_cache_free(cache));
+
+    return 0;
+}
@@ -0,0 +1,466 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * etc/cnid_dbd/comm.c: round robin service, eviction of the client idle
+ * longest, client_idle_timeout and the replies held back for a group
+ * commit. The clients are socketpairs handed
+ * over the control socket the way cnid_metad does. comm.c keeps its state
+ * in statics, every scenario runs in a process of its own.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <atalk/util.h>
+#include <atalk/logger.h>
+#include <atalk/cnid_dbd_private.h>
+
+#include "db_param.h"
+#include "comm.h"
+#include "test.h"
+
+static struct db_param dbp;
+static int ctl[2];
+static char namebuf[DBD_MAX_BATCH_LEN + 1];
+
+static int setup(int table_size, int idle_timeout)
+{
+    memset(&dbp, 0, sizeof(dbp));
+    dbp.fd_table_size = table_size;
+    dbp.client_idle_timeout = idle_timeout;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) < 0)
+        return -1;
+    return comm_init(&dbp, ctl[1], -1);
+}
+
+/* a new client, like cnid_metad passes it on */
+static int client(void)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return -1;
+    if (send_fd(ctl[0], sv[1]) < 0)
+        return -1;
+    close(sv[1]);
+    return sv[0];
+}
+
+/* the client tags its request with id */
+static int request(int fd, cnid_t id)
+{
+    struct cnid_dbd_rqst rqst;
+
+    memset(&rqst, 0, sizeof(rqst));
+    rqst.op = CNID_DBD_OP_GET;
+    rqst.cnid = id;
+    return write(fd, &rqst, sizeof(rqst)) == sizeof(rqst) ? 0 : -1;
+}
+
+/* serve one request, echo the tag and name with send, which is comm_snd()
+ * or comm_hold(). returns the tag, 0 for none */
+static cnid_t answer(int timeout, int (*send)(struct cnid_dbd_rply *),
+                     char *name)
+{
+    struct cnid_dbd_rqst rqst;
+    struct cnid_dbd_rply rply;
+    int ret;
+
+    rqst.name = namebuf;
+    if ((ret = comm_rcv(&rqst, timeout, NULL, NULL)) <= 0)
+        return ret < 0 ? (cnid_t)-1 : 0;
+
+    memset(&rply, 0, sizeof(rply));
+    rply.result = CNID_DBD_RES_OK;
+    rply.cnid = rqst.cnid;
+    if (name) {
+        rply.name = name;
+        rply.namelen = strlen(name);
+    }
+    if (send(&rply) != 1)
+        return (cnid_t)-1;
+    return rqst.cnid;
+}
+
+static cnid_t serve(int timeout)
+{
+    return answer(timeout, comm_snd, NULL);
+}
+
+/* serve the next request, the round that picks up a new client or a
+ * hangup has none */
+static cnid_t next(int timeout)
+{
+    cnid_t id = 0;
+    int i;
+
+    for (i = 0; i < 10 && id == 0; i++)
+        id = serve(timeout);
+    return id;
+}
+
+/* comm.c takes one new client per round */
+static int accept_clients(int n)
+{
+    int i;
+
+    for (i = 0; i < 10 && comm_nbe() < n; i++)
+        if (serve(100) != 0)
+            return -1;
+    return comm_nbe() == n ? 0 : -1;
+}
+
+/* the client waits for the reply, returns its tag */
+static cnid_t reply(int fd)
+{
+    struct cnid_dbd_rply rply;
+
+    if (readt(fd, &rply, sizeof(rply), 0, 2) != sizeof(rply))
+        return (cnid_t)-1;
+    return rply.cnid;
+}
+
+/* like reply(), with the name */
+static cnid_t reply_name(int fd, char *name, size_t len)
+{
+    struct cnid_dbd_rply rply;
+
+    if (readt(fd, &rply, sizeof(rply), 0, 2) != sizeof(rply)
+        || rply.namelen >= len
+        || readt(fd, name, rply.namelen, 0, 2) != rply.namelen)
+        return (cnid_t)-1;
+    name[rply.namelen] = '\0';
+    return rply.cnid;
+}
+
+/* 1 if there's something to read, a reply or EOF */
+static int readable(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/* 1 if cnid_dbd has closed the client */
+static int closed(int fd)
+{
+    struct pollfd pfd;
+    char c;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) != 1)
+        return 0;
+    return recv(fd, &c, 1, MSG_DONTWAIT) == 0;
+}
+
+/* ------------------- scenarios */
+
+/* everybody with a request gets a turn before anybody gets a second one */
+static int round_robin(void)
+{
+    int fd[3], i, n, turns[3] = {0, 0, 0};
+    int pending[3] = {3, 1, 2};
+    cnid_t id;
+
+    if (setup(16, 0) < 0)
+        return -1;
+    for (i = 0; i < 3; i++)
+        if ((fd[i] = client()) < 0)
+            return -1;
+    CHECK(accept_clients(3) == 0);
+
+    for (i = 0; i < 3; i++)
+        for (n = 0; n < pending[i]; n++)
+            CHECK(request(fd[i], i + 1) == 0);
+
+    /* rounds: {1,2,3}, {1,3}, {1} */
+    for (i = 0; i < 6; i++) {
+        id = next(1000);
+        CHECK(id >= 1 && id <= 3);
+        turns[id - 1]++;
+        CHECK(reply(fd[id - 1]) == id);
+        if (i == 2)
+            CHECK(turns[0] == 1 && turns[1] == 1 && turns[2] == 1);
+        if (i == 4)
+            CHECK(turns[0] == 2 && turns[1] == 1 && turns[2] == 2);
+    }
+    CHECK(turns[0] == 3);
+    CHECK(serve(0) == 0);
+    return 0;
+}
+
+/* the table is full: a new client pushes out the one idle longest */
+static int evict(void)
+{
+    int fd[5], i;
+
+    if (setup(4, 0) < 0)
+        return -1;
+    for (i = 0; i < 3; i++)
+        CHECK((fd[i] = client()) >= 0);
+    CHECK(accept_clients(3) == 0);
+
+    /* the times are in seconds */
+    sleep(1);
+    CHECK(request(fd[1], 2) == 0 && request(fd[2], 3) == 0);
+    for (i = 0; i < 2; i++)
+        CHECK(next(1000) != 0);
+    CHECK(reply(fd[1]) == 2 && reply(fd[2]) == 3);
+
+    /* a new client is the youngest, it takes the last slot */
+    sleep(1);
+    CHECK((fd[3] = client()) >= 0);
+    CHECK(accept_clients(4) == 0);
+
+    CHECK((fd[4] = client()) >= 0);
+    CHECK(request(fd[4], 5) == 0);
+    CHECK(next(1000) == 5 && reply(fd[4]) == 5);
+    CHECK(comm_nbe() == 4);
+    CHECK(closed(fd[0]));
+    for (i = 1; i < 5; i++)
+        CHECK(!closed(fd[i]));
+
+    /* the others still get their turn */
+    for (i = 1; i < 5; i++)
+        CHECK(request(fd[i], i + 1) == 0);
+    for (i = 1; i < 5; i++)
+        CHECK(next(1000) != 0);
+    for (i = 1; i < 5; i++)
+        CHECK(reply(fd[i]) == i + 1);
+    return 0;
+}
+
+/* many more clients than table slots */
+#define MANY 600
+#define SLOTS 200
+static int many(void)
+{
+    static int fd[MANY];
+    int i, gone = 0;
+
+    if (setup(SLOTS, 0) < 0)
+        return -1;
+    for (i = 0; i < MANY; i++) {
+        CHECK((fd[i] = client()) >= 0);
+        CHECK(request(fd[i], i + 1) == 0);
+        CHECK(next(1000) == i + 1);
+        CHECK(reply(fd[i]) == i + 1);
+        CHECK(comm_nbe() == (i < SLOTS ? i + 1 : SLOTS));
+    }
+    for (i = 0; i < MANY; i++) {
+        if (closed(fd[i])) {
+            gone++;
+            continue;
+        }
+        CHECK(request(fd[i], i + 1) == 0);
+        CHECK(next(1000) == i + 1 && reply(fd[i]) == i + 1);
+    }
+    CHECK(gone == MANY - SLOTS);
+    return 0;
+}
+
+/* client_idle_timeout closes a quiet client but not a busy one, and
+ * comm_rcv() doesn't sleep past the timeout */
+static int idle(void)
+{
+    struct timeval start, now;
+    int quiet, busy;
+
+    if (setup(16, 1) < 0)
+        return -1;
+    CHECK((quiet = client()) >= 0 && (busy = client()) >= 0);
+    CHECK(accept_clients(2) == 0);
+
+    gettimeofday(&start, NULL);
+    while (!closed(quiet)) {
+        CHECK(request(busy, 2) == 0);
+        CHECK(next(5000) == 2 && reply(busy) == 2);
+        usleep(200000);
+        gettimeofday(&now, NULL);
+        CHECK(now.tv_sec - start.tv_sec < 4);
+    }
+    CHECK(comm_nbe() == 1);
+    CHECK(!closed(busy));
+
+    /* nothing but the timeout to wait for */
+    gettimeofday(&start, NULL);
+    while (comm_nbe())
+        CHECK(serve(10000) == 0);
+    gettimeofday(&now, NULL);
+    CHECK(now.tv_sec - start.tv_sec < 4);
+    CHECK(closed(busy));
+    return 0;
+}
+
+/* the client hangs up */
+static int hangup(void)
+{
+    int fd[2];
+
+    if (setup(16, 0) < 0)
+        return -1;
+    CHECK((fd[0] = client()) >= 0 && (fd[1] = client()) >= 0);
+    CHECK(request(fd[1], 2) == 0);
+    close(fd[0]);
+    CHECK(next(1000) == 2 && reply(fd[1]) == 2);
+    CHECK(serve(100) == 0);
+    CHECK(comm_nbe() == 1);
+    return 0;
+}
+
+/* serve the next request, hold the reply back */
+static cnid_t hold(char *name)
+{
+    cnid_t id = 0;
+    int i;
+
+    for (i = 0; i < 10 && id == 0; i++)
+        id = answer(1000, comm_hold, name);
+    return id;
+}
+
+/* nobody sees a held reply before comm_flush(), then each client gets its
+ * own */
+static int group(void)
+{
+    int fd[3], i;
+
+    if (setup(16, 0) < 0)
+        return -1;
+    for (i = 0; i < 3; i++)
+        CHECK((fd[i] = client()) >= 0);
+    CHECK(accept_clients(3) == 0);
+
+    /* a write and a read in the same group */
+    CHECK(request(fd[0], 1) == 0 && request(fd[1], 2) == 0);
+    CHECK(hold(NULL) != 0 && hold(NULL) != 0);
+    /* the third client isn't in the group */
+    CHECK(request(fd[2], 3) == 0);
+    CHECK(next(1000) == 3 && reply(fd[2]) == 3);
+    CHECK(!readable(fd[0]) && !readable(fd[1]));
+
+    comm_flush();
+    CHECK(reply(fd[0]) == 1 && reply(fd[1]) == 2);
+    CHECK(!readable(fd[2]));
+
+    /* a second group: nothing is sent twice */
+    CHECK(request(fd[1], 12) == 0);
+    CHECK(hold(NULL) == 12);
+    CHECK(!readable(fd[1]));
+    comm_flush();
+    CHECK(reply(fd[1]) == 12);
+    comm_flush();
+    for (i = 0; i < 3; i++)
+        CHECK(!readable(fd[i]));
+    return 0;
+}
+
+/* the name of a held reply usually points into a buffer that is reused
+ * by the next request */
+static int held_name(void)
+{
+    char name[32], got[32];
+    int fd[2], i;
+
+    if (setup(16, 0) < 0)
+        return -1;
+    for (i = 0; i < 2; i++)
+        CHECK((fd[i] = client()) >= 0);
+    CHECK(accept_clients(2) == 0);
+
+    CHECK(request(fd[0], 1) == 0 && request(fd[1], 2) == 0);
+    strcpy(name, "first");
+    CHECK(hold(name) != 0);
+    strcpy(name, "second reply");
+    CHECK(hold(name) != 0);
+    strcpy(name, "gone");
+    comm_flush();
+
+    for (i = 0; i < 2; i++) {
+        CHECK(reply_name(fd[i], got, sizeof(got)) == i + 1);
+        /* round robin, either could have been first */
+        CHECK(strcmp(got, "first") == 0 || strcmp(got, "second reply") == 0);
+    }
+    return 0;
+}
+
+/* a client hangs up while its reply is held: the reply is dropped, and
+ * doesn't go to a new client that got the same descriptor */
+static int held_hangup(void)
+{
+    int fd[3], i;
+
+    if (setup(16, 0) < 0)
+        return -1;
+    for (i = 0; i < 2; i++)
+        CHECK((fd[i] = client()) >= 0);
+    CHECK(accept_clients(2) == 0);
+
+    CHECK(request(fd[0], 1) == 0 && request(fd[1], 2) == 0);
+    CHECK(hold(NULL) != 0 && hold(NULL) != 0);
+    close(fd[0]);
+    CHECK(serve(100) == 0);
+    CHECK(comm_nbe() == 1);
+
+    CHECK((fd[2] = client()) >= 0);
+    CHECK(accept_clients(2) == 0);
+    comm_flush();
+    CHECK(reply(fd[1]) == 2);
+    CHECK(!readable(fd[2]));
+
+    CHECK(request(fd[2], 3) == 0);
+    CHECK(next(1000) == 3 && reply(fd[2]) == 3);
+    return 0;
+}
+
+static int run(int (*fn)(void))
+{
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    switch ((pid = fork())) {
+    case -1:
+        return -1;
+    case 0:
+        exit(fn() == 0 ? 0 : 1);
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status) ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int reti;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Running tests\n=============\n");
+    TEST_int(run(round_robin), 0);
+    TEST_int(run(evict), 0);
+    TEST_int(run(many), 0);
+    TEST_int(run(idle), 0);
+    TEST_int(run(hangup), 0);
+    TEST_int(run(group), 0);
+    TEST_int(run(held_name), 0);
+    TEST_int(run(held_hangup), 0);
+
+    return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * etc/cnid_dbd/cmd_dbd_prefetch.c: the threads walk the whole volume once,
+ * count objects like the scanner does, skip what the scanner skips and
+ * stop cleanly at any point.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <atalk/volinfo.h>
+#include <atalk/volume.h>
+#include <atalk/cnid_dbd_private.h>
+
+#include "cmd_dbd.h"
+#include "test.h"
+
+#define DEPTH  3
+#define FANOUT 4
+#define FILES  20
+#define THREADS 4
+
+static char top[] = "/tmp/dbd_prefetch_test.XXXXXX";
+
+/* what the threads should find */
+static struct scan_prefetch_stat want;
+static unsigned long long want_ea;      /* ::EA headers on top */
+
+/* cmd_dbd.c */
+void dbd_log(enum logtype lt, char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+static int mkfile(const char *dir, const char *name)
+{
+    char path[MAXPATHLEN];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if ((fd = open(path, O_WRONLY | O_CREAT, 0600)) < 0)
+        return -1;
+    if (write(fd, "header", 6) != 6) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+static int mksub(const char *dir, const char *name, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%s", dir, name);
+    return mkdir(path, 0700);
+}
+
+/* a directory the threads walk, with depth levels below it */
+static int mktree(const char *dir, int depth, int root)
+{
+    char path[MAXPATHLEN], ad[MAXPATHLEN], name[32];
+    int i;
+
+    want.dirs++;
+    if (mksub(dir, ADv2_DIRNAME, ad, sizeof(ad)) < 0
+        || mkfile(ad, ".Parent") < 0 || mkfile(ad, ".Parent::EA") < 0)
+        return -1;
+    want.objects++;
+    want.headers++;
+    want_ea++;
+
+    for (i = 0; i < FILES; i++) {
+        snprintf(name, sizeof(name), "file%d", i);
+        if (mkfile(dir, name) < 0)
+            return -1;
+        want.objects++;
+        if (i % 2)
+            continue;
+        if (mkfile(ad, name) < 0)
+            return -1;
+        want.headers++;
+        if (i % 4)
+            continue;
+        strcat(name, "::EA");
+        if (mkfile(ad, name) < 0)
+            return -1;
+        want_ea++;
+    }
+
+    /* not followed */
+    if (symlink(".", strcat(strcpy(path, dir), "/link")) < 0)
+        return -1;
+    want.objects++;
+
+    /* skipped, but counted */
+    if (mksub(dir, ".AppleDB", path, sizeof(path)) < 0
+        || mkfile(path, "cnid2.db") < 0)
+        return -1;
+    want.objects++;
+    /* the scanner only skips it in the volume root */
+    if (mksub(dir, ".zfs", path, sizeof(path)) < 0)
+        return -1;
+    want.objects++;
+    if (!root && depth == 0)
+        want.dirs++;            /* empty */
+    else if (!root && mktree(path, 0, 0) < 0)
+        return -1;
+
+    if (depth == 0)
+        return 0;
+    for (i = 0; i < FANOUT; i++) {
+        snprintf(name, sizeof(name), "dir%d", i);
+        if (mksub(dir, name, path, sizeof(path)) < 0)
+            return -1;
+        want.objects++;
+        if (mktree(path, depth - 1, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* the threads stop by themselves when they have run out of directories */
+static int threads(void)
+{
+    DIR *dp;
+    struct dirent *de;
+    int n = 0;
+
+    if ((dp = opendir("/proc/self/task")) == NULL)
+        return -1;
+    while ((de = readdir(dp)) != NULL)
+        if (de->d_name[0] != '.')
+            n++;
+    closedir(dp);
+    return n;
+}
+
+static int walk(struct volinfo *vi)
+{
+    struct scan_prefetch_stat st;
+    int i, base = threads(), ea = (vi->v_vfs_ea == AFPVOL_EA_AD);
+
+    if (scan_prefetch_start(vi, THREADS) < 0)
+        return -1;
+    scan_prefetch_progress(1ULL << 40);
+    for (i = 0; i < 1000 && threads() > base; i++)
+        usleep(10000);
+    if (base < 0)
+        sleep(5);       /* no /proc */
+    scan_prefetch_stop(&st);
+
+    if (st.dirs != want.dirs || st.objects != want.objects)
+        return -1;
+    return st.headers == want.headers + (ea ? want_ea : 0) ? 0 : -1;
+}
+
+/* stop at any point, the counts never exceed a full walk */
+static int cut(struct volinfo *vi)
+{
+    struct scan_prefetch_stat st;
+    int i, base = threads();
+
+    for (i = 0; i < 100; i++) {
+        if (scan_prefetch_start(vi, THREADS) < 0)
+            return -1;
+        if (i % 2)
+            scan_prefetch_progress(1ULL << 40);
+        usleep(i * 10);
+        scan_prefetch_stop(&st);
+        if (st.dirs > want.dirs || st.objects > want.objects)
+            return -1;
+    }
+    return threads() == base ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct volinfo vi;
+    char missing[MAXPATHLEN];
+    int reti;
+
+    printf("Running tests\n=============\n");
+
+    TEST_expr(reti = mkdtemp(top) != NULL, reti);
+    TEST_int(mktree(top, DEPTH, 1), 0);
+
+    memset(&vi, 0, sizeof(vi));
+    snprintf(missing, sizeof(missing), "%s/missing", top);
+    vi.v_path = missing;
+    TEST_int(scan_prefetch_start(&vi, THREADS), -1);
+    vi.v_path = top;
+    TEST_int(scan_prefetch_start(&vi, 0), -1);
+    TEST(scan_prefetch_stop(NULL));
+
+    TEST_int(walk(&vi), 0);
+    TEST(vi.v_vfs_ea = AFPVOL_EA_AD);
+    TEST_int(walk(&vi), 0);
+    TEST_int(cut(&vi), 0);
+
+    if (chdir("/") == 0) {
+        char cmd[MAXPATHLEN + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", top);
+        if (system(cmd) != 0)
+            printf("can't remove %s\n", top);
+    }
+    return 0;
+}
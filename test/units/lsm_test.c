@@ -0,0 +1,390 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * libatalk/cnid/lsm/lsm_store.c: the store finds what a simple model says
+ * by CNID, DID/name and dev/ino, through merges into the base and L1, in a
+ * second handle, after a reopen, with a torn log and after a bulk load.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include <atalk/cnid.h>
+
+#include "lsm_store.h"
+#include "test.h"
+
+#define NCNIDS  70000           /* a bit more than LSM_MEMMAX: a base, then L1 */
+#define NKEYS   (2 * NCNIDS)    /* random keys collide now and then */
+#define FIRST   100             /* CNID of slot 0 */
+#define BATCH   100             /* changes per lock */
+
+static char top[] = "/tmp/lsm_test.XXXXXX";
+static char bulkdir[MAXPATHLEN];
+
+/* the model: what every slot has, and who has every key */
+static int dn_of[NCNIDS], di_of[NCNIDS];
+static int dn_owner[NKEYS + 1], di_owner[NKEYS + 1];
+
+static void mkrec(int slot, int dn, int di, struct lsm_rec *rec, char *name)
+{
+    rec->cnid = htonl(FIRST + slot);
+    rec->did = htonl(CNID_START + dn / 50);
+    rec->namelen = sprintf(name, "file %d", dn);
+    rec->name = name;
+    rec->dev = di % 3 + 1;
+    rec->ino = ((u_int64_t)di << 20) | 7;   /* more than 32 bits */
+    rec->type = (dn % 7 == 0);
+}
+
+static void model_del(int slot)
+{
+    if (dn_of[slot] < 0)
+        return;
+    dn_owner[dn_of[slot]] = di_owner[di_of[slot]] = -1;
+    dn_of[slot] = di_of[slot] = -1;
+}
+
+static void model_put(int slot, int dn, int di)
+{
+    if (dn_owner[dn] >= 0)
+        model_del(dn_owner[dn]);
+    if (di_owner[di] >= 0)
+        model_del(di_owner[di]);
+    model_del(slot);
+    dn_of[slot] = dn;
+    di_of[slot] = di;
+    dn_owner[dn] = di_owner[di] = slot;
+}
+
+static int put(lsm_db *db, int slot, int dn, int di)
+{
+    struct lsm_rec rec;
+    char name[32];
+
+    mkrec(slot, dn, di, &rec, name);
+    if (lsm_put(db, &rec) < 0)
+        return -1;
+    model_put(slot, dn, di);
+    return 0;
+}
+
+static int same(const struct lsm_rec *a, const struct lsm_rec *b)
+{
+    return a->cnid == b->cnid && a->did == b->did && a->dev == b->dev
+        && a->ino == b->ino && a->type == b->type && a->namelen == b->namelen
+        && !memcmp(a->name, b->name, a->namelen) && !a->name[a->namelen];
+}
+
+/* every slot and every key as the model has them */
+static int verify(lsm_db *db)
+{
+    struct lsm_rec rec, want;
+    char name[32], buf[MAXPATHLEN + 1];
+    int i, ret = -1;
+
+    if (lsm_lock(db, 0) < 0)
+        return -1;
+    for (i = 0; i < NCNIDS; i++) {
+        if (dn_of[i] < 0) {
+            if (lsm_get_id(db, htonl(FIRST + i), &rec, buf) != 0)
+                goto exit;
+            continue;
+        }
+        mkrec(i, dn_of[i], di_of[i], &want, name);
+        if (lsm_get_id(db, want.cnid, &rec, buf) != 1 || !same(&rec, &want))
+            goto exit;
+    }
+    for (i = 0; i < NKEYS; i++) {
+        mkrec(0, i, i, &want, name);
+        switch (lsm_get_didname(db, want.did, want.name, want.namelen, &rec, buf)) {
+        case 0:
+            if (dn_owner[i] >= 0)
+                goto exit;
+            break;
+        case 1:
+            if (dn_owner[i] < 0 || rec.cnid != htonl(FIRST + dn_owner[i]))
+                goto exit;
+            break;
+        default:
+            goto exit;
+        }
+        switch (lsm_get_devino(db, want.dev, want.ino, &rec, buf)) {
+        case 0:
+            if (di_owner[i] >= 0)
+                goto exit;
+            break;
+        case 1:
+            if (di_owner[i] < 0 || rec.cnid != htonl(FIRST + di_owner[i]))
+                goto exit;
+            break;
+        default:
+            goto exit;
+        }
+    }
+    ret = 0;
+exit:
+    lsm_unlock(db);
+    return ret;
+}
+
+/* slot i gets key i */
+static int fill(lsm_db *db)
+{
+    int i;
+
+    for (i = 0; i < NCNIDS; i++) {
+        if (i % BATCH == 0 && lsm_lock(db, 1) < 0)
+            return -1;
+        if (put(db, i, i, i) < 0)
+            return -1;
+        if (i % BATCH == BATCH - 1 && lsm_unlock(db) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* n random puts and deletes on the first slots slots with the first keys */
+static int churn(lsm_db *db, int n, int slots, int keys, unsigned int seed)
+{
+    int i, slot, ret;
+
+    for (i = 0; i < n; i++) {
+        if (i % BATCH == 0 && lsm_lock(db, 1) < 0)
+            return -1;
+        slot = rand_r(&seed) % slots;
+        if (rand_r(&seed) % 5 == 0) {
+            ret = lsm_del(db, htonl(FIRST + slot));
+            if (ret != (dn_of[slot] >= 0))
+                return -1;
+            model_del(slot);
+        } else if (put(db, slot, rand_r(&seed) % keys, rand_r(&seed) % keys) < 0) {
+            return -1;
+        }
+        if (i % BATCH == BATCH - 1 && lsm_unlock(db) < 0)
+            return -1;
+    }
+    return lsm_unlock(db);
+}
+
+static int exists(const char *name)
+{
+    char path[MAXPATHLEN];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", top, LSM_DIRNAME, name);
+    return stat(path, &st) == 0;
+}
+
+static off_t logsize(void)
+{
+    char path[MAXPATHLEN];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", top, LSM_DIRNAME, LSM_LOGNAME);
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+/* a change that only made it partly to the log is dropped, so is garbage
+ * after a whole one */
+static int torn(int cut, const char *garbage)
+{
+    struct lsm_rec rec, got;
+    char name[32], buf[MAXPATHLEN + 1], path[MAXPATHLEN];
+    lsm_db *db;
+    off_t before, after;
+    int fd, kept = (cut == 0);
+
+    /* its own CNID and keys, the model doesn't change */
+    mkrec(NCNIDS, NKEYS, NKEYS, &rec, name);
+    if ((db = lsm_open(top, 0, 0)) == NULL)
+        return -1;
+    before = logsize();
+    if (lsm_lock(db, 1) < 0 || lsm_put(db, &rec) < 0 || lsm_unlock(db) < 0)
+        return -1;
+    lsm_close(db);
+    if ((after = logsize()) <= before)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", top, LSM_DIRNAME, LSM_LOGNAME);
+    if (truncate(path, after - cut) < 0)
+        return -1;
+    if (garbage) {
+        if ((fd = open(path, O_WRONLY | O_APPEND)) < 0)
+            return -1;
+        if (write(fd, garbage, strlen(garbage)) != (ssize_t)strlen(garbage)) {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+
+    /* opening takes the write lock, which cuts the log */
+    if ((db = lsm_open(top, 0, 0)) == NULL)
+        return -1;
+    if (logsize() != (kept ? after : before))
+        return -1;
+    if (lsm_lock(db, 0) < 0 || lsm_get_id(db, rec.cnid, &got, buf) != kept
+        || lsm_get_devino(db, rec.dev, rec.ino, &got, buf) != kept)
+        return -1;
+    lsm_unlock(db);
+    if (verify(db) < 0)
+        return -1;
+
+    /* and the log takes new changes after the cut */
+    if (lsm_lock(db, 1) < 0 || lsm_put(db, &rec) < 0 || lsm_unlock(db) < 0)
+        return -1;
+    lsm_close(db);
+    if ((db = lsm_open(top, 0, 0)) == NULL)
+        return -1;
+    if (lsm_lock(db, 1) < 0 || lsm_get_id(db, rec.cnid, &got, buf) != 1
+        || !same(&got, &rec) || lsm_del(db, rec.cnid) != 1 || lsm_unlock(db) < 0)
+        return -1;
+    return lsm_close(db);
+}
+
+/* the later of two records with the same key wins */
+static int bulk(void)
+{
+    struct lsm_rec rec, got;
+    char name[32], buf[MAXPATHLEN + 1];
+    lsm_db *db;
+    int i;
+
+    if ((db = lsm_open(bulkdir, 0, LSM_BULK)) == NULL || !lsm_bulk(db))
+        return -1;
+    /* backwards, so it has to be sorted */
+    for (i = 999; i >= 0; i--) {
+        mkrec(i, i, i, &rec, name);
+        if (lsm_bulk_add(db, &rec) < 0)
+            return -1;
+    }
+    mkrec(5, 2000, 2000, &rec, name);       /* slot 5 renamed */
+    if (lsm_bulk_add(db, &rec) < 0)
+        return -1;
+    mkrec(1000, 6, 3000, &rec, name);       /* takes slot 6's name */
+    if (lsm_put(db, &rec) < 0)
+        return -1;
+    rec.cnid = CNID_INVALID;
+    if (lsm_bulk_add(db, &rec) != -1)
+        return -1;
+    if (lsm_close(db) < 0)
+        return -1;
+
+    if ((db = lsm_open(bulkdir, 0, 0)) == NULL || lsm_bulk(db) || lsm_lock(db, 0) < 0)
+        return -1;
+    for (i = 0; i <= 1000; i++) {
+        if (i == 6) {
+            if (lsm_get_id(db, htonl(FIRST + i), &got, buf) != 0)
+                return -1;
+            continue;
+        }
+        if (i == 5)
+            mkrec(i, 2000, 2000, &rec, name);
+        else if (i == 1000)
+            mkrec(i, 6, 3000, &rec, name);
+        else
+            mkrec(i, i, i, &rec, name);
+        if (lsm_get_id(db, rec.cnid, &got, buf) != 1 || !same(&got, &rec))
+            return -1;
+        if (lsm_get_didname(db, rec.did, rec.name, rec.namelen, &got, buf) != 1
+            || got.cnid != rec.cnid)
+            return -1;
+        if (lsm_get_devino(db, rec.dev, rec.ino, &got, buf) != 1
+            || got.cnid != rec.cnid)
+            return -1;
+    }
+    /* slot 5's old keys are gone */
+    mkrec(5, 5, 5, &rec, name);
+    if (lsm_get_didname(db, rec.did, rec.name, rec.namelen, &got, buf) != 0
+        || lsm_get_devino(db, rec.dev, rec.ino, &got, buf) != 0)
+        return -1;
+    lsm_unlock(db);
+    if (ntohl(lsm_nextid(db)) != FIRST + 1001)
+        return -1;
+    return lsm_close(db);
+}
+
+int main(int argc, char **argv)
+{
+    struct lsm_rec rec;
+    char name[32], stamp[LSM_STAMPLEN], stamp2[LSM_STAMPLEN];
+    lsm_db *db, *other;
+    int reti;
+
+    printf("Running tests\n=============\n");
+
+    memset(dn_of, -1, sizeof(dn_of));
+    memset(di_of, -1, sizeof(di_of));
+    memset(dn_owner, -1, sizeof(dn_owner));
+    memset(di_owner, -1, sizeof(di_owner));
+
+    TEST_expr(reti = mkdtemp(top) != NULL, reti);
+    snprintf(bulkdir, sizeof(bulkdir), "%s/bulk", top);
+    TEST_int(mkdir(bulkdir, 0700), 0);
+
+    TEST_expr(db = lsm_open(top, 0, 0), db != NULL);
+    TEST_expr(other = lsm_open(top, 0, 0), other != NULL);
+    TEST(lsm_getstamp(db, stamp));
+    TEST(lsm_getstamp(other, stamp2));
+    TEST_int(memcmp(stamp, stamp2, LSM_STAMPLEN), 0);
+    TEST_int(ntohl(lsm_nextid(db)), CNID_START);
+
+    /* changes only with the write lock */
+    mkrec(0, 0, 0, &rec, name);
+    TEST_int(lsm_put(db, &rec), -1);
+    TEST_int(lsm_lock(db, 0), 0);
+    TEST_int(lsm_put(db, &rec), -1);
+    TEST_int(lsm_unlock(db), 0);
+
+    /* into the base at LSM_MEMMAX */
+    TEST_int(fill(db), 0);
+    TEST_int(exists(LSM_BASENAME), 1);
+    TEST_int(verify(db), 0);
+    TEST_int(verify(other), 0);
+
+    /* a lot of changes to few records: the log fills up, into L1 */
+    TEST_int(churn(db, 300000, 1000, 2000, 1), 0);
+    TEST_int(exists(LSM_L1NAME), 1);
+    TEST_int(verify(db), 0);
+    TEST_int(verify(other), 0);
+
+    /* the other one writes too */
+    TEST_int(churn(other, 20000, NCNIDS, NKEYS, 2), 0);
+    TEST_int(verify(db), 0);
+    TEST_int(churn(db, 100000, NCNIDS, NKEYS, 3), 0);
+    TEST_int(verify(other), 0);
+    TEST_int(lsm_close(other), 0);
+    TEST_int(lsm_close(db), 0);
+
+    /* all from the files */
+    TEST_expr(db = lsm_open(top, 0, 0), db != NULL);
+    TEST_int(verify(db), 0);
+    TEST(lsm_getstamp(db, stamp2));
+    TEST_int(memcmp(stamp, stamp2, LSM_STAMPLEN), 0);
+    TEST_expr(reti = ntohl(lsm_nextid(db)), reti >= FIRST + NCNIDS);
+    TEST_int(lsm_close(db), 0);
+
+    TEST_int(torn(1, NULL), 0);
+    TEST_int(torn(20, NULL), 0);
+    TEST_int(torn(0, "garbage at the end"), 0);
+
+    TEST_int(bulk(), 0);
+
+    if (chdir("/") == 0) {
+        char cmd[MAXPATHLEN + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", top);
+        if (system(cmd) != 0)
+            printf("can't remove %s\n", top);
+    }
+    return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * etc/afpd/prefetch.c: the thread pool returns what lstat() or stat()
+ * would, in any order of waiting, across a chdir() of the caller and
+ * after jobs were dropped by prefetch_end().
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <atalk/util.h>
+#include <atalk/adouble.h>
+#include <atalk/volume.h>
+
+#include "prefetch.h"
+#include "test.h"
+
+#define THREADS 4
+#define NFILES  (PREFETCH_MAX + 40)
+
+static char top[] = "/tmp/prefetch_test.XXXXXX";
+static char names[NFILES][16];
+static struct vol vol;
+
+/* NFILES files of different sizes, a directory, a symlink and the
+ * AppleDouble headers of every other file */
+static int mktree(const char *dir)
+{
+    char path[MAXPATHLEN];
+    char buf[AD_DATASZ2];
+    int i, fd;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+    snprintf(path, sizeof(path), "%s/.AppleDouble", dir);
+    if (mkdir(path, 0700) < 0)
+        return -1;
+    memset(buf, 0, sizeof(buf));
+
+    for (i = 0; i < NFILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "f%03d", i);
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        if ((fd = open(path, O_WRONLY | O_CREAT, 0600)) < 0)
+            return -1;
+        if (write(fd, buf, i) != i) {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        if (i % 2)
+            continue;
+        snprintf(path, sizeof(path), "%s/.AppleDouble/%s", dir, names[i]);
+        if ((fd = open(path, O_WRONLY | O_CREAT, 0600)) < 0)
+            return -1;
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    snprintf(path, sizeof(path), "%s/dir", dir);
+    if (mkdir(path, 0700) < 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s/link", dir);
+    return symlink("f100", path);
+}
+
+static int same(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino == b->st_ino && a->st_dev == b->st_dev
+        && a->st_mode == b->st_mode && a->st_size == b->st_size;
+}
+
+/* prefetch the first n names of dir, wait for them in the order of step:
+ * 1 forward, -1 backward, 7 hops around */
+static int walk(const char *dir, int n, int step)
+{
+    struct stat st, want;
+    int job[PREFETCH_MAX];
+    int i, j;
+
+    if (chdir(dir) < 0 || prefetch_begin(&vol, THREADS) < 0)
+        return -1;
+    for (i = 0; i < n; i++)
+        if ((job[i] = prefetch_add(names[i])) != i)
+            return -1;
+    /* the caller moves around, the threads don't care */
+    if (chdir("/") < 0)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        j = step > 0 ? (i * step) % n : n - 1 - i;
+        if (prefetch_wait(job[j], &st) < 0)
+            return -1;
+        if (chdir(dir) < 0 || lstat(names[j], &want) < 0 || chdir("/") < 0)
+            return -1;
+        if (!same(&st, &want))
+            return -1;
+    }
+    prefetch_end();
+    return 0;
+}
+
+/* symlinks are followed only with AFPVOL_FOLLOWSYM, a missing name fails */
+static int special(const char *dir)
+{
+    const char *list[] = {"dir", "link", "nonexistent", ".AppleDouble"};
+    struct stat st, want;
+    int i, job[4];
+
+    if (chdir(dir) < 0 || prefetch_begin(&vol, THREADS) < 0)
+        return -1;
+    for (i = 0; i < 4; i++)
+        if ((job[i] = prefetch_add(list[i])) < 0)
+            return -1;
+
+    if (prefetch_wait(job[0], &st) < 0 || !S_ISDIR(st.st_mode))
+        return -1;
+    if (prefetch_wait(job[1], &st) < 0)
+        return -1;
+    if (vol.v_flags & AFPVOL_FOLLOWSYM) {
+        if (stat("link", &want) < 0 || !S_ISREG(st.st_mode))
+            return -1;
+    } else if (lstat("link", &want) < 0 || !S_ISLNK(st.st_mode)) {
+        return -1;
+    }
+    if (!same(&st, &want))
+        return -1;
+    errno = 0;
+    if (prefetch_wait(job[2], &st) != -1 || errno != ENOENT)
+        return -1;
+    if (prefetch_wait(job[3], &st) < 0 || !S_ISDIR(st.st_mode))
+        return -1;
+    prefetch_end();
+    return 0;
+}
+
+/* more jobs than PREFETCH_MAX, bad job numbers */
+static int limits(const char *dir)
+{
+    struct stat st;
+    int i;
+
+    if (chdir(dir) < 0 || prefetch_begin(&vol, THREADS) < 0)
+        return -1;
+    for (i = 0; i < PREFETCH_MAX; i++)
+        if (prefetch_add(names[i]) != i)
+            return -1;
+    if (prefetch_add(names[PREFETCH_MAX]) != -1)
+        return -1;
+    errno = 0;
+    if (prefetch_wait(-1, &st) != -1 || errno != EINVAL)
+        return -1;
+    errno = 0;
+    if (prefetch_wait(PREFETCH_MAX, &st) != -1 || errno != EINVAL)
+        return -1;
+    prefetch_end();
+
+    /* nothing left after prefetch_end() */
+    errno = 0;
+    if (prefetch_add(names[0]) != -1 || prefetch_wait(0, &st) != -1
+        || errno != EINVAL)
+        return -1;
+    return 0;
+}
+
+/* end early with jobs queued and running, again and again, then the next
+ * directory must only see its own results */
+static int drop(const char *dir, const char *other)
+{
+    struct stat st;
+    int i, n;
+
+    for (i = 0; i < 200; i++) {
+        if (chdir(dir) < 0 || prefetch_begin(&vol, THREADS) < 0)
+            return -1;
+        for (n = 0; n < (i * 13) % PREFETCH_MAX + 1; n++)
+            if (prefetch_add(names[n]) != n)
+                return -1;
+        if (i % 3 == 0 && prefetch_wait(n / 2, &st) < 0)
+            return -1;
+        prefetch_end();
+    }
+    return walk(other, 60, 1);
+}
+
+int main(int argc, char **argv)
+{
+    char dir1[MAXPATHLEN], dir2[MAXPATHLEN];
+    int reti;
+
+    printf("Running tests\n=============\n");
+
+    vol.ad_path = ad_path;
+    TEST_expr(reti = mkdtemp(top) != NULL, reti);
+    snprintf(dir1, sizeof(dir1), "%s/one", top);
+    snprintf(dir2, sizeof(dir2), "%s/two", top);
+    TEST_int(mktree(dir1), 0);
+    TEST_int(mktree(dir2), 0);
+
+    TEST_int(prefetch_begin(&vol, 0), -1);
+    TEST_int(walk(dir1, PREFETCH_MAX, 1), 0);
+    TEST_int(walk(dir1, PREFETCH_MAX, -1), 0);
+    TEST_int(walk(dir2, PREFETCH_MAX, 7), 0);
+    TEST_int(walk(dir2, 1, 1), 0);
+    TEST_int(special(dir1), 0);
+    TEST(vol.v_flags |= AFPVOL_FOLLOWSYM);
+    TEST_int(special(dir1), 0);
+    TEST(vol.v_flags &= ~AFPVOL_FOLLOWSYM);
+    TEST_int(limits(dir1), 0);
+    TEST_int(drop(dir1, dir2), 0);
+
+    if (chdir("/") == 0) {
+        char cmd[MAXPATHLEN + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", top);
+        if (system(cmd) != 0)
+            printf("can't remove %s\n", top);
+    }
+    return 0;
+}
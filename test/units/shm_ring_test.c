@@ -0,0 +1,292 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * libatalk/util/shm_ring.c: wrap around, full and short buffers, garbled
+ * rings and a producer in another process.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <atalk/shm_ring.h>
+
+#include "test.h"
+
+#define RINGSIZE 64
+#define MESSAGES 100000
+
+static shm_ring_t ring;
+
+static void fill(unsigned char *buf, size_t len, unsigned int seq)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (unsigned char)(seq * 31 + i);
+}
+
+static int put(unsigned int seq, size_t len)
+{
+    unsigned char buf[RINGSIZE];
+    struct iovec iov;
+
+    fill(buf, len, seq);
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return shm_ring_put(&ring, &iov, 1);
+}
+
+/* get a message of len bytes with the contents put(seq, len) wrote */
+static int get(unsigned int seq, size_t len)
+{
+    unsigned char buf[RINGSIZE], want[RINGSIZE];
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    if (shm_ring_get(&ring, &iov, 1) != (ssize_t)len)
+        return -1;
+    fill(want, len, seq);
+    return memcmp(buf, want, len) ? -1 : 0;
+}
+
+/* message lengths 1 .. 27 move the 4 byte length over the end of the ring
+ * in every possible way */
+static int wrap(unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        if (put(i, i % 27 + 1) < 0 || get(i, i % 27 + 1) < 0)
+            return -1;
+        if (!shm_ring_empty(&ring))
+            return -1;
+    }
+    return 0;
+}
+
+/* two messages queued most of the time */
+static int wrap2(unsigned int n)
+{
+    unsigned int i;
+
+    if (put(0, 20) < 0)
+        return -1;
+    for (i = 1; i < n; i++) {
+        if (put(i, 20 + i % 5) < 0 || get(i - 1, 20 + (i - 1) % 5) < 0)
+            return -1;
+    }
+    return get(n - 1, 20 + (n - 1) % 5);
+}
+
+static int scatter(void)
+{
+    unsigned char hdr[8], rest[RINGSIZE], want[RINGSIZE];
+    struct iovec iov[2];
+
+    if (put(7, 30) < 0)
+        return -1;
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = rest;
+    iov[1].iov_len = sizeof(rest);
+    if (shm_ring_get(&ring, iov, 2) != 30)
+        return -1;
+    fill(want, 30, 7);
+    return memcmp(hdr, want, 8) || memcmp(rest, want + 8, 22) ? -1 : 0;
+}
+
+static int gather(void)
+{
+    unsigned char want[RINGSIZE];
+    struct iovec iov[3];
+
+    fill(want, 30, 9);
+    iov[0].iov_base = want;
+    iov[0].iov_len = 5;
+    iov[1].iov_base = want + 5;
+    iov[1].iov_len = 0;
+    iov[2].iov_base = want + 5;
+    iov[2].iov_len = 25;
+    if (shm_ring_put(&ring, iov, 3) < 0)
+        return -1;
+    return get(9, 30);
+}
+
+/* a message that doesn't fit the buffers stays in the ring */
+static int emsgsize(void)
+{
+    unsigned char buf[10];
+    struct iovec iov;
+
+    if (put(3, 30) < 0)
+        return -1;
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    errno = 0;
+    if (shm_ring_get(&ring, &iov, 1) != -1 || errno != EMSGSIZE)
+        return -1;
+    return get(3, 30);
+}
+
+static int full(void)
+{
+    int n = 0;
+
+    /* 4 messages of 4 + 12 bytes */
+    while (put(n, 12) == 0)
+        n++;
+    if (n != RINGSIZE / 16 || errno != EAGAIN)
+        return -1;
+    if (get(0, 12) < 0 || put(n, 12) < 0 || put(n + 1, 12) == 0)
+        return -1;
+    for (n = 1; n <= RINGSIZE / 16; n++)
+        if (get(n, 12) < 0)
+            return -1;
+    return shm_ring_empty(&ring) ? 0 : -1;
+}
+
+/* the peer moved tail beyond what the ring holds */
+static int garbled(void)
+{
+    unsigned char buf[RINGSIZE];
+    struct iovec iov;
+    u_int32_t tail = ring.hdr->tail;
+
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+
+    ring.hdr->tail = ring.hdr->head + RINGSIZE + 4;
+    errno = 0;
+    if (shm_ring_get(&ring, &iov, 1) != -1 || errno != EPROTO)
+        return -1;
+
+    /* a length longer than what was published */
+    ring.hdr->tail = tail;
+    if (put(1, 8) < 0)
+        return -1;
+    ring.hdr->tail -= 1;
+    errno = 0;
+    if (shm_ring_get(&ring, &iov, 1) != -1 || errno != EPROTO)
+        return -1;
+    ring.hdr->tail += 1;
+    if (get(1, 8) < 0)
+        return -1;
+
+    /* less than the length itself */
+    if (put(2, 8) < 0)
+        return -1;
+    tail = ring.hdr->tail;
+    ring.hdr->tail = ring.hdr->head + 2;
+    errno = 0;
+    if (shm_ring_get(&ring, &iov, 1) != -1 || errno != EPROTO)
+        return -1;
+    ring.hdr->tail = tail;
+    return get(2, 8);
+}
+
+/* the consumer's side of the sleep protocol */
+static int sleeping(void)
+{
+    if (shm_ring_sleep(&ring) != 0 || !shm_ring_waiting(&ring))
+        return -1;
+    shm_ring_awake(&ring);
+    if (shm_ring_waiting(&ring))
+        return -1;
+    if (shm_ring_wait(&ring, 10, 10) != 0 || shm_ring_waiting(&ring))
+        return -1;
+
+    if (put(5, 10) < 0)
+        return -1;
+    if (shm_ring_sleep(&ring) != 1 || shm_ring_waiting(&ring))
+        return -1;
+    if (shm_ring_wait(&ring, 0, 1000) != 1)
+        return -1;
+    return get(5, 10);
+}
+
+/* a producer process that has to wait for space and wakes us up */
+static int twoproc(void)
+{
+    unsigned int i;
+    int status;
+    pid_t pid;
+
+    switch ((pid = fork())) {
+    case -1:
+        return -1;
+    case 0:
+        /* ring is in the shared mapping, the child is the producer */
+        for (i = 0; i < MESSAGES; i++) {
+            while (put(i, i % 20 + 1) < 0)
+                usleep(10);
+            shm_ring_wake(&ring);
+        }
+        _exit(0);
+    }
+
+    for (i = 0; i < MESSAGES; i++) {
+        while (shm_ring_empty(&ring))
+            shm_ring_wait(&ring, 100, 1000);
+        if (get(i, i % 20 + 1) < 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            return -1;
+        }
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)
+        || WEXITSTATUS(status))
+        return -1;
+    return shm_ring_empty(&ring) ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    void *mem;
+    int reti;
+
+    printf("Running tests\n=============\n");
+
+    TEST_expr(mem = mmap(NULL, SHM_RING_LEN(RINGSIZE), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0),
+              mem != MAP_FAILED);
+    TEST(shm_ring_init(mem, RINGSIZE));
+    TEST(shm_ring_attach(&ring, mem, RINGSIZE));
+
+    TEST_int(shm_ring_empty(&ring), 1);
+    TEST_int(get(0, 0), 0);   /* nothing there, length 0 */
+    TEST_int(put(0, 0), -1);
+    TEST_int(put(0, RINGSIZE - 3), -1);
+    TEST_int(put(0, RINGSIZE - 4), 0);
+    TEST_int(get(0, RINGSIZE - 4), 0);
+
+    TEST_int(wrap(10000), 0);
+    TEST_int(wrap2(10000), 0);
+    TEST_int(scatter(), 0);
+    TEST_int(gather(), 0);
+    TEST_int(emsgsize(), 0);
+    TEST_int(full(), 0);
+    TEST_int(garbled(), 0);
+
+    /* the free running counters overflow */
+    TEST(ring.hdr->head = ring.hdr->tail = 0xffffffff - 40);
+    TEST_int(wrap(1000), 0);
+    TEST_int(wrap2(1000), 0);
+    TEST_expr(reti = ring.hdr->head < 0x80000000, reti);
+    TEST_int(emsgsize(), 0);
+
+    TEST_int(sleeping(), 0);
+    TEST_int(twoproc(), 0);
+
+    return 0;
+}
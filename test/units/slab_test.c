@@ -0,0 +1,198 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * libatalk/util/slab.c: objects don't overlap, freed space is reused,
+ * empty chunks go back to the system and the statistics add up.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atalk/slab.h>
+
+#include "test.h"
+
+#define OBJSIZE 44
+#define NOBJS   20000           /* about 15 chunks */
+#define CHURN   1000000
+
+static void *objs[NOBJS];
+
+static void fill(void *obj, size_t len, unsigned int n)
+{
+    memset(obj, n & 0xff, len);
+}
+
+static int check(const void *obj, size_t len, unsigned int n)
+{
+    const unsigned char *p = obj;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (p[i] != (n & 0xff))
+            return -1;
+    return 0;
+}
+
+static int inuse(const slab_t *slab)
+{
+    struct slab_stat st;
+
+    slab_stat(slab, &st);
+    return st.inuse;
+}
+
+static int chunks(const slab_t *slab)
+{
+    struct slab_stat st;
+
+    slab_stat(slab, &st);
+    return st.chunks;
+}
+
+/* the chunks hold as many objects as fit, the objects are aligned and
+ * don't overlap */
+static int fill_up(slab_t *slab)
+{
+    int i, min;
+
+    for (i = 0; i < NOBJS; i++) {
+        if ((objs[i] = slab_alloc(slab)) == NULL)
+            return -1;
+        if ((uintptr_t)objs[i] % sizeof(void *))
+            return -1;
+        fill(objs[i], OBJSIZE, i);
+    }
+    for (i = 0; i < NOBJS; i++)
+        if (check(objs[i], OBJSIZE, i) < 0)
+            return -1;
+
+    /* objects are rounded up to pointer size, chunks have a header */
+    min = (NOBJS * OBJSIZE + SLAB_CHUNK - 1) / SLAB_CHUNK;
+    if (chunks(slab) < min || chunks(slab) > min + 2)
+        return -1;
+    return inuse(slab) == NOBJS ? 0 : -1;
+}
+
+/* free every other object, the holes are used before a new chunk */
+static int holes(slab_t *slab)
+{
+    int i, n = chunks(slab);
+
+    for (i = 0; i < NOBJS; i += 2)
+        slab_free(slab, objs[i]);
+    if (chunks(slab) != n || inuse(slab) != NOBJS / 2)
+        return -1;
+    for (i = 0; i < NOBJS; i += 2) {
+        if ((objs[i] = slab_alloc(slab)) == NULL)
+            return -1;
+        fill(objs[i], OBJSIZE, i);
+    }
+    if (chunks(slab) != n)
+        return -1;
+    for (i = 0; i < NOBJS; i++)
+        if (check(objs[i], OBJSIZE, i) < 0)
+            return -1;
+    return 0;
+}
+
+/* all gone: one empty chunk is kept */
+static int empty(slab_t *slab)
+{
+    struct slab_stat st;
+    int i;
+
+    for (i = 0; i < NOBJS; i++) {
+        slab_free(slab, objs[i]);
+        objs[i] = NULL;
+    }
+    slab_stat(slab, &st);
+    return st.inuse == 0 && st.chunks == 1 && st.allocs == st.frees ? 0 : -1;
+}
+
+/* random allocs and frees, the contents of the live objects survive */
+static int churn(slab_t *slab)
+{
+    unsigned int seed = 1;
+    int i, j, live = 0;
+
+    for (i = 0; i < CHURN; i++) {
+        j = rand_r(&seed) % NOBJS;
+        if (objs[j]) {
+            if (check(objs[j], OBJSIZE, j) < 0)
+                return -1;
+            slab_free(slab, objs[j]);
+            objs[j] = NULL;
+            live--;
+        } else {
+            if ((objs[j] = slab_alloc(slab)) == NULL)
+                return -1;
+            fill(objs[j], OBJSIZE, j);
+            live++;
+        }
+        if (i % 100000 == 0 && inuse(slab) != live)
+            return -1;
+    }
+    for (j = 0; j < NOBJS; j++)
+        if (objs[j] && check(objs[j], OBJSIZE, j) < 0)
+            return -1;
+    return inuse(slab) == live ? 0 : -1;
+}
+
+/* the size classes and malloc() for the big ones */
+static int sizes(void)
+{
+    static void *p[2100];
+    struct slab_stat st;
+    size_t len;
+
+    for (len = 1; len < 2100; len++) {
+        if ((p[len] = slab_alloc_size(len)) == NULL)
+            return -1;
+        fill(p[len], len, len);
+    }
+    slab_stat_size(&st);
+    if (st.inuse != SLAB_MAX_CLASS || st.allocs != SLAB_MAX_CLASS)
+        return -1;
+    for (len = 1; len < 2100; len++) {
+        if (check(p[len], len, len) < 0)
+            return -1;
+        slab_free_size(p[len], len);
+    }
+    slab_stat_size(&st);
+    return st.inuse == 0 && st.frees == SLAB_MAX_CLASS ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    slab_t *slab;
+    int reti;
+
+    printf("Running tests\n=============\n");
+
+    TEST_expr(slab = slab_create(0), slab == NULL && errno == EINVAL);
+    TEST_expr(slab = slab_create(SLAB_MAX_OBJ + 1), slab == NULL && errno == EINVAL);
+    TEST_expr(slab = slab_create(SLAB_MAX_OBJ), slab != NULL);
+    TEST(slab_destroy(slab));
+
+    TEST_expr(slab = slab_create(OBJSIZE), slab != NULL);
+    TEST(slab_free(slab, NULL));
+    TEST_int(fill_up(slab), 0);
+    TEST_int(holes(slab), 0);
+    TEST_int(empty(slab), 0);
+    TEST_int(fill_up(slab), 0);
+    TEST_int(empty(slab), 0);
+    TEST_int(churn(slab), 0);
+    TEST_int(empty(slab), 0);
+    TEST(slab_destroy(slab));
+
+    TEST_int(sizes(), 0);
+
+    return 0;
+}
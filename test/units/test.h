@@ -0,0 +1,58 @@
+/*
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Checks of single modules, the macros are those of test/afpd/test.h
+ */
+
+#ifndef UNITS_TEST_H
+#define UNITS_TEST_H
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+static inline void alignok(int len)
+{
+    int i = 1;
+    if (len < 80)
+        i = 80 - len;
+    while (i--)
+        printf(" ");
+}
+
+#define TEST(a) \
+    printf("Testing: %s ... ", (#a) ); \
+    alignok(strlen(#a));               \
+    a;                                 \
+    printf("[ok]\n");
+
+#define TEST_int(a, b) \
+    printf("Testing: %s ... ", (#a) );            \
+    alignok(strlen(#a));                          \
+    if ((reti = (a)) != b) {                      \
+        printf("[error]\n");                      \
+        exit(1);                                  \
+    } else { printf("[ok]\n"); }
+
+#define TEST_expr(a, b)                              \
+    printf("Testing: %s ... ", (#a) );               \
+    alignok(strlen(#a));                             \
+    a;                                               \
+    if (b) {                                         \
+        printf("[ok]\n");                            \
+    } else {                                         \
+        printf("[error]\n");                         \
+        exit(1);                                     \
+    }
+
+/* for the loops: quiet unless it fails */
+#define CHECK(a)                                                    \
+    if (!(a)) {                                                     \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #a); \
+        exit(1);                                                    \
+    }
+
+#endif  /* UNITS_TEST_H */